@@ -2,8 +2,25 @@
 	see copyright notice in squirrel.h
 */
 #include "sqpcheader.h"
-void *sq_vm_malloc(SQUnsignedInteger size){	return malloc(size); }
+static void *sq_default_malloc(SQUnsignedInteger size){	return malloc(size); }
 
-void *sq_vm_realloc(void *p, SQUnsignedInteger oldsize, SQUnsignedInteger size){ return realloc(p, size); }
+static void *sq_default_realloc(void *p, SQUnsignedInteger oldsize, SQUnsignedInteger size){ return realloc(p, size); }
 
-void sq_vm_free(void *p, SQUnsignedInteger size){	free(p); }
+static void sq_default_free(void *p, SQUnsignedInteger size){	free(p); }
+
+static SQMALLOCFUNC _malloc_func = sq_default_malloc;
+static SQREALLOCFUNC _realloc_func = sq_default_realloc;
+static SQFREEFUNC _free_func = sq_default_free;
+
+void sq_setallocator(SQMALLOCFUNC mallocfunc, SQREALLOCFUNC reallocfunc, SQFREEFUNC freefunc)
+{
+	_malloc_func = mallocfunc ? mallocfunc : sq_default_malloc;
+	_realloc_func = reallocfunc ? reallocfunc : sq_default_realloc;
+	_free_func = freefunc ? freefunc : sq_default_free;
+}
+
+void *sq_vm_malloc(SQUnsignedInteger size){	return _malloc_func(size); }
+
+void *sq_vm_realloc(void *p, SQUnsignedInteger oldsize, SQUnsignedInteger size){ return _realloc_func(p, oldsize, size); }
+
+void sq_vm_free(void *p, SQUnsignedInteger size){	_free_func(p, size); }
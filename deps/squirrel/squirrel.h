@@ -180,6 +180,10 @@ typedef SQInteger (*SQREADFUNC)(SQUserPointer,SQUserPointer,SQInteger);
 
 typedef SQInteger (*SQLEXREADFUNC)(SQUserPointer);
 
+typedef void *(*SQMALLOCFUNC)(SQUnsignedInteger);
+typedef void *(*SQREALLOCFUNC)(void*,SQUnsignedInteger,SQUnsignedInteger);
+typedef void (*SQFREEFUNC)(void*,SQUnsignedInteger);
+
 typedef struct tagSQRegFunction{
 	const SQChar *name;
 	SQFUNCTION f;
@@ -352,6 +356,7 @@ SQUIRREL_API SQRESULT sq_readclosure(HSQUIRRELVM vm,SQREADFUNC readf,SQUserPoint
 SQUIRREL_API void *sq_malloc(SQUnsignedInteger size);
 SQUIRREL_API void *sq_realloc(void* p,SQUnsignedInteger oldsize,SQUnsignedInteger newsize);
 SQUIRREL_API void sq_free(void *p,SQUnsignedInteger size);
+SQUIRREL_API void sq_setallocator(SQMALLOCFUNC mallocfunc,SQREALLOCFUNC reallocfunc,SQFREEFUNC freefunc);
 
 /*debug*/
 SQUIRREL_API SQRESULT sq_stackinfos(HSQUIRRELVM v,SQInteger level,SQStackInfos *si);
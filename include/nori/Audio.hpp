@@ -31,17 +31,65 @@
 #include <nori/Resource.hpp>
 #include <nori/Sample.hpp>
 
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
 namespace nori
 {
 
+class AudioSource;
 class AudioContext;
+class AudioDevice;
+class AudioBufferCache;
+
+/*! @brief Audio output backend.
+ *  @ingroup audio
+ */
+enum AudioBackend
+{
+  /*! Sound is played through the default OpenAL device.
+   */
+  AUDIO_OPENAL,
+  /*! Sound is mixed on the CPU and written to a WAV file, or discarded.
+   */
+  AUDIO_SOFTWARE
+};
+
+/*! @brief Audio context configuration.
+ *  @ingroup audio
+ */
+class AudioConfig
+{
+public:
+  /*! Constructor.
+   */
+  AudioConfig(AudioBackend backend = AUDIO_OPENAL,
+              uint frequency = 48000,
+              const Path& output = Path());
+  /*! The desired output backend.
+   */
+  AudioBackend backend;
+  /*! The output frequency of the software backend.
+   */
+  uint frequency;
+  /*! The WAV file written by the software backend, or empty to discard the
+   *  mixed output.
+   */
+  Path output;
+};
 
 /*! @brief Audio sample data buffer.
  *  @ingroup audio
+ *
+ *  A buffer created from a compressed sample is only decoded when a source
+ *  using it is bound to a voice, and may be evicted again when not in use.
+ *  See AudioContext::setSampleCacheSize.
  */
 class AudioBuffer : public Resource, public RefObject
 {
   friend class AudioSource;
+  friend class AudioBufferCache;
 public:
   /*! Destructor.
    */
@@ -58,6 +106,17 @@ public:
   /*! @return The format of the data in this buffer.
    */
   SampleFormat format() const { return m_format; }
+  /*! @return @c true if this buffer keeps its sample compressed, otherwise
+   *  @c false.
+   */
+  bool isCompressed() const { return m_sample != nullptr; }
+  /*! @return @c true if the data of this buffer is currently decoded,
+   *  otherwise @c false.
+   */
+  bool isResident() const { return m_bufferID != 0; }
+  /*! @return The size, in bytes, of the decoded data of this buffer.
+   */
+  size_t size() const { return m_size; }
   /*! @return The context within which this buffer was created.
    */
   AudioContext& context() const { return m_context; }
@@ -67,23 +126,126 @@ public:
   static Ref<AudioBuffer> create(const ResourceInfo& info,
                                  AudioContext& context,
                                  const Sample& data);
+  /*! Creates a buffer object within the specified context that decodes the
+   *  specified compressed sample on demand.
+   */
+  static Ref<AudioBuffer> create(const ResourceInfo& info,
+                                 AudioContext& context,
+                                 CompressedSample& data);
+  /*! Reads the specified sample into a buffer.  The sample is kept compressed
+   *  if the sample cache of the context is enabled.
+   */
   static Ref<AudioBuffer> read(AudioContext& context, const std::string& sampleName);
 private:
   AudioBuffer(const ResourceInfo& info, AudioContext& context);
   AudioBuffer(const AudioBuffer&) = delete;
   bool init(const Sample& data);
+  bool init(CompressedSample& data);
   AudioBuffer& operator = (const AudioBuffer&) = delete;
   AudioContext& m_context;
   uint m_bufferID;
   SampleFormat m_format;
   Time m_duration;
+  size_t m_size;
+  Ref<CompressedSample> m_sample;
+  uint m_lastUsed;
+  uint m_useCount;
+  bool m_prefetching;
+};
+
+/*! @brief Streamed audio sample.
+ *  @ingroup audio
+ *
+ *  An audio stream decodes a sample file a chunk at a time on a worker thread
+ *  and feeds the chunks to its source through a short queue of buffers, so
+ *  memory use is bounded regardless of the length of the sample.  Loops are
+ *  decoded back to back into the same chunk, so looping playback has no gap.
+ *
+ *  A stream can only be used by one source at a time.  Streaming sources are
+ *  refilled by AudioContext::update, which should be called every frame.
+ */
+class AudioStream : public RefObject
+{
+  friend class AudioSource;
+public:
+  /*! Destructor.
+   */
+  ~AudioStream();
+  /*! @return @c true if this stream contains mono data, otherwise @c false.
+   */
+  bool isMono() const { return m_format == SAMPLE_MONO16; }
+  /*! @return @c true if this stream contains stereo data, otherwise @c false.
+   */
+  bool isStereo() const { return m_format == SAMPLE_STEREO16; }
+  /*! @return The duration, in seconds, of this stream.
+   */
+  Time duration() const { return m_duration; }
+  /*! @return The format of the data in this stream.
+   */
+  SampleFormat format() const { return m_format; }
+  /*! @return The source currently using this stream, or @c nullptr if no
+   *  source is using it.
+   */
+  AudioSource* source() const { return m_source; }
+  /*! @return The context within which this stream was created.
+   */
+  AudioContext& context() const { return m_context; }
+  /*! Opens the specified sample file for streaming within the specified
+   *  context.
+   */
+  static Ref<AudioStream> open(AudioContext& context, const std::string& sampleName);
+private:
+  struct Chunk
+  {
+    std::vector<int16> data;
+    size_t frames;
+  };
+  AudioStream(AudioContext& context);
+  AudioStream(const AudioStream&) = delete;
+  bool init(const std::string& sampleName);
+  void setLooping(bool newState);
+  void seek(size_t frame);
+  bool isFinished();
+  bool fill(uint bufferID);
+  void work();
+  AudioStream& operator = (const AudioStream&) = delete;
+  AudioContext& m_context;
+  AudioSource* m_source;
+  std::unique_ptr<SampleStream> m_sample;
+  SampleFormat m_format;
+  uint m_frequency;
+  Time m_duration;
+  std::vector<uint> m_bufferIDs;
+  std::vector<uint> m_freeBufferIDs;
+  std::vector<Chunk> m_chunks;
+  size_t m_first;
+  size_t m_count;
+  size_t m_seekFrame;
+  uint m_generation;
+  bool m_seeking;
+  bool m_looping;
+  bool m_ended;
+  bool m_stopping;
+  std::thread m_worker;
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
 };
 
 /*! @brief Audio source.
  *  @ingroup audio
+ *
+ *  An audio source is a logical sound emitter.  The context binds a limited
+ *  number of device voices to the most audible of its started
+ *  sources once per frame.  The remaining started sources are virtual.  They
+ *  advance their playback position without producing sound, and resume at the
+ *  right offset when they are bound again.
+ *
+ *  Property and state changes are applied to the bound voice by
+ *  AudioContext::update, which should be called every frame.
  */
 class AudioSource : public RefObject
 {
+  friend class AudioContext;
 public:
   /*! Audio source state enumeration.
    */
@@ -102,7 +264,8 @@ public:
   /*! Destructor.
    */
   ~AudioSource();
-  /*! Starts this source playing the currently set buffer.
+  /*! Starts this source playing the currently set buffer or stream from the
+   *  beginning.
    */
   void start();
   /*! Stops the playing of this source.
@@ -127,12 +290,19 @@ public:
   /*! @return @c true if this source is in the Source::STOPPED state.
    */
   bool isStopped() const { return state() == STOPPED; }
+  /*! @return @c true if this source is started or paused but not currently
+   *  bound to a voice.
+   */
+  bool isVirtual() const { return m_state != STOPPED && !m_sourceID; }
   /*! @return @c true if this source loops playback.
    */
   bool isLooping() const { return m_looping; }
   /*! @return The state of this source.
+   *
+   *  @remarks A source that reaches the end of its buffer is stopped by the
+   *  next call to AudioContext::update.
    */
-  State state() const;
+  State state() const { return m_state; }
   /*! Sets whether this source loops playback.
    */
   void setLooping(bool newState);
@@ -163,9 +333,29 @@ public:
   /*! @return The pitch of this source.
    */
   float pitch() const { return m_pitch; }
-  /*! Sets the pitch of this source.
+  /*! Sets the pitch of this source, which must be positive.
    */
   void setPitch(float newPitch);
+  /*! @return The priority of this source.
+   */
+  float priority() const { return m_priority; }
+  /*! Sets the priority of this source.  The audibility of a source, which
+   *  decides whether it is bound to a voice, is its attenuated gain scaled by
+   *  its priority.
+   */
+  void setPriority(float newPriority);
+  /*! @return The distance under which this source is not attenuated.
+   */
+  float referenceDistance() const { return m_referenceDistance; }
+  /*! Sets the distance under which this source is not attenuated.
+   */
+  void setReferenceDistance(float newDistance);
+  /*! @return The distance attenuation rolloff factor of this source.
+   */
+  float rolloffFactor() const { return m_rolloffFactor; }
+  /*! Sets the distance attenuation rolloff factor of this source.
+   */
+  void setRolloffFactor(float newFactor);
   /*! @return The currently set buffer for this source, or @c nullptr if no
    *  buffer is set.
    */
@@ -173,8 +363,33 @@ public:
   /*! Sets the buffer to be used by this source.
    *  @param[in] newBuffer The buffer to use, or @c nullptr to detach the
    *  currently used buffer.
+   *
+   *  @remarks This stops the source and detaches any currently used stream.
    */
   void setBuffer(AudioBuffer* newBuffer);
+  /*! @return The currently set stream for this source, or @c nullptr if no
+   *  stream is set.
+   */
+  AudioStream* stream() const { return m_stream; }
+  /*! Sets the stream to be used by this source.
+   *  @param[in] newStream The stream to use, or @c nullptr to detach the
+   *  currently used stream.
+   *
+   *  @remarks This detaches any currently used buffer, and detaches the
+   *  stream from any other source using it.
+   *
+   *  @remarks Streaming sources are never virtual while started or paused, as
+   *  resuming a stream would require decoding from a new position.
+   */
+  void setStream(AudioStream* newStream);
+  /*! Moves the playback position of this source.
+   *  @param[in] position The time, in seconds, from the beginning of the
+   *  currently set buffer or stream.
+   *
+   *  @remarks For a stream, playback continues as soon as the worker thread
+   *  has decoded the data at the new position.
+   */
+  void seek(Time position);
   /*! @return The context within which this buffer was created.
    */
   AudioContext& context() const { return m_context; }
@@ -182,18 +397,45 @@ public:
    */
   static Ref<AudioSource> create(AudioContext& context);
 private:
+  enum
+  {
+    DIRTY_POSITION = 0x01,
+    DIRTY_VELOCITY = 0x02,
+    DIRTY_GAIN = 0x04,
+    DIRTY_PITCH = 0x08,
+    DIRTY_LOOPING = 0x10,
+    DIRTY_DISTANCE = 0x20,
+    DIRTY_OFFSET = 0x40,
+    DIRTY_STATE = 0x80,
+    DIRTY_ALL = 0xff
+  };
   AudioSource(AudioContext& context);
   AudioSource(const AudioSource&) = delete;
   bool init();
+  void setState(State newState);
+  void advance(Time deltaTime);
+  bool bind(uint sourceID);
+  uint unbind();
+  void flush();
+  void refill();
+  void clearQueue();
   AudioSource& operator = (const AudioSource&) = delete;
   AudioContext& m_context;
+  uint m_index;
   uint m_sourceID;
+  uint m_dirty;
+  State m_state;
+  Time m_offset;
   bool m_looping;
   vec3 m_position;
   vec3 m_velocity;
   float m_gain;
   float m_pitch;
+  float m_priority;
+  float m_referenceDistance;
+  float m_rolloffFactor;
   Ref<AudioBuffer> m_buffer;
+  Ref<AudioStream> m_stream;
 };
 
 /*! @brief Audio context.
@@ -201,6 +443,10 @@ private:
  */
 class AudioContext
 {
+  friend class AudioBuffer;
+  friend class AudioBufferCache;
+  friend class AudioStream;
+  friend class AudioSource;
 public:
   /*! Destructor.
    */
@@ -235,26 +481,94 @@ public:
   /*! Sets the listener gain of this context.
    */
   void setListenerGain(float newGain);
+  /*! Advances virtual sources, binds voices to the most audible sources and
+   *  applies all source changes made since the last update.  This also refills
+   *  the buffer queues of sources playing streams.  This should be called
+   *  every frame.
+   */
+  void update();
+  /*! Updates this context as if the specified time had passed since the last
+   *  update.  With the software backend this also mixes that much audio,
+   *  which makes output deterministic for a given sequence of time steps.
+   */
+  void update(Time deltaTime);
+  /*! @return The maximum number of voices bound at any one time.
+   */
+  uint maxVoiceCount() const { return m_maxVoiceCount; }
+  /*! Sets the maximum number of voices bound at any one time.
+   *
+   *  @remarks The actual limit may be lower if the audio device runs out of
+   *  voices.
+   */
+  void setMaxVoiceCount(uint newCount);
+  /*! @return The number of sources currently bound to voices.
+   */
+  uint voiceCount() const { return uint(m_voiceIDs.size() - m_freeVoiceIDs.size()); }
+  /*! @return The number of sources in this context.
+   */
+  uint sourceCount() const { return uint(m_sources.size()); }
+  /*! @return The maximum size, in bytes, of decoded compressed buffers, or
+   *  zero if the sample cache is disabled.
+   */
+  size_t sampleCacheSize() const;
+  /*! Sets the maximum size, in bytes, of decoded compressed buffers.
+   *
+   *  @remarks While this is nonzero, AudioBuffer::read keeps samples
+   *  compressed.  They are decoded when first played and the least recently
+   *  used ones are evicted when this size is exceeded.  Buffers in use by a
+   *  voice are never evicted.
+   */
+  void setSampleCacheSize(size_t newSize);
+  /*! @return The total size, in bytes, of decoded compressed buffers.
+   */
+  size_t residentSampleBytes() const;
+  /*! @return The fraction of voice bindings of compressed buffers that found
+   *  the buffer already decoded.
+   */
+  float sampleCacheHitRate() const;
+  /*! Decodes the specified compressed buffer on a worker thread, so that it
+   *  is already decoded when a source using it is bound to a voice.
+   */
+  void prefetch(AudioBuffer& buffer);
   /*! @return The resource cache used by this context.
    */
   ResourceCache& cache() const { return m_cache; }
   /*! Creates the context singleton object.
    *  @param[in] cache The resource cache to use.
+   *  @param[in] config The requested configuration.
    *  @return @c true if successful, or @c false otherwise.
    */
-  static std::unique_ptr<AudioContext> create(ResourceCache& cache);
+  static std::unique_ptr<AudioContext> create(ResourceCache& cache,
+                                              const AudioConfig& config = AudioConfig());
 private:
   AudioContext(ResourceCache& cache);
   AudioContext(const AudioContext&) = delete;
-  bool init();
+  bool init(const AudioConfig& config);
+  void addSource(AudioSource& source);
+  void removeSource(AudioSource& source);
+  uint allocateVoice();
   AudioContext& operator = (const AudioContext&) = delete;
   ResourceCache& m_cache;
-  void* m_device;
-  void* m_handle;
+  std::unique_ptr<AudioDevice> m_device;
   vec3 m_listenerPosition;
   vec3 m_listenerVelocity;
   quat m_listenerRotation;
   float m_listenerGain;
+  uint m_maxVoiceCount;
+  Timer m_timer;
+  std::vector<uint> m_voiceIDs;
+  std::vector<uint> m_freeVoiceIDs;
+  std::vector<AudioSource*> m_sources;
+  std::vector<uint8> m_sourceModes;
+  std::vector<vec3> m_sourcePositions;
+  std::vector<float> m_sourceGains;
+  std::vector<float> m_sourcePriorities;
+  std::vector<float> m_sourceReferenceDistances;
+  std::vector<float> m_sourceRolloffFactors;
+  std::vector<float> m_audibility;
+  std::vector<uint> m_ranking;
+  std::vector<bool> m_selected;
+  std::unique_ptr<AudioBufferCache> m_bufferCache;
 };
 
 } /*namespace nori*/
@@ -54,10 +54,12 @@ private:
     ITEM_POINTS,
     ITEM_LINES,
     ITEM_TRIANGLES,
+    ITEM_BATCHES,
     ITEM_TEXTURES,
     ITEM_VERTEXBUFFERS,
     ITEM_INDEXBUFFERS,
     ITEM_PROGRAMS,
+    ITEM_GLYPHS,
     ITEM_COUNT
   };
   void updateCountItem(Item item, const char* unit, size_t count);
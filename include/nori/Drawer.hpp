@@ -118,12 +118,22 @@ private:
  *  @ingroup ui
  *
  *  This class provides drawing for widgets.
+ *
+ *  Primitives drawn between @ref begin and @ref end are accumulated into a
+ *  batch of vertex colored, textured primitives, which is only rendered when
+ *  the primitive type or texture changes, or when the batch is explicitly
+ *  flushed.  Primitives are clipped to the current clipping area as they are
+ *  added, so clipping areas never split a batch.
  */
 class Drawer
 {
 public:
   void begin();
   void end();
+  /*! Renders all batched primitives.  Call this before rendering anything
+   *  directly through the render context between @ref begin and @ref end.
+   */
+  void flush();
   /*! Pushes a clipping area onto the clip stack. The current
    *  clipping area then becomes the specified area as clipped by the
    *  previously current clipping area.
@@ -151,6 +161,10 @@ public:
   void drawRect(const Rect& rect, vec4 color);
   void fillRect(const Rect& rect, vec4 color);
   void blitTexture(const Rect& area, Texture& texture, vec4 color);
+  /*! Blits a texture containing premultiplied alpha, such as one rendered to
+   *  with the drawer.
+   */
+  void blitPremultipliedTexture(const Rect& area, Texture& texture);
   void drawText(const Rect& area,
                 const char* text,
                 Alignment alignment,
@@ -165,31 +179,58 @@ public:
   void drawButton(const Rect& area, WidgetState state, const char* text = "");
   void drawCheck(const Rect& area, WidgetState state, bool checked, const char* text = "");
   void drawTab(const Rect& area, WidgetState state, const char* text = "");
+  /*! @return @c false if any text drawn since @ref begin was incomplete
+   *  because its glyphs were not yet available, or @c true otherwise.
+   */
+  bool isComplete() const { return m_complete; }
   const Theme& theme() const { return *m_theme; }
   RenderContext& context() { return m_context; }
   Font& font() { return *m_font; }
   void setFont(Font* font);
   static std::unique_ptr<Drawer> create(RenderContext& context);
 private:
+  enum BatchMode
+  {
+    BATCH_SOLID,
+    BATCH_MAPPED,
+    BATCH_PREMULTIPLIED,
+    BATCH_ELEMENT,
+    BATCH_TEXT
+  };
   Drawer(RenderContext& context);
   bool init();
   void drawElement(const Rect& area, const Rect& mapping);
-  void setDrawingState(vec4 color, bool wireframe);
+  Vertex4fc2ft2fv* addToBatch(PrimitiveType type,
+                              BatchMode mode,
+                              Texture* texture,
+                              uint count);
+  void addQuad(BatchMode mode,
+               Texture* texture,
+               vec2 minPosition,
+               vec2 maxPosition,
+               vec2 minTexcoord,
+               vec2 maxTexcoord,
+               vec4 color);
+  bool clipLine(vec2& start, vec2& end) const;
   RenderContext& m_context;
   Ref<Theme> m_theme;
-  Ref<VertexBuffer> m_vertexBuffer;
-  Ref<IndexBuffer> m_indexBuffer;
   Ref<SharedProgramState> m_state;
   Ref<Font> m_font;
   RectClipStackf m_clipAreaStack;
-  PrimitiveRange m_range;
+  std::vector<Vertex4fc2ft2fv> m_vertices;
+  std::vector<Font::Quad> m_quads;
+  PrimitiveType m_batchType;
+  BatchMode m_batchMode;
+  Ref<Texture> m_batchTexture;
+  uint m_batchOperationCount;
+  bool m_complete;
   Pass m_drawPass;
   Pass m_blitPass;
+  Pass m_premultipliedPass;
   Pass m_elementPass;
-  UniformStateIndex m_elementPosIndex;
-  UniformStateIndex m_elementSizeIndex;
-  UniformStateIndex m_texPosIndex;
-  UniformStateIndex m_texSizeIndex;
+  Pass m_textPass;
+  UniformStateIndex m_blitImageIndex;
+  UniformStateIndex m_textGlyphsIndex;
 };
 
 } /*namespace nori*/
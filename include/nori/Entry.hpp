@@ -52,11 +52,14 @@ private:
   void onCharacter(uint32 codepoint) override;
   void onTextChanged();
   void onCaretMoved();
+  void onWindowUpdated();
   void setCaretPosition(uint newPosition, bool notify);
   Signal<void,Entry&> m_textChanged;
   Signal<void,Entry&> m_caretMoved;
   TextController m_controller;
   Timer m_timer;
+  mutable Rect m_caretArea;
+  mutable bool m_caretVisible;
 };
 
 } /*namespace nori*/
@@ -48,6 +48,7 @@ public:
   float advance(int first, int second, float scale) const;
   float width(int index, float scale) const;
   float height(int index, float scale) const;
+  vec2 glyphSize(int index, float scale) const;
   Ref<Image> glyph(int index, float scale) const;
   static Ref<Face> create(const ResourceInfo& info, const char* data, size_t size);
   static Ref<Face> read(ResourceCache& cache, const std::string& name);
@@ -32,21 +32,33 @@
 #include <nori/Resource.hpp>
 #include <nori/Image.hpp>
 #include <nori/Face.hpp>
+#include <nori/GlyphAtlas.hpp>
 
 namespace nori
 {
 
 /*! @brief %Font layout and rendering object.
  *
- *  This class provides layout and rendering of a single font.
+ *  This class provides layout and rendering of a single font.  Glyph images
+ *  are kept in the glyph atlas of the render context, shared by all fonts.
  */
 class Font : public Resource, public RefObject
 {
 public:
+  class Quad;
   /*! Renders the specified text at the current pen position.
    *  @param text The text to render.
    */
   void drawText(vec2 pen, vec4 color, const char* text);
+  /*! Creates quads for the glyphs of the specified text, for rendering with
+   *  the glyph atlas pages of the render context.
+   *  @param[in] pen The pen position at the start of the text.
+   *  @param[in] text The text to realize.
+   *  @param[out] quads The resulting glyph quads.
+   *  @return @c true if all glyphs were realized, or @c false if some glyphs
+   *  were skipped because they are not yet resident in the glyph atlas.
+   */
+  bool realizeText(vec2 pen, const char* text, std::vector<Quad>& quads);
   /*! @return The ascender for this font.
    */
   float ascender() const { return m_ascender; }
@@ -87,9 +99,8 @@ private:
   Font(const ResourceInfo& info, RenderContext& context);
   Font(const Font&) = delete;
   bool init(Face& font, uint height);
-  const Glyph* addGlyph(uint32 codepoint);
-  const Glyph* findGlyph(uint32 codepoint);
-  bool addGlyphTextureRow();
+  Glyph* addGlyph(uint32 codepoint);
+  Glyph* findGlyph(uint32 codepoint);
   Font& operator = (const Font&) = delete;
   RenderContext& m_context;
   Ref<Face> m_face;
@@ -100,10 +111,10 @@ private:
   float m_leading;
   float m_width;
   float m_height;
-  ivec2 m_position;
-  Ref<Texture> m_texture;
   Pass m_pass;
   UniformStateIndex m_colorIndex;
+  UniformStateIndex m_glyphsIndex;
+  std::vector<Quad> m_quads;
   std::vector<Vertex2ft2fv> m_vertices;
 };
 
@@ -120,11 +131,27 @@ public:
   {
     return codepoint == desired;
   }
-  vec2 offset;
+  GlyphSlot slot;
   vec2 size;
   vec2 bearing;
   float advance;
   uint32 codepoint;
+  int index;
+};
+
+/*! @brief Glyph quad.
+ *
+ *  A quad of two triangles mapping a glyph image within a glyph atlas page.
+ */
+class Font::Quad
+{
+public:
+  bool operator < (const Quad& other) const
+  {
+    return page < other.page;
+  }
+  Vertex2ft2fv vertices[6];
+  uint page;
 };
 
 } /*namespace nori*/
@@ -0,0 +1,189 @@
+///////////////////////////////////////////////////////////////////////
+// Nori - a simple game engine
+// Copyright (c) 2014 Camilla Berglund <elmindreda@elmindreda.org>
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any
+// damages arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any
+// purpose, including commercial applications, and to alter it and
+// redistribute it freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you
+//     must not claim that you wrote the original software. If you use
+//     this software in a product, an acknowledgment in the product
+//     documentation would be appreciated but is not required.
+//
+//  2. Altered source versions must be plainly marked as such, and
+//     must not be misrepresented as being the original software.
+//
+//  3. This notice may not be removed or altered from any source
+//     distribution.
+//
+///////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+namespace nori
+{
+
+class Face;
+class Image;
+class Texture;
+class RenderContext;
+
+/*! @brief Location of a glyph image within a glyph atlas.
+ *
+ *  A slot is only valid as long as its generation matches that of the atlas
+ *  page it refers to.  Pass the same slot object to GlyphAtlas::acquire each
+ *  time the glyph is drawn and it will be kept up to date.
+ */
+class GlyphSlot
+{
+public:
+  /*! Constructor.
+   */
+  GlyphSlot();
+  /*! The index of the atlas page containing the glyph image.
+   */
+  uint page;
+  /*! The generation of the atlas page when the glyph image was added.
+   */
+  uint generation;
+  /*! The position, in texels, of the glyph image within the page.
+   */
+  vec2 offset;
+};
+
+/*! @brief Shared glyph image atlas.
+ *
+ *  The glyph atlas packs glyph images of any face and size into a set of
+ *  texture pages, using the skyline bottom-left heuristic.  When all pages are
+ *  full, the least recently used page is evicted and its generation advanced,
+ *  invalidating every slot referring to it.
+ *
+ *  If the atlas has worker threads, glyph images are rasterized
+ *  asynchronously and added to the atlas by @ref update, which the render
+ *  context calls once per frame.  Until then, GlyphAtlas::acquire returns
+ *  @c false for those glyphs, so anything drawn with them must be redrawn
+ *  when @ref glyphsAdded is emitted.
+ *
+ *  Glyph images that do not fit because every page is in use during the
+ *  current frame are kept and added again by the next @ref update, which
+ *  may then evict a page for them.
+ */
+class GlyphAtlas
+{
+public:
+  /*! Destructor.
+   */
+  ~GlyphAtlas();
+  /*! Makes the specified glyph image resident in this atlas.
+   *  @param[in] face The face of the glyph.
+   *  @param[in] index The index of the glyph within the face.
+   *  @param[in] scale The scale of the glyph.
+   *  @param[in,out] slot The slot of the glyph.
+   *  @return @c true if the glyph is resident and the slot valid, or @c false
+   *  if it is not (yet) available.
+   */
+  bool acquire(Face& face, int index, float scale, GlyphSlot& slot);
+  /*! Adds any glyph images rasterized or left without room since the last
+   *  call and starts a new frame for the purpose of eviction.
+   */
+  void update();
+  /*! @return The number of pages in this atlas.
+   */
+  uint pageCount() const { return uint(m_pages.size()); }
+  /*! @return The texture of the specified page.
+   */
+  Texture& pageTexture(uint index) const;
+  /*! @return The width and height, in texels, of each page.
+   */
+  uint pageSize() const { return m_pageSize; }
+  /*! @return The fraction of the area of all pages covered by glyph images.
+   */
+  float occupancy() const;
+  /*! @return The number of pages evicted since this atlas was created.
+   */
+  uint evictionCount() const { return m_evictionCount; }
+  /*! @return The signal for when asynchronously rasterized glyph images are
+   *  added to this atlas.
+   */
+  SignalProxy<void> glyphsAdded() { return m_glyphsAdded; }
+  /*! Creates a glyph atlas.
+   *  @param[in] context The render context within which to create the atlas.
+   *  @param[in] workerCount The number of rasterization threads to start, or
+   *  zero to rasterize glyphs immediately.
+   *  @param[in] maxPageCount The maximum number of texture pages.
+   */
+  static std::unique_ptr<GlyphAtlas> create(RenderContext& context,
+                                            uint workerCount = 0,
+                                            uint maxPageCount = 8);
+private:
+  class Key
+  {
+  public:
+    bool operator < (const Key& other) const;
+    const Face* face;
+    float scale;
+    int index;
+  };
+  class Entry
+  {
+  public:
+    Ref<Face> face;
+    Ref<Image> image;
+    GlyphSlot slot;
+    bool pending;
+  };
+  class Job
+  {
+  public:
+    Key key;
+    Ref<Image> image;
+  };
+  class Page
+  {
+  public:
+    bool allocate(uint width, uint height, ivec2& position);
+    Ref<Texture> texture;
+    std::vector<ivec3> skyline;
+    std::vector<Key> keys;
+    uint generation;
+    uint lastUsed;
+    size_t usedArea;
+  };
+  GlyphAtlas(RenderContext& context);
+  GlyphAtlas(const GlyphAtlas&) = delete;
+  bool init(uint workerCount, uint maxPageCount);
+  bool insert(const Key& key, Entry& entry, Image* image);
+  Page* addPage();
+  Page* evictPage();
+  void work();
+  GlyphAtlas& operator = (const GlyphAtlas&) = delete;
+  RenderContext& m_context;
+  uint m_pageSize;
+  uint m_maxPageCount;
+  uint m_frame;
+  uint m_evictionCount;
+  std::vector<Page> m_pages;
+  std::map<Key, Entry> m_entries;
+  std::deque<Job> m_requests;
+  std::deque<Job> m_results;
+  std::vector<Key> m_retries;
+  std::vector<std::thread> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  bool m_stopping;
+  Signal<void> m_glyphsAdded;
+};
+
+} /*namespace nori*/
+
@@ -26,6 +26,10 @@
 #pragma once
 
 #include <algorithm>
+#include <cassert>
+#include <deque>
+#include <limits>
+#include <vector>
 
 namespace nori
 {
@@ -38,6 +42,15 @@ enum IDBucket
 };
 
 /*! @brief Generic ID pool.
+ *
+ *  Released IDs are reused in the order they were released, once more than
+ *  the margin of them are waiting.  Each ID has a generation that is
+ *  incremented when it is released, so that an ID and generation pair held
+ *  past the release of the ID can be detected as stale.
+ *
+ *  The largest value of the ID type is never allocated.  Once all other IDs
+ *  have been allocated, released IDs are reused regardless of the margin, and
+ *  running out of those as well is a fatal error.
  */
 template <typename T, uint margin = 100>
 class IDPool
@@ -49,33 +62,63 @@ public:
   }
   T allocateID()
   {
-    if (released.size() > margin)
+    const bool exhausted = next == std::numeric_limits<T>::max();
+
+    if (released.size() > margin || (exhausted && !released.empty()))
     {
-      const T id = released.back();
-      released.pop_back();
+      const T id = released.front();
+      released.pop_front();
+      slots[id].released = false;
       return id;
     }
 
-    return next++;
+    if (exhausted)
+      panic("ID pool exhausted");
+
+    const T id = next++;
+    if (slots.size() <= id)
+      slots.resize(id + 1);
+
+    return id;
   }
   void releaseID(T id)
   {
-    released.insert(released.begin(), id);
+    assert(bucketOf(id) == ID_BUCKET_ALLOCATED);
+
+    slots[id].released = true;
+    slots[id].generation++;
+    released.push_back(id);
   }
-  IDBucket bucketOf(T id)
+  IDBucket bucketOf(T id) const
   {
     if (id >= next)
       return ID_BUCKET_UNUSED;
 
-    if (std::find(released.begin(), released.end(), id) != released.end())
+    if (slots[id].released)
       return ID_BUCKET_RELEASED;
 
     return ID_BUCKET_ALLOCATED;
   }
+  /*! @return The current generation of the specified ID.
+   */
+  uint32 generationOf(T id) const
+  {
+    if (id >= next)
+      return 0;
+
+    return slots[id].generation;
+  }
 private:
-  std::vector<T> released;
+  class Slot
+  {
+  public:
+    Slot(): generation(0), released(false) { }
+    uint32 generation;
+    bool released;
+  };
+  std::deque<T> released;
+  std::vector<Slot> slots;
   T next;
 };
 
 } /*namespace nori*/
-
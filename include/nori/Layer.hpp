@@ -32,6 +32,8 @@ namespace nori
 
 class Widget;
 class LayerStack;
+class Texture;
+class TextureFramebuffer;
 
 /*! @brief Root object for widgets.
  *  @ingroup ui
@@ -47,7 +49,16 @@ public:
   /*! Destructor.
    */
   ~Layer();
+  /*! Updates this layer.
+   *
+   *  @remarks Overrides must call this to update the layout of widgets.
+   */
   virtual void update();
+  /*! Runs a measure and an arrange pass over all widgets with dirty
+   *  layouts.  This is done once per update and, if still needed, before
+   *  drawing.
+   */
+  void updateLayout();
   /*! Draws all visible widgets in this UI layer.
    */
   virtual void draw();
@@ -65,8 +76,29 @@ public:
   void cancelDragging();
   void activatePrevWidget();
   void activateNextWidget();
+  /*! Flags this entire layer as needing to be redrawn.
+   */
   void invalidate();
+  /*! Flags the specified area of this layer as needing to be redrawn.
+   *  @param[in] area The area to redraw, in global coordinates.
+   */
+  void invalidate(const Rect& area);
   virtual bool isOpaque() const;
+  /*! @return @c true if this layer is in retained mode, otherwise @c false.
+   */
+  bool isRetained() const { return m_retained; }
+  /*! Sets whether this layer is in retained mode.
+   *
+   *  In retained mode, the widgets of this layer are drawn into a texture,
+   *  which is then blitted to the framebuffer every frame.  Only the areas of
+   *  the layer that have been invalidated since the previous frame are
+   *  redrawn, so the cost of a static layer is that of a single blit.
+   *
+   *  @remarks Widget drawing is composited with source alpha blending into
+   *  the cache, so translucent widgets over uncovered areas of the layer
+   *  appear slightly more transparent than in immediate mode.
+   */
+  void setRetained(bool enabled);
   bool hasCapturedCursor() const;
   vec2 cursorPoint() const;
   Drawer& drawer() const { return m_drawer; }
@@ -91,9 +123,11 @@ protected:
   void onScroll(vec2 offset) override;
   void onFocus(bool activated) override;
 private:
+  void drawRetained();
   void updateHoveredWidget();
   void activateWidget(int offset);
   void removeWidget(Widget& widget);
+  void onGlyphsAdded();
   void focusableWidgets(std::vector<Widget*>& target,
                         const std::vector<Widget*>& source) const;
   Window& m_window;
@@ -107,6 +141,12 @@ private:
   Widget* m_captureWidget;
   LayerStack* m_stack;
   Signal<void,Layer&> m_sizeChanged;
+  bool m_layoutDirty;
+  bool m_retained;
+  bool m_dirty;
+  Rect m_dirtyArea;
+  Ref<Texture> m_cacheTexture;
+  Ref<TextureFramebuffer> m_cacheFramebuffer;
 };
 
 class LayerStack
@@ -35,7 +35,12 @@ enum LayoutMode
   STATIC_SIZE
 };
 
-/*! @ingroup ui
+/*! @brief Stacking layout widget.
+ *  @ingroup ui
+ *
+ *  Layouts are updated lazily by the layout passes of their layer.  The
+ *  measure pass caches the total stacked size and flexible child count, and
+ *  the arrange pass uses these to set the areas of the children.
  */
 class Layout : public Widget
 {
@@ -52,9 +57,12 @@ protected:
   void onAreaChanged() override;
   void onAreaChanged(Widget& parent);
   void onSizeChanged(Layer& layer);
+  void onMeasure() override;
+  void onArrange() override;
 private:
-  void update();
   float m_borderSize;
+  float m_stackSize;
+  uint m_flexibleCount;
   Orientation m_orientation;
   LayoutMode m_mode;
 };
@@ -28,6 +28,43 @@
 namespace nori
 {
 
+/*! @brief Data source for virtual lists.
+ *
+ *  A list model provides the rows of a List on demand, so that only the
+ *  visible rows are ever queried.  Sorting and filtering are the concern of
+ *  the model, which should emit its changed signal afterwards.
+ *
+ *  @ingroup ui
+ */
+class ListModel
+{
+public:
+  virtual ~ListModel() { }
+  /*! @return The number of rows in this model.
+   */
+  virtual uint rowCount() const = 0;
+  /*! @return The text of the specified row.
+   */
+  virtual std::string rowText(uint row) const = 0;
+  /*! @return The ID of the specified row.
+   */
+  virtual ItemID rowID(uint row) const { return row; }
+  /*! @return The index of the row with the specified ID, or @c NO_ITEM if no
+   *  such row exists.
+   *  @remarks The default implementation is a linear search.
+   */
+  virtual uint findRow(ItemID id) const;
+  /*! @return The signal emitted when the rows of this model have changed.
+   */
+  SignalProxy<void,ListModel&> changed() { return m_changed; }
+protected:
+  /*! Notifies any lists using this model that its rows have changed.
+   */
+  void notifyChanged() { m_changed(*this); }
+private:
+  Signal<void,ListModel&> m_changed;
+};
+
 /*! @ingroup ui
  */
 class List : public Widget, public ItemContainer
@@ -53,6 +90,20 @@ public:
   void setSelectedItem(Item& newItem);
   ItemID selectedID();
   void setSelectedID(ItemID newItemID);
+  /*! @return The model of this list, or @c nullptr if it displays items.
+   */
+  ListModel* model() const { return m_model; }
+  /*! Makes this a virtual list displaying the rows of the specified model.
+   *  Only the visible rows are queried, and all rows have the same height,
+   *  so memory use and per-frame cost are independent of the row count.
+   *  @param[in] newModel The model to use, or @c nullptr to display items.
+   *
+   *  @remarks Any items of this list are ignored while a model is set.
+   *  @remarks The model must outlive its use by this list.
+   *  @remarks Edits to model rows are only reported via the item edited
+   *  signal.
+   */
+  void setModel(ListModel* newModel);
   const std::vector<Item*>& items() const override { return m_items; }
   SignalProxy<void,List&> itemSelected() { return m_itemSelected; }
   SignalProxy<void,List&,const std::string&> itemEdited() { return m_itemEdited; }
@@ -70,6 +121,11 @@ private:
   void onEntryKey(Widget& widget, Key key, Action action, uint mods);
   void onEntryDestroyed(Widget& widget);
   void onValueChanged(Scroller& scroller);
+  void onModelChanged(ListModel& model);
+  void drawRow(const Rect& area, const char* text, WidgetState state) const;
+  uint rowCount() const;
+  float rowHeight() const;
+  uint visibleRowCount() const;
   void beginEditing();
   void applyEditing();
   void cancelEditing();
@@ -80,9 +136,12 @@ private:
   Signal<void,List&,const std::string&> m_itemEdited;
   bool m_editable;
   std::vector<Item*> m_items;
+  ListModel* m_model;
+  SignalSlot<void,ListModel&>* m_modelSlot;
   uint m_offset;
   uint m_maxOffset;
   uint m_selection;
+  ItemID m_selectedID;
   Scroller* m_scroller;
   Entry* m_entry;
 };
@@ -25,17 +25,32 @@
 
 #pragma once
 
-#include <list>
 #include <memory>
+#include <atomic>
+#include <thread>
 
 #include <nori/Core.hpp>
 #include <nori/Time.hpp>
+#include <nori/Path.hpp>
 #include <nori/ID.hpp>
+#include <nori/Primitive.hpp>
+#include <nori/Transform.hpp>
 
 namespace nori
 {
 
+class Host;
 class NetworkObject;
+class SnapshotHistory;
+class ServiceEvent;
+class ServiceQueues;
+class PacketBlock;
+class PacketPool;
+class InterestGrid;
+class NetworkSimulation;
+class SimulatedLink;
+class HostRecorder;
+class HostReplay;
 
 /*! Network channel ID.
  *  @ingroup net
@@ -45,7 +60,7 @@ typedef uint8 ChannelID;
 /*! Network target ID.
  *  @ingroup net
  */
-typedef uint8 TargetID;
+typedef uint16 TargetID;
 
 /*! Network event ID.
  *  @ingroup net
@@ -102,42 +117,142 @@ enum
   OBJECT_ID_INVALID,
   OBJECT_ID_GAME,
   OBJECT_ID_LEVEL,
+  /*! Recipient of replication snapshots and their acknowledgements.
+   */
+  OBJECT_ID_SNAPSHOT,
+  /*! Recipient of packets of coalesced events sent by the send scheduler.
+   */
+  OBJECT_ID_BATCH,
   OBJECT_ID_POOL_BASE,
 };
 
 /*! Packet data descriptor.
  *  @ingroup net
+ *
+ *  Packet data allocated by a Host is pooled and reference counted, so it
+ *  stays valid for as long as any copy of the descriptor or any packet
+ *  created from it exists.  Pooled packet data grows as it is written to,
+ *  while writing past the capacity of other packet data is an error.
+ *
+ *  Bit writes are packed into the last partially written byte, while byte
+ *  writes always begin a new byte.  Reads must therefore mirror the order and
+ *  kind of the writes that produced the data.
  */
 class PacketData
 {
+  friend class Host;
 public:
   PacketData();
   PacketData(void* data, size_t capacity, size_t size = 0);
+  PacketData(const PacketData& source);
+  ~PacketData();
+  PacketData& operator = (const PacketData& source);
   uint8 read8();
   uint16 read16();
   uint32 read32();
   float read32f();
+  /*! Reads a byte if enough data remains.
+   *  @return @c true if successful, or @c false if there was not enough data,
+   *  in which case nothing is read.
+   */
+  bool read8(uint8& value);
+  /*! Reads a 16-bit integer if enough data remains.
+   *  @return @c true if successful, or @c false if there was not enough data,
+   *  in which case nothing is read.
+   */
+  bool read16(uint16& value);
+  /*! Reads a 32-bit integer if enough data remains.
+   *  @return @c true if successful, or @c false if there was not enough data,
+   *  in which case nothing is read.
+   */
+  bool read32(uint32& value);
+  /*! Checks once whether the specified number of bits remain to be read,
+   *  so that a run of fields can then be read with the unchecked readers.
+   *  @return @c true if enough data remains, otherwise @c false.
+   */
+  bool require(size_t bitCount) const;
+  /*! Reads an unsigned integer of the specified width.
+   *  @param[in] count The number of bits to read, from 1 to 32.
+   */
+  uint32 readBits(uint count);
+  /*! Reads an unsigned integer of the specified width without checking the
+   *  bounds, which must first have been checked with require.
+   */
+  uint32 readBitsUnchecked(uint count);
+  /*! Reads a variable length unsigned integer written with writeVarint.
+   */
+  uint32 readVarint();
+  /*! Reads a variable length unsigned integer written with writeVarint.
+   *  @return @c true if successful, or @c false if the data was truncated or
+   *  the integer was too long, in which case nothing is read.
+   */
+  bool readVarint(uint32& value);
+  /*! Reads a float quantized with writeFloat with the same parameters.
+   */
+  float readFloat(float minValue, float maxValue, uint bits);
+  /*! Reads a float quantized with writeFloat without checking the bounds,
+   *  which must first have been checked with require.
+   */
+  float readFloatUnchecked(float minValue, float maxValue, uint bits);
+  /*! Reads a unit quaternion written with writeQuat with the same parameters.
+   */
+  quat readQuat(uint bits = 9);
+  /*! Reads the specified number of bytes, checking the bounds only once.
+   *  @return @c true if successful, or @c false if there was not enough data,
+   *  in which case nothing is read.
+   */
+  bool readBytes(void* target, size_t count);
   template <typename T>
   T read();
   void write8(uint8 value);
   void write16(uint16 value);
   void write32(uint32 value);
   void write32f(float value);
+  /*! Writes the specified number of low bits of an unsigned integer.
+   *  @param[in] value The value to write.
+   *  @param[in] count The number of bits to write, from 1 to 32.
+   */
+  void writeBits(uint32 value, uint count);
+  /*! Writes an unsigned integer using one byte per seven significant bits.
+   */
+  void writeVarint(uint32 value);
+  /*! Writes a float clamped to the specified range and quantized to the
+   *  specified number of bits, from 1 to 32.
+   */
+  void writeFloat(float value, float minValue, float maxValue, uint bits);
+  /*! Writes a unit quaternion as the index of its largest component and its
+   *  three smallest components, each quantized to the specified number of
+   *  bits.  The default uses 29 bits in total.
+   */
+  void writeQuat(const quat& value, uint bits = 9);
+  void writeBytes(const void* source, size_t count);
   template <typename T>
   void write(const T& value);
   bool isEmpty();
   size_t size() const;
   size_t capacity() const;
+  /*! @return The number of bytes remaining to be read.
+   */
+  size_t remaining() const { return m_size - m_offset; }
   const void* data() const;
 private:
+  void reserve(size_t size);
+  PacketBlock* m_block;
   uint8* m_data;
   size_t m_capacity;
   size_t m_size;
   size_t m_offset;
+  uint8 m_writeBits;
+  uint8 m_readBits;
 };
 
 /*! Network peer.
  *  @ingroup net
+ *
+ *  While interest management is enabled on the server, a peer with view
+ *  volumes only receives broadcast events and snapshot updates for network
+ *  objects with bounds that intersect at least one of its view volumes, and
+ *  for network objects without bounds.
  */
 class Peer
 {
@@ -148,16 +263,85 @@ public:
   bool isClient() const { return m_id != SERVER; }
   bool isServer() const { return m_id == SERVER; }
   TargetID id() const { return m_id; }
+  /*! @return The generation of the ID of this peer, which together with the
+   *  ID identifies this peer even after the ID has been reused.
+   */
+  uint32 generation() const { return m_generation; }
   const std::string& name() const { return m_name; }
   uint32 address() const;
   Time roundTripTime() const;
+  /*! Adds a spherical view volume to this peer.
+   */
+  void addView(const Sphere& view);
+  /*! Adds a box-shaped view volume to this peer.
+   */
+  void addView(const AABB& view);
+  /*! Replaces the specified view volume of this peer with a spherical one.
+   *  @param[in] index The index of the view volume, in the order they were
+   *  added.
+   *  @remarks Views that are moved every update force the relevant objects
+   *  of the peer to be found again every update, so moving them only once
+   *  the point of view has strayed a margin from their center is cheaper.
+   */
+  void setView(size_t index, const Sphere& view);
+  /*! Replaces the specified view volume of this peer with a box-shaped one.
+   *  @param[in] index The index of the view volume, in the order they were
+   *  added.
+   */
+  void setView(size_t index, const AABB& view);
+  /*! Removes all view volumes from this peer, making all network objects
+   *  relevant to it.
+   */
+  void clearViews();
+  /*! @return @c true if the specified network object is relevant to this peer
+   *  as of the last update, otherwise @c false.
+   */
+  bool isRelevant(NetworkObjectID objectID) const;
 private:
-  Peer(void* peer, TargetID targetID, const char* name);
+  class QueuedPacket
+  {
+  public:
+    PacketData data;
+    ChannelID channel;
+    PacketType type;
+    float priority;
+    float accumulated;
+    Time time;
+  };
+  class View
+  {
+  public:
+    Sphere sphere;
+    AABB box;
+    bool spherical;
+  };
+  class VisibleSet
+  {
+  public:
+    uint32 sequence;
+    bool all;
+    std::vector<NetworkObjectID> ids;
+  };
+  Peer(Host& host, void* peer, TargetID targetID, const char* name);
+  Host* m_host;
   void* m_peer;
+  uint32 m_connectID;
+  uint32 m_address;
+  uint32 m_roundTripTime;
   TargetID m_id;
+  uint32 m_generation;
+  size_t m_index;
   std::string m_name;
   bool m_disconnecting;
   uint32 m_reason;
+  uint32 m_ackedSnapshot;
+  std::vector<QueuedPacket> m_queue;
+  double m_credit;
+  std::vector<View> m_views;
+  bool m_viewsChanged;
+  std::vector<bool> m_relevant;
+  std::vector<NetworkObjectID> m_relevantIDs;
+  std::vector<VisibleSet> m_visible;
 };
 
 /*! Network host event listener.
@@ -179,16 +363,80 @@ protected:
  */
 class Host
 {
+  friend class Peer;
   friend class NetworkObject;
+  friend class NetworkSimulation;
 public:
   ~Host();
   bool sendPacketTo(TargetID targetID,
                     ChannelID channel,
                     PacketType type,
                     const PacketData& data);
+  /*! Queues an event for the send scheduler, which runs at the start of each
+   *  update.  The scheduler coalesces queued events into packets of at most
+   *  one MTU per peer, channel and packet type, within the bandwidth budget
+   *  of each peer.
+   *
+   *  Reliable events are sent first and in the order they were queued.  The
+   *  remaining events are sent in order of their accumulated priority, which
+   *  grows by their priority every update they wait, so that low priority
+   *  events are delayed but not starved.  Unreliable events that wait longer
+   *  than a second are dropped.
+   *
+   *  @param[in] targetID The target to send to.
+   *  @param[in] channel The channel to send on.
+   *  @param[in] type The packet type to send as.
+   *  @param[in] data The event, as created by createEvent.
+   *  @param[in] priority The priority, reflecting the relevance of the event.
+   *  @return @c true if successful, or @c false if an error occurred.
+   */
+  bool queuePacketTo(TargetID targetID,
+                     ChannelID channel,
+                     PacketType type,
+                     const PacketData& data,
+                     float priority = 1.f);
+  /*! Dispatches received events to the observer and, unless a service thread
+   *  is running, services and flushes the connection.
+   *  @param[in] timeout The maximum time to wait for events.  This is ignored
+   *  while a service thread is running and by simulated hosts.
+   *  @return @c false if this client has been disconnected, otherwise @c true.
+   */
   bool update(Time timeout);
-  void* allocatePacketData(size_t size);
+  /*! Starts a thread that services and flushes the connection at the
+   *  specified rate, independent of the frame rate.  While it runs, events
+   *  are passed to update and packets are passed to the thread through
+   *  lock-free queues.
+   *  @param[in] frequency The service rate, in Hz.
+   *  @return @c true if successful, or @c false if an error occurred.
+   */
+  bool startServiceThread(uint frequency = 500);
+  /*! Stops the service thread, dispatching any events it has received.
+   */
+  void stopServiceThread();
+  /*! @return @c true if a service thread is running, otherwise @c false.
+   */
+  bool isThreaded() const { return m_threaded; }
+  /*! Captures the replicated fields of all network objects and sends each
+   *  client a snapshot delta-compressed against the last snapshot it
+   *  acknowledged.  Call this once per tick on the server.
+   *
+   *  Only the four byte words of state that changed since the baseline are
+   *  sent, along with one mask bit per word.  Changed words are sent as
+   *  their XOR against the baseline without entropy coding, so they cost
+   *  their full size.
+   *  @param[in] channel The channel to send snapshots on.
+   *  @return @c true if successful, or @c false if an error occurred.
+   */
+  bool replicate(ChannelID channel = 0);
+  /*! Allocates pooled packet data.
+   *  @param[in] capacity The initial capacity, in bytes.
+   */
+  PacketData allocatePacketData(size_t capacity);
   Peer* findPeer(TargetID targetID);
+  /*! @return The peer with the specified ID and ID generation, or @c nullptr
+   *  if no such peer exists, such as if the ID has since been reused.
+   */
+  Peer* findPeer(TargetID targetID, uint32 generation);
   NetworkObject* findObject(NetworkObjectID objectID);
   PacketData createEvent(EventID eventID, NetworkObjectID recipientID);
   bool dispatchEvent(TargetID sourceID, PacketData& data);
@@ -198,33 +446,141 @@ public:
   uint totalOutgoingBytes() const;
   uint incomingBytesPerSecond() const;
   uint outgoingBytesPerSecond() const;
+  /*! @return The time since this host was created, or the simulated time of
+   *  a simulated host, in seconds.
+   */
+  Time time() const;
+  /*! @return The total number of snapshot bytes sent or received.
+   */
+  size_t totalSnapshotBytes() const { return m_snapshotBytes; }
+  /*! @return The number of bytes of packet data currently in use.
+   */
+  size_t packetMemoryUsage() const;
+  /*! @return The highest number of bytes of packet data in use at once.
+   */
+  size_t packetMemoryHighWater() const;
+  /*! @return The number of queued events dropped for waiting too long.
+   */
+  size_t droppedEventCount() const { return m_droppedEventCount; }
+  /*! @return The send scheduler bandwidth budget of each peer, in bytes per
+   *  second, or zero if unlimited.
+   */
+  uint peerBandwidth() const { return m_peerBandwidth; }
+  /*! Sets the send scheduler bandwidth budget of each peer.
+   *  @param[in] newBandwidth The budget, in bytes per second, or zero for
+   *  no limit.
+   */
+  void setPeerBandwidth(uint newBandwidth);
+  /*! @return @c true if interest management is enabled, otherwise @c false.
+   */
+  bool isInterestManaged() const { return bool(m_interest); }
+  /*! Enables or disables interest management on the server.  While enabled,
+   *  broadcast packets are assumed to be events and are only sent to peers
+   *  to which their recipient object is relevant, and snapshots only include
+   *  the objects relevant to each peer.  The relevant objects of each peer are
+   *  found using a uniform grid and updated each update and replication.
+   *  @param[in] enabled Whether to enable interest management.
+   *  @param[in] cellSize The size of the grid cells, which should be close to
+   *  the size of typical view volumes.
+   *  @return @c true if successful, or @c false if an error occurred.
+   */
+  bool setInterestManagement(bool enabled, float cellSize = 64.f);
+  /*! @return The number of broadcast event sends withheld from peers by
+   *  interest management.
+   */
+  size_t savedMessageCount() const { return m_savedMessageCount; }
   void setObserver(HostObserver* newObserver);
+  /*! Starts recording all packets sent and received, peer connections and
+   *  disconnections and updates, with their timing, to an append-only log.
+   *  The log is written by a separate thread.
+   *  @param[in] path The path of the log file to create.
+   *  @return @c true if successful, or @c false if an error occurred.
+   */
+  bool startRecording(const Path& path);
+  /*! Stops recording, writing any remaining records to the log.
+   */
+  void stopRecording();
+  /*! @return @c true if this host is recording, otherwise @c false.
+   */
+  bool isRecording() const { return bool(m_recorder); }
   static std::unique_ptr<Host> create(uint16 port,
                                       size_t maxClientCount,
                                       uint8 maxChannelCount = 0);
   static std::unique_ptr<Host> connect(const std::string& name,
                                        uint16 port,
                                        uint8 maxChannelCount = 0);
+  /*! Creates a host that replays a log recorded by startRecording, passing
+   *  the recorded connections, disconnections and received packets to the
+   *  observer from update, without any network.  Packets sent by the host are
+   *  discarded.  Update returns @c false once the log has been replayed.
+   *  @param[in] path The path of the log file.
+   *  @param[in] realTime @c true to replay records at their original times,
+   *  or @c false to replay the records of one recorded update per update.
+   */
+  static std::unique_ptr<Host> replay(const Path& path, bool realTime = true);
 private:
   Host();
   Host(const Host&) = delete;
   bool init(uint16 port, size_t maxClientCount, uint8 maxChannelCount);
   bool init(const std::string& name, uint16 port, uint8 maxChannelCount);
+  bool init(const Path& path, bool realTime);
   bool broadcast(ChannelID channel, PacketType type, const PacketData& data);
+  bool sendSnapshot(Peer& peer, ChannelID channel);
+  bool sendENetPacket(Peer* peer, ChannelID channel, void* packet);
+  bool handleEvent(ServiceEvent& event);
+  void* createENetPacket(const PacketData& data, PacketType type);
+  void disconnectPeer(Peer& peer, uint32 reason);
+  void drainOutbound();
+  void service(uint frequency);
+  void flushServiceQueues(bool dispatch);
+  bool receiveSnapshot(TargetID sourceID, PacketData& data);
+  bool schedule(Peer& peer, Time deltaTime);
+  bool dispatchBatch(TargetID sourceID, PacketData& data);
+  void updateInterest();
+  bool replayRecords();
+  bool isQueued() const { return m_threaded || m_simulation || m_replay; }
+  bool isRelevant(const Peer& peer, NetworkObjectID objectID) const;
   Host& operator = (const Host&) = delete;
   void* m_object;
-  std::list<Peer> m_peers;
+  std::vector<Peer*> m_peers;
+  std::vector<std::unique_ptr<Peer>> m_peerTable;
   HostObserver* m_observer;
   IDPool<TargetID> m_clientIDs;
   IDPool<NetworkObjectID> m_objectIDs;
   std::vector<NetworkObject*> m_objects;
-  size_t m_allocated;
-  uint8 m_buffer[65536];
+  std::unique_ptr<PacketPool> m_pool;
+  std::unique_ptr<SnapshotHistory> m_snapshots;
+  size_t m_snapshotBytes;
+  std::vector<uint8> m_snapshotDelta;
+  std::vector<NetworkObjectID> m_snapshotIDs;
+  std::vector<uint8> m_snapshotMask;
+  std::unique_ptr<ServiceQueues> m_queues;
+  std::thread m_thread;
+  std::atomic<bool> m_running;
+  std::atomic<uint> m_totalIncoming;
+  std::atomic<uint> m_totalOutgoing;
+  std::atomic<uint> m_incomingBandwidth;
+  std::atomic<uint> m_outgoingBandwidth;
+  Timer m_timer;
+  uint m_peerBandwidth;
+  size_t m_droppedEventCount;
+  std::unique_ptr<InterestGrid> m_interest;
+  size_t m_savedMessageCount;
+  NetworkSimulation* m_simulation;
+  Time m_updateTime;
+  std::unique_ptr<HostRecorder> m_recorder;
+  std::unique_ptr<HostReplay> m_replay;
+  bool m_threaded;
   bool m_server;
   static uint m_count;
 };
 
 /*! @brief Network object.
+ *
+ *  Subclasses may declare replicated fields with the replicate methods,
+ *  usually in their constructor.  Replicated fields are sent by
+ *  Host::replicate and must be declared in the same order on the server and
+ *  on clients.
  */
 class NetworkObject
 {
@@ -232,11 +588,27 @@ class NetworkObject
 public:
   NetworkObject(Host& host, NetworkObjectID objectID = OBJECT_ID_INVALID);
   virtual ~NetworkObject();
+  /*! Called on the server before the replicated fields of this object are
+   *  captured, and on clients after they have been updated.
+   */
   virtual void synchronize();
   bool isOnServer() const { return m_host.isServer(); }
   bool isOnClient() const { return m_host.isClient(); }
   NetworkObjectID id() const { return m_id; }
   Host& host() const { return m_host; }
+  /*! @return @c true if this object has bounds, otherwise @c false.
+   */
+  bool isBounded() const { return m_bounded; }
+  /*! @return The bounds of this object, used by interest management.
+   */
+  const Sphere& bounds() const { return m_bounds; }
+  /*! Sets the bounds of this object, used by interest management.  Objects
+   *  without bounds are relevant to all peers.
+   */
+  void setBounds(const Sphere& newBounds);
+  /*! Moves the bounds of this object to the specified position.
+   */
+  void setPosition(vec3 newPosition);
 protected:
   PacketData createEvent(EventID eventID, NetworkObjectID recipientID) const;
   bool broadcastEvent(ChannelID channelID,
@@ -255,12 +627,296 @@ protected:
                  PacketType type,
                  NetworkObjectID recipientID,
                  EventID eventID) const;
+  /*! Queues an event for the send scheduler.
+   *  @sa Host::queuePacketTo
+   */
+  bool queueEvent(TargetID targetID,
+                  ChannelID channelID,
+                  PacketType type,
+                  PacketData& data,
+                  float priority = 1.f) const;
   virtual void receiveEvent(TargetID senderID,
                             PacketData& data,
                             EventID eventID);
+  void replicate(bool& field);
+  void replicate(uint8& field);
+  void replicate(uint16& field);
+  void replicate(uint32& field);
+  void replicate(int32& field);
+  void replicate(float& field);
+  void replicate(vec2& field);
+  void replicate(vec3& field);
+  void replicate(vec4& field);
+  void replicate(quat& field);
 private:
+  class Replica
+  {
+  public:
+    void* address;
+    uint8 elementSize;
+    uint8 elementCount;
+  };
+  void addReplica(void* address, uint elementSize, uint elementCount);
+  void captureReplicas(uint8* target) const;
+  void applyReplicas(const uint8* source);
   NetworkObjectID m_id;
+  bool m_pooled;
   Host& m_host;
+  std::vector<Replica> m_replicas;
+  uint m_replicaSize;
+  Sphere m_bounds;
+  bool m_bounded;
+};
+
+/*! @brief Time-stamped transform buffer for smoothing replicated motion.
+ *  @ingroup net
+ *
+ *  Clients add each transform they receive along with the server time it was
+ *  captured at and the local time it arrived, and evaluate the buffer at the
+ *  local time.  Transforms are evaluated at the estimated server time minus a
+ *  delay, which grows with the measured arrival jitter so that there is
+ *  almost always a received transform on either side to interpolate between.
+ *  When received transforms run out, motion is extrapolated for a limited time.
+ */
+class TransformInterpolator
+{
+public:
+  /*! Constructor.
+   *  @param[in] capacity The number of received transforms to keep.
+   */
+  TransformInterpolator(size_t capacity = 32);
+  /*! Adds a received transform.  Transforms older than the newest one added
+   *  are ignored.
+   *  @param[in] time The server time the transform was captured at.
+   *  @param[in] arrival The local time the transform arrived at.
+   *  @param[in] transform The transform.
+   */
+  void add(Time time, Time arrival, const Transform3& transform);
+  /*! Evaluates the buffer.
+   *  @param[in] now The current local time.
+   *  @param[out] result The interpolated transform.
+   *  @return @c true if successful, or @c false if no transforms have been
+   *  added.
+   */
+  bool evaluate(Time now, Transform3& result) const;
+  /*! Removes all transforms and resets the jitter estimate.
+   */
+  void reset();
+  /*! @return The total interpolation delay, including jitter compensation.
+   */
+  Time delay() const { return m_delay + m_jitterScale * m_jitter; }
+  /*! @return The measured arrival jitter, in seconds.
+   */
+  Time jitter() const { return m_jitter; }
+  /*! Sets the base interpolation delay, which should be at least the interval
+   *  at which transforms are sent.
+   */
+  void setDelay(Time newDelay) { m_delay = newDelay; }
+  /*! Sets how many times the measured jitter is added to the delay.
+   */
+  void setJitterScale(float newScale) { m_jitterScale = newScale; }
+  /*! Sets the longest time to extrapolate past the newest transform.
+   */
+  void setMaxExtrapolation(Time newTime) { m_maxExtrapolation = newTime; }
+private:
+  class State
+  {
+  public:
+    Time time;
+    Transform3 transform;
+  };
+  const State& state(size_t index) const;
+  std::vector<State> m_states;
+  size_t m_first;
+  size_t m_count;
+  Time m_delay;
+  float m_jitterScale;
+  Time m_maxExtrapolation;
+  Time m_offset;
+  Time m_jitter;
+};
+
+/*! @brief Client-side prediction of a locally controlled transform.
+ *  @ingroup net
+ *
+ *  Inputs are applied locally as soon as they are made and recorded with
+ *  their sequence number, which should be sent to the server with the input.
+ *  When the server reports the authoritative transform after the last input
+ *  it has processed, acknowledged inputs are discarded and, if the prediction
+ *  for that input was wrong, the remaining inputs are replayed on top of the
+ *  authoritative transform.
+ *
+ *  Subclasses implement applyInput, which must be deterministic and match
+ *  what the server does with each input.
+ */
+class TransformPredictor
+{
+public:
+  TransformPredictor();
+  virtual ~TransformPredictor();
+  /*! Applies an input to the predicted transform and records it.  The input
+   *  is kept until acknowledged, so it should be allocated by a Host.
+   *  @param[in] input The input, as sent to the server.
+   *  @return The sequence number of the input.
+   */
+  uint32 predict(const PacketData& input);
+  /*! Reconciles the prediction with the server.
+   *  @param[in] sequence The sequence number of the last input the server
+   *  has processed.
+   *  @param[in] authoritative The transform on the server after that input.
+   */
+  void reconcile(uint32 sequence, const Transform3& authoritative);
+  /*! @return The predicted transform.
+   */
+  const Transform3& transform() const { return m_transform; }
+  /*! Sets the predicted transform without replaying any inputs.
+   */
+  void setTransform(const Transform3& newTransform);
+  /*! @return The number of inputs not yet acknowledged by the server.
+   */
+  size_t pendingInputCount() const { return m_inputs.size(); }
+  /*! Sets the largest position error, and rotation error in radians, that
+   *  is not corrected.
+   */
+  void setTolerance(float newTolerance) { m_tolerance = newTolerance; }
+protected:
+  /*! Called to apply an input to a transform, both when predicting and when
+   *  replaying inputs after a correction.
+   */
+  virtual void applyInput(Transform3& transform, PacketData& input) = 0;
+  /*! Called after the prediction has been corrected.  The default does
+   *  nothing, but it may be used to smooth out the correction.
+   */
+  virtual void onCorrection(const Transform3& previous, const Transform3& corrected);
+private:
+  class Input
+  {
+  public:
+    uint32 sequence;
+    PacketData data;
+    Transform3 predicted;
+  };
+  std::vector<Input> m_inputs;
+  Transform3 m_transform;
+  uint32 m_sequence;
+  float m_tolerance;
+};
+
+/*! @brief Simulated network link conditions.
+ *  @ingroup net
+ */
+class LinkModel
+{
+public:
+  LinkModel();
+  /*! The delay of every packet in each direction, in seconds.
+   */
+  Time latency;
+  /*! The largest random extra delay of each packet, in seconds.  Unreliable
+   *  packets may be reordered by it.
+   */
+  Time jitter;
+  /*! The probability of each packet being lost.  Lost reliable packets are
+   *  resent after a round trip, delaying the reliable packets behind them.
+   */
+  float loss;
+};
+
+/*! @brief Deterministic in-process network.
+ *  @ingroup net
+ *
+ *  Hosts created by a simulation exchange packets through it instead of
+ *  through ENet.  Packets are delayed and lost according to the link model,
+ *  using a random number generator seeded on creation, and are delivered only
+ *  as the simulation is advanced, so that a run is reproducible from its seed
+ *  as long as the hosts are driven in the same way.
+ *
+ *  Packets delivered by advance are received by the next update of each host.
+ *  Simulated hosts cannot start a service thread and must be destroyed before
+ *  the simulation.
+ */
+class NetworkSimulation
+{
+  friend class Host;
+public:
+  ~NetworkSimulation();
+  /*! Creates the server host of this simulation.
+   *  @param[in] maxClientCount The maximum number of connected clients.
+   */
+  std::unique_ptr<Host> createServer(size_t maxClientCount);
+  /*! Creates a client host connected to the server of this simulation.
+   */
+  std::unique_ptr<Host> connect();
+  /*! Advances the simulated time, sending the packets queued by all hosts
+   *  and delivering the packets that have arrived.
+   *  @param[in] deltaTime The time to advance, in seconds.
+   */
+  void advance(Time deltaTime);
+  /*! @return The simulated time, in seconds.
+   */
+  Time time() const { return m_time; }
+  /*! @return The number of packets lost or dropped as out of sequence.
+   */
+  size_t lostPacketCount() const { return m_lostCount; }
+  /*! @return The number of packets delivered.
+   */
+  size_t deliveredPacketCount() const { return m_deliveredCount; }
+  /*! @return The delivery delay, in seconds, that the specified fraction of
+   *  packets received by the specified host arrived within.
+   */
+  Time latencyPercentile(const Host& host, float fraction) const;
+  const LinkModel& linkModel() const { return m_model; }
+  void setLinkModel(const LinkModel& newModel);
+  /*! Creates a simulation.
+   *  @param[in] seed The seed of the random number generator.
+   */
+  static std::unique_ptr<NetworkSimulation> create(uint32 seed);
+private:
+  class Packet
+  {
+  public:
+    Time time;
+    Time sent;
+    uint64 order;
+    uint link;
+    uint side;
+    uint type;
+    void* packet;
+    ChannelID channel;
+    uint32 data;
+    uint32 sequence;
+  };
+  class Endpoint
+  {
+  public:
+    Host* host;
+    std::vector<float> delays;
+    size_t delayCount;
+    uint lastIncoming;
+    uint lastOutgoing;
+  };
+  NetworkSimulation(uint32 seed);
+  NetworkSimulation(const NetworkSimulation&) = delete;
+  Host* createHost(bool server);
+  void detach(Host& host);
+  void flush(Host& host);
+  void flush(Endpoint& endpoint);
+  void schedule(SimulatedLink& link, uint side, uint type, void* packet,
+                ChannelID channel, uint32 data);
+  bool deliver(const Packet& packet, Time arrival);
+  float random();
+  static bool isLater(const Packet& x, const Packet& y);
+  NetworkSimulation& operator = (const NetworkSimulation&) = delete;
+  LinkModel m_model;
+  uint32 m_state;
+  Time m_time;
+  uint64 m_order;
+  std::vector<Endpoint> m_endpoints;
+  std::vector<std::unique_ptr<SimulatedLink>> m_links;
+  std::vector<Packet> m_packets;
+  size_t m_maxClientCount;
+  size_t m_lostCount;
+  size_t m_deliveredCount;
 };
 
 } /*namespace nori*/
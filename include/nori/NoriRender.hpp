@@ -38,6 +38,7 @@
 #include <nori/Program.hpp>
 #include <nori/RenderContext.hpp>
 #include <nori/Pass.hpp>
+#include <nori/GlyphAtlas.hpp>
 #include <nori/Font.hpp>
 #include <nori/Material.hpp>
 #include <nori/RenderQueue.hpp>
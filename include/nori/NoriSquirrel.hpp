@@ -36,6 +36,7 @@
 #if NORI_INCLUDE_SQUIRREL
 
 #include <nori/Squirrel.hpp>
+#include <nori/SqWorkers.hpp>
 
 #else
 #error "Squirrel module not enabled"
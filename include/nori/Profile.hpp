@@ -36,6 +36,7 @@ class ProfileNode
 public:
   bool operator == (const char* string) const;
   Time duration() const { return m_duration; }
+  Time selfDuration() const;
   uint callCount() const { return m_calls; }
   const std::string& name() const { return m_name; }
   const std::vector<ProfileNode>& children() const { return m_children; }
@@ -51,22 +52,32 @@ private:
 class Profile
 {
 public:
+  Profile();
   void beginFrame();
   void endFrame();
   void beginNode(const char* name);
   void endNode();
   const ProfileNode& rootNode() const { return m_root; }
+  std::string hierarchicalReport() const;
+  std::string flatReport() const;
+  /*! @return The current profile of the calling thread.
+   */
   static Profile* currentNode() { return m_current; }
+  /*! Sets the current profile of the calling thread.  A profile must only be
+   *  current on one thread at a time.
+   */
+  static void setCurrentNode(Profile* newProfile) { m_current = newProfile; }
 private:
   Profile(const Profile&) = delete;
   void beginNode(ProfileNode& node);
   Profile& operator = (const Profile&) = delete;
   static void resetNode(ProfileNode& node);
+  static void reportNode(std::string& report, const ProfileNode& node, uint depth);
   typedef std::vector<ProfileNode*> Stack;
   ProfileNode m_root;
   Stack m_stack;
   Timer m_timer;
-  static Profile* m_current;
+  static thread_local Profile* m_current;
 };
 
 class ProfileNodeCall
@@ -42,6 +42,7 @@ class VertexBuffer;
 class IndexBuffer;
 class RenderContext;
 class PrimitiveRange;
+class GlyphAtlas;
 
 /*! @brief Polygon face enumeration.
  */
@@ -149,7 +150,8 @@ public:
                uint depthBits = 24,
                uint stencilBits = 0,
                uint samples = 0,
-               bool debug = false);
+               bool debug = false,
+               uint glyphWorkerCount = 0);
   /*! The desired color buffer bit depth.
    */
   uint colorBits;
@@ -165,6 +167,10 @@ public:
   /*! Whether to create a debug context.
    */
   bool debug;
+  /*! The number of threads rasterizing glyphs for the glyph atlas, or zero to
+   *  rasterize each glyph when it is first drawn.
+   */
+  uint glyphWorkerCount;
 };
 
 /*! Render state.
@@ -257,12 +263,15 @@ public:
     uint pointCount;
     uint lineCount;
     uint triangleCount;
+    uint batchCount;
+    uint batchedOperationCount;
     Time duration;
   };
   RenderStats();
   void addFrame();
   void addStateChange();
   void addPrimitives(PrimitiveType type, uint vertexCount);
+  void addBatch(uint operationCount);
   void addTexture(size_t size);
   void removeTexture(size_t size);
   void addVertexBuffer(size_t size);
@@ -271,6 +280,7 @@ public:
   void removeIndexBuffer(size_t size);
   void addProgram();
   void removeProgram();
+  void setGlyphAtlasUsage(uint pageCount, float occupancy, uint evictionCount);
   float frameRate() const { return m_frameRate; }
   uint frameCount() const { return m_frameCount; }
   const Frame& currentFrame() const { return m_frames.front(); }
@@ -281,6 +291,9 @@ public:
   size_t totalTextureSize() const { return m_textureSize; }
   size_t totalVertexBufferSize() const { return m_vertexBufferSize; }
   size_t totalIndexBufferSize() const { return m_indexBufferSize; }
+  uint glyphAtlasPageCount() const { return m_glyphAtlasPageCount; }
+  float glyphAtlasOccupancy() const { return m_glyphAtlasOccupancy; }
+  uint glyphAtlasEvictionCount() const { return m_glyphAtlasEvictionCount; }
 private:
   uint m_frameCount;
   float m_frameRate;
@@ -292,6 +305,9 @@ private:
   size_t m_textureSize;
   size_t m_vertexBufferSize;
   size_t m_indexBufferSize;
+  uint m_glyphAtlasPageCount;
+  float m_glyphAtlasOccupancy;
+  uint m_glyphAtlasEvictionCount;
   Timer m_timer;
 };
 
@@ -519,6 +535,9 @@ public:
   bool debug() const { return m_debug; }
   RenderStats* stats() const;
   void setStats(RenderStats* newStats);
+  /*! @return The glyph atlas shared by all fonts of this context.
+   */
+  GlyphAtlas& glyphAtlas();
   /*! @return The limits of this context.
    */
   const RenderLimits& limits() const;
@@ -556,6 +575,8 @@ private:
   GLFWwindow* m_handle;
   bool m_debug;
   std::unique_ptr<RenderLimits> m_limits;
+  std::unique_ptr<GlyphAtlas> m_glyphAtlas;
+  uint m_glyphWorkerCount;
   int m_swapInterval;
   Recti m_scissorArea;
   Recti m_viewportArea;
@@ -54,5 +54,83 @@ public:
   uint frequency;
 };
 
+/*! @brief Compressed audio sample.
+ *
+ *  A compressed sample keeps the contents of a sample file in memory and
+ *  decodes it on demand, trading decoding time for a much smaller footprint
+ *  than a decoded Sample.
+ */
+class CompressedSample : public Resource, public RefObject
+{
+public:
+  CompressedSample(const ResourceInfo& info,
+                   std::vector<char>&& data,
+                   SampleFormat format,
+                   uint frequency,
+                   size_t length);
+  /*! Decodes this sample.  This may be called from any thread.
+   *  @param[out] target The decoded data.
+   *  @return @c true if successful, or @c false otherwise.
+   */
+  bool decode(std::vector<char>& target) const;
+  /*! @return The size, in bytes, of the decoded data.
+   */
+  size_t decodedSize() const;
+  static Ref<CompressedSample> read(ResourceCache& cache, const std::string& name);
+  std::vector<char> data;
+  SampleFormat format;
+  uint frequency;
+  size_t length;
+};
+
+/*! @brief Incremental audio sample decoder.
+ *
+ *  Unlike Sample::read, a sample stream only decodes as much of the file as
+ *  is requested, so memory use is independent of the length of the sample.
+ */
+class SampleStream
+{
+public:
+  /*! Destructor.
+   */
+  ~SampleStream();
+  /*! Decodes sample frames at the current position.
+   *  @param[out] target The buffer to decode into, with room for the
+   *  specified number of frames in the format of this stream.
+   *  @param[in] count The maximum number of frames to decode.
+   *  @return The number of frames decoded, or zero at the end of the stream.
+   */
+  size_t read(int16* target, size_t count);
+  /*! Moves the current position to the specified frame.
+   *  @return @c true if successful, or @c false otherwise.
+   */
+  bool seek(size_t frame);
+  /*! @return The format of the decoded data.  This is always a 16-bit format.
+   */
+  SampleFormat format() const { return m_format; }
+  /*! @return The number of channels of the decoded data.
+   */
+  uint channels() const { return m_format == SAMPLE_MONO16 ? 1 : 2; }
+  /*! @return The sample rate, in Hz, of this stream.
+   */
+  uint frequency() const { return m_frequency; }
+  /*! @return The length, in frames, of this stream.
+   */
+  size_t length() const { return m_length; }
+  /*! Opens the specified sample file for streaming.
+   */
+  static std::unique_ptr<SampleStream> open(ResourceCache& cache,
+                                            const std::string& name);
+private:
+  SampleStream();
+  SampleStream(const SampleStream&) = delete;
+  bool init(const Path& path);
+  SampleStream& operator = (const SampleStream&) = delete;
+  void* m_handle;
+  SampleFormat m_format;
+  uint m_frequency;
+  size_t m_length;
+};
+
 } /*namespace nori*/
 
@@ -0,0 +1,154 @@
+///////////////////////////////////////////////////////////////////////
+// Nori - a simple game engine
+// Copyright (c) 2014 Camilla Berglund <elmindreda@elmindreda.org>
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any
+// damages arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any
+// purpose, including commercial applications, and to alter it and
+// redistribute it freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you
+//     must not claim that you wrote the original software. If you use
+//     this software in a product, an acknowledgment in the product
+//     documentation would be appreciated but is not required.
+//
+//  2. Altered source versions must be plainly marked as such, and
+//     must not be misrepresented as being the original software.
+//
+//  3. This notice may not be removed or altered from any source
+//     distribution.
+//
+///////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+
+namespace nori
+{
+
+/*! @brief Serialized Squirrel value sent between script entities.
+ *  @ingroup squirrel
+ *
+ *  Messages carry null, bool, integer, float and string values, and arrays
+ *  and tables of these.  The main thread has entity ID zero.
+ */
+class SqMessage
+{
+public:
+  /*! Constructor.
+   */
+  SqMessage();
+  /*! Constructor.
+   */
+  SqMessage(uint32 sender, uint32 target, const char* name);
+  /*! Serializes the value at the specified index on the stack of the
+   *  specified %VM as the value of this message.
+   *  @return @c true if successful, or @c false if the value, or any value
+   *  it contains, cannot be serialized.
+   */
+  bool store(HSQUIRRELVM vm, SQInteger index);
+  /*! Pushes the value of this message onto the stack of the specified %VM.
+   */
+  bool push(HSQUIRRELVM vm) const;
+  /*! The ID of the entity sending this message.
+   */
+  uint32 sender;
+  /*! The ID of the entity receiving this message.
+   */
+  uint32 target;
+  /*! The name of this message.
+   */
+  std::string name;
+  /*! The serialized value of this message.
+   */
+  std::vector<uint8> data;
+};
+
+/*! @brief Pool of Squirrel VMs running entity scripts in parallel.
+ *  @ingroup squirrel
+ *
+ *  Each worker thread owns a %VM and the entities assigned to it.  Scripts
+ *  must be executed in every %VM before entities are created, and entities
+ *  are instances of a class in the root table.  The class is called with the
+ *  entity ID when the entity is created.
+ *
+ *  Each update, every worker delivers pending messages to the @c onMessage
+ *  method of each target entity, called with the sender ID, name and value,
+ *  and then calls the @c update method of each of its entities with the time
+ *  elapsed.  Scripts send messages with the global function @c send, taking
+ *  the target ID, name and value.
+ *
+ *  Messages are exchanged between updates and ordered by sender ID, in the
+ *  order they were sent, so the order does not depend on the number of
+ *  workers or on thread scheduling.  Messages sent to the main thread are
+ *  available from @ref messages until the next update.
+ *
+ *  Apart from during @ref update, the VMs are only touched by the calling
+ *  thread.
+ */
+class SqWorkerPool
+{
+public:
+  /*! Destructor.
+   */
+  ~SqWorkerPool();
+  /*! Executes the specified script in every %VM.
+   */
+  bool execute(const char* name);
+  /*! Creates an entity from the specified script class.
+   *  @return The ID of the created entity, or zero if an error occurred.
+   */
+  uint32 createEntity(const char* className);
+  /*! Destroys the specified entity.  Pending messages to it are discarded.
+   */
+  void destroyEntity(uint32 id);
+  /*! Posts a message to be delivered at the next update.
+   */
+  void post(const SqMessage& message);
+  /*! Runs the scripts of all entities and waits for them to finish.
+   */
+  void update(Time deltaTime);
+  /*! @return The messages sent to the main thread during the last update.
+   */
+  const std::vector<SqMessage>& messages() const { return m_messages; }
+  /*! @return The number of worker threads in this pool.
+   */
+  uint workerCount() const { return uint(m_workers.size()); }
+  /*! @return The %VM of the specified worker.
+   */
+  SqVM& vm(uint index) const;
+  /*! Creates a worker pool.
+   *  @param[in] cache The resource cache to load scripts from.
+   *  @param[in] workerCount The number of worker threads to start, or zero
+   *  to start one per hardware thread.
+   */
+  static std::unique_ptr<SqWorkerPool> create(ResourceCache& cache,
+                                              uint workerCount = 0);
+private:
+  class Worker;
+  SqWorkerPool(ResourceCache& cache);
+  SqWorkerPool(const SqWorkerPool&) = delete;
+  bool init(uint workerCount);
+  void work(Worker& worker);
+  void route(SqMessage&& message);
+  SqWorkerPool& operator = (const SqWorkerPool&) = delete;
+  ResourceCache& m_cache;
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  std::vector<SqMessage> m_messages;
+  uint32 m_nextID;
+  std::mutex m_mutex;
+  std::condition_variable m_startCondition;
+  std::condition_variable m_finishCondition;
+  uint64 m_frame;
+  uint m_pending;
+  Time m_deltaTime;
+  bool m_stopping;
+};
+
+} /*namespace nori*/
+
@@ -28,12 +28,16 @@
 
 #include <squirrel.h>
 
+#include <type_traits>
+
 namespace nori
 {
 
 class SqObject;
 class SqTable;
+class SqClass;
 class SqInstance;
+class SqFunction;
 
 namespace detail
 {
@@ -46,6 +50,79 @@ inline void push(HSQUIRRELVM vm) { }
 template <typename T>
 void push(HSQUIRRELVM vm, T value);
 
+// Scalar conversions are defined here so they can be inlined into the
+// marshalling code of each binding
+
+template <>
+inline bool get(HSQUIRRELVM vm, SQInteger index)
+{
+  SQBool value;
+  sq_getbool(vm, index, &value);
+  return value ? true : false;
+}
+
+template <>
+inline void push(HSQUIRRELVM vm, bool value)
+{
+  sq_pushbool(vm, SQBool(value));
+}
+
+template <>
+inline int get(HSQUIRRELVM vm, SQInteger index)
+{
+  SQInteger value;
+  sq_getinteger(vm, index, &value);
+  return int(value);
+}
+
+template <>
+inline void push(HSQUIRRELVM vm, int value)
+{
+  sq_pushinteger(vm, SQInteger(value));
+}
+
+template <>
+inline float get(HSQUIRRELVM vm, SQInteger index)
+{
+  SQFloat value;
+  sq_getfloat(vm, index, &value);
+  return float(value);
+}
+
+template <>
+inline void push(HSQUIRRELVM vm, float value)
+{
+  sq_pushfloat(vm, SQFloat(value));
+}
+
+template <>
+inline const char* get(HSQUIRRELVM vm, SQInteger index)
+{
+  const SQChar* value;
+  sq_getstring(vm, index, &value);
+  return value;
+}
+
+template <>
+inline void push(HSQUIRRELVM vm, const char* value)
+{
+  sq_pushstring(vm, value, -1);
+}
+
+template <>
+inline std::string get(HSQUIRRELVM vm, SQInteger index)
+{
+  const SQChar* value;
+  sq_getstring(vm, index, &value);
+  return std::string(value);
+}
+
+template <>
+inline void push(HSQUIRRELVM vm, std::string value)
+{
+  sq_pushstring(vm, value.c_str(), value.size());
+}
+
 template <typename T, typename... A>
 void push(HSQUIRRELVM vm, T value, A... args)
 {
@@ -128,14 +205,14 @@ template <typename R, typename... A>
 SQInteger demarshalFunction(HSQUIRRELVM vm)
 {
   Function<R>::template demarshal<A...>(vm, IndexBuilder<sizeof...(A)>());
-  return 1;
+  return std::is_void<R>::value ? 0 : 1;
 }
 
 template <typename T, typename R, typename... A>
 SQInteger demarshalMethod(HSQUIRRELVM vm)
 {
   Method<T,R>::template demarshal<A...>(vm, IndexBuilder<sizeof...(A)>());
-  return 1;
+  return std::is_void<R>::value ? 0 : 1;
 }
 
 template <typename R, typename... A>
@@ -160,15 +237,69 @@ inline SQFUNCTION demarshaller(R (T::*method)(A...) const)
 
 /*! @brief Squirrel %VM instance.
  *  @ingroup squirrel
+ *
+ *  When bytecode caching is enabled, scripts executed by name are compiled
+ *  once and their bytecode written to the cache directory, or next to the
+ *  script if no directory is set.  The cached bytecode is used for as long
+ *  as the script text and the Squirrel version are unchanged.
+ *
+ *  All VMs allocate small objects from a shared size-classed pool with
+ *  per-thread caches.  Memory use is counted per VM, by attributing each
+ *  allocation to the VM of the innermost SqMemoryScope on the calling thread.
+ *  The memory use of a VM should only be read while it is not running on
+ *  another thread.
+ *
+ *  When profiling is enabled, script function calls and source lines are
+ *  recorded as nodes in the current Profile of the thread running the
+ *  script, so each worker thread needs a profile of its own.  Line nodes are
+ *  only recorded for scripts compiled while profiling is enabled.  Profiling
+ *  should only be toggled while no script is running.
+ *
+ *  Reference cycles are only freed by the garbage collector, which is never
+ *  run implicitly.  Collect garbage with a time budget each frame, which
+ *  only collects once the heap has grown and the collection is expected to
+ *  fit the budget, and collect unconditionally during loading screens.  The
+ *  collector is not incremental, so the budgeted collection never collects
+ *  over budget.  Once the heap has doubled since the last collection without
+ *  a collection fitting the budget, the collection is reported as overdue,
+ *  and should be made unconditionally at the next loading screen or other
+ *  pause.  The heap of each VM is its own memory use, so VMs on different
+ *  threads are collected independently.
  */
 class SqVM
 {
   friend class SqObject;
+  friend class SqMemoryScope;
 public:
   SqVM(ResourceCache& cache);
   ~SqVM();
   bool execute(const char* name);
   bool execute(const char* name, const char* text);
+  bool precompile(const char* name);
+  bool precompileTree(const char* directory);
+  bool isCaching() const { return m_caching; }
+  void setCaching(bool enabled);
+  const Path& cacheDirectory() const { return m_cacheDirectory; }
+  void setCacheDirectory(const Path& newDirectory);
+  bool isProfiling() const { return m_profiling; }
+  void setProfiling(bool enabled);
+  /*! Collects garbage regardless of how long it takes.
+   *  @return The number of objects collected.
+   */
+  uint collectGarbage();
+  /*! Collects garbage if the heap has grown since the last collection and the
+   *  collection is expected to take no longer than the specified budget.
+   *  @return @c true if garbage was collected, otherwise @c false.
+   */
+  bool collectGarbage(Time budget);
+  /*! @return @c true if the heap has grown too large since the last
+   *  collection for the budget passed to the last budgeted collection, in
+   *  which case garbage should be collected unconditionally at the next
+   *  opportunity.
+   */
+  bool isCollectionOverdue() const { return m_garbageOverdue; }
+  Time garbagePauseTime() const { return m_garbagePauseTime; }
+  uint garbageCollectedCount() const { return m_garbageCollectedCount; }
   operator HSQUIRRELVM ();
   void* foreignPointer() const;
   void setForeignPointer(void* newValue);
@@ -176,6 +307,12 @@ public:
   SqTable constTable();
   SqTable registryTable();
   ResourceCache& cache() const;
+  /*! @return The number of bytes of Squirrel memory used by this VM.
+   */
+  size_t memoryUsage() const { return m_memoryUsage; }
+  /*! @return The largest number of bytes of Squirrel memory used by this VM.
+   */
+  size_t memoryHighWater() const { return m_memoryHighWater; }
 private:
   NORI_CHECKFORMAT(2, static void onLogMessage(HSQUIRRELVM vm, const SQChar* format, ...));
   NORI_CHECKFORMAT(2, static void onLogError(HSQUIRRELVM vm, const SQChar* format, ...));
@@ -185,8 +322,70 @@ private:
                               SQInteger line,
                               SQInteger column);
   static SQInteger onRuntimeError(HSQUIRRELVM vm);
+  static void onDebugHook(HSQUIRRELVM vm,
+                          SQInteger type,
+                          const SQChar* source,
+                          SQInteger line,
+                          const SQChar* function);
+  static void* onAllocate(SQUnsignedInteger size);
+  static void* onReallocate(void* memory,
+                            SQUnsignedInteger oldSize,
+                            SQUnsignedInteger newSize);
+  static void onFree(void* memory, SQUnsignedInteger size);
+  static void addMemoryUsage(size_t added, size_t removed);
+  template <typename T>
+  friend void detail::push(HSQUIRRELVM vm, T value);
+  enum ValueClass
+  {
+    VALUE_VEC2,
+    VALUE_VEC3,
+    VALUE_VEC4,
+    VALUE_QUAT,
+    VALUE_TRANSFORM3,
+    VALUE_CLASS_COUNT
+  };
+  void registerValueClass(ValueClass index, const char* name, SqClass class_);
+  bool load(const char* name, const Path& path, const std::string& text);
+  bool run();
+  Path bytecodePath(const char* name, const Path& path) const;
+  bool readBytecode(const Path& path, uint64 hash);
+  bool writeBytecode(const Path& path, uint64 hash);
+  uint64 bytecodeHash(const std::string& text) const;
   ResourceCache& m_cache;
   HSQUIRRELVM m_vm;
+  bool m_caching;
+  Path m_cacheDirectory;
+  bool m_profiling;
+  std::vector<uint8> m_profileFrames;
+  Time m_garbagePauseTime;
+  Time m_garbageRate;
+  uint m_garbageCollectedCount;
+  size_t m_garbageUsage;
+  bool m_garbageOverdue;
+  size_t m_memoryUsage;
+  size_t m_memoryHighWater;
+  HSQOBJECT m_valueClasses[VALUE_CLASS_COUNT];
+  static thread_local SqVM* m_current;
+};
+
+/*! @brief Scope attributing Squirrel memory use on this thread to a VM.
+ *  @ingroup squirrel
+ *
+ *  Memory allocated and freed by Squirrel is counted towards the VM of the
+ *  innermost scope on the calling thread.  The VM and object wrappers enter
+ *  a scope for every call into Squirrel, so one is only needed around direct
+ *  calls to the Squirrel API.
+ */
+class SqMemoryScope
+{
+public:
+  SqMemoryScope(SqVM& vm);
+  SqMemoryScope(HSQUIRRELVM vm);
+  ~SqMemoryScope();
+private:
+  SqMemoryScope(const SqMemoryScope&) = delete;
+  SqMemoryScope& operator = (const SqMemoryScope&) = delete;
+  SqVM* m_previous;
 };
 
 /*! @brief Squirrel object reference.
@@ -234,6 +433,7 @@ protected:
   T get(const char* name);
   template <typename T>
   bool set(const char* name, T value);
+  SqFunction function(const char* name);
   SQInteger size() const;
   HSQUIRRELVM m_vm;
   HSQOBJECT m_handle;
@@ -254,6 +454,8 @@ inline bool SqObject::addSlot(const char* name, T value)
   if (isNull())
     return false;
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_pushstring(m_vm, name, -1);
   detail::push(m_vm, value);
@@ -270,6 +472,8 @@ inline bool SqObject::addStaticSlot(const char* name, T value)
   if (isNull())
     return false;
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_pushstring(m_vm, name, -1);
   detail::push(m_vm, value);
@@ -283,6 +487,8 @@ inline bool SqObject::addStaticSlot(const char* name, T value)
 template <typename... A>
 inline bool SqObject::call(const char* name, A... args)
 {
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_pushstring(m_vm, name, -1);
   if (SQ_FAILED(sq_get(m_vm, -2)))
@@ -303,6 +509,8 @@ inline bool SqObject::call(const char* name, A... args)
 template <typename R, typename... A>
 inline R SqObject::eval(const char* name, A... args)
 {
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_pushstring(m_vm, name, -1);
   if (SQ_FAILED(sq_get(m_vm, -2)))
@@ -328,6 +536,8 @@ inline R SqObject::eval(const char* name, A... args)
 template <typename T>
 inline T SqObject::get(const char* name)
 {
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_pushstring(m_vm, name, -1);
 
@@ -349,6 +559,8 @@ inline bool SqObject::set(const char* name, T value)
   if (isNull())
     return false;
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_pushstring(m_vm, name, -1);
   detail::push(m_vm, value);
@@ -392,6 +604,8 @@ inline bool SqArray::insert(SQInteger index, T value)
   if (isNull())
     return false;
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   detail::push(m_vm, value);
 
@@ -407,6 +621,8 @@ inline bool SqArray::push(T value)
   if (isNull())
     return false;
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   detail::push(m_vm, value);
 
@@ -442,6 +658,8 @@ inline bool SqArray::set(SQInteger index, T value)
   if (isNull())
     return false;
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_pushinteger(m_vm, index);
   detail::push(m_vm, value);
@@ -467,6 +685,7 @@ public:
   using SqObject::clear;
   using SqObject::call;
   using SqObject::eval;
+  using SqObject::function;
   using SqObject::get;
   using SqObject::set;
   using SqObject::size;
@@ -491,6 +710,7 @@ public:
   using SqObject::clear;
   using SqObject::call;
   using SqObject::eval;
+  using SqObject::function;
   using SqObject::get;
   using SqObject::set;
   using SqObject::size;
@@ -509,12 +729,75 @@ public:
   SqInstance(HSQUIRRELVM vm, SQInteger index);
   using SqObject::call;
   using SqObject::eval;
+  using SqObject::function;
   using SqObject::get;
   using SqObject::set;
   void* pointer();
   SqClass class_() const;
 };
 
+/*! @brief Squirrel closure reference.
+ *  @ingroup squirrel
+ *
+ *  A closure looked up once by name, along with the environment it is called
+ *  with.  Use this instead of SqObject::call or SqObject::eval for closures
+ *  called repeatedly, such as per-frame callbacks, to skip the slot lookup.
+ */
+class SqFunction : public SqObject
+{
+public:
+  SqFunction() { }
+  SqFunction(const SqObject& environment, const char* name);
+  template <typename... A>
+  bool call(A... args);
+  template <typename R, typename... A>
+  R eval(A... args);
+  const SqObject& environment() const { return m_environment; }
+private:
+  SqObject m_environment;
+};
+
+template <typename... A>
+inline bool SqFunction::call(A... args)
+{
+  if (isNull())
+    return false;
+
+  SqMemoryScope scope(m_vm);
+
+  sq_pushobject(m_vm, m_handle);
+  sq_pushobject(m_vm, m_environment.handle());
+  detail::push(m_vm, args...);
+
+  const SQRESULT result = sq_call(m_vm, sizeof...(args) + 1, false, true);
+
+  sq_poptop(m_vm);
+  return SQ_SUCCEEDED(result);
+}
+
+template <typename R, typename... A>
+inline R SqFunction::eval(A... args)
+{
+  if (isNull())
+    throw Exception("Failed to retrieve closure");
+
+  SqMemoryScope scope(m_vm);
+
+  sq_pushobject(m_vm, m_handle);
+  sq_pushobject(m_vm, m_environment.handle());
+  detail::push(m_vm, args...);
+
+  if (SQ_FAILED(sq_call(m_vm, sizeof...(args) + 1, true, true)))
+  {
+    sq_poptop(m_vm);
+    throw Exception("Failed to call closure");
+  }
+
+  const R result = detail::get<R>(m_vm, -1);
+  sq_pop(m_vm, 2);
+  return result;
+}
+
 /*! @ingroup squirrel
  */
 template <typename T>
@@ -533,6 +816,7 @@ public:
   {
     return addFunction(name, &method, sizeof(method), detail::demarshaller(method), true);
   }
+  static SQUserPointer typeTag() { return &m_tag; }
 private:
   static SQInteger constructor(HSQUIRRELVM vm);
   static SQInteger destructor(SQUserPointer pointer, SQInteger size);
@@ -543,6 +827,8 @@ template <typename T>
 inline SqDataClass<T>::SqDataClass(HSQUIRRELVM vm):
   SqClass(vm)
 {
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_setclassudsize(m_vm, -1, sizeof(T));
   sq_settypetag(m_vm, -1, &m_tag);
@@ -619,6 +905,8 @@ template <typename T>
 inline SqRefClass<T>::SqRefClass(HSQUIRRELVM vm):
   SqClass(vm)
 {
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_settypetag(m_vm, -1, &m_tag);
 
@@ -151,6 +151,17 @@ public:
   static const VertexFormat format;
 };
 
+/*! @brief Predefined vertex format.
+ */
+class Vertex4fc2ft2fv
+{
+public:
+  vec4 color;
+  vec2 texcoord;
+  vec2 position;
+  static const VertexFormat format;
+};
+
 /*! @brief Predefined vertex format.
  */
 class Vertex4fc2ft3fv
@@ -85,11 +85,17 @@ public:
    *  events.
    */
   void disable();
-  /*! Flags the layer this widget belongs to as needing to redraw itself.
+  /*! Flags the area of this widget as needing to be redrawn.
    *
    *  @remarks This is a helper method for Layer::invalidate.
    */
   void invalidate();
+  /*! Flags the specified area of this widget as needing to be redrawn.
+   *  @param[in] area The area to redraw, in local coordinates.
+   *
+   *  @remarks This is a helper method for Layer::invalidate.
+   */
+  void invalidate(const Rect& area);
   /*! Makes this the active widget.
    *
    *  @remarks This is ignored if the widget is hidden or disabled.
@@ -181,6 +187,16 @@ public:
   void setPosition(vec2 newPosition);
   vec2 desiredSize() const { return m_desired; }
   void setDesiredSize(vec2 newSize);
+  /*! Flags the layout of this widget as needing to be updated.  The layout
+   *  is updated during the next layout pass of its layer.
+   *
+   *  @remarks This also flags all ancestors of this widget.
+   */
+  void invalidateLayout();
+  /*! @return @c true if the layout of this widget needs updating, otherwise
+   *  @c false.
+   */
+  bool isLayoutDirty() const { return m_layoutDirty; }
   void setFocusable(bool focusable);
   /*! Sets whether this widget can be the source of drag operations.
    */
@@ -206,6 +222,14 @@ protected:
   virtual void onChildRemoved(Widget& child);
   virtual void onChildDesiredSizeChanged(Widget& child);
   virtual void onAreaChanged();
+  /*! Called during the measure pass, after all children with dirty layouts
+   *  have been measured.  Implementations should update their desired size.
+   */
+  virtual void onMeasure();
+  /*! Called during the arrange pass, before any children with dirty layouts
+   *  are arranged.  Implementations should set the areas of their children.
+   */
+  virtual void onArrange();
   virtual void onFocusChanged(bool activated);
   virtual void onKey(Key key, Action action, uint mods);
   virtual void onCharacter(uint32 codepoint);
@@ -221,6 +245,8 @@ protected:
   virtual void onDragMoved(vec2 point, MouseButton button);
   virtual void onDragEnded(vec2 point, MouseButton button);
 private:
+  void measureLayout();
+  void arrangeLayout();
   Signal<void,Widget&> m_destroyed;
   Signal<void,Widget&> m_areaChanged;
   Signal<void,Widget&,bool> m_focusChanged;
@@ -241,6 +267,7 @@ private:
   bool m_visible;
   bool m_draggable;
   bool m_focusable;
+  bool m_layoutDirty;
   Rect m_area;
   vec2 m_desired;
 };
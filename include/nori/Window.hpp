@@ -394,6 +394,10 @@ public:
   virtual ~Window();
   bool update();
   void invalidate();
+  /*! Requests a refresh after the specified delay, for content that changes
+   *  over time while the window is otherwise idle.
+   */
+  void invalidate(Time delay);
   void captureCursor();
   void releaseCursor();
   /*! @return @c true if the specified key is pressed, otherwise @c false.
@@ -460,6 +464,7 @@ private:
   static void scrollCallback(GLFWwindow* handle, double x, double y);
   GLFWwindow* m_handle;
   bool m_needsRefresh;
+  Time m_refreshTime;
   RefreshMode m_refreshMode;
   EventHook* m_hook;
   EventTarget* m_target;
@@ -2,8 +2,8 @@
 #version 150
 
 uniform sampler2D image;
-uniform vec4 color;
 
+in vec4 color;
 in vec2 texCoord;
 
 out vec4 fragment;
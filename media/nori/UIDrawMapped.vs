@@ -1,13 +1,16 @@
 
 #version 150
 
-in vec2 vPosition;
+in vec4 vColor;
 in vec2 vTexCoord;
+in vec2 vPosition;
 
+out vec4 color;
 out vec2 texCoord;
 
 void main()
 {
+  color = vColor;
   texCoord = vTexCoord;
 
   gl_Position = wyP * vec4(vPosition, 0.0, 1.0);
@@ -1,7 +1,7 @@
 
 #version 150
 
-uniform vec4 color;
+in vec4 color;
 
 out vec4 fragment;
 
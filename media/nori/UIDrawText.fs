@@ -0,0 +1,15 @@
+
+#version 150
+
+uniform sampler2DRect glyphs;
+
+in vec4 color;
+in vec2 texCoord;
+
+out vec4 fragment;
+
+void main()
+{
+  fragment = vec4(color.rgb, color.a * texture(glyphs, texCoord).r);
+}
+
@@ -3,12 +3,13 @@
 
 uniform sampler2DRect image;
 
+in vec4 color;
 in vec2 texCoord;
 
 out vec4 fragment;
 
 void main()
 {
-  fragment = texture(image, texCoord);
+  fragment = texture(image, texCoord) * color;
 }
 
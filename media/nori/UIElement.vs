@@ -1,25 +1,18 @@
 
 #version 150
 
-uniform vec2 elementPos;
-uniform vec2 elementSize;
-uniform vec2 texPos;
-uniform vec2 texSize;
-
-in vec2 vSizeScale;
-in vec2 vOffsetScale;
-in vec2 vTexScale;
+in vec4 vColor;
+in vec2 vTexCoord;
+in vec2 vPosition;
 
+out vec4 color;
 out vec2 texCoord;
 
 void main()
 {
-  vec2 position = elementPos +
-                  elementSize * vSizeScale +
-                  texSize * vOffsetScale;
-
-  texCoord = texPos + texSize * vTexScale;
+  color = vColor;
+  texCoord = vTexCoord;
 
-  gl_Position = wyMVP * vec4(position, 0.0, 1.0);
+  gl_Position = wyP * vec4(vPosition, 0.0, 1.0);
 }
 
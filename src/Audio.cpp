@@ -31,11 +31,19 @@
 #include <nori/Audio.hpp>
 
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtc/constants.hpp>
 
 #include <al.h>
 #include <alc.h>
 
+#include <cmath>
+#include <limits>
+#include <atomic>
+#include <fstream>
+#include <deque>
 #include <memory>
+#include <algorithm>
 
 namespace nori
 {
@@ -43,6 +51,29 @@ namespace nori
 namespace
 {
 
+// Four queued buffers of 8192 frames hold about 0.7 seconds at 44.1 kHz,
+// enough to ride out long frames between calls to AudioContext::update
+const size_t STREAM_BUFFER_COUNT = 4;
+const size_t STREAM_CHUNK_COUNT = 4;
+const size_t STREAM_CHUNK_FRAMES = 8192;
+
+const uint DEFAULT_MAX_VOICE_COUNT = 32;
+
+const uint SOFTWARE_VOICE_COUNT = 256;
+const size_t SOFTWARE_COMMAND_COUNT = 4096;
+const size_t SOFTWARE_BLOCK_FRAMES = 4096;
+
+// Favour bound sources, so sources of nearly equal audibility do not trade
+// voices every frame
+const float BOUND_AUDIBILITY_BIAS = 1.25f;
+
+enum
+{
+  SOURCE_INACTIVE,
+  SOURCE_ACTIVE,
+  SOURCE_PINNED
+};
+
 ALenum convertToAL(SampleFormat format)
 {
   switch (format)
@@ -148,375 +179,2759 @@ bool checkALC(const char* format, ...)
 
 } /*namespace*/
 
-AudioBuffer::~AudioBuffer()
+AudioConfig::AudioConfig(AudioBackend backend,
+                         uint frequency,
+                         const Path& output):
+  backend(backend),
+  frequency(frequency),
+  output(output)
 {
-  if (m_bufferID)
-    alDeleteBuffers(1, &m_bufferID);
 }
 
-bool AudioBuffer::isMono() const
+/*! @brief Audio output device.
+ *
+ *  The device interface follows the subset of OpenAL used by the context.
+ *  Buffers and voices are named by nonzero integers, and all functions are
+ *  called on the thread owning the context.
+ */
+class AudioDevice
 {
-  return m_format == SAMPLE_MONO8 || m_format == SAMPLE_MONO16;
-}
-
-bool AudioBuffer::isStereo() const
+public:
+  enum VoiceState
+  {
+    VOICE_PLAYING,
+    VOICE_PAUSED,
+    VOICE_STOPPED
+  };
+  virtual ~AudioDevice() { }
+  virtual uint createBuffer() = 0;
+  virtual void deleteBuffer(uint bufferID) = 0;
+  virtual bool setBufferData(uint bufferID,
+                             SampleFormat format,
+                             const void* data,
+                             size_t size,
+                             uint frequency) = 0;
+  virtual uint createVoice() = 0;
+  virtual void deleteVoice(uint voiceID) = 0;
+  virtual void setVoiceBuffer(uint voiceID, uint bufferID) = 0;
+  virtual void queueBuffer(uint voiceID, uint bufferID) = 0;
+  virtual uint unqueueBuffer(uint voiceID) = 0;
+  virtual uint processedBufferCount(uint voiceID) = 0;
+  virtual uint queuedBufferCount(uint voiceID) = 0;
+  virtual void setVoicePosition(uint voiceID, const vec3& position) = 0;
+  virtual void setVoiceVelocity(uint voiceID, const vec3& velocity) = 0;
+  virtual void setVoiceGain(uint voiceID, float gain) = 0;
+  virtual void setVoicePitch(uint voiceID, float pitch) = 0;
+  virtual void setVoiceLooping(uint voiceID, bool looping) = 0;
+  virtual void setVoiceDistance(uint voiceID, float reference, float rolloff) = 0;
+  virtual Time voiceOffset(uint voiceID) = 0;
+  virtual void setVoiceOffset(uint voiceID, Time offset) = 0;
+  virtual VoiceState voiceState(uint voiceID) = 0;
+  virtual void play(uint voiceID) = 0;
+  virtual void pause(uint voiceID) = 0;
+  virtual void stop(uint voiceID) = 0;
+  virtual void setListener(const vec3& position,
+                           const vec3& velocity,
+                           const quat& rotation,
+                           float gain) = 0;
+  virtual void update(Time deltaTime) = 0;
+};
+
+/*! @brief OpenAL audio output device.
+ */
+class OpenALDevice : public AudioDevice
+{
+public:
+  OpenALDevice();
+  ~OpenALDevice();
+  bool init();
+  uint createBuffer() override;
+  void deleteBuffer(uint bufferID) override;
+  bool setBufferData(uint bufferID,
+                     SampleFormat format,
+                     const void* data,
+                     size_t size,
+                     uint frequency) override;
+  uint createVoice() override;
+  void deleteVoice(uint voiceID) override;
+  void setVoiceBuffer(uint voiceID, uint bufferID) override;
+  void queueBuffer(uint voiceID, uint bufferID) override;
+  uint unqueueBuffer(uint voiceID) override;
+  uint processedBufferCount(uint voiceID) override;
+  uint queuedBufferCount(uint voiceID) override;
+  void setVoicePosition(uint voiceID, const vec3& position) override;
+  void setVoiceVelocity(uint voiceID, const vec3& velocity) override;
+  void setVoiceGain(uint voiceID, float gain) override;
+  void setVoicePitch(uint voiceID, float pitch) override;
+  void setVoiceLooping(uint voiceID, bool looping) override;
+  void setVoiceDistance(uint voiceID, float reference, float rolloff) override;
+  Time voiceOffset(uint voiceID) override;
+  void setVoiceOffset(uint voiceID, Time offset) override;
+  VoiceState voiceState(uint voiceID) override;
+  void play(uint voiceID) override;
+  void pause(uint voiceID) override;
+  void stop(uint voiceID) override;
+  void setListener(const vec3& position,
+                   const vec3& velocity,
+                   const quat& rotation,
+                   float gain) override;
+  void update(Time deltaTime) override;
+private:
+  ALCdevice* m_device;
+  ALCcontext* m_context;
+};
+
+OpenALDevice::OpenALDevice():
+  m_device(nullptr),
+  m_context(nullptr)
 {
-  return m_format == SAMPLE_STEREO8 || m_format == SAMPLE_STEREO16;
 }
 
-Ref<AudioBuffer> AudioBuffer::create(const ResourceInfo& info,
-                                     AudioContext& context,
-                                     const Sample& data)
+OpenALDevice::~OpenALDevice()
 {
-  Ref<AudioBuffer> buffer = new AudioBuffer(info, context);
-  if (!buffer->init(data))
-    return nullptr;
+  if (m_context)
+  {
+    alcMakeContextCurrent(nullptr);
+    alcDestroyContext(m_context);
+  }
 
-  return buffer;
+  if (m_device)
+    alcCloseDevice(m_device);
 }
 
-Ref<AudioBuffer> AudioBuffer::read(AudioContext& context, const std::string& sampleName)
+bool OpenALDevice::init()
 {
-  ResourceCache& cache = context.cache();
-
-  std::string name;
-  name += "sample:";
-  name += sampleName;
+  m_device = alcOpenDevice(nullptr);
+  if (!m_device)
+  {
+    checkALC("Failed to open OpenAL device");
+    return false;
+  }
 
-  if (Ref<AudioBuffer> buffer = cache.find<AudioBuffer>(name))
-    return buffer;
+  m_context = alcCreateContext(m_device, nullptr);
+  if (!m_context)
+  {
+    checkALC("Failed to create OpenAL context");
+    return false;
+  }
 
-  Ref<Sample> data = Sample::read(cache, sampleName);
-  if (!data)
+  if (!alcMakeContextCurrent(m_context))
   {
-    logError("Failed to read sample for buffer %s", name.c_str());
-    return nullptr;
+    checkALC("Failed to make OpenAL context current");
+    return false;
   }
 
-  return create(ResourceInfo(cache, name), context, *data);
+  log("OpenAL context version %s created",
+      (const char*) alGetString(AL_VERSION));
+
+  log("OpenAL context renderer is %s by %s",
+      (const char*) alGetString(AL_RENDERER),
+      (const char*) alGetString(AL_VENDOR));
+
+  log("OpenAL context uses device %s",
+      (const char*) alcGetString(m_device, ALC_DEVICE_SPECIFIER));
+
+  return true;
 }
 
-AudioBuffer::AudioBuffer(const ResourceInfo& info, AudioContext& context):
-  Resource(info),
-  m_context(context),
-  m_bufferID(0),
-  m_duration(0.0)
+uint OpenALDevice::createBuffer()
 {
+  ALuint bufferID;
+  alGenBuffers(1, &bufferID);
+
+  if (!checkAL("Error during OpenAL buffer creation"))
+    return 0;
+
+  return bufferID;
 }
 
-bool AudioBuffer::init(const Sample& data)
+void OpenALDevice::deleteBuffer(uint bufferID)
+{
+  alDeleteBuffers(1, &bufferID);
+}
+
+bool OpenALDevice::setBufferData(uint bufferID,
+                                 SampleFormat format,
+                                 const void* data,
+                                 size_t size,
+                                 uint frequency)
 {
-  alGenBuffers(1, &m_bufferID);
-  alBufferData(m_bufferID,
-               convertToAL(data.format),
-               data.data.data(), (ALsizei) data.data.size(),
-               data.frequency);
+  alBufferData(bufferID, convertToAL(format), data, (ALsizei) size, frequency);
 
-  if (!checkAL("Error during OpenAL buffer creation"))
+  if (!checkAL("Error during OpenAL buffer data upload"))
     return false;
 
-  m_format = data.format;
-  m_duration = Time(data.data.size()) / (getFormatSize(m_format) * data.frequency);
-
   return true;
 }
 
-AudioSource::~AudioSource()
+uint OpenALDevice::createVoice()
 {
-  if (m_sourceID)
-    alDeleteSources(1, &m_sourceID);
+  ALuint sourceID;
+  alGenSources(1, &sourceID);
+
+  // OpenAL implementations have a fixed limit on the number of sources
+  if (alGetError() != AL_NO_ERROR)
+    return 0;
+
+  return sourceID;
 }
 
-void AudioSource::start()
+void OpenALDevice::deleteVoice(uint voiceID)
 {
-  alSourcePlay(m_sourceID);
+  alDeleteSources(1, &voiceID);
+}
 
-#if NORI_DEBUG
-  checkAL("Failed to start source");
-#endif
+void OpenALDevice::setVoiceBuffer(uint voiceID, uint bufferID)
+{
+  alSourcei(voiceID, AL_BUFFER, bufferID);
 }
 
-void AudioSource::stop()
+void OpenALDevice::queueBuffer(uint voiceID, uint bufferID)
 {
-  alSourceStop(m_sourceID);
+  alSourceQueueBuffers(voiceID, 1, &bufferID);
+}
 
-#if NORI_DEBUG
-  checkAL("Failed to stop source");
-#endif
+uint OpenALDevice::unqueueBuffer(uint voiceID)
+{
+  ALuint bufferID;
+  alSourceUnqueueBuffers(voiceID, 1, &bufferID);
+  return bufferID;
 }
 
-void AudioSource::pause()
+uint OpenALDevice::processedBufferCount(uint voiceID)
 {
-  alSourcePause(m_sourceID);
+  ALint count = 0;
+  alGetSourcei(voiceID, AL_BUFFERS_PROCESSED, &count);
+  return count;
+}
 
-#if NORI_DEBUG
-  checkAL("Failed to pause source");
-#endif
+uint OpenALDevice::queuedBufferCount(uint voiceID)
+{
+  ALint count = 0;
+  alGetSourcei(voiceID, AL_BUFFERS_QUEUED, &count);
+  return count;
 }
 
-void AudioSource::resume()
+void OpenALDevice::setVoicePosition(uint voiceID, const vec3& position)
 {
-  alSourcePlay(m_sourceID);
+  alSourcefv(voiceID, AL_POSITION, value_ptr(position));
+}
 
-#if NORI_DEBUG
-  checkAL("Failed to resume source");
-#endif
+void OpenALDevice::setVoiceVelocity(uint voiceID, const vec3& velocity)
+{
+  alSourcefv(voiceID, AL_VELOCITY, value_ptr(velocity));
 }
 
-AudioSource::State AudioSource::state() const
+void OpenALDevice::setVoiceGain(uint voiceID, float gain)
 {
-  ALenum state;
-  alGetSourcei(m_sourceID, AL_SOURCE_STATE, &state);
+  alSourcef(voiceID, AL_GAIN, gain);
+}
 
-#if NORI_DEBUG
-  checkAL("Failed to get source state");
-#endif
+void OpenALDevice::setVoicePitch(uint voiceID, float pitch)
+{
+  alSourcef(voiceID, AL_PITCH, pitch);
+}
+
+void OpenALDevice::setVoiceLooping(uint voiceID, bool looping)
+{
+  alSourcei(voiceID, AL_LOOPING, looping);
+}
+
+void OpenALDevice::setVoiceDistance(uint voiceID, float reference, float rolloff)
+{
+  alSourcef(voiceID, AL_REFERENCE_DISTANCE, reference);
+  alSourcef(voiceID, AL_ROLLOFF_FACTOR, rolloff);
+}
+
+Time OpenALDevice::voiceOffset(uint voiceID)
+{
+  ALfloat offset = 0.f;
+  alGetSourcef(voiceID, AL_SEC_OFFSET, &offset);
+  return offset;
+}
+
+void OpenALDevice::setVoiceOffset(uint voiceID, Time offset)
+{
+  alSourcef(voiceID, AL_SEC_OFFSET, float(offset));
+}
+
+AudioDevice::VoiceState OpenALDevice::voiceState(uint voiceID)
+{
+  ALint state;
+  alGetSourcei(voiceID, AL_SOURCE_STATE, &state);
 
   switch (state)
   {
-    case AL_INITIAL:
-    case AL_STOPPED:
-      return STOPPED;
     case AL_PLAYING:
-      return STARTED;
+      return VOICE_PLAYING;
     case AL_PAUSED:
-      return PAUSED;
+      return VOICE_PAUSED;
+    default:
+      return VOICE_STOPPED;
   }
+}
 
-  panic("Unknown OpenAL source state %u", state);
+void OpenALDevice::play(uint voiceID)
+{
+  alSourcePlay(voiceID);
 }
 
-void AudioSource::setLooping(bool newState)
+void OpenALDevice::pause(uint voiceID)
 {
-  if (m_looping != newState)
-  {
-    m_looping = newState;
-    alSourcei(m_sourceID, AL_LOOPING, m_looping);
+  alSourcePause(voiceID);
+}
 
-#if NORI_DEBUG
-    checkAL("Failed to set source looping state");
-#endif
-  }
+void OpenALDevice::stop(uint voiceID)
+{
+  alSourceStop(voiceID);
 }
 
-void AudioSource::setPosition(const vec3& newPosition)
+void OpenALDevice::setListener(const vec3& position,
+                               const vec3& velocity,
+                               const quat& rotation,
+                               float gain)
 {
-  if (m_position != newPosition)
-  {
-    m_position = newPosition;
-    alSourcefv(m_sourceID, AL_POSITION, value_ptr(m_position));
+  const vec3 at = rotation * vec3(0.f, 0.f, -1.f);
+  const vec3 up = rotation * vec3(0.f, 1.f, 0.f);
 
+  const float orientation[] = { at.x, at.y, at.z, up.x, up.y, up.z };
+
+  alListenerfv(AL_POSITION, value_ptr(position));
+  alListenerfv(AL_VELOCITY, value_ptr(velocity));
+  alListenerfv(AL_ORIENTATION, orientation);
+  alListenerf(AL_GAIN, gain);
+}
+
+void OpenALDevice::update(Time deltaTime)
+{
 #if NORI_DEBUG
-    checkAL("Failed to set source position");
+  checkAL("Error during audio update");
 #endif
-  }
 }
 
-void AudioSource::setVelocity(const vec3& newVelocity)
+/*! @brief Software audio output device.
+ *
+ *  Voices are mixed on a separate thread, which receives commands from the
+ *  game thread through a lock-free single producer, single consumer ring.
+ *  The mixer only mixes as many frames as update asks for, so the output
+ *  depends only on the commands and the time steps given, not on thread
+ *  timing.
+ *
+ *  The game thread keeps a shadow of the state of each voice.  The mixer
+ *  reports its progress at the end of each block, and the game thread picks
+ *  up the reports of the previous block at the start of the next.  Commands
+ *  that restart a voice bump its epoch, so reports from before the restart
+ *  are ignored.
+ */
+class SoftwareDevice : public AudioDevice
 {
-  if (m_velocity != newVelocity)
+public:
+  SoftwareDevice();
+  ~SoftwareDevice();
+  bool init(const AudioConfig& config);
+  uint createBuffer() override;
+  void deleteBuffer(uint bufferID) override;
+  bool setBufferData(uint bufferID,
+                     SampleFormat format,
+                     const void* data,
+                     size_t size,
+                     uint frequency) override;
+  uint createVoice() override;
+  void deleteVoice(uint voiceID) override;
+  void setVoiceBuffer(uint voiceID, uint bufferID) override;
+  void queueBuffer(uint voiceID, uint bufferID) override;
+  uint unqueueBuffer(uint voiceID) override;
+  uint processedBufferCount(uint voiceID) override;
+  uint queuedBufferCount(uint voiceID) override;
+  void setVoicePosition(uint voiceID, const vec3& position) override;
+  void setVoiceVelocity(uint voiceID, const vec3& velocity) override;
+  void setVoiceGain(uint voiceID, float gain) override;
+  void setVoicePitch(uint voiceID, float pitch) override;
+  void setVoiceLooping(uint voiceID, bool looping) override;
+  void setVoiceDistance(uint voiceID, float reference, float rolloff) override;
+  Time voiceOffset(uint voiceID) override;
+  void setVoiceOffset(uint voiceID, Time offset) override;
+  VoiceState voiceState(uint voiceID) override;
+  void play(uint voiceID) override;
+  void pause(uint voiceID) override;
+  void stop(uint voiceID) override;
+  void setListener(const vec3& position,
+                   const vec3& velocity,
+                   const quat& rotation,
+                   float gain) override;
+  void update(Time deltaTime) override;
+private:
+  enum CommandType
   {
-    m_velocity = newVelocity;
-    alSourcefv(m_sourceID, AL_VELOCITY, value_ptr(m_velocity));
-
-#if NORI_DEBUG
-    checkAL("Failed to set source velocity");
-#endif
-  }
+    COMMAND_BUFFER_DATA,
+    COMMAND_BUFFER_DELETE,
+    COMMAND_VOICE_RESET,
+    COMMAND_VOICE_BUFFER,
+    COMMAND_VOICE_QUEUE,
+    COMMAND_VOICE_UNQUEUE,
+    COMMAND_VOICE_POSITION,
+    COMMAND_VOICE_GAIN,
+    COMMAND_VOICE_PITCH,
+    COMMAND_VOICE_LOOPING,
+    COMMAND_VOICE_DISTANCE,
+    COMMAND_VOICE_OFFSET,
+    COMMAND_VOICE_PLAY,
+    COMMAND_VOICE_PAUSE,
+    COMMAND_VOICE_STOP,
+    COMMAND_LISTENER,
+    COMMAND_MIX,
+    COMMAND_QUIT
+  };
+  struct Command
+  {
+    uint8 type;
+    uint id;
+    uint value;
+    float values[8];
+    void* data;
+  };
+  struct Buffer
+  {
+    std::vector<int16> samples;
+    uint channels;
+    uint frequency;
+    size_t frames;
+  };
+  struct Report
+  {
+    uint epoch;
+    uint consumed;
+    bool ended;
+    Time offset;
+  };
+  struct Shadow
+  {
+    bool used;
+    VoiceState state;
+    uint epoch;
+    uint unqueued;
+    Time offset;
+    std::deque<uint> queue;
+    Report report;
+  };
+  struct Voice
+  {
+    VoiceState state;
+    uint epoch;
+    std::vector<uint> queue;
+    size_t current;
+    uint consumed;
+    bool ended;
+    double position;
+    Time pendingOffset;
+    bool looping;
+    vec3 location;
+    float gain;
+    float pitch;
+    float reference;
+    float rolloff;
+  };
+  Shadow& shadow(uint voiceID) { return m_shadows[voiceID - 1]; }
+  bool isCurrent(const Shadow& shadow) const;
+  void push(const Command& command);
+  void wake();
+  void run();
+  void execute(const Command& command);
+  void reset(Voice& voice, uint epoch);
+  void mix(size_t frames);
+  void mixVoice(Voice& voice, size_t frames);
+  void writeHeader(uint32 dataSize);
+  Time m_remainder;
+  uint64 m_submitted;
+  uint m_bufferCount;
+  std::vector<uint> m_freeBufferIDs;
+  std::vector<Shadow> m_shadows;
+  uint m_frequency;
+  std::vector<Buffer*> m_buffers;
+  std::vector<Voice> m_voices;
+  std::vector<Report> m_reports;
+  vec3 m_listenerPosition;
+  quat m_listenerRotation;
+  float m_listenerGain;
+  std::vector<float> m_left;
+  std::vector<float> m_right;
+  std::vector<float> m_scratchLeft;
+  std::vector<float> m_scratchRight;
+  std::vector<int16> m_output;
+  std::ofstream m_stream;
+  uint64 m_writtenFrames;
+  std::vector<Command> m_commands;
+  std::atomic<size_t> m_head;
+  std::atomic<size_t> m_tail;
+  uint64 m_completed;
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::condition_variable m_completion;
+  std::thread m_thread;
+};
+
+SoftwareDevice::SoftwareDevice():
+  m_remainder(0.0),
+  m_submitted(0),
+  m_bufferCount(0),
+  m_frequency(0),
+  m_listenerGain(1.f),
+  m_writtenFrames(0),
+  m_head(0),
+  m_tail(0),
+  m_completed(0)
+{
 }
 
-void AudioSource::setBuffer(AudioBuffer* newBuffer)
+SoftwareDevice::~SoftwareDevice()
 {
-  if (m_buffer != newBuffer)
+  if (m_thread.joinable())
   {
-    m_buffer = newBuffer;
+    Command command;
+    command.type = COMMAND_QUIT;
+    push(command);
+    m_thread.join();
+  }
 
-    if (m_buffer)
-      alSourcei(m_sourceID, AL_BUFFER, m_buffer->m_bufferID);
-    else
-      alSourcei(m_sourceID, AL_BUFFER, AL_NONE);
+  for (Buffer* buffer : m_buffers)
+    delete buffer;
 
-#if NORI_DEBUG
-    checkAL("Failed to set source buffer");
-#endif
+  if (m_stream.is_open())
+  {
+    m_stream.seekp(0);
+    writeHeader(uint32(m_writtenFrames * 2 * sizeof(int16)));
   }
 }
 
-void AudioSource::setGain(float newGain)
+bool SoftwareDevice::init(const AudioConfig& config)
 {
-  if (m_gain != newGain)
+  m_frequency = config.frequency;
+  if (!m_frequency)
   {
-    m_gain = newGain;
-    alSourcefv(m_sourceID, AL_GAIN, &m_gain);
+    logError("Invalid software mixer frequency");
+    return false;
+  }
 
-#if NORI_DEBUG
-    checkAL("Failed to set source gain");
-#endif
+  if (!config.output.isEmpty())
+  {
+    m_stream.open(config.output.name(),
+                  std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!m_stream)
+    {
+      logError("Failed to create audio output file %s",
+               config.output.name().c_str());
+      return false;
+    }
+
+    writeHeader(0);
   }
-}
 
-void AudioSource::setPitch(float newPitch)
-{
-  if (m_pitch != newPitch)
+  m_shadows.resize(SOFTWARE_VOICE_COUNT);
+  m_voices.resize(SOFTWARE_VOICE_COUNT);
+  m_reports.resize(SOFTWARE_VOICE_COUNT);
+  m_commands.resize(SOFTWARE_COMMAND_COUNT);
+
+  for (uint i = 0;  i < SOFTWARE_VOICE_COUNT;  i++)
   {
-    m_pitch = newPitch;
-    alSourcefv(m_sourceID, AL_PITCH, &m_pitch);
+    Shadow& shadow = m_shadows[i];
+    shadow.used = false;
+    shadow.state = VOICE_STOPPED;
+    shadow.epoch = 0;
+    shadow.unqueued = 0;
+    shadow.offset = 0.0;
+    shadow.report = Report();
+    reset(m_voices[i], 0);
+  }
 
-#if NORI_DEBUG
-    checkAL("Failed to set source pitch");
-#endif
+  try
+  {
+    m_thread = std::thread(&SoftwareDevice::run, this);
+  }
+  catch (const std::system_error& e)
+  {
+    logError("Failed to start software mixer thread: %s", e.what());
+    return false;
   }
+
+  if (config.output.isEmpty())
+    log("Software audio mixer running at %u Hz with no output", m_frequency);
+  else
+  {
+    log("Software audio mixer running at %u Hz writing to %s",
+        m_frequency, config.output.name().c_str());
+  }
+
+  return true;
 }
 
-Ref<AudioSource> AudioSource::create(AudioContext& context)
+uint SoftwareDevice::createBuffer()
 {
-  Ref<AudioSource> source = new AudioSource(context);
-  if (!source->init())
-    return nullptr;
+  if (!m_freeBufferIDs.empty())
+  {
+    const uint bufferID = m_freeBufferIDs.back();
+    m_freeBufferIDs.pop_back();
+    return bufferID;
+  }
 
-  return source;
+  return ++m_bufferCount;
 }
 
-AudioSource::AudioSource(AudioContext& context):
-  m_context(context),
-  m_sourceID(0),
-  m_looping(false),
-  m_gain(1.f),
-  m_pitch(1.f)
+void SoftwareDevice::deleteBuffer(uint bufferID)
 {
+  Command command;
+  command.type = COMMAND_BUFFER_DELETE;
+  command.id = bufferID;
+  push(command);
+
+  m_freeBufferIDs.push_back(bufferID);
 }
 
-bool AudioSource::init()
+bool SoftwareDevice::setBufferData(uint bufferID,
+                                   SampleFormat format,
+                                   const void* data,
+                                   size_t size,
+                                   uint frequency)
 {
-  alGenSources(1, &m_sourceID);
+  Buffer* buffer = new Buffer();
+  buffer->frequency = frequency;
 
-  if (!checkAL("Error during audio buffer creation"))
-    return false;
+  if (format == SAMPLE_MONO8 || format == SAMPLE_STEREO8)
+  {
+    const uint8* source = (const uint8*) data;
+
+    buffer->samples.resize(size);
+    for (size_t i = 0;  i < size;  i++)
+      buffer->samples[i] = int16((int(source[i]) - 128) << 8);
+  }
+  else
+  {
+    const int16* source = (const int16*) data;
+    buffer->samples.assign(source, source + size / sizeof(int16));
+  }
+
+  if (format == SAMPLE_MONO8 || format == SAMPLE_MONO16)
+    buffer->channels = 1;
+  else
+    buffer->channels = 2;
+
+  buffer->frames = buffer->samples.size() / buffer->channels;
+
+  Command command;
+  command.type = COMMAND_BUFFER_DATA;
+  command.id = bufferID;
+  command.data = buffer;
+  push(command);
 
   return true;
 }
 
-AudioContext::~AudioContext()
+uint SoftwareDevice::createVoice()
 {
-  if (m_handle)
+  for (uint i = 0;  i < SOFTWARE_VOICE_COUNT;  i++)
   {
-    alcMakeContextCurrent(nullptr);
-    alcDestroyContext((ALCcontext*) m_handle);
+    Shadow& shadow = m_shadows[i];
+    if (shadow.used)
+      continue;
+
+    // Epochs keep counting across reuse, so old reports never match
+    shadow.used = true;
+    shadow.state = VOICE_STOPPED;
+    shadow.epoch++;
+    shadow.unqueued = 0;
+    shadow.offset = 0.0;
+    shadow.queue.clear();
+
+    Command command;
+    command.type = COMMAND_VOICE_RESET;
+    command.id = i + 1;
+    command.value = shadow.epoch;
+    push(command);
+
+    return i + 1;
   }
 
-  if (m_device)
-    alcCloseDevice((ALCdevice*) m_device);
+  return 0;
 }
 
-void AudioContext::setListenerPosition(const vec3& newPosition)
+void SoftwareDevice::deleteVoice(uint voiceID)
 {
-  if (m_listenerPosition != newPosition)
-  {
-    m_listenerPosition = newPosition;
-    alListenerfv(AL_POSITION, value_ptr(m_listenerPosition));
+  Shadow& s = shadow(voiceID);
+  s.used = false;
+  s.epoch++;
+  s.queue.clear();
+
+  Command command;
+  command.type = COMMAND_VOICE_RESET;
+  command.id = voiceID;
+  command.value = s.epoch;
+  push(command);
+}
 
-#if NORI_DEBUG
-    checkAL("Failed to set listener position");
-#endif
-  }
+void SoftwareDevice::setVoiceBuffer(uint voiceID, uint bufferID)
+{
+  Shadow& s = shadow(voiceID);
+  s.state = VOICE_STOPPED;
+  s.epoch++;
+  s.unqueued = 0;
+  s.offset = 0.0;
+  s.queue.clear();
+
+  if (bufferID)
+    s.queue.push_back(bufferID);
+
+  Command command;
+  command.type = COMMAND_VOICE_BUFFER;
+  command.id = voiceID;
+  command.value = s.epoch;
+  command.data = (void*) uintptr_t(bufferID);
+  push(command);
 }
 
-void AudioContext::setListenerVelocity(const vec3& newVelocity)
+void SoftwareDevice::queueBuffer(uint voiceID, uint bufferID)
 {
-  if (m_listenerVelocity != newVelocity)
-  {
-    m_listenerVelocity = newVelocity;
-    alListenerfv(AL_VELOCITY, value_ptr(m_listenerVelocity));
+  shadow(voiceID).queue.push_back(bufferID);
 
-#if NORI_DEBUG
-    checkAL("Failed to set listener velocity");
-#endif
-  }
+  Command command;
+  command.type = COMMAND_VOICE_QUEUE;
+  command.id = voiceID;
+  command.value = bufferID;
+  push(command);
 }
 
-void AudioContext::setListenerRotation(const quat& newRotation)
+uint SoftwareDevice::unqueueBuffer(uint voiceID)
 {
-  if (m_listenerRotation != newRotation)
-  {
-    m_listenerRotation = newRotation;
+  if (!processedBufferCount(voiceID))
+    return 0;
 
-    const vec3 at = newRotation * vec3(0.f, 0.f, -1.f);
-    const vec3 up = newRotation * vec3(0.f, 1.f, 0.f);
+  Shadow& s = shadow(voiceID);
 
-    const float orientation[] = { at.x, at.y, at.z, up.x, up.y, up.z };
+  const uint bufferID = s.queue.front();
+  s.queue.pop_front();
+  s.unqueued++;
 
-    alListenerfv(AL_ORIENTATION, orientation);
+  Command command;
+  command.type = COMMAND_VOICE_UNQUEUE;
+  command.id = voiceID;
+  push(command);
 
-#if NORI_DEBUG
-    checkAL("Failed to set listener rotation");
-#endif
-  }
+  return bufferID;
 }
 
-void AudioContext::setListenerGain(float newGain)
+uint SoftwareDevice::processedBufferCount(uint voiceID)
 {
-  if (m_listenerGain != newGain)
-  {
-    m_listenerGain = newGain;
-    alListenerfv(AL_GAIN, &m_listenerGain);
+  const Shadow& s = shadow(voiceID);
+  if (!isCurrent(s))
+    return 0;
 
-#if NORI_DEBUG
-    checkAL("Failed to set listener gain");
-#endif
-  }
+  return min(s.report.consumed - s.unqueued, uint(s.queue.size()));
 }
 
-std::unique_ptr<AudioContext> AudioContext::create(ResourceCache& cache)
+uint SoftwareDevice::queuedBufferCount(uint voiceID)
 {
-  std::unique_ptr<AudioContext> context(new AudioContext(cache));
-  if (!context->init())
-    return nullptr;
+  return uint(shadow(voiceID).queue.size());
+}
 
-  return context;
+void SoftwareDevice::setVoicePosition(uint voiceID, const vec3& position)
+{
+  Command command;
+  command.type = COMMAND_VOICE_POSITION;
+  command.id = voiceID;
+  command.values[0] = position.x;
+  command.values[1] = position.y;
+  command.values[2] = position.z;
+  push(command);
 }
 
-AudioContext::AudioContext(ResourceCache& cache):
-  m_cache(cache),
-  m_device(nullptr),
-  m_handle(nullptr),
-  m_listenerGain(1.f)
+void SoftwareDevice::setVoiceVelocity(uint voiceID, const vec3& velocity)
 {
+  // The software mixer has no doppler shift
 }
 
-bool AudioContext::init()
+void SoftwareDevice::setVoiceGain(uint voiceID, float gain)
 {
-  m_device = alcOpenDevice(nullptr);
-  if (!m_device)
-  {
-    checkALC("Failed to open OpenAL device");
+  Command command;
+  command.type = COMMAND_VOICE_GAIN;
+  command.id = voiceID;
+  command.values[0] = gain;
+  push(command);
+}
+
+void SoftwareDevice::setVoicePitch(uint voiceID, float pitch)
+{
+  Command command;
+  command.type = COMMAND_VOICE_PITCH;
+  command.id = voiceID;
+  command.values[0] = pitch;
+  push(command);
+}
+
+void SoftwareDevice::setVoiceLooping(uint voiceID, bool looping)
+{
+  Command command;
+  command.type = COMMAND_VOICE_LOOPING;
+  command.id = voiceID;
+  command.value = looping;
+  push(command);
+}
+
+void SoftwareDevice::setVoiceDistance(uint voiceID, float reference, float rolloff)
+{
+  Command command;
+  command.type = COMMAND_VOICE_DISTANCE;
+  command.id = voiceID;
+  command.values[0] = reference;
+  command.values[1] = rolloff;
+  push(command);
+}
+
+Time SoftwareDevice::voiceOffset(uint voiceID)
+{
+  const Shadow& s = shadow(voiceID);
+  if (!isCurrent(s))
+    return s.offset;
+
+  return s.report.offset;
+}
+
+void SoftwareDevice::setVoiceOffset(uint voiceID, Time offset)
+{
+  Shadow& s = shadow(voiceID);
+  s.epoch++;
+  s.unqueued = 0;
+  s.offset = offset;
+
+  Command command;
+  command.type = COMMAND_VOICE_OFFSET;
+  command.id = voiceID;
+  command.value = s.epoch;
+  command.values[0] = float(offset);
+  push(command);
+}
+
+AudioDevice::VoiceState SoftwareDevice::voiceState(uint voiceID)
+{
+  const Shadow& s = shadow(voiceID);
+  if (s.state != VOICE_STOPPED && isCurrent(s) && s.report.ended)
+    return VOICE_STOPPED;
+
+  return s.state;
+}
+
+void SoftwareDevice::play(uint voiceID)
+{
+  const bool resume = voiceState(voiceID) == VOICE_PAUSED;
+
+  Shadow& s = shadow(voiceID);
+  s.state = VOICE_PLAYING;
+
+  // Like OpenAL, playing a stopped or playing voice restarts its queue
+  if (!resume)
+  {
+    s.epoch++;
+    s.unqueued = 0;
+  }
+
+  Command command;
+  command.type = COMMAND_VOICE_PLAY;
+  command.id = voiceID;
+  command.value = resume ? 0 : s.epoch;
+  push(command);
+}
+
+void SoftwareDevice::pause(uint voiceID)
+{
+  if (voiceState(voiceID) != VOICE_PLAYING)
+    return;
+
+  shadow(voiceID).state = VOICE_PAUSED;
+
+  Command command;
+  command.type = COMMAND_VOICE_PAUSE;
+  command.id = voiceID;
+  push(command);
+}
+
+void SoftwareDevice::stop(uint voiceID)
+{
+  Shadow& s = shadow(voiceID);
+  s.state = VOICE_STOPPED;
+  s.epoch++;
+  s.unqueued = 0;
+  s.offset = 0.0;
+
+  Command command;
+  command.type = COMMAND_VOICE_STOP;
+  command.id = voiceID;
+  command.value = s.epoch;
+  push(command);
+}
+
+void SoftwareDevice::setListener(const vec3& position,
+                                 const vec3& velocity,
+                                 const quat& rotation,
+                                 float gain)
+{
+  Command command;
+  command.type = COMMAND_LISTENER;
+  command.values[0] = position.x;
+  command.values[1] = position.y;
+  command.values[2] = position.z;
+  command.values[3] = rotation.x;
+  command.values[4] = rotation.y;
+  command.values[5] = rotation.z;
+  command.values[6] = rotation.w;
+  command.values[7] = gain;
+  push(command);
+}
+
+void SoftwareDevice::update(Time deltaTime)
+{
+  // Wait for the previous blocks, so their reports can be read safely
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_completion.wait(lock, [this] { return m_completed == m_submitted; });
+  }
+
+  for (uint i = 0;  i < SOFTWARE_VOICE_COUNT;  i++)
+    m_shadows[i].report = m_reports[i];
+
+  m_remainder += deltaTime * m_frequency;
+
+  size_t frames = size_t(m_remainder);
+  m_remainder -= Time(frames);
+
+  while (frames)
+  {
+    const size_t count = min(frames, SOFTWARE_BLOCK_FRAMES);
+
+    Command command;
+    command.type = COMMAND_MIX;
+    command.value = uint(count);
+    push(command);
+
+    m_submitted++;
+    frames -= count;
+  }
+}
+
+bool SoftwareDevice::isCurrent(const Shadow& shadow) const
+{
+  return shadow.report.epoch == shadow.epoch;
+}
+
+void SoftwareDevice::push(const Command& command)
+{
+  const size_t head = m_head.load(std::memory_order_relaxed);
+
+  while (head - m_tail.load(std::memory_order_acquire) == m_commands.size())
+  {
+    wake();
+    std::this_thread::yield();
+  }
+
+  m_commands[head & (m_commands.size() - 1)] = command;
+  m_head.store(head + 1, std::memory_order_release);
+
+  // Other commands are picked up along with the next block
+  if (command.type == COMMAND_MIX || command.type == COMMAND_QUIT)
+    wake();
+}
+
+void SoftwareDevice::wake()
+{
+  // Taking the lock orders this with the predicate check of the mixer
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+  }
+
+  m_condition.notify_one();
+}
+
+void SoftwareDevice::run()
+{
+  for (;;)
+  {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+
+    if (tail == m_head.load(std::memory_order_acquire))
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_condition.wait(lock, [this, tail]
+      {
+        return m_head.load(std::memory_order_acquire) != tail;
+      });
+
+      continue;
+    }
+
+    const Command command = m_commands[tail & (m_commands.size() - 1)];
+    m_tail.store(tail + 1, std::memory_order_release);
+
+    if (command.type == COMMAND_QUIT)
+      return;
+
+    execute(command);
+  }
+}
+
+void SoftwareDevice::execute(const Command& command)
+{
+  switch (command.type)
+  {
+    case COMMAND_BUFFER_DATA:
+    {
+      if (m_buffers.size() < command.id)
+        m_buffers.resize(command.id, nullptr);
+
+      delete m_buffers[command.id - 1];
+      m_buffers[command.id - 1] = (Buffer*) command.data;
+      break;
+    }
+
+    case COMMAND_BUFFER_DELETE:
+    {
+      if (command.id <= m_buffers.size())
+      {
+        delete m_buffers[command.id - 1];
+        m_buffers[command.id - 1] = nullptr;
+      }
+
+      break;
+    }
+
+    case COMMAND_VOICE_RESET:
+    {
+      reset(m_voices[command.id - 1], command.value);
+      break;
+    }
+
+    case COMMAND_VOICE_BUFFER:
+    {
+      Voice& voice = m_voices[command.id - 1];
+      voice.state = VOICE_STOPPED;
+      voice.epoch = command.value;
+      voice.queue.clear();
+      voice.current = 0;
+      voice.consumed = 0;
+      voice.ended = false;
+      voice.position = 0.0;
+      voice.pendingOffset = 0.0;
+
+      if (const uint bufferID = uint(uintptr_t(command.data)))
+        voice.queue.push_back(bufferID);
+
+      break;
+    }
+
+    case COMMAND_VOICE_QUEUE:
+    {
+      m_voices[command.id - 1].queue.push_back(command.value);
+      break;
+    }
+
+    case COMMAND_VOICE_UNQUEUE:
+    {
+      Voice& voice = m_voices[command.id - 1];
+      if (voice.current > 0)
+      {
+        voice.queue.erase(voice.queue.begin());
+        voice.current--;
+      }
+
+      break;
+    }
+
+    case COMMAND_VOICE_POSITION:
+    {
+      m_voices[command.id - 1].location = vec3(command.values[0],
+                                               command.values[1],
+                                               command.values[2]);
+      break;
+    }
+
+    case COMMAND_VOICE_GAIN:
+    {
+      m_voices[command.id - 1].gain = command.values[0];
+      break;
+    }
+
+    case COMMAND_VOICE_PITCH:
+    {
+      m_voices[command.id - 1].pitch = command.values[0];
+      break;
+    }
+
+    case COMMAND_VOICE_LOOPING:
+    {
+      m_voices[command.id - 1].looping = command.value != 0;
+      break;
+    }
+
+    case COMMAND_VOICE_DISTANCE:
+    {
+      Voice& voice = m_voices[command.id - 1];
+      voice.reference = command.values[0];
+      voice.rolloff = command.values[1];
+      break;
+    }
+
+    case COMMAND_VOICE_OFFSET:
+    {
+      Voice& voice = m_voices[command.id - 1];
+      voice.epoch = command.value;
+      voice.consumed = 0;
+      voice.ended = false;
+
+      // Like OpenAL, the offset of a stopped voice applies when it is played
+      if (voice.state == VOICE_STOPPED)
+        voice.pendingOffset = command.values[0];
+      else if (voice.current < voice.queue.size())
+      {
+        const uint bufferID = voice.queue[voice.current];
+        if (bufferID <= m_buffers.size() && m_buffers[bufferID - 1])
+          voice.position = command.values[0] * m_buffers[bufferID - 1]->frequency;
+      }
+
+      break;
+    }
+
+    case COMMAND_VOICE_PLAY:
+    {
+      Voice& voice = m_voices[command.id - 1];
+
+      if (command.value)
+      {
+        voice.epoch = command.value;
+        voice.current = 0;
+        voice.consumed = 0;
+        voice.ended = false;
+        voice.position = 0.0;
+
+        if (!voice.queue.empty())
+        {
+          const uint bufferID = voice.queue.front();
+          if (bufferID <= m_buffers.size() && m_buffers[bufferID - 1])
+            voice.position = voice.pendingOffset * m_buffers[bufferID - 1]->frequency;
+        }
+
+        voice.pendingOffset = 0.0;
+      }
+
+      voice.state = VOICE_PLAYING;
+      break;
+    }
+
+    case COMMAND_VOICE_PAUSE:
+    {
+      Voice& voice = m_voices[command.id - 1];
+      if (voice.state == VOICE_PLAYING)
+        voice.state = VOICE_PAUSED;
+
+      break;
+    }
+
+    case COMMAND_VOICE_STOP:
+    {
+      Voice& voice = m_voices[command.id - 1];
+      voice.state = VOICE_STOPPED;
+      voice.epoch = command.value;
+      voice.current = voice.queue.size();
+      voice.consumed = uint(voice.queue.size());
+      voice.ended = false;
+      voice.position = 0.0;
+      voice.pendingOffset = 0.0;
+      break;
+    }
+
+    case COMMAND_LISTENER:
+    {
+      m_listenerPosition = vec3(command.values[0],
+                                command.values[1],
+                                command.values[2]);
+      m_listenerRotation = quat(command.values[6],
+                                command.values[3],
+                                command.values[4],
+                                command.values[5]);
+      m_listenerGain = command.values[7];
+      break;
+    }
+
+    case COMMAND_MIX:
+    {
+      mix(command.value);
+
+      for (uint i = 0;  i < SOFTWARE_VOICE_COUNT;  i++)
+      {
+        const Voice& voice = m_voices[i];
+
+        Report& report = m_reports[i];
+        report.epoch = voice.epoch;
+        report.consumed = voice.consumed;
+        report.ended = voice.ended;
+        report.offset = 0.0;
+
+        if (voice.current < voice.queue.size())
+        {
+          const uint bufferID = voice.queue[voice.current];
+          if (bufferID <= m_buffers.size() && m_buffers[bufferID - 1])
+            report.offset = voice.position / m_buffers[bufferID - 1]->frequency;
+        }
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_completed++;
+      }
+
+      m_completion.notify_all();
+      break;
+    }
+  }
+}
+
+void SoftwareDevice::reset(Voice& voice, uint epoch)
+{
+  voice.state = VOICE_STOPPED;
+  voice.epoch = epoch;
+  voice.queue.clear();
+  voice.current = 0;
+  voice.consumed = 0;
+  voice.ended = false;
+  voice.position = 0.0;
+  voice.pendingOffset = 0.0;
+  voice.looping = false;
+  voice.location = vec3(0.f);
+  voice.gain = 1.f;
+  voice.pitch = 1.f;
+  voice.reference = 1.f;
+  voice.rolloff = 1.f;
+}
+
+void SoftwareDevice::mix(size_t frames)
+{
+  m_left.assign(frames, 0.f);
+  m_right.assign(frames, 0.f);
+  m_scratchLeft.resize(frames);
+  m_scratchRight.resize(frames);
+
+  for (Voice& voice : m_voices)
+  {
+    if (voice.state == VOICE_PLAYING)
+      mixVoice(voice, frames);
+  }
+
+  if (!m_stream.is_open())
+    return;
+
+  m_output.resize(frames * 2);
+
+  for (size_t i = 0;  i < frames;  i++)
+  {
+    const float left = clamp(m_left[i], -1.f, 1.f);
+    const float right = clamp(m_right[i], -1.f, 1.f);
+    m_output[i * 2 + 0] = int16(left * 32767.f);
+    m_output[i * 2 + 1] = int16(right * 32767.f);
+  }
+
+  m_stream.write((const char*) m_output.data(), m_output.size() * sizeof(int16));
+  m_writtenFrames += frames;
+}
+
+void SoftwareDevice::mixVoice(Voice& voice, size_t frames)
+{
+  // This matches the default inverse distance clamped model of OpenAL
+  const vec3 direction = voice.location - m_listenerPosition;
+  const float distance = length(direction);
+  const float divisor = voice.reference +
+                        voice.rolloff * max(distance - voice.reference, 0.f);
+
+  float gain = voice.gain * m_listenerGain / 32768.f;
+  if (divisor > 0.f)
+    gain *= voice.reference / divisor;
+
+  // Equal power panning on the horizontal axis of the listener
+  float pan = 0.f;
+  if (distance > 0.f)
+    pan = clamp((conjugate(m_listenerRotation) * direction).x / distance, -1.f, 1.f);
+
+  const float angle = (pan + 1.f) * quarter_pi<float>();
+  const float leftGain = gain * std::cos(angle);
+  const float rightGain = gain * std::sin(angle);
+
+  size_t done = 0;
+
+  while (done < frames)
+  {
+    if (voice.current >= voice.queue.size())
+    {
+      voice.state = VOICE_STOPPED;
+      voice.ended = true;
+      return;
+    }
+
+    const uint bufferID = voice.queue[voice.current];
+
+    const Buffer* buffer = nullptr;
+    if (bufferID <= m_buffers.size())
+      buffer = m_buffers[bufferID - 1];
+
+    const bool repeat = voice.looping && voice.queue.size() == 1;
+
+    if (!buffer || !buffer->frames)
+    {
+      if (repeat)
+      {
+        voice.state = VOICE_STOPPED;
+        voice.ended = true;
+        return;
+      }
+
+      voice.current++;
+      voice.consumed++;
+      voice.position = 0.0;
+      continue;
+    }
+
+    const double step = double(buffer->frequency) / m_frequency * voice.pitch;
+    const double remaining = max(double(buffer->frames) - voice.position, 0.0);
+    const size_t count = min(frames - done, size_t(std::ceil(remaining / step)));
+
+    float* left = m_scratchLeft.data();
+    float* right = m_scratchRight.data();
+
+    const int16* samples = buffer->samples.data();
+    const size_t last = buffer->frames - 1;
+
+    // Linear interpolation resampling into planar scratch buffers
+    if (buffer->channels == 1)
+    {
+      for (size_t i = 0;  i < count;  i++)
+      {
+        const double p = voice.position + i * step;
+        const size_t index = min(size_t(p), last);
+        const size_t next = min(index + 1, last);
+        const float t = float(p - double(index));
+        left[i] = samples[index] + (samples[next] - samples[index]) * t;
+      }
+    }
+    else
+    {
+      for (size_t i = 0;  i < count;  i++)
+      {
+        const double p = voice.position + i * step;
+        const size_t index = min(size_t(p), last);
+        const size_t next = min(index + 1, last);
+        const float t = float(p - double(index));
+        left[i] = samples[index * 2] + (samples[next * 2] - samples[index * 2]) * t;
+        right[i] = samples[index * 2 + 1] + (samples[next * 2 + 1] - samples[index * 2 + 1]) * t;
+      }
+    }
+
+    float* outLeft = m_left.data() + done;
+    float* outRight = m_right.data() + done;
+
+    // Kept free of branches and dependencies so the compiler can vectorize
+    if (buffer->channels == 1)
+    {
+      for (size_t i = 0;  i < count;  i++)
+      {
+        outLeft[i] += left[i] * leftGain;
+        outRight[i] += left[i] * rightGain;
+      }
+    }
+    else
+    {
+      // Like OpenAL, stereo data is not spatialized
+      for (size_t i = 0;  i < count;  i++)
+      {
+        outLeft[i] += left[i] * gain;
+        outRight[i] += right[i] * gain;
+      }
+    }
+
+    done += count;
+    voice.position += count * step;
+
+    if (voice.position >= buffer->frames)
+    {
+      if (repeat)
+        voice.position = std::fmod(voice.position, double(buffer->frames));
+      else
+      {
+        voice.position -= buffer->frames;
+        voice.current++;
+        voice.consumed++;
+      }
+    }
+  }
+}
+
+void SoftwareDevice::writeHeader(uint32 dataSize)
+{
+  const uint32 frequency = m_frequency;
+  const uint32 byteRate = frequency * 2 * sizeof(int16);
+  const uint32 riffSize = 36 + dataSize;
+  const uint32 formatSize = 16;
+  const uint16 format = 1;
+  const uint16 channels = 2;
+  const uint16 blockAlign = 2 * sizeof(int16);
+  const uint16 bits = 16;
+
+  // WAV files are little-endian, like all supported platforms
+  m_stream.write("RIFF", 4);
+  m_stream.write((const char*) &riffSize, 4);
+  m_stream.write("WAVEfmt ", 8);
+  m_stream.write((const char*) &formatSize, 4);
+  m_stream.write((const char*) &format, 2);
+  m_stream.write((const char*) &channels, 2);
+  m_stream.write((const char*) &frequency, 4);
+  m_stream.write((const char*) &byteRate, 4);
+  m_stream.write((const char*) &blockAlign, 2);
+  m_stream.write((const char*) &bits, 2);
+  m_stream.write("data", 4);
+  m_stream.write((const char*) &dataSize, 4);
+}
+
+/*! @brief Cache of decoded compressed audio buffers.
+ *
+ *  Compressed buffers are decoded when bound to a voice, or earlier on a
+ *  worker thread if prefetched.  Decoded buffers not in use by any voice are
+ *  evicted in least recently used order when the cache exceeds its size.
+ */
+class AudioBufferCache
+{
+public:
+  AudioBufferCache(AudioDevice& device);
+  ~AudioBufferCache();
+  bool acquire(AudioBuffer& buffer);
+  void release(AudioBuffer& buffer);
+  void prefetch(AudioBuffer& buffer);
+  void cancel(AudioBuffer& buffer);
+  void update();
+  void evict();
+  size_t m_capacity;
+  size_t m_residentBytes;
+  uint64 m_hitCount;
+  uint64 m_missCount;
+private:
+  struct Job
+  {
+    AudioBuffer* buffer;
+    const CompressedSample* sample;
+    std::vector<char> data;
+    bool decoded;
+  };
+  bool claim(AudioBuffer& buffer, std::vector<char>& data);
+  bool upload(AudioBuffer& buffer, const std::vector<char>& data);
+  void work();
+  AudioDevice& m_device;
+  uint m_frame;
+  std::vector<AudioBuffer*> m_resident;
+  std::deque<Job> m_requests;
+  std::deque<Job> m_results;
+  AudioBuffer* m_decoding;
+  std::thread m_worker;
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  bool m_stopping;
+};
+
+AudioBufferCache::AudioBufferCache(AudioDevice& device):
+  m_capacity(0),
+  m_residentBytes(0),
+  m_hitCount(0),
+  m_missCount(0),
+  m_device(device),
+  m_frame(0),
+  m_decoding(nullptr),
+  m_stopping(false)
+{
+}
+
+AudioBufferCache::~AudioBufferCache()
+{
+  if (m_worker.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+
+    m_condition.notify_all();
+    m_worker.join();
+  }
+}
+
+bool AudioBufferCache::acquire(AudioBuffer& buffer)
+{
+  buffer.m_lastUsed = m_frame;
+  buffer.m_useCount++;
+
+  if (!buffer.m_sample)
+    return true;
+
+  if (buffer.isResident())
+  {
+    m_hitCount++;
+    return true;
+  }
+
+  m_missCount++;
+
+  std::vector<char> data;
+
+  // Decode on this thread unless a prefetch has done or is doing it
+  if (!claim(buffer, data) && !buffer.m_sample->decode(data))
+  {
+    buffer.m_useCount--;
     return false;
   }
 
-  m_handle = alcCreateContext((ALCdevice*) m_device, nullptr);
-  if (!m_handle)
+  if (!upload(buffer, data))
   {
-    checkALC("Failed to create OpenAL context");
+    buffer.m_useCount--;
     return false;
   }
 
-  if (!alcMakeContextCurrent((ALCcontext*) m_handle))
+  evict();
+  return true;
+}
+
+void AudioBufferCache::release(AudioBuffer& buffer)
+{
+  buffer.m_lastUsed = m_frame;
+  buffer.m_useCount--;
+}
+
+void AudioBufferCache::prefetch(AudioBuffer& buffer)
+{
+  if (!buffer.m_sample || buffer.isResident() || buffer.m_prefetching)
+    return;
+
+  if (!m_worker.joinable())
+  {
+    try
+    {
+      m_worker = std::thread(&AudioBufferCache::work, this);
+    }
+    catch (const std::system_error& e)
+    {
+      logError("Failed to start audio decoder thread: %s", e.what());
+      return;
+    }
+  }
+
+  buffer.m_prefetching = true;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    Job job;
+    job.buffer = &buffer;
+    job.sample = buffer.m_sample;
+    job.decoded = false;
+    m_requests.push_back(std::move(job));
+  }
+
+  m_condition.notify_all();
+}
+
+void AudioBufferCache::cancel(AudioBuffer& buffer)
+{
+  if (buffer.m_prefetching)
   {
-    checkALC("Failed to make OpenAL context current");
+    std::vector<char> data;
+    claim(buffer, data);
+  }
+
+  if (buffer.isResident() && buffer.m_sample)
+  {
+    m_resident.erase(std::find(m_resident.begin(), m_resident.end(), &buffer));
+    m_residentBytes -= buffer.m_size;
+  }
+}
+
+void AudioBufferCache::update()
+{
+  m_frame++;
+
+  std::deque<Job> results;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    results.swap(m_results);
+  }
+
+  if (results.empty())
+    return;
+
+  for (Job& job : results)
+  {
+    AudioBuffer& buffer = *job.buffer;
+    buffer.m_prefetching = false;
+
+    if (job.decoded && !buffer.isResident())
+    {
+      buffer.m_lastUsed = m_frame;
+      upload(buffer, job.data);
+    }
+  }
+
+  evict();
+}
+
+void AudioBufferCache::evict()
+{
+  while (m_residentBytes > m_capacity)
+  {
+    AudioBuffer* victim = nullptr;
+
+    for (AudioBuffer* buffer : m_resident)
+    {
+      if (buffer->m_useCount)
+        continue;
+
+      if (!victim || int(buffer->m_lastUsed - victim->m_lastUsed) < 0)
+        victim = buffer;
+    }
+
+    if (!victim)
+      break;
+
+    m_device.deleteBuffer(victim->m_bufferID);
+    victim->m_bufferID = 0;
+
+    m_resident.erase(std::find(m_resident.begin(), m_resident.end(), victim));
+    m_residentBytes -= victim->m_size;
+  }
+}
+
+bool AudioBufferCache::claim(AudioBuffer& buffer, std::vector<char>& data)
+{
+  if (!buffer.m_prefetching)
     return false;
+
+  buffer.m_prefetching = false;
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  for (auto r = m_requests.begin();  r != m_requests.end();  r++)
+  {
+    if (r->buffer == &buffer)
+    {
+      m_requests.erase(r);
+      return false;
+    }
   }
 
-  log("OpenAL context version %s created",
-      (const char*) alGetString(AL_VERSION));
+  m_condition.wait(lock, [this, &buffer] { return m_decoding != &buffer; });
 
-  log("OpenAL context renderer is %s by %s",
-      (const char*) alGetString(AL_RENDERER),
-      (const char*) alGetString(AL_VENDOR));
+  for (auto r = m_results.begin();  r != m_results.end();  r++)
+  {
+    if (r->buffer == &buffer)
+    {
+      const bool decoded = r->decoded;
+      data.swap(r->data);
+      m_results.erase(r);
+      return decoded;
+    }
+  }
 
-  log("OpenAL context uses device %s",
-      (const char*) alcGetString((ALCdevice*) m_device, ALC_DEVICE_SPECIFIER));
+  return false;
+}
+
+bool AudioBufferCache::upload(AudioBuffer& buffer, const std::vector<char>& data)
+{
+  buffer.m_bufferID = m_device.createBuffer();
+  if (!buffer.m_bufferID)
+    return false;
+
+  if (!m_device.setBufferData(buffer.m_bufferID,
+                              buffer.m_format,
+                              data.data(), data.size(),
+                              buffer.m_sample->frequency))
+  {
+    m_device.deleteBuffer(buffer.m_bufferID);
+    buffer.m_bufferID = 0;
+    return false;
+  }
 
+  m_resident.push_back(&buffer);
+  m_residentBytes += buffer.m_size;
   return true;
 }
 
+void AudioBufferCache::work()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  for (;;)
+  {
+    m_condition.wait(lock, [this] { return m_stopping || !m_requests.empty(); });
+
+    if (m_stopping)
+      return;
+
+    Job job = std::move(m_requests.front());
+    m_requests.pop_front();
+    m_decoding = job.buffer;
+
+    lock.unlock();
+    job.decoded = job.sample->decode(job.data);
+    lock.lock();
+
+    m_decoding = nullptr;
+    m_results.push_back(std::move(job));
+    m_condition.notify_all();
+  }
+}
+
+AudioBuffer::~AudioBuffer()
+{
+  m_context.m_bufferCache->cancel(*this);
+
+  if (m_bufferID)
+    m_context.m_device->deleteBuffer(m_bufferID);
+}
+
+bool AudioBuffer::isMono() const
+{
+  return m_format == SAMPLE_MONO8 || m_format == SAMPLE_MONO16;
+}
+
+bool AudioBuffer::isStereo() const
+{
+  return m_format == SAMPLE_STEREO8 || m_format == SAMPLE_STEREO16;
+}
+
+Ref<AudioBuffer> AudioBuffer::create(const ResourceInfo& info,
+                                     AudioContext& context,
+                                     const Sample& data)
+{
+  Ref<AudioBuffer> buffer = new AudioBuffer(info, context);
+  if (!buffer->init(data))
+    return nullptr;
+
+  return buffer;
+}
+
+Ref<AudioBuffer> AudioBuffer::create(const ResourceInfo& info,
+                                     AudioContext& context,
+                                     CompressedSample& data)
+{
+  Ref<AudioBuffer> buffer = new AudioBuffer(info, context);
+  if (!buffer->init(data))
+    return nullptr;
+
+  return buffer;
+}
+
+Ref<AudioBuffer> AudioBuffer::read(AudioContext& context, const std::string& sampleName)
+{
+  ResourceCache& cache = context.cache();
+
+  std::string name;
+  name += "sample:";
+  name += sampleName;
+
+  if (Ref<AudioBuffer> buffer = cache.find<AudioBuffer>(name))
+    return buffer;
+
+  if (context.sampleCacheSize())
+  {
+    Ref<CompressedSample> data = CompressedSample::read(cache, sampleName);
+    if (!data)
+    {
+      logError("Failed to read compressed sample for buffer %s", name.c_str());
+      return nullptr;
+    }
+
+    return create(ResourceInfo(cache, name), context, *data);
+  }
+
+  Ref<Sample> data = Sample::read(cache, sampleName);
+  if (!data)
+  {
+    logError("Failed to read sample for buffer %s", name.c_str());
+    return nullptr;
+  }
+
+  return create(ResourceInfo(cache, name), context, *data);
+}
+
+AudioBuffer::AudioBuffer(const ResourceInfo& info, AudioContext& context):
+  Resource(info),
+  m_context(context),
+  m_bufferID(0),
+  m_duration(0.0),
+  m_size(0),
+  m_lastUsed(0),
+  m_useCount(0),
+  m_prefetching(false)
+{
+}
+
+bool AudioBuffer::init(const Sample& data)
+{
+  AudioDevice& device = *m_context.m_device;
+
+  m_bufferID = device.createBuffer();
+  if (!m_bufferID)
+    return false;
+
+  if (!device.setBufferData(m_bufferID,
+                            data.format,
+                            data.data.data(), data.data.size(),
+                            data.frequency))
+  {
+    return false;
+  }
+
+  m_format = data.format;
+  m_duration = Time(data.data.size()) / (getFormatSize(m_format) * data.frequency);
+  m_size = data.data.size();
+
+  return true;
+}
+
+bool AudioBuffer::init(CompressedSample& data)
+{
+  m_sample = &data;
+  m_format = data.format;
+  m_duration = Time(data.length) / data.frequency;
+  m_size = data.decodedSize();
+
+  return true;
+}
+
+AudioStream::~AudioStream()
+{
+  if (m_worker.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+
+    m_condition.notify_all();
+    m_worker.join();
+  }
+
+  for (uint bufferID : m_bufferIDs)
+    m_context.m_device->deleteBuffer(bufferID);
+}
+
+Ref<AudioStream> AudioStream::open(AudioContext& context, const std::string& sampleName)
+{
+  Ref<AudioStream> stream = new AudioStream(context);
+  if (!stream->init(sampleName))
+    return nullptr;
+
+  return stream;
+}
+
+AudioStream::AudioStream(AudioContext& context):
+  m_context(context),
+  m_source(nullptr),
+  m_format(SAMPLE_MONO16),
+  m_frequency(0),
+  m_duration(0.0),
+  m_first(0),
+  m_count(0),
+  m_seekFrame(0),
+  m_generation(0),
+  m_seeking(false),
+  m_looping(false),
+  m_ended(false),
+  m_stopping(false)
+{
+}
+
+bool AudioStream::init(const std::string& sampleName)
+{
+  m_sample = SampleStream::open(m_context.cache(), sampleName);
+  if (!m_sample)
+  {
+    logError("Failed to open sample stream %s", sampleName.c_str());
+    return false;
+  }
+
+  m_format = m_sample->format();
+  m_frequency = m_sample->frequency();
+  m_duration = Time(m_sample->length()) / m_frequency;
+
+  for (size_t i = 0;  i < STREAM_BUFFER_COUNT;  i++)
+  {
+    const uint bufferID = m_context.m_device->createBuffer();
+    if (!bufferID)
+      return false;
+
+    m_bufferIDs.push_back(bufferID);
+  }
+
+  m_freeBufferIDs = m_bufferIDs;
+
+  m_chunks.resize(STREAM_CHUNK_COUNT);
+  for (Chunk& chunk : m_chunks)
+  {
+    chunk.data.resize(STREAM_CHUNK_FRAMES * m_sample->channels());
+    chunk.frames = 0;
+  }
+
+  try
+  {
+    m_worker = std::thread(&AudioStream::work, this);
+  }
+  catch (const std::system_error& e)
+  {
+    logError("Failed to start audio stream decoder thread: %s", e.what());
+    return false;
+  }
+
+  return true;
+}
+
+void AudioStream::setLooping(bool newState)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_looping = newState;
+    if (m_looping)
+      m_ended = false;
+  }
+
+  m_condition.notify_one();
+}
+
+void AudioStream::seek(size_t frame)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_seekFrame = frame;
+    m_seeking = true;
+    m_generation++;
+    m_first = 0;
+    m_count = 0;
+    m_ended = false;
+  }
+
+  m_condition.notify_one();
+}
+
+bool AudioStream::isFinished()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_ended && !m_seeking && m_count == 0;
+}
+
+bool AudioStream::fill(uint bufferID)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_count)
+      return false;
+
+    const Chunk& chunk = m_chunks[m_first];
+    m_context.m_device->setBufferData(bufferID,
+                                      m_format,
+                                      chunk.data.data(),
+                                      chunk.frames * getFormatSize(m_format),
+                                      m_frequency);
+
+    m_first = (m_first + 1) % m_chunks.size();
+    m_count--;
+  }
+
+  m_condition.notify_one();
+  return true;
+}
+
+void AudioStream::work()
+{
+  const uint channels = m_sample->channels();
+  std::vector<int16> data(STREAM_CHUNK_FRAMES * channels);
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  for (;;)
+  {
+    m_condition.wait(lock, [this]
+    {
+      return m_stopping || m_seeking || (!m_ended && m_count < m_chunks.size());
+    });
+
+    if (m_stopping)
+      return;
+
+    const uint generation = m_generation;
+    const bool looping = m_looping;
+    const bool seeking = m_seeking;
+    const size_t seekFrame = m_seekFrame;
+
+    m_seeking = false;
+
+    // Decode without holding the lock, so the game thread never waits on it
+    lock.unlock();
+
+    if (seeking)
+      m_sample->seek(seekFrame);
+
+    size_t frames = m_sample->read(data.data(), STREAM_CHUNK_FRAMES);
+    bool ended = false;
+
+    // Continue from the beginning within the same chunk, so the loop point
+    // is not audible as a gap between two buffers
+    while (frames < STREAM_CHUNK_FRAMES)
+    {
+      if (!looping || !m_sample->seek(0))
+      {
+        ended = true;
+        break;
+      }
+
+      const size_t count = m_sample->read(data.data() + frames * channels,
+                                          STREAM_CHUNK_FRAMES - frames);
+      if (!count)
+      {
+        ended = true;
+        break;
+      }
+
+      frames += count;
+    }
+
+    lock.lock();
+
+    // Discard the chunk if a seek was requested while decoding it
+    if (generation != m_generation)
+      continue;
+
+    if (frames)
+    {
+      Chunk& chunk = m_chunks[(m_first + m_count) % m_chunks.size()];
+      chunk.data.swap(data);
+      chunk.frames = frames;
+      m_count++;
+    }
+
+    m_ended = ended;
+  }
+}
+
+AudioSource::~AudioSource()
+{
+  if (m_stream)
+    setStream(nullptr);
+
+  if (m_sourceID)
+    m_context.m_freeVoiceIDs.push_back(unbind());
+
+  m_context.removeSource(*this);
+}
+
+void AudioSource::start()
+{
+  // Streams restart from the beginning, like buffers
+  if (m_stream && m_state != STOPPED)
+    m_stream->seek(0);
+
+  m_offset = 0.0;
+  m_dirty |= DIRTY_OFFSET;
+  setState(STARTED);
+}
+
+void AudioSource::stop()
+{
+  if (m_state == STOPPED)
+    return;
+
+  if (m_stream)
+    m_stream->seek(0);
+
+  m_offset = 0.0;
+  setState(STOPPED);
+}
+
+void AudioSource::pause()
+{
+  if (m_state == STARTED)
+    setState(PAUSED);
+}
+
+void AudioSource::resume()
+{
+  if (m_state == PAUSED)
+    setState(STARTED);
+}
+
+void AudioSource::setLooping(bool newState)
+{
+  if (m_looping != newState)
+  {
+    m_looping = newState;
+    m_dirty |= DIRTY_LOOPING;
+
+    if (m_stream)
+      m_stream->setLooping(m_looping);
+  }
+}
+
+void AudioSource::setPosition(const vec3& newPosition)
+{
+  if (m_position != newPosition)
+  {
+    m_position = newPosition;
+    m_context.m_sourcePositions[m_index] = newPosition;
+    m_dirty |= DIRTY_POSITION;
+  }
+}
+
+void AudioSource::setVelocity(const vec3& newVelocity)
+{
+  if (m_velocity != newVelocity)
+  {
+    m_velocity = newVelocity;
+    m_dirty |= DIRTY_VELOCITY;
+  }
+}
+
+void AudioSource::setBuffer(AudioBuffer* newBuffer)
+{
+  if (m_stream && newBuffer)
+    setStream(nullptr);
+
+  if (m_buffer != newBuffer)
+  {
+    if (m_sourceID)
+      m_context.m_freeVoiceIDs.push_back(unbind());
+
+    m_buffer = newBuffer;
+    m_offset = 0.0;
+    setState(STOPPED);
+  }
+}
+
+void AudioSource::setStream(AudioStream* newStream)
+{
+  if (m_stream == newStream)
+    return;
+
+  if (m_buffer)
+    setBuffer(nullptr);
+
+  if (m_sourceID)
+    m_context.m_freeVoiceIDs.push_back(unbind());
+
+  if (m_stream)
+  {
+    m_stream->seek(0);
+    m_stream->m_source = nullptr;
+  }
+
+  if (newStream && newStream->m_source)
+    newStream->m_source->setStream(nullptr);
+
+  m_stream = newStream;
+
+  if (m_stream)
+  {
+    m_stream->m_source = this;
+    m_stream->setLooping(m_looping);
+  }
+
+  m_offset = 0.0;
+  setState(STOPPED);
+}
+
+void AudioSource::seek(Time position)
+{
+  if (m_stream)
+  {
+    const size_t length = m_stream->m_sample->length();
+    const size_t frame = min(size_t(max(position, 0.0) * m_stream->m_frequency),
+                             length ? length - 1 : 0);
+
+    // Queued data is discarded and replaced by the next update
+    m_stream->seek(frame);
+  }
+  else
+    m_offset = max(position, 0.0);
+
+  m_dirty |= DIRTY_OFFSET;
+}
+
+void AudioSource::setGain(float newGain)
+{
+  if (m_gain != newGain)
+  {
+    m_gain = newGain;
+    m_context.m_sourceGains[m_index] = newGain;
+    m_dirty |= DIRTY_GAIN;
+  }
+}
+
+void AudioSource::setPitch(float newPitch)
+{
+  // OpenAL rejects these as well, while the software mixer cannot step
+  // through a buffer with them
+  if (!(newPitch > 0.f) || !std::isfinite(newPitch))
+  {
+    logError("Invalid audio source pitch %f", newPitch);
+    return;
+  }
+
+  if (m_pitch != newPitch)
+  {
+    m_pitch = newPitch;
+    m_dirty |= DIRTY_PITCH;
+  }
+}
+
+void AudioSource::setPriority(float newPriority)
+{
+  m_priority = newPriority;
+  m_context.m_sourcePriorities[m_index] = newPriority;
+}
+
+void AudioSource::setReferenceDistance(float newDistance)
+{
+  if (m_referenceDistance != newDistance)
+  {
+    m_referenceDistance = newDistance;
+    m_context.m_sourceReferenceDistances[m_index] = newDistance;
+    m_dirty |= DIRTY_DISTANCE;
+  }
+}
+
+void AudioSource::setRolloffFactor(float newFactor)
+{
+  if (m_rolloffFactor != newFactor)
+  {
+    m_rolloffFactor = newFactor;
+    m_context.m_sourceRolloffFactors[m_index] = newFactor;
+    m_dirty |= DIRTY_DISTANCE;
+  }
+}
+
+Ref<AudioSource> AudioSource::create(AudioContext& context)
+{
+  Ref<AudioSource> source = new AudioSource(context);
+  if (!source->init())
+    return nullptr;
+
+  return source;
+}
+
+AudioSource::AudioSource(AudioContext& context):
+  m_context(context),
+  m_index(0),
+  m_sourceID(0),
+  m_dirty(0),
+  m_state(STOPPED),
+  m_offset(0.0),
+  m_looping(false),
+  m_gain(1.f),
+  m_pitch(1.f),
+  m_priority(1.f),
+  m_referenceDistance(1.f),
+  m_rolloffFactor(1.f)
+{
+}
+
+bool AudioSource::init()
+{
+  m_context.addSource(*this);
+  return true;
+}
+
+void AudioSource::setState(State newState)
+{
+  m_state = newState;
+  m_dirty |= DIRTY_STATE;
+
+  uint8 mode = SOURCE_INACTIVE;
+  if (m_stream && m_state != STOPPED)
+    mode = SOURCE_PINNED;
+  else if (m_state == STARTED)
+    mode = SOURCE_ACTIVE;
+
+  m_context.m_sourceModes[m_index] = mode;
+}
+
+void AudioSource::advance(Time deltaTime)
+{
+  if (!m_buffer)
+  {
+    setState(STOPPED);
+    return;
+  }
+
+  const Time duration = m_buffer->duration();
+
+  m_offset += deltaTime * m_pitch;
+  if (m_offset >= duration)
+  {
+    if (m_looping && duration > 0.0)
+      m_offset = std::fmod(m_offset, duration);
+    else
+    {
+      m_offset = 0.0;
+      setState(STOPPED);
+    }
+  }
+}
+
+bool AudioSource::bind(uint sourceID)
+{
+  if (m_buffer)
+  {
+    if (!m_context.m_bufferCache->acquire(*m_buffer))
+    {
+      logError("Failed to decode buffer %s", m_buffer->name().c_str());
+      m_offset = 0.0;
+      setState(STOPPED);
+      return false;
+    }
+
+    m_context.m_device->setVoiceBuffer(sourceID, m_buffer->m_bufferID);
+  }
+
+  m_sourceID = sourceID;
+  m_dirty = DIRTY_ALL;
+  flush();
+  return true;
+}
+
+uint AudioSource::unbind()
+{
+  AudioDevice& device = *m_context.m_device;
+
+  if (m_stream)
+    clearQueue();
+  else
+  {
+    // Keep the playback position so a virtual source can continue from it
+    if (m_state != STOPPED && !(m_dirty & DIRTY_OFFSET))
+      m_offset = device.voiceOffset(m_sourceID);
+
+    device.stop(m_sourceID);
+    device.setVoiceBuffer(m_sourceID, 0);
+
+    if (m_buffer)
+      m_context.m_bufferCache->release(*m_buffer);
+  }
+
+  const uint sourceID = m_sourceID;
+  m_sourceID = 0;
+  return sourceID;
+}
+
+void AudioSource::flush()
+{
+  AudioDevice& device = *m_context.m_device;
+
+  if (m_dirty & DIRTY_POSITION)
+    device.setVoicePosition(m_sourceID, m_position);
+
+  if (m_dirty & DIRTY_VELOCITY)
+    device.setVoiceVelocity(m_sourceID, m_velocity);
+
+  if (m_dirty & DIRTY_GAIN)
+    device.setVoiceGain(m_sourceID, m_gain);
+
+  if (m_dirty & DIRTY_PITCH)
+    device.setVoicePitch(m_sourceID, m_pitch);
+
+  // Streams loop by decoding, as looping the source would loop the queue
+  if (m_dirty & DIRTY_LOOPING)
+    device.setVoiceLooping(m_sourceID, m_stream ? false : m_looping);
+
+  if (m_dirty & DIRTY_DISTANCE)
+    device.setVoiceDistance(m_sourceID, m_referenceDistance, m_rolloffFactor);
+
+  if (m_dirty & DIRTY_OFFSET)
+  {
+    if (m_stream)
+      clearQueue();
+    else
+      device.setVoiceOffset(m_sourceID, m_offset);
+  }
+
+  if (m_dirty & DIRTY_STATE)
+  {
+    const AudioDevice::VoiceState state = device.voiceState(m_sourceID);
+
+    // Streams are started by refill once data has been queued
+    if (m_state == STARTED)
+    {
+      if (state != AudioDevice::VOICE_PLAYING && !m_stream)
+        device.play(m_sourceID);
+    }
+    else if (m_state == PAUSED)
+    {
+      if (state == AudioDevice::VOICE_PLAYING)
+        device.pause(m_sourceID);
+    }
+    else
+      device.stop(m_sourceID);
+  }
+
+  m_dirty = 0;
+}
+
+void AudioSource::refill()
+{
+  AudioDevice& device = *m_context.m_device;
+  std::vector<uint>& freeBufferIDs = m_stream->m_freeBufferIDs;
+
+  uint processed = device.processedBufferCount(m_sourceID);
+  while (processed-- > 0)
+    freeBufferIDs.push_back(device.unqueueBuffer(m_sourceID));
+
+  while (!freeBufferIDs.empty() && m_stream->fill(freeBufferIDs.back()))
+  {
+    device.queueBuffer(m_sourceID, freeBufferIDs.back());
+    freeBufferIDs.pop_back();
+  }
+
+  if (m_state == STARTED)
+  {
+    if (device.voiceState(m_sourceID) != AudioDevice::VOICE_PLAYING)
+    {
+      // Either the stream has started or seeked, or the queue ran dry
+      if (device.queuedBufferCount(m_sourceID) > 0)
+        device.play(m_sourceID);
+      else if (m_stream->isFinished())
+      {
+        m_stream->seek(0);
+        setState(STOPPED);
+      }
+    }
+  }
+}
+
+void AudioSource::clearQueue()
+{
+  m_context.m_device->stop(m_sourceID);
+  m_context.m_device->setVoiceBuffer(m_sourceID, 0);
+
+  m_stream->m_freeBufferIDs = m_stream->m_bufferIDs;
+}
+
+AudioContext::~AudioContext()
+{
+  for (uint voiceID : m_voiceIDs)
+    m_device->deleteVoice(voiceID);
+}
+
+void AudioContext::setListenerPosition(const vec3& newPosition)
+{
+  if (m_listenerPosition != newPosition)
+  {
+    m_listenerPosition = newPosition;
+    m_device->setListener(m_listenerPosition,
+                          m_listenerVelocity,
+                          m_listenerRotation,
+                          m_listenerGain);
+  }
+}
+
+void AudioContext::setListenerVelocity(const vec3& newVelocity)
+{
+  if (m_listenerVelocity != newVelocity)
+  {
+    m_listenerVelocity = newVelocity;
+    m_device->setListener(m_listenerPosition,
+                          m_listenerVelocity,
+                          m_listenerRotation,
+                          m_listenerGain);
+  }
+}
+
+void AudioContext::setListenerRotation(const quat& newRotation)
+{
+  if (m_listenerRotation != newRotation)
+  {
+    m_listenerRotation = newRotation;
+    m_device->setListener(m_listenerPosition,
+                          m_listenerVelocity,
+                          m_listenerRotation,
+                          m_listenerGain);
+  }
+}
+
+void AudioContext::setListenerGain(float newGain)
+{
+  if (m_listenerGain != newGain)
+  {
+    m_listenerGain = newGain;
+    m_device->setListener(m_listenerPosition,
+                          m_listenerVelocity,
+                          m_listenerRotation,
+                          m_listenerGain);
+  }
+}
+
+void AudioContext::update()
+{
+  update(m_timer.deltaTime());
+}
+
+void AudioContext::update(Time deltaTime)
+{
+  m_bufferCache->update();
+
+  // Stop sources that have played to the end, whether bound or virtual
+  for (AudioSource* source : m_sources)
+  {
+    if (source->m_state != AudioSource::STARTED || source->m_stream)
+      continue;
+
+    if (source->m_sourceID)
+    {
+      if (source->m_dirty & (AudioSource::DIRTY_OFFSET | AudioSource::DIRTY_STATE))
+        continue;
+
+      if (m_device->voiceState(source->m_sourceID) == AudioDevice::VOICE_STOPPED)
+      {
+        source->m_offset = 0.0;
+        source->setState(AudioSource::STOPPED);
+      }
+    }
+    else
+      source->advance(deltaTime);
+  }
+
+  const size_t count = m_sources.size();
+
+  m_audibility.resize(count);
+  m_selected.assign(count, false);
+  m_ranking.clear();
+
+  for (size_t i = 0;  i < count;  i++)
+  {
+    if (m_sourceModes[i] == SOURCE_INACTIVE)
+      continue;
+
+    if (m_sourceModes[i] == SOURCE_PINNED)
+      m_audibility[i] = std::numeric_limits<float>::max();
+    else
+    {
+      // This matches the default inverse distance clamped model of OpenAL
+      const float distance = length(m_sourcePositions[i] - m_listenerPosition);
+      const float reference = m_sourceReferenceDistances[i];
+      const float rolloff = m_sourceRolloffFactors[i];
+      const float divisor = reference + rolloff * max(distance - reference, 0.f);
+
+      float audibility = m_sourceGains[i] * m_sourcePriorities[i];
+      if (divisor > 0.f)
+        audibility *= reference / divisor;
+
+      if (audibility <= 0.f)
+        continue;
+
+      if (m_sources[i]->m_sourceID)
+        audibility *= BOUND_AUDIBILITY_BIAS;
+
+      m_audibility[i] = audibility;
+    }
+
+    m_ranking.push_back(uint(i));
+  }
+
+  if (m_ranking.size() > m_maxVoiceCount)
+  {
+    std::nth_element(m_ranking.begin(),
+                     m_ranking.begin() + m_maxVoiceCount,
+                     m_ranking.end(),
+                     [this](uint a, uint b)
+    {
+      return m_audibility[a] > m_audibility[b];
+    });
+
+    m_ranking.resize(m_maxVoiceCount);
+  }
+
+  for (uint index : m_ranking)
+    m_selected[index] = true;
+
+  // Release voices before binding, so they can be reused in the same update
+  for (size_t i = 0;  i < count;  i++)
+  {
+    if (m_sources[i]->m_sourceID && !m_selected[i])
+      m_freeVoiceIDs.push_back(m_sources[i]->unbind());
+  }
+
+  for (uint index : m_ranking)
+  {
+    AudioSource* source = m_sources[index];
+    if (source->m_sourceID)
+      continue;
+
+    const uint sourceID = allocateVoice();
+    if (!sourceID)
+      break;
+
+    if (!source->bind(sourceID))
+      m_freeVoiceIDs.push_back(sourceID);
+  }
+
+  for (AudioSource* source : m_sources)
+  {
+    if (!source->m_sourceID)
+      continue;
+
+    if (source->m_dirty)
+      source->flush();
+
+    if (source->m_stream)
+      source->refill();
+  }
+
+  m_device->update(deltaTime);
+}
+
+void AudioContext::setMaxVoiceCount(uint newCount)
+{
+  m_maxVoiceCount = newCount;
+}
+
+size_t AudioContext::sampleCacheSize() const
+{
+  return m_bufferCache->m_capacity;
+}
+
+void AudioContext::setSampleCacheSize(size_t newSize)
+{
+  m_bufferCache->m_capacity = newSize;
+  m_bufferCache->evict();
+}
+
+size_t AudioContext::residentSampleBytes() const
+{
+  return m_bufferCache->m_residentBytes;
+}
+
+float AudioContext::sampleCacheHitRate() const
+{
+  const uint64 total = m_bufferCache->m_hitCount + m_bufferCache->m_missCount;
+  if (!total)
+    return 0.f;
+
+  return float(double(m_bufferCache->m_hitCount) / total);
+}
+
+void AudioContext::prefetch(AudioBuffer& buffer)
+{
+  m_bufferCache->prefetch(buffer);
+}
+
+std::unique_ptr<AudioContext> AudioContext::create(ResourceCache& cache,
+                                                  const AudioConfig& config)
+{
+  std::unique_ptr<AudioContext> context(new AudioContext(cache));
+  if (!context->init(config))
+    return nullptr;
+
+  return context;
+}
+
+AudioContext::AudioContext(ResourceCache& cache):
+  m_cache(cache),
+  m_listenerGain(1.f),
+  m_maxVoiceCount(DEFAULT_MAX_VOICE_COUNT)
+{
+}
+
+bool AudioContext::init(const AudioConfig& config)
+{
+  if (config.backend == AUDIO_SOFTWARE)
+  {
+    std::unique_ptr<SoftwareDevice> device(new SoftwareDevice());
+    if (!device->init(config))
+      return false;
+
+    m_device = std::move(device);
+  }
+  else
+  {
+    std::unique_ptr<OpenALDevice> device(new OpenALDevice());
+    if (!device->init())
+      return false;
+
+    m_device = std::move(device);
+  }
+
+  m_bufferCache.reset(new AudioBufferCache(*m_device));
+
+  m_timer.start();
+  return true;
+}
+
+void AudioContext::addSource(AudioSource& source)
+{
+  source.m_index = uint(m_sources.size());
+
+  m_sources.push_back(&source);
+  m_sourceModes.push_back(SOURCE_INACTIVE);
+  m_sourcePositions.push_back(source.m_position);
+  m_sourceGains.push_back(source.m_gain);
+  m_sourcePriorities.push_back(source.m_priority);
+  m_sourceReferenceDistances.push_back(source.m_referenceDistance);
+  m_sourceRolloffFactors.push_back(source.m_rolloffFactor);
+}
+
+void AudioContext::removeSource(AudioSource& source)
+{
+  const uint index = source.m_index;
+  const uint last = uint(m_sources.size() - 1);
+
+  if (index != last)
+  {
+    m_sources[index] = m_sources[last];
+    m_sources[index]->m_index = index;
+    m_sourceModes[index] = m_sourceModes[last];
+    m_sourcePositions[index] = m_sourcePositions[last];
+    m_sourceGains[index] = m_sourceGains[last];
+    m_sourcePriorities[index] = m_sourcePriorities[last];
+    m_sourceReferenceDistances[index] = m_sourceReferenceDistances[last];
+    m_sourceRolloffFactors[index] = m_sourceRolloffFactors[last];
+  }
+
+  m_sources.pop_back();
+  m_sourceModes.pop_back();
+  m_sourcePositions.pop_back();
+  m_sourceGains.pop_back();
+  m_sourcePriorities.pop_back();
+  m_sourceReferenceDistances.pop_back();
+  m_sourceRolloffFactors.pop_back();
+}
+
+uint AudioContext::allocateVoice()
+{
+  if (!m_freeVoiceIDs.empty())
+  {
+    const uint sourceID = m_freeVoiceIDs.back();
+    m_freeVoiceIDs.pop_back();
+    return sourceID;
+  }
+
+  if (m_voiceIDs.size() >= m_maxVoiceCount)
+    return 0;
+
+  const uint sourceID = m_device->createVoice();
+  if (!sourceID)
+  {
+    logWarning("Audio device ran out of voices at %u voices",
+               uint(m_voiceIDs.size()));
+
+    m_maxVoiceCount = uint(m_voiceIDs.size());
+    return 0;
+  }
+
+  m_voiceIDs.push_back(sourceID);
+  return sourceID;
+}
+
 } /*namespace nori*/
 
@@ -40,6 +40,8 @@ Canvas::Canvas(Layer& layer, Widget* parent):
 
 void Canvas::draw() const
 {
+  layer().drawer().flush();
+
   m_drawn(*this);
 
   Widget::draw();
@@ -112,6 +112,10 @@ void Interface::update()
     updateCountItem(ITEM_LINES, "lines / f", frame.lineCount);
     updateCountItem(ITEM_TRIANGLES, "triangles / f", frame.triangleCount);
 
+    labels[ITEM_BATCHES]->setText(format("%u ops in %u batches / f",
+                                         frame.batchedOperationCount,
+                                         frame.batchCount));
+
     updateCountItem(ITEM_PROGRAMS, "programs", stats->programCount());
     updateCountSizeItem(ITEM_TEXTURES,
                         "textures",
@@ -125,12 +129,18 @@ void Interface::update()
                         "IBs",
                         stats->indexBufferCount(),
                         stats->totalIndexBufferSize());
+
+    labels[ITEM_GLYPHS]->setText(format("%u glyph pages (%u%%)",
+                                        stats->glyphAtlasPageCount(),
+                                        uint(stats->glyphAtlasOccupancy() * 100.f)));
   }
   else
   {
     for (size_t i = 0;  i < ITEM_COUNT;  i++)
       labels[i]->setText("No stats available");
   }
+
+  Layer::update();
 }
 
 void Interface::draw()
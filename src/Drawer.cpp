@@ -27,6 +27,8 @@
 
 #include <nori/Core.hpp>
 #include <nori/Bimap.hpp>
+#include <nori/Time.hpp>
+#include <nori/Profile.hpp>
 
 #include <nori/Drawer.hpp>
 
@@ -40,22 +42,20 @@ namespace
 
 Bimap<std::string, WidgetState> widgetStateMap;
 
-class ElementVertex
-{
-public:
-  inline void set(vec2 newSizeScale, vec2 newOffsetScale, vec2 newTexScale)
-  {
-    sizeScale = newSizeScale;
-    offsetScale = newOffsetScale;
-    texScale = newTexScale;
-  }
-  vec2 sizeScale;
-  vec2 offsetScale;
-  vec2 texScale;
-  static VertexFormat format;
-};
-
-VertexFormat ElementVertex::format("2f:vSizeScale 2f:vOffsetScale 2f:vTexScale");
+// Layout of the corners of the nine-slice grid of a UI element, per axis
+//
+// There are three kinds of scaling factors:
+//  * The size scale, which when multiplied by the screen space size
+//    of the element places vertices in the closest corner
+//  * The offset scale, which when multiplied by the texture space size of
+//    the element pulls the vertices defining its inner edges towards the
+//    center of the element
+//  * The texture coordinate scale, which when multiplied by the texture
+//    space size of the element becomes the relative texture coordinate
+//    of that vertex
+const float elementSizeScale[] = { 0.f, 0.f, 1.f, 1.f };
+const float elementOffsetScale[] = { 0.f, 0.5f, -0.5f, 0.f };
+const float elementTexScale[] = { 0.f, 0.5f, 0.5f, 1.f };
 
 const uint THEME_XML_VERSION = 3;
 
@@ -207,13 +207,67 @@ void Drawer::begin()
   m_context.setScissorArea(Recti(0, 0, width, height));
 
   m_state->setOrthoProjectionMatrix(float(width), float(height));
+
+  m_complete = true;
 }
 
 void Drawer::end()
 {
+  flush();
+
   m_context.setSharedProgramState(nullptr);
 }
 
+void Drawer::flush()
+{
+  if (m_vertices.empty())
+    return;
+
+  ProfileNodeCall call("Drawer::flush");
+
+  VertexRange range = m_context.allocateVertices(uint(m_vertices.size()),
+                                                 Vertex4fc2ft2fv::format);
+  if (range.isEmpty())
+  {
+    logError("Failed to allocate vertices for UI drawing");
+    m_vertices.clear();
+    m_batchOperationCount = 0;
+    return;
+  }
+
+  range.copyFrom(m_vertices.data());
+
+  switch (m_batchMode)
+  {
+    case BATCH_SOLID:
+      m_drawPass.apply();
+      break;
+    case BATCH_MAPPED:
+      m_blitPass.setUniformTexture(m_blitImageIndex, m_batchTexture);
+      m_blitPass.apply();
+      break;
+    case BATCH_PREMULTIPLIED:
+      m_premultipliedPass.setUniformTexture(m_blitImageIndex, m_batchTexture);
+      m_premultipliedPass.apply();
+      break;
+    case BATCH_ELEMENT:
+      m_elementPass.apply();
+      break;
+    case BATCH_TEXT:
+      m_textPass.setUniformTexture(m_textGlyphsIndex, m_batchTexture);
+      m_textPass.apply();
+      break;
+  }
+
+  m_context.render(PrimitiveRange(m_batchType, range));
+
+  if (RenderStats* stats = m_context.stats())
+    stats->addBatch(m_batchOperationCount);
+
+  m_vertices.clear();
+  m_batchOperationCount = 0;
+}
+
 bool Drawer::pushClipArea(const Rect& area)
 {
   return m_clipAreaStack.push(area);
@@ -226,31 +280,25 @@ void Drawer::popClipArea()
 
 void Drawer::drawPoint(vec2 point, vec4 color)
 {
-  Vertex2fv vertex;
-  vertex.position = point;
-
-  VertexRange range = m_context.allocateVertices(1, Vertex2fv::format);
-  if (range.isEmpty())
+  vec2 end = point;
+  if (!clipLine(point, end))
     return;
 
-  range.copyFrom(&vertex);
-  setDrawingState(color, true);
-  m_context.render(PrimitiveRange(POINT_LIST, range));
+  Vertex4fc2ft2fv* vertices = addToBatch(POINT_LIST, BATCH_SOLID, nullptr, 1);
+  vertices[0].color = color;
+  vertices[0].position = point;
 }
 
 void Drawer::drawLine(vec2 start, vec2 end, vec4 color)
 {
-  Vertex2fv vertices[2];
-  vertices[0].position = start;
-  vertices[1].position = end;
-
-  VertexRange range = m_context.allocateVertices(2, Vertex2fv::format);
-  if (range.isEmpty())
+  if (!clipLine(start, end))
     return;
 
-  range.copyFrom(vertices);
-  setDrawingState(color, true);
-  m_context.render(PrimitiveRange(LINE_LIST, range));
+  Vertex4fc2ft2fv* vertices = addToBatch(LINE_LIST, BATCH_SOLID, nullptr, 2);
+  vertices[0].color = color;
+  vertices[0].position = start;
+  vertices[1].color = color;
+  vertices[1].position = end;
 }
 
 void Drawer::drawRect(const Rect& rect, vec4 color)
@@ -261,19 +309,16 @@ void Drawer::drawRect(const Rect& rect, vec4 color)
   if (maxX - minX < 1.f || maxY - minY < 1.f)
     return;
 
-  Vertex2fv vertices[4];
-  vertices[0].position = vec2(minX, minY);
-  vertices[1].position = vec2(maxX, minY);
-  vertices[2].position = vec2(maxX, maxY);
-  vertices[3].position = vec2(minX, maxY);
-
-  VertexRange range = m_context.allocateVertices(4, Vertex2fv::format);
-  if (range.isEmpty())
-    return;
-
-  range.copyFrom(vertices);
-  setDrawingState(color, true);
-  m_context.render(PrimitiveRange(LINE_LOOP, range));
+  const vec2 corners[] =
+  {
+    vec2(minX, minY),
+    vec2(maxX, minY),
+    vec2(maxX, maxY),
+    vec2(minX, maxY)
+  };
+
+  for (uint i = 0;  i < 4;  i++)
+    drawLine(corners[i], corners[(i + 1) % 4], color);
 }
 
 void Drawer::fillRect(const Rect& rect, vec4 color)
@@ -284,19 +329,10 @@ void Drawer::fillRect(const Rect& rect, vec4 color)
   if (maxX - minX < 1.f || maxY - minY < 1.f)
     return;
 
-  Vertex2fv vertices[4];
-  vertices[0].position = vec2(minX, minY);
-  vertices[1].position = vec2(maxX, minY);
-  vertices[2].position = vec2(maxX, maxY);
-  vertices[3].position = vec2(minX, maxY);
-
-  VertexRange range = m_context.allocateVertices(4, Vertex2fv::format);
-  if (range.isEmpty())
-    return;
-
-  range.copyFrom(vertices);
-  setDrawingState(color, false);
-  m_context.render(PrimitiveRange(TRIANGLE_FAN, range));
+  addQuad(BATCH_SOLID, nullptr,
+          vec2(minX, minY), vec2(maxX, maxY),
+          vec2(0.f), vec2(0.f),
+          color);
 }
 
 void Drawer::blitTexture(const Rect& area, Texture& texture, vec4 color)
@@ -307,32 +343,24 @@ void Drawer::blitTexture(const Rect& area, Texture& texture, vec4 color)
   if (maxX - minX < 1.f || maxY - minY < 1.f)
     return;
 
-  Vertex2ft2fv vertices[4];
-  vertices[0].texcoord = vec2(0.f, 0.f);
-  vertices[0].position = vec2(minX, minY);
-  vertices[1].texcoord = vec2(1.f, 0.f);
-  vertices[1].position = vec2(maxX, minY);
-  vertices[2].texcoord = vec2(1.f, 1.f);
-  vertices[2].position = vec2(maxX, maxY);
-  vertices[3].texcoord = vec2(0.f, 1.f);
-  vertices[3].position = vec2(minX, maxY);
-
-  VertexRange range = m_context.allocateVertices(4, Vertex2ft2fv::format);
-  if (range.isEmpty())
-    return;
-
-  range.copyFrom(vertices);
+  addQuad(BATCH_MAPPED, &texture,
+          vec2(minX, minY), vec2(maxX, maxY),
+          vec2(0.f), vec2(1.f),
+          color);
+}
 
-  if (color.a < 1.f || texture.format().semantic() == PixelFormat::RGBA)
-    m_blitPass.setBlendFactors(BLEND_SRC_ALPHA, BLEND_ONE_MINUS_SRC_ALPHA);
-  else
-    m_blitPass.setBlendFactors(BLEND_ONE, BLEND_ZERO);
+void Drawer::blitPremultipliedTexture(const Rect& area, Texture& texture)
+{
+  float minX, minY, maxX, maxY;
+  area.bounds(minX, minY, maxX, maxY);
 
-  m_blitPass.setUniformState("color", color);
-  m_blitPass.setUniformTexture("image", &texture);
-  m_blitPass.apply();
+  if (maxX - minX < 1.f || maxY - minY < 1.f)
+    return;
 
-  m_context.render(PrimitiveRange(TRIANGLE_FAN, range));
+  addQuad(BATCH_PREMULTIPLIED, &texture,
+          vec2(minX, minY), vec2(maxX, maxY),
+          vec2(0.f), vec2(1.f),
+          vec4(1.f));
 }
 
 void Drawer::drawText(const Rect& area,
@@ -375,7 +403,20 @@ void Drawer::drawText(const Rect& area,
       panic("Invalid vertical alignment");
   }
 
-  m_font->drawText(pen, vec4(color, 1.f), text);
+  if (!m_font->realizeText(pen, text, m_quads))
+    m_complete = false;
+
+  GlyphAtlas& atlas = m_context.glyphAtlas();
+
+  // The first and third vertices of each glyph quad are its minimum and
+  // maximum corners
+  for (const Font::Quad& quad : m_quads)
+  {
+    addQuad(BATCH_TEXT, &atlas.pageTexture(quad.page),
+            quad.vertices[0].position, quad.vertices[2].position,
+            quad.vertices[0].texcoord, quad.vertices[2].texcoord,
+            vec4(color, 1.f));
+  }
 }
 
 void Drawer::drawText(const Rect& area,
@@ -462,7 +503,11 @@ std::unique_ptr<Drawer> Drawer::create(RenderContext& context)
 }
 
 Drawer::Drawer(RenderContext& context):
-  m_context(context)
+  m_context(context),
+  m_batchType(TRIANGLE_LIST),
+  m_batchMode(BATCH_SOLID),
+  m_batchOperationCount(0),
+  m_complete(true)
 {
 }
 
@@ -470,79 +515,6 @@ bool Drawer::init()
 {
   m_state = new SharedProgramState();
 
-  // Set up element geometry
-  {
-    m_vertexBuffer = VertexBuffer::create(m_context, 16, ElementVertex::format, USAGE_STATIC);
-    if (!m_vertexBuffer)
-      return false;
-
-    ElementVertex vertices[16];
-
-    // These are scaling factors used when rendering UI widget elements
-    //
-    // There are three kinds:
-    //  * The size scale, which when multiplied by the screen space size
-    //    of the element places vertices in the closest corner
-    //  * The offset scale, which when multiplied by the texture space size of
-    //    the element pulls the vertices defining its inner edges towards the
-    //    center of the element
-    //  * The texture coordinate scale, which when multiplied by the texture
-    //    space size of the element becomes the relative texture coordinate
-    //    of that vertex
-    //
-    // This allows rendering of UI elements by changing only four uniforms: the
-    // position and size of the element in screen and texture space.
-
-    vertices[0x0].set(vec2(0.f, 0.f), vec2(  0.f,   0.f), vec2( 0.f,  0.f));
-    vertices[0x1].set(vec2(0.f, 0.f), vec2( 0.5f,   0.f), vec2(0.5f,  0.f));
-    vertices[0x2].set(vec2(1.f, 0.f), vec2(-0.5f,   0.f), vec2(0.5f,  0.f));
-    vertices[0x3].set(vec2(1.f, 0.f), vec2(  0.f,   0.f), vec2( 1.f,  0.f));
-
-    vertices[0x4].set(vec2(0.f, 0.f), vec2(  0.f,  0.5f), vec2( 0.f, 0.5f));
-    vertices[0x5].set(vec2(0.f, 0.f), vec2( 0.5f,  0.5f), vec2(0.5f, 0.5f));
-    vertices[0x6].set(vec2(1.f, 0.f), vec2(-0.5f,  0.5f), vec2(0.5f, 0.5f));
-    vertices[0x7].set(vec2(1.f, 0.f), vec2(  0.f,  0.5f), vec2( 1.f, 0.5f));
-
-    vertices[0x8].set(vec2(0.f, 1.f), vec2(  0.f, -0.5f), vec2( 0.f, 0.5f));
-    vertices[0x9].set(vec2(0.f, 1.f), vec2( 0.5f, -0.5f), vec2(0.5f, 0.5f));
-    vertices[0xa].set(vec2(1.f, 1.f), vec2(-0.5f, -0.5f), vec2(0.5f, 0.5f));
-    vertices[0xb].set(vec2(1.f, 1.f), vec2(  0.f, -0.5f), vec2( 1.f, 0.5f));
-
-    vertices[0xc].set(vec2(0.f, 1.f), vec2(  0.f,   0.f), vec2( 0.f,  1.f));
-    vertices[0xd].set(vec2(0.f, 1.f), vec2( 0.5f,   0.f), vec2(0.5f,  1.f));
-    vertices[0xe].set(vec2(1.f, 1.f), vec2(-0.5f,   0.f), vec2(0.5f,  1.f));
-    vertices[0xf].set(vec2(1.f, 1.f), vec2(  0.f,   0.f), vec2( 1.f,  1.f));
-
-    m_vertexBuffer->copyFrom(vertices, 16);
-
-    m_indexBuffer = IndexBuffer::create(m_context, 54, INDEX_UINT8, USAGE_STATIC);
-    if (!m_indexBuffer)
-      return false;
-
-    uint8 indices[54];
-    size_t index = 0;
-
-    // This is a perfectly normal indexed triangle list using the vertices above
-
-    for (int y = 0;  y < 3;  y++)
-    {
-      for (int x = 0;  x < 3;  x++)
-      {
-        indices[index++] = x + y * 4;
-        indices[index++] = (x + 1) + (y + 1) * 4;
-        indices[index++] = x + (y + 1) * 4;
-
-        indices[index++] = x + y * 4;
-        indices[index++] = (x + 1) + y * 4;
-        indices[index++] = (x + 1) + (y + 1) * 4;
-      }
-    }
-
-    m_indexBuffer->copyFrom(indices, 54);
-
-    m_range = PrimitiveRange(TRIANGLE_LIST, *m_vertexBuffer, *m_indexBuffer);
-  }
-
   // Load default theme
   {
     const std::string themeName("nori/UIDefault.theme");
@@ -557,7 +529,7 @@ bool Drawer::init()
     m_font = m_theme->m_font;
   }
 
-  // Set up solid pass
+  // Set up element pass
   {
     Ref<Program> program = Program::read(m_context,
                                          "nori/UIElement.vs",
@@ -569,12 +541,8 @@ bool Drawer::init()
     }
 
     ProgramInterface interface;
-    interface.addUniform("elementPos", UNIFORM_VEC2);
-    interface.addUniform("elementSize", UNIFORM_VEC2);
-    interface.addUniform("texPos", UNIFORM_VEC2);
-    interface.addUniform("texSize", UNIFORM_VEC2);
     interface.addUniform("image", UNIFORM_SAMPLER_RECT);
-    interface.addAttributes(ElementVertex::format);
+    interface.addAttributes(Vertex4fc2ft2fv::format);
 
     if (!interface.matches(*program, true))
     {
@@ -584,16 +552,12 @@ bool Drawer::init()
     }
 
     m_elementPass.setProgram(program);
+    m_elementPass.setCullFace(FACE_NONE);
     m_elementPass.setDepthTesting(false);
     m_elementPass.setDepthWriting(false);
     m_elementPass.setUniformTexture("image", m_theme->m_texture);
     m_elementPass.setBlendFactors(BLEND_SRC_ALPHA, BLEND_ONE_MINUS_SRC_ALPHA);
     m_elementPass.setMultisampling(false);
-
-    m_elementPosIndex = m_elementPass.uniformStateIndex("elementPos");
-    m_elementSizeIndex = m_elementPass.uniformStateIndex("elementSize");
-    m_texPosIndex = m_elementPass.uniformStateIndex("texPos");
-    m_texSizeIndex = m_elementPass.uniformStateIndex("texSize");
   }
 
   // Set up solid pass
@@ -608,8 +572,8 @@ bool Drawer::init()
     }
 
     ProgramInterface interface;
-    interface.addUniform("color", UNIFORM_VEC4);
-    interface.addAttributes(Vertex2fv::format);
+    interface.addAttribute("vColor", ATTRIBUTE_VEC4);
+    interface.addAttribute("vPosition", ATTRIBUTE_VEC2);
 
     if (!interface.matches(*program, true))
     {
@@ -622,6 +586,7 @@ bool Drawer::init()
     m_drawPass.setCullFace(FACE_NONE);
     m_drawPass.setDepthTesting(false);
     m_drawPass.setDepthWriting(false);
+    m_drawPass.setBlendFactors(BLEND_SRC_ALPHA, BLEND_ONE_MINUS_SRC_ALPHA);
     m_drawPass.setMultisampling(false);
   }
 
@@ -638,8 +603,7 @@ bool Drawer::init()
 
     ProgramInterface interface;
     interface.addUniform("image", UNIFORM_SAMPLER_2D);
-    interface.addUniform("color", UNIFORM_VEC4);
-    interface.addAttributes(Vertex2ft2fv::format);
+    interface.addAttributes(Vertex4fc2ft2fv::format);
 
     if (!interface.matches(*program, true))
     {
@@ -652,7 +616,45 @@ bool Drawer::init()
     m_blitPass.setCullFace(FACE_NONE);
     m_blitPass.setDepthTesting(false);
     m_blitPass.setDepthWriting(false);
+    m_blitPass.setBlendFactors(BLEND_SRC_ALPHA, BLEND_ONE_MINUS_SRC_ALPHA);
     m_blitPass.setMultisampling(false);
+
+    m_blitImageIndex = m_blitPass.uniformStateIndex("image");
+
+    m_premultipliedPass = m_blitPass;
+    m_premultipliedPass.setBlendFactors(BLEND_ONE, BLEND_ONE_MINUS_SRC_ALPHA);
+  }
+
+  // Set up text pass
+  {
+    Ref<Program> program = Program::read(m_context,
+                                         "nori/UIDrawText.vs",
+                                         "nori/UIDrawText.fs");
+    if (!program)
+    {
+      logError("Failed to load UI text shader program");
+      return false;
+    }
+
+    ProgramInterface interface;
+    interface.addUniform("glyphs", UNIFORM_SAMPLER_RECT);
+    interface.addAttributes(Vertex4fc2ft2fv::format);
+
+    if (!interface.matches(*program, true))
+    {
+      logError("UI text shader program %s does not conform to the required interface",
+               program->name().c_str());
+      return false;
+    }
+
+    m_textPass.setProgram(program);
+    m_textPass.setCullFace(FACE_NONE);
+    m_textPass.setDepthTesting(false);
+    m_textPass.setDepthWriting(false);
+    m_textPass.setBlendFactors(BLEND_SRC_ALPHA, BLEND_ONE_MINUS_SRC_ALPHA);
+    m_textPass.setMultisampling(false);
+
+    m_textGlyphsIndex = m_textPass.uniformStateIndex("glyphs");
   }
 
   return true;
@@ -660,27 +662,136 @@ bool Drawer::init()
 
 void Drawer::drawElement(const Rect& area, const Rect& mapping)
 {
-  m_elementPass.setUniformState(m_elementPosIndex, area.position);
-  m_elementPass.setUniformState(m_elementSizeIndex, area.size);
-  m_elementPass.setUniformState(m_texPosIndex, mapping.position);
-  m_elementPass.setUniformState(m_texSizeIndex, mapping.size);
-  m_elementPass.apply();
+  vec2 positions[4];
+  vec2 texcoords[4];
+
+  for (uint i = 0;  i < 4;  i++)
+  {
+    positions[i] = area.position +
+                   area.size * vec2(elementSizeScale[i]) +
+                   mapping.size * vec2(elementOffsetScale[i]);
+    texcoords[i] = mapping.position + mapping.size * vec2(elementTexScale[i]);
+  }
 
-  m_context.render(m_range);
+  for (uint y = 0;  y < 3;  y++)
+  {
+    for (uint x = 0;  x < 3;  x++)
+    {
+      addQuad(BATCH_ELEMENT, m_theme->m_texture,
+              vec2(positions[x].x, positions[y].y),
+              vec2(positions[x + 1].x, positions[y + 1].y),
+              vec2(texcoords[x].x, texcoords[y].y),
+              vec2(texcoords[x + 1].x, texcoords[y + 1].y),
+              vec4(1.f));
+    }
+  }
 }
 
-void Drawer::setDrawingState(vec4 color, bool wireframe)
+Vertex4fc2ft2fv* Drawer::addToBatch(PrimitiveType type,
+                                    BatchMode mode,
+                                    Texture* texture,
+                                    uint count)
 {
-  m_drawPass.setUniformState("color", color);
+  if (type != m_batchType || mode != m_batchMode || texture != m_batchTexture)
+  {
+    flush();
 
-  if (color.a == 1.f)
-    m_drawPass.setBlendFactors(BLEND_ONE, BLEND_ZERO);
-  else
-    m_drawPass.setBlendFactors(BLEND_SRC_ALPHA, BLEND_ONE_MINUS_SRC_ALPHA);
+    m_batchType = type;
+    m_batchMode = mode;
+    m_batchTexture = texture;
+  }
+
+  m_batchOperationCount++;
 
-  m_drawPass.setWireframe(wireframe);
-  m_drawPass.apply();
+  const size_t start = m_vertices.size();
+  m_vertices.resize(start + count);
+  return &m_vertices[start];
 }
 
-} /*namespace nori*/
+void Drawer::addQuad(BatchMode mode,
+                     Texture* texture,
+                     vec2 minPosition,
+                     vec2 maxPosition,
+                     vec2 minTexcoord,
+                     vec2 maxTexcoord,
+                     vec4 color)
+{
+  if (!m_clipAreaStack.isEmpty())
+  {
+    float minX, minY, maxX, maxY;
+    m_clipAreaStack.total().bounds(minX, minY, maxX, maxY);
+
+    const vec2 minClipped = max(minPosition, vec2(minX, minY));
+    const vec2 maxClipped = min(maxPosition, vec2(maxX, maxY));
+
+    if (minClipped.x >= maxClipped.x || minClipped.y >= maxClipped.y)
+      return;
+
+    // Texture coordinates are linear across the quad, so they can be clipped
+    // along with the positions
+    const vec2 scale = (maxTexcoord - minTexcoord) / (maxPosition - minPosition);
+
+    minTexcoord += (minClipped - minPosition) * scale;
+    maxTexcoord -= (maxPosition - maxClipped) * scale;
+    minPosition = minClipped;
+    maxPosition = maxClipped;
+  }
+
+  Vertex4fc2ft2fv* vertices = addToBatch(TRIANGLE_LIST, mode, texture, 6);
+  vertices[0].texcoord = minTexcoord;
+  vertices[0].position = minPosition;
+  vertices[1].texcoord = vec2(maxTexcoord.x, minTexcoord.y);
+  vertices[1].position = vec2(maxPosition.x, minPosition.y);
+  vertices[2].texcoord = maxTexcoord;
+  vertices[2].position = maxPosition;
+  vertices[3] = vertices[2];
+  vertices[4].texcoord = vec2(minTexcoord.x, maxTexcoord.y);
+  vertices[4].position = vec2(minPosition.x, maxPosition.y);
+  vertices[5] = vertices[0];
+
+  for (uint i = 0;  i < 6;  i++)
+    vertices[i].color = color;
+}
+
+bool Drawer::clipLine(vec2& start, vec2& end) const
+{
+  if (m_clipAreaStack.isEmpty())
+    return true;
 
+  float minX, minY, maxX, maxY;
+  m_clipAreaStack.total().bounds(minX, minY, maxX, maxY);
+
+  // Liang-Barsky clipping against each edge of the clipping area
+  const vec2 delta = end - start;
+  const float p[] = { -delta.x, delta.x, -delta.y, delta.y };
+  const float q[] = { start.x - minX, maxX - start.x, start.y - minY, maxY - start.y };
+
+  float first = 0.f, last = 1.f;
+
+  for (uint i = 0;  i < 4;  i++)
+  {
+    if (p[i] == 0.f)
+    {
+      if (q[i] < 0.f)
+        return false;
+    }
+    else
+    {
+      const float t = q[i] / p[i];
+
+      if (p[i] < 0.f)
+        first = max(first, t);
+      else
+        last = min(last, t);
+
+      if (first > last)
+        return false;
+    }
+  }
+
+  end = start + delta * last;
+  start = start + delta * first;
+  return true;
+}
+
+} /*namespace nori*/
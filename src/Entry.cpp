@@ -35,7 +35,8 @@ namespace nori
 
 Entry::Entry(Layer& layer, Widget* parent, const std::string& text):
   Widget(layer, parent),
-  m_controller(text)
+  m_controller(text),
+  m_caretVisible(false)
 {
   Font& font = layer.drawer().theme().font();
   const float em = font.height();
@@ -50,6 +51,7 @@ Entry::Entry(Layer& layer, Widget* parent, const std::string& text):
 
   m_controller.textChanged().connect(*this, &Entry::onTextChanged);
   m_controller.caretMoved().connect(*this, &Entry::onCaretMoved);
+  layer.window().updated().connect(*this, &Entry::onWindowUpdated);
 
   m_timer.start();
   setFocusable(true);
@@ -84,7 +86,7 @@ void Entry::draw() const
     drawer.setFont(nullptr);
     drawer.drawText(textArea, text.c_str(), LEFT_ALIGNED, state());
 
-    if (isActive() && floor(fmod(m_timer.time(), 2.0)) == 0.0)
+    if (isActive())
     {
       const Rect bounds = font.boundsOf(text.c_str(), 0, m_controller.caretPosition());
       const float position = bounds.size.x;
@@ -94,7 +96,11 @@ void Entry::draw() const
       const vec2 end = vec2(textArea.position.x + position,
                             textArea.position.y + textArea.size.y);
 
-      drawer.drawLine(start, end, vec4(drawer.theme().caretColor(state()), 1.f));
+      m_caretArea = Rect(start - vec2(1.f), end - start + vec2(2.f));
+      m_caretVisible = floor(fmod(m_timer.time(), 2.0)) == 0.0;
+
+      if (m_caretVisible)
+        drawer.drawLine(start, end, vec4(drawer.theme().caretColor(state()), 1.f));
     }
 
     Widget::draw();
@@ -102,6 +108,20 @@ void Entry::draw() const
   }
 }
 
+void Entry::onWindowUpdated()
+{
+  if (!isActive())
+    return;
+
+  const Time time = m_timer.time();
+
+  // Only the caret needs redrawing for it to blink, and only when it does
+  if ((floor(fmod(time, 2.0)) == 0.0) != m_caretVisible)
+    layer().invalidate(m_caretArea);
+
+  layer().window().invalidate(floor(time) + 1.0 - time);
+}
+
 void Entry::onFocusChanged(bool activated)
 {
   if (activated)
@@ -128,6 +128,17 @@ float Face::height(int index, float scale) const
   return float(bottom - top + 1);
 }
 
+vec2 Face::glyphSize(int index, float scale) const
+{
+  if (stbtt_IsGlyphEmpty(m_info, index))
+    return vec2(0.f);
+
+  int left, top, right, bottom;
+  stbtt_GetGlyphBitmapBox(m_info, index, scale, scale,
+                          &left, &top, &right, &bottom);
+  return vec2(right - left, bottom - top);
+}
+
 Ref<Image> Face::glyph(int index, float scale) const
 {
   if (stbtt_IsGlyphEmpty(m_info, index))
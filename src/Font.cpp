@@ -37,6 +37,8 @@
 
 #include <utf8.h>
 
+#include <algorithm>
+
 namespace nori
 {
 
@@ -49,54 +51,26 @@ const uint FONT_XML_VERSION = 2;
 
 void Font::drawText(vec2 pen, vec4 color, const char* text)
 {
-  uint vertexCount = 0;
+  GlyphAtlas& atlas = m_context.glyphAtlas();
 
-  // Realize vertices for glyphs
-  {
-    const size_t length = std::strlen(text);
-    m_vertices.resize(length * 6);
+  realizeText(pen, text, m_quads);
 
-    for (const char* c = text;  *c != '\0'; )
-    {
-      const uint32 codepoint = utf8::next<const char*>(c, text + length);
-      const Glyph* glyph = findGlyph(codepoint);
-      if (!glyph)
-      {
-        glyph = findGlyph(0xfffd);
-        if (!glyph)
-          continue;
-      }
+  if (m_quads.empty())
+    return;
 
-      pen = round(pen);
+  // Group quads by atlas page so each page needs only a single draw
+  std::stable_sort(m_quads.begin(), m_quads.end());
 
-      if (all(greaterThan(glyph->size, vec2(0.f))))
-      {
-        const Rect pa(pen + glyph->bearing - vec2(0.5f), glyph->size);
-        const Rect ta(glyph->offset + vec2(0.5f), glyph->size);
-
-        m_vertices[vertexCount + 0].texcoord = ta.position;
-        m_vertices[vertexCount + 0].position = pa.position;
-        m_vertices[vertexCount + 1].texcoord = ta.position + vec2(ta.size.x, 0.f);
-        m_vertices[vertexCount + 1].position = pa.position + vec2(pa.size.x, 0.f);
-        m_vertices[vertexCount + 2].texcoord = ta.position + ta.size;
-        m_vertices[vertexCount + 2].position = pa.position + pa.size;
-
-        m_vertices[vertexCount + 3] = m_vertices[vertexCount + 2];
-        m_vertices[vertexCount + 4].texcoord = ta.position + vec2(0.f, ta.size.y);
-        m_vertices[vertexCount + 4].position = pa.position + vec2(0.f, pa.size.y);
-        m_vertices[vertexCount + 5] = m_vertices[vertexCount + 0];
-
-        vertexCount += 6;
-      }
+  m_vertices.resize(m_quads.size() * 6);
 
-      pen += vec2(glyph->advance, 0.f);
-    }
+  for (size_t i = 0;  i < m_quads.size();  i++)
+  {
+    std::copy(m_quads[i].vertices,
+              m_quads[i].vertices + 6,
+              m_vertices.begin() + i * 6);
   }
 
-  if (!vertexCount)
-    return;
-
-  VertexRange range = m_context.allocateVertices(vertexCount,
+  VertexRange range = m_context.allocateVertices(uint(m_vertices.size()),
                                                  Vertex2ft2fv::format);
   if (range.isEmpty())
   {
@@ -107,9 +81,85 @@ void Font::drawText(vec2 pen, vec4 color, const char* text)
   range.copyFrom(m_vertices.data());
 
   m_pass.setUniformState(m_colorIndex, color);
-  m_pass.apply();
 
-  m_context.render(PrimitiveRange(TRIANGLE_LIST, range));
+  for (size_t first = 0;  first < m_quads.size(); )
+  {
+    const uint page = m_quads[first].page;
+
+    size_t last = first + 1;
+    while (last < m_quads.size() && m_quads[last].page == page)
+      last++;
+
+    m_pass.setUniformTexture(m_glyphsIndex, &atlas.pageTexture(page));
+    m_pass.apply();
+
+    m_context.render(PrimitiveRange(TRIANGLE_LIST,
+                                    *range.vertexBuffer(),
+                                    range.start() + first * 6,
+                                    (last - first) * 6));
+
+    first = last;
+  }
+}
+
+bool Font::realizeText(vec2 pen, const char* text, std::vector<Quad>& quads)
+{
+  GlyphAtlas& atlas = m_context.glyphAtlas();
+
+  const size_t length = std::strlen(text);
+  bool complete = true;
+
+  quads.clear();
+
+  for (const char* c = text;  *c != '\0'; )
+  {
+    const uint32 codepoint = utf8::next<const char*>(c, text + length);
+    Glyph* glyph = findGlyph(codepoint);
+    if (!glyph)
+    {
+      glyph = findGlyph(0xfffd);
+      if (!glyph)
+        continue;
+    }
+
+    pen = round(pen);
+
+    if (all(greaterThan(glyph->size, vec2(0.f))))
+    {
+      if (!atlas.acquire(*m_face, glyph->index, m_scale, glyph->slot))
+      {
+        complete = false;
+        pen += vec2(glyph->advance, 0.f);
+        continue;
+      }
+
+      const Rect pa(pen + glyph->bearing - vec2(0.5f), glyph->size);
+      const Rect ta(glyph->slot.offset + vec2(0.5f), glyph->size);
+
+      quads.push_back(Quad());
+
+      Quad& quad = quads.back();
+      quad.page = glyph->slot.page;
+
+      Vertex2ft2fv* vertices = quad.vertices;
+
+      vertices[0].texcoord = ta.position;
+      vertices[0].position = pa.position;
+      vertices[1].texcoord = ta.position + vec2(ta.size.x, 0.f);
+      vertices[1].position = pa.position + vec2(pa.size.x, 0.f);
+      vertices[2].texcoord = ta.position + ta.size;
+      vertices[2].position = pa.position + pa.size;
+
+      vertices[3] = vertices[2];
+      vertices[4].texcoord = ta.position + vec2(0.f, ta.size.y);
+      vertices[4].position = pa.position + vec2(0.f, pa.size.y);
+      vertices[5] = vertices[0];
+    }
+
+    pen += vec2(glyph->advance, 0.f);
+  }
+
+  return complete;
 }
 
 Rect Font::boundsOf(const char* text)
@@ -256,10 +306,11 @@ bool Font::init(Face& face, uint height)
   m_ascender  = ceil(face.ascender(m_scale));
   m_descender = ceil(face.descender(m_scale));
 
-  if (uint(m_width) + 1 > m_context.limits().maxTextureSize ||
-      uint(m_height) + 1 > m_context.limits().maxTextureSize)
+  const uint pageSize = m_context.glyphAtlas().pageSize();
+
+  if (uint(m_width) + 2 > pageSize || uint(m_height) + 2 > pageSize)
   {
-    logError("Font %s is too large for texture size limits", name().c_str());
+    logError("Font %s is too large for the glyph atlas", name().c_str());
     return false;
   }
 
@@ -295,17 +346,13 @@ bool Font::init(Face& face, uint height)
     m_pass.setUniformState("color", vec4(1.f));
 
     m_colorIndex = m_pass.uniformStateIndex("color");
+    m_glyphsIndex = m_pass.uniformStateIndex("glyphs");
   }
 
-  m_position = ivec2(1);
-
-  if (!addGlyphTextureRow())
-    return false;
-
   return true;
 }
 
-const Font::Glyph* Font::addGlyph(uint32 codepoint)
+Font::Glyph* Font::addGlyph(uint32 codepoint)
 {
   const int index = m_face->indexForCodePoint(codepoint);
   if (!index)
@@ -315,40 +362,15 @@ const Font::Glyph* Font::addGlyph(uint32 codepoint)
   Glyph& glyph = m_glyphs.back();
 
   glyph.codepoint = codepoint;
+  glyph.index = index;
   glyph.advance = ceil(m_face->advance(index, m_scale));
   glyph.bearing = ceil(m_face->bearing(index, m_scale));
-
-  if (Ref<Image> image = m_face->glyph(index, m_scale))
-  {
-    if (m_position.x + image->width() + 1 > m_texture->width())
-    {
-      m_position.x = 1;
-      m_position.y += int(m_height) + 1;
-
-      if (m_position.y + image->height() + 1 > m_texture->height())
-      {
-        if (!addGlyphTextureRow())
-          return nullptr;
-      }
-    }
-
-    if (!m_texture->copyFrom(0, *image, m_position.x, m_position.y))
-    {
-      logError("Failed to copy glyph image data for font %s",
-                name().c_str());
-      return nullptr;
-    }
-
-    glyph.offset = vec2(m_position);
-    glyph.size = vec2(image->width(), image->height());
-
-    m_position.x += image->width() + 1;
-  }
+  glyph.size = m_face->glyphSize(index, m_scale);
 
   return &glyph;
 }
 
-const Font::Glyph* Font::findGlyph(uint32 codepoint)
+Font::Glyph* Font::findGlyph(uint32 codepoint)
 {
   auto glyph = std::find(m_glyphs.begin(), m_glyphs.end(), codepoint);
   if (glyph == m_glyphs.end())
@@ -357,42 +379,5 @@ const Font::Glyph* Font::findGlyph(uint32 codepoint)
   return &(*glyph);
 }
 
-bool Font::addGlyphTextureRow()
-{
-  Ref<Image> glyphs;
-  uint textureWidth = m_context.limits().maxTextureSize;
-  uint textureHeight = 0;
-
-  if (m_texture)
-  {
-    textureHeight = m_texture->height();
-    glyphs = m_texture->data(0);
-  }
-
-  textureHeight += uint(m_height) + 1;
-
-  if (textureHeight > m_context.limits().maxTextureSize)
-  {
-    logError("Glyph texture for font %s is full", name().c_str());
-    return false;
-  }
-
-  const TextureData data(PixelFormat::L8, textureWidth, textureHeight);
-  const TextureParams params(TEXTURE_RECT, TF_NONE, FILTER_NEAREST, ADDRESS_CLAMP);
-
-  m_texture = Texture::create(cache(), m_context, params, data);
-  if (!m_texture)
-  {
-    logError("Failed to create glyph texture for font %s", name().c_str());
-    return false;
-  }
-
-  if (glyphs)
-    m_texture->copyFrom(0, *glyphs);
-
-  m_pass.setUniformTexture("glyphs", m_texture);
-  return true;
-}
-
 } /*namespace nori*/
 
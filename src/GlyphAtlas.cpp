@@ -0,0 +1,462 @@
+///////////////////////////////////////////////////////////////////////
+// Nori - a simple game engine
+// Copyright (c) 2014 Camilla Berglund <elmindreda@elmindreda.org>
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any
+// damages arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any
+// purpose, including commercial applications, and to alter it and
+// redistribute it freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you
+//     must not claim that you wrote the original software. If you use
+//     this software in a product, an acknowledgment in the product
+//     documentation would be appreciated but is not required.
+//
+//  2. Altered source versions must be plainly marked as such, and
+//     must not be misrepresented as being the original software.
+//
+//  3. This notice may not be removed or altered from any source
+//     distribution.
+//
+///////////////////////////////////////////////////////////////////////
+
+#include <nori/Config.hpp>
+
+#include <nori/Core.hpp>
+#include <nori/Time.hpp>
+#include <nori/Profile.hpp>
+
+#include <nori/Texture.hpp>
+#include <nori/RenderBuffer.hpp>
+#include <nori/Program.hpp>
+#include <nori/RenderContext.hpp>
+
+#include <nori/Path.hpp>
+#include <nori/Resource.hpp>
+#include <nori/Image.hpp>
+#include <nori/Face.hpp>
+#include <nori/GlyphAtlas.hpp>
+
+#include <algorithm>
+#include <climits>
+
+namespace nori
+{
+
+GlyphSlot::GlyphSlot():
+  page(0),
+  generation(0)
+{
+}
+
+GlyphAtlas::~GlyphAtlas()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopping = true;
+  }
+
+  m_condition.notify_all();
+
+  for (std::thread& worker : m_workers)
+    worker.join();
+}
+
+bool GlyphAtlas::acquire(Face& face, int index, float scale, GlyphSlot& slot)
+{
+  if (slot.page < m_pages.size())
+  {
+    Page& page = m_pages[slot.page];
+    if (page.generation == slot.generation)
+    {
+      page.lastUsed = m_frame;
+      return true;
+    }
+  }
+
+  const Key key = { &face, scale, index };
+
+  auto entry = m_entries.find(key);
+  if (entry != m_entries.end())
+  {
+    if (entry->second.pending)
+      return false;
+
+    const GlyphSlot& resident = entry->second.slot;
+    if (resident.page < m_pages.size())
+    {
+      Page& page = m_pages[resident.page];
+      if (page.generation == resident.generation)
+      {
+        page.lastUsed = m_frame;
+        slot = resident;
+        return true;
+      }
+    }
+
+    // The glyph has no image or did not fit in the atlas
+    return false;
+  }
+
+  Entry& created = m_entries[key];
+  created.face = &face;
+  created.pending = true;
+
+  if (m_workers.empty())
+  {
+    ProfileNodeCall call("GlyphAtlas::acquire");
+
+    Ref<Image> image = face.glyph(index, scale);
+    insert(key, created, image);
+    return acquire(face, index, scale, slot);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_requests.push_back(Job());
+    m_requests.back().key = key;
+  }
+
+  m_condition.notify_one();
+  return false;
+}
+
+void GlyphAtlas::update()
+{
+  ProfileNodeCall call("GlyphAtlas::update");
+
+  m_frame++;
+
+  bool added = false;
+
+  // Pages used during the previous frame may now be evicted, so glyphs that
+  // found no room then may fit now
+  std::vector<Key> retries;
+  std::swap(retries, m_retries);
+
+  for (const Key& key : retries)
+  {
+    auto entry = m_entries.find(key);
+    if (entry == m_entries.end() || !entry->second.image)
+      continue;
+
+    Ref<Image> image = entry->second.image;
+    entry->second.image = nullptr;
+
+    if (insert(key, entry->second, image))
+      added = true;
+  }
+
+  if (!m_workers.empty())
+  {
+    std::deque<Job> results;
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      std::swap(results, m_results);
+    }
+
+    for (const Job& job : results)
+    {
+      auto entry = m_entries.find(job.key);
+      if (entry != m_entries.end())
+        insert(job.key, entry->second, job.image);
+    }
+
+    if (!results.empty())
+      added = true;
+  }
+
+  if (added)
+    m_glyphsAdded();
+}
+
+Texture& GlyphAtlas::pageTexture(uint index) const
+{
+  return *m_pages[index].texture;
+}
+
+float GlyphAtlas::occupancy() const
+{
+  if (m_pages.empty())
+    return 0.f;
+
+  size_t usedArea = 0;
+
+  for (const Page& page : m_pages)
+    usedArea += page.usedArea;
+
+  return float(usedArea) / float(m_pages.size() * m_pageSize * m_pageSize);
+}
+
+std::unique_ptr<GlyphAtlas> GlyphAtlas::create(RenderContext& context,
+                                               uint workerCount,
+                                               uint maxPageCount)
+{
+  std::unique_ptr<GlyphAtlas> atlas(new GlyphAtlas(context));
+  if (!atlas->init(workerCount, maxPageCount))
+    return nullptr;
+
+  return atlas;
+}
+
+bool GlyphAtlas::Key::operator < (const Key& other) const
+{
+  if (face != other.face)
+    return face < other.face;
+  if (scale != other.scale)
+    return scale < other.scale;
+
+  return index < other.index;
+}
+
+bool GlyphAtlas::Page::allocate(uint width, uint height, ivec2& position)
+{
+  const int pageWidth = int(texture->width());
+  const int pageHeight = int(texture->height());
+
+  size_t bestIndex = skyline.size();
+  int bestTop = INT_MAX;
+  int bestWidth = INT_MAX;
+
+  // Find the lowest position along the skyline where the rectangle fits,
+  // preferring narrower segments to reduce wasted space
+  for (size_t i = 0;  i < skyline.size();  i++)
+  {
+    const int x = skyline[i].x;
+    if (x + int(width) > pageWidth)
+      break;
+
+    int y = 0;
+    int remaining = int(width);
+
+    for (size_t j = i;  remaining > 0;  j++)
+    {
+      y = max(y, skyline[j].y);
+      remaining -= skyline[j].z;
+    }
+
+    if (y + int(height) > pageHeight)
+      continue;
+
+    if (y + int(height) < bestTop ||
+        (y + int(height) == bestTop && skyline[i].z < bestWidth))
+    {
+      bestIndex = i;
+      bestTop = y + int(height);
+      bestWidth = skyline[i].z;
+      position = ivec2(x, y);
+    }
+  }
+
+  if (bestIndex == skyline.size())
+    return false;
+
+  skyline.insert(skyline.begin() + bestIndex,
+                 ivec3(position.x, bestTop, int(width)));
+
+  // Shrink or remove the segments now covered by the new one
+  for (size_t i = bestIndex + 1;  i < skyline.size();  )
+  {
+    const int end = skyline[i - 1].x + skyline[i - 1].z;
+    if (skyline[i].x >= end)
+      break;
+
+    const int shrink = end - skyline[i].x;
+    if (skyline[i].z > shrink)
+    {
+      skyline[i].x += shrink;
+      skyline[i].z -= shrink;
+      break;
+    }
+
+    skyline.erase(skyline.begin() + i);
+  }
+
+  // Merge adjacent segments of equal height
+  for (size_t i = 0;  i + 1 < skyline.size();  )
+  {
+    if (skyline[i].y == skyline[i + 1].y)
+    {
+      skyline[i].z += skyline[i + 1].z;
+      skyline.erase(skyline.begin() + i + 1);
+    }
+    else
+      i++;
+  }
+
+  usedArea += width * height;
+  return true;
+}
+
+GlyphAtlas::GlyphAtlas(RenderContext& context):
+  m_context(context),
+  m_pageSize(0),
+  m_maxPageCount(0),
+  m_frame(0),
+  m_evictionCount(0),
+  m_stopping(false)
+{
+}
+
+bool GlyphAtlas::init(uint workerCount, uint maxPageCount)
+{
+  m_pageSize = min(1024u, m_context.limits().maxTextureRectangleSize);
+  m_maxPageCount = max(maxPageCount, 1u);
+
+  for (uint i = 0;  i < workerCount;  i++)
+    m_workers.push_back(std::thread(&GlyphAtlas::work, this));
+
+  return true;
+}
+
+bool GlyphAtlas::insert(const Key& key, Entry& entry, Image* image)
+{
+  entry.pending = false;
+
+  if (!image)
+    return false;
+
+  // Leave a one texel gap to the right of and below each glyph image
+  const uint width = image->width() + 1;
+  const uint height = image->height() + 1;
+
+  if (width + 1 > m_pageSize || height + 1 > m_pageSize)
+  {
+    logError("Glyph image is too large for glyph atlas");
+    return false;
+  }
+
+  Page* page = nullptr;
+  ivec2 position;
+
+  for (Page& p : m_pages)
+  {
+    if (p.allocate(width, height, position))
+    {
+      page = &p;
+      break;
+    }
+  }
+
+  if (!page)
+  {
+    if (m_pages.size() < m_maxPageCount)
+      page = addPage();
+    else
+      page = evictPage();
+
+    // Keep the image for another attempt during the next update
+    if (!page || !page->allocate(width, height, position))
+    {
+      entry.image = image;
+      m_retries.push_back(key);
+      return false;
+    }
+  }
+
+  if (!page->texture->copyFrom(0, *image, position.x, position.y))
+  {
+    logError("Failed to copy glyph image data to glyph atlas");
+    return false;
+  }
+
+  page->keys.push_back(key);
+  page->lastUsed = m_frame;
+
+  entry.slot.page = uint(page - m_pages.data());
+  entry.slot.generation = page->generation;
+  entry.slot.offset = vec2(position);
+  return true;
+}
+
+GlyphAtlas::Page* GlyphAtlas::addPage()
+{
+  const TextureData data(PixelFormat::L8, m_pageSize, m_pageSize);
+  const TextureParams params(TEXTURE_RECT, TF_NONE, FILTER_NEAREST, ADDRESS_CLAMP);
+
+  Ref<Texture> texture = Texture::create(ResourceInfo(m_context.cache()),
+                                         m_context, params, data);
+  if (!texture)
+  {
+    logError("Failed to create glyph atlas page texture");
+    return nullptr;
+  }
+
+  m_pages.push_back(Page());
+
+  Page& page = m_pages.back();
+  page.texture = texture;
+  page.skyline.push_back(ivec3(1, 1, int(m_pageSize) - 1));
+  page.generation = 1;
+  page.lastUsed = m_frame;
+  page.usedArea = 0;
+
+  return &page;
+}
+
+GlyphAtlas::Page* GlyphAtlas::evictPage()
+{
+  Page* page = nullptr;
+
+  for (Page& p : m_pages)
+  {
+    if (!page || p.lastUsed < page->lastUsed)
+      page = &p;
+  }
+
+  // Glyphs already drawn during this frame must stay put
+  if (page->lastUsed == m_frame)
+  {
+    logWarning("Glyph atlas is full");
+    return nullptr;
+  }
+
+  for (const Key& key : page->keys)
+    m_entries.erase(key);
+
+  // Clear the page so no stale texels bleed into the gaps between glyphs
+  const std::vector<uint8> texels(m_pageSize * m_pageSize, 0);
+  page->texture->copyFrom(0, TextureData(PixelFormat::L8,
+                                         m_pageSize, m_pageSize, 1,
+                                         texels.data()));
+
+  page->keys.clear();
+  page->skyline.clear();
+  page->skyline.push_back(ivec3(1, 1, int(m_pageSize) - 1));
+  page->generation++;
+  page->usedArea = 0;
+
+  m_evictionCount++;
+  return page;
+}
+
+void GlyphAtlas::work()
+{
+  for (;;)
+  {
+    Job job;
+
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_condition.wait(lock, [this] { return m_stopping || !m_requests.empty(); });
+      if (m_stopping)
+        return;
+
+      job = std::move(m_requests.front());
+      m_requests.pop_front();
+    }
+
+    job.image = job.key.face->glyph(job.key.index, job.key.scale);
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_results.push_back(std::move(job));
+    }
+  }
+}
+
+} /*namespace nori*/
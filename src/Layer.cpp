@@ -44,10 +44,16 @@ Layer::Layer(Drawer& drawer):
   m_draggedWidget(nullptr),
   m_hoveredWidget(nullptr),
   m_captureWidget(nullptr),
-  m_stack(nullptr)
+  m_stack(nullptr),
+  m_layoutDirty(false),
+  m_retained(false),
+  m_dirty(true)
 {
   assert(&m_window);
   assert(&m_drawer);
+
+  // Text drawn before its glyphs were rasterized is missing those glyphs
+  m_drawer.context().glyphAtlas().glyphsAdded().connect(*this, &Layer::onGlyphsAdded);
 }
 
 Layer::~Layer()
@@ -57,12 +63,38 @@ Layer::~Layer()
 
 void Layer::update()
 {
+  updateLayout();
+}
+
+void Layer::updateLayout()
+{
+  if (!m_layoutDirty)
+    return;
+
+  ProfileNodeCall call("Layer::updateLayout");
+
+  // Any layout invalidated by the arrange pass is left for the next update
+  m_layoutDirty = false;
+
+  for (Widget* r : m_roots)
+    r->measureLayout();
+
+  for (Widget* r : m_roots)
+    r->arrangeLayout();
 }
 
 void Layer::draw()
 {
   ProfileNodeCall call("Layer::draw");
 
+  updateLayout();
+
+  if (m_retained)
+  {
+    drawRetained();
+    return;
+  }
+
   m_drawer.begin();
 
   for (Widget* r : m_roots)
@@ -140,6 +172,30 @@ void Layer::activateNextWidget()
 
 void Layer::invalidate()
 {
+  if (m_retained)
+  {
+    const Framebuffer& framebuffer = m_drawer.context().framebuffer();
+
+    m_dirtyArea.set(0.f, 0.f, float(framebuffer.width()), float(framebuffer.height()));
+    m_dirty = true;
+  }
+
+  m_window.invalidate();
+}
+
+void Layer::invalidate(const Rect& area)
+{
+  if (m_retained)
+  {
+    if (m_dirty)
+      m_dirtyArea.envelop(area);
+    else
+    {
+      m_dirtyArea = area;
+      m_dirty = true;
+    }
+  }
+
   m_window.invalidate();
 }
 
@@ -159,6 +215,22 @@ vec2 Layer::cursorPoint() const
   return vec2(cursorPosition.x, m_window.height() - cursorPosition.y);
 }
 
+void Layer::setRetained(bool enabled)
+{
+  if (m_retained == enabled)
+    return;
+
+  m_retained = enabled;
+
+  if (!m_retained)
+  {
+    m_cacheFramebuffer = nullptr;
+    m_cacheTexture = nullptr;
+  }
+
+  invalidate();
+}
+
 void Layer::setActiveWidget(Widget* widget)
 {
   if (widget)
@@ -313,6 +385,95 @@ void Layer::onFocus(bool activated)
   }
 }
 
+void Layer::drawRetained()
+{
+  RenderContext& context = m_drawer.context();
+
+  Ref<Framebuffer> target = &context.framebuffer();
+  const uint width = target->width();
+  const uint height = target->height();
+
+  if (!m_cacheTexture ||
+      m_cacheTexture->width() != width ||
+      m_cacheTexture->height() != height)
+  {
+    const TextureParams params(TEXTURE_2D, TF_NONE, FILTER_NEAREST, ADDRESS_CLAMP);
+    const TextureData data(PixelFormat::RGBA8, width, height);
+
+    m_cacheTexture = Texture::create(ResourceInfo(context.cache()),
+                                     context, params, data);
+    if (!m_cacheTexture)
+    {
+      logError("Failed to create cache texture for UI layer");
+      m_retained = false;
+      return;
+    }
+
+    m_cacheFramebuffer = TextureFramebuffer::create(context);
+    if (!m_cacheFramebuffer ||
+        !m_cacheFramebuffer->setColorBuffer(m_cacheTexture))
+    {
+      logError("Failed to create cache framebuffer for UI layer");
+      m_cacheTexture = nullptr;
+      m_retained = false;
+      return;
+    }
+
+    m_dirtyArea.set(0.f, 0.f, float(width), float(height));
+    m_dirty = true;
+  }
+
+  if (m_dirty)
+  {
+    ProfileNodeCall call("Layer::drawRetained");
+
+    // Widgets may invalidate areas while being drawn, so clear the dirty
+    // area first to retain those for the next frame
+    const vec2 size = vec2(float(width), float(height));
+    const vec2 minimum = clamp(floor(m_dirtyArea.position), vec2(0.f), size);
+    const vec2 maximum = clamp(ceil(m_dirtyArea.position + m_dirtyArea.size),
+                               minimum, size);
+    m_dirty = false;
+
+    // Round the area out to whole pixels so that the cleared pixels and the
+    // clipped redraw cover exactly the same region
+    const Rect area(minimum, maximum - minimum);
+    const Recti pixels(ivec2(minimum), ivec2(maximum - minimum));
+
+    context.setFramebuffer(*m_cacheFramebuffer);
+    m_drawer.begin();
+
+    if (m_drawer.pushClipArea(area))
+    {
+      // Clipping areas do not touch the scissor area, so the clear has to be
+      // scissored explicitly or it would wipe the whole cache
+      context.setScissorArea(pixels);
+      context.clearColorBuffer(vec4(0.f));
+      context.setScissorArea(Recti(0, 0, width, height));
+
+      for (Widget* r : m_roots)
+      {
+        if (r->isVisible())
+          r->draw();
+      }
+
+      m_drawer.popClipArea();
+    }
+
+    m_drawer.end();
+    context.setFramebuffer(*target);
+
+    // Text with glyphs still being rasterized has to be redrawn later
+    if (!m_drawer.isComplete())
+      invalidate(area);
+  }
+
+  m_drawer.begin();
+  m_drawer.blitPremultipliedTexture(Rect(0.f, 0.f, float(width), float(height)),
+                                    *m_cacheTexture);
+  m_drawer.end();
+}
+
 void Layer::updateHoveredWidget()
 {
   if (m_captureWidget)
@@ -393,6 +554,11 @@ void Layer::removeWidget(Widget& widget)
   }
 }
 
+void Layer::onGlyphsAdded()
+{
+  invalidate();
+}
+
 void Layer::focusableWidgets(std::vector<Widget*>& target,
                              const std::vector<Widget*>& source) const
 {
@@ -36,9 +36,13 @@ namespace nori
 Layout::Layout(Layer& layer, Widget* parent, Orientation orientation, LayoutMode mode):
   Widget(layer, parent),
   m_borderSize(0.f),
+  m_stackSize(0.f),
+  m_flexibleCount(0),
   m_orientation(orientation),
   m_mode(mode)
 {
+  invalidateLayout();
+
   if (m_mode == COVER_PARENT)
   {
     if (parent)
@@ -57,30 +61,30 @@ Layout::Layout(Layer& layer, Widget* parent, Orientation orientation, LayoutMode
 void Layout::setBorderSize(float newSize)
 {
   m_borderSize = newSize;
-  update();
+  invalidateLayout();
 }
 
 void Layout::onChildAdded(Widget& child)
 {
-  update();
+  invalidateLayout();
   Widget::onChildAdded(child);
 }
 
 void Layout::onChildDesiredSizeChanged(Widget& child)
 {
-  update();
+  invalidateLayout();
   Widget::onChildDesiredSizeChanged(child);
 }
 
 void Layout::onChildRemoved(Widget& child)
 {
-  update();
+  invalidateLayout();
   Widget::onChildRemoved(child);
 }
 
 void Layout::onAreaChanged()
 {
-  update();
+  invalidateLayout();
   Widget::onAreaChanged();
 }
 
@@ -95,10 +99,11 @@ void Layout::onSizeChanged(Layer& layer)
   setArea(Rect(vec2(0.f), vec2(float(window.width()), float(window.height()))));
 }
 
-void Layout::update()
+void Layout::onMeasure()
 {
-  uint flexibleCount = 0;
-  float stackSize = m_borderSize;
+  m_flexibleCount = 0;
+  m_stackSize = m_borderSize;
+
   vec2 desiredArea;
 
   for (Widget* c : children())
@@ -113,21 +118,24 @@ void Layout::update()
       desiredSize = c->desiredSize().x;
 
     if (desiredSize == 0.f)
-      flexibleCount++;
+      m_flexibleCount++;
 
-    stackSize += desiredSize + m_borderSize;
+    m_stackSize += desiredSize + m_borderSize;
   }
 
   if (m_mode == WRAP_CHILDREN)
     setDesiredSize(desiredArea);
+}
 
+void Layout::onArrange()
+{
   if (m_orientation == VERTICAL)
   {
     const float childWidth = width() - m_borderSize * 2.f;
     float flexibleHeight = 0.f, positionY = height();
 
-    if (flexibleCount)
-      flexibleHeight = (height() - stackSize) / flexibleCount;
+    if (m_flexibleCount)
+      flexibleHeight = (height() - m_stackSize) / m_flexibleCount;
 
     for (Widget* c : children())
     {
@@ -144,8 +152,8 @@ void Layout::update()
     const float childHeight = height() - m_borderSize * 2.f;
     float flexibleWidth = 0.f, positionX = m_borderSize;
 
-    if (flexibleCount)
-      flexibleWidth = (width() - stackSize) / flexibleCount;
+    if (m_flexibleCount)
+      flexibleWidth = (width() - m_stackSize) / m_flexibleCount;
 
     for (Widget* c : children())
     {
@@ -38,12 +38,28 @@
 namespace nori
 {
 
+uint ListModel::findRow(ItemID id) const
+{
+  const uint count = rowCount();
+
+  for (uint i = 0;  i < count;  i++)
+  {
+    if (rowID(i) == id)
+      return i;
+  }
+
+  return NO_ITEM;
+}
+
 List::List(Layer& layer, Widget* parent):
   Widget(layer, parent),
   m_editable(false),
+  m_model(nullptr),
+  m_modelSlot(nullptr),
   m_offset(0),
   m_maxOffset(0),
   m_selection(NO_ITEM),
+  m_selectedID(NO_ITEM),
   m_scroller(nullptr),
   m_entry(nullptr)
 {
@@ -56,6 +72,7 @@ List::List(Layer& layer, Widget* parent):
 
 List::~List()
 {
+  delete m_modelSlot;
   delete m_entry;
   destroyItems();
 }
@@ -166,13 +183,13 @@ void List::setOffset(uint newOffset)
 
 void List::setSelection(uint newSelection)
 {
-  assert(newSelection == NO_ITEM || newSelection < m_items.size());
+  assert(newSelection == NO_ITEM || newSelection < rowCount());
   setSelection(newSelection, false);
 }
 
 Item* List::selectedItem()
 {
-  if (m_selection == NO_ITEM)
+  if (m_model || m_selection == NO_ITEM)
     return nullptr;
 
   assert(m_selection < m_items.size());
@@ -188,6 +205,14 @@ void List::setSelectedItem(Item& newItem)
 
 ItemID List::selectedID()
 {
+  if (m_model)
+  {
+    if (m_selection == NO_ITEM)
+      return NO_ITEM;
+
+    return m_model->rowID(m_selection);
+  }
+
   if (Item* item = selectedItem())
     return item->id();
 
@@ -196,6 +221,15 @@ ItemID List::selectedID()
 
 void List::setSelectedID(ItemID newItemID)
 {
+  if (m_model)
+  {
+    const uint row = m_model->findRow(newItemID);
+    if (row != NO_ITEM)
+      setSelection(row, false);
+
+    return;
+  }
+
   for (Item* i : m_items)
   {
     if (i->id() == newItemID)
@@ -206,6 +240,27 @@ void List::setSelectedID(ItemID newItemID)
   }
 }
 
+void List::setModel(ListModel* newModel)
+{
+  if (m_model == newModel)
+    return;
+
+  if (m_entry)
+    cancelEditing();
+
+  delete m_modelSlot;
+  m_modelSlot = nullptr;
+
+  m_model = newModel;
+  if (m_model)
+    m_modelSlot = m_model->changed().connect(*this, &List::onModelChanged);
+
+  m_offset = 0;
+  setSelection(rowCount() ? 0 : NO_ITEM, false);
+  updateScroller();
+  invalidate();
+}
+
 void List::draw() const
 {
   Drawer& drawer = layer().drawer();
@@ -215,6 +270,28 @@ void List::draw() const
   {
     drawer.drawWell(area, state());
 
+    if (m_model)
+    {
+      const float height = rowHeight();
+      const uint end = min(m_model->rowCount(), m_offset + visibleRowCount() + 1);
+
+      for (uint i = m_offset;  i < end;  i++)
+      {
+        const Rect rowArea(area.position.x,
+                           area.position.y + area.size.y - (i - m_offset + 1) * height,
+                           area.size.x,
+                           height);
+
+        drawRow(rowArea, m_model->rowText(i).c_str(),
+                i == m_selection ? STATE_SELECTED : STATE_NORMAL);
+      }
+
+      Widget::draw();
+
+      drawer.popClipArea();
+      return;
+    }
+
     float itemTop = area.size.y;
 
     for (uint i = m_offset;  i < m_items.size();  i++)
@@ -255,6 +332,29 @@ void List::onMouseButton(vec2 point,
   {
     const vec2 local = transformToLocal(point);
 
+    if (m_model)
+    {
+      const uint visible = uint((height() - local.y) / rowHeight());
+      const uint row = m_offset + visible;
+
+      if (local.y >= 0.f && row < m_model->rowCount())
+      {
+        if (visible >= visibleRowCount())
+          setOffset(m_offset + 1);
+
+        if (m_selection == row)
+        {
+          if (button == MOUSE_BUTTON_LEFT && m_editable)
+            beginEditing();
+        }
+        else
+          setSelection(row, true);
+      }
+
+      Widget::onMouseButton(point, button, action, mods);
+      return;
+    }
+
     float itemTop = height();
 
     for (uint i = m_offset;  i < m_items.size();  i++)
@@ -291,14 +391,16 @@ void List::onKey(Key key, Action action, uint mods)
 {
   if ((action == PRESSED || action == REPEATED) && mods == 0)
   {
+    const uint count = rowCount();
+
     switch (key)
     {
       case KEY_UP:
       {
         if (m_selection == NO_ITEM)
         {
-          if (!m_items.empty())
-            setSelection(uint(m_items.size() - 1), true);
+          if (count)
+            setSelection(count - 1, true);
         }
         else if (m_selection > 0)
           setSelection(m_selection - 1, true);
@@ -309,24 +411,25 @@ void List::onKey(Key key, Action action, uint mods)
       {
         if (m_selection == NO_ITEM)
         {
-          if (!m_items.empty())
+          if (count)
             setSelection(0, true);
         }
-        else if (m_selection < m_items.size() - 1)
+        else if (m_selection < count - 1)
           setSelection(m_selection + 1, true);
         break;
       }
 
       case KEY_HOME:
       {
-        setSelection(0, true);
+        if (count)
+          setSelection(0, true);
         break;
       }
 
       case KEY_END:
       {
-        if (!m_items.empty())
-          setSelection(uint(m_items.size() - 1), true);
+        if (count)
+          setSelection(count - 1, true);
         break;
       }
 
@@ -340,7 +443,7 @@ void List::onKey(Key key, Action action, uint mods)
 
 void List::onScroll(vec2 offset)
 {
-  if (!m_items.empty() && !m_entry->isVisible() &&
+  if (rowCount() && (!m_entry || !m_entry->isVisible()) &&
       int(offset.y) + int(m_offset) >= 0)
   {
     setOffset(m_offset + int(offset.y));
@@ -389,9 +492,83 @@ void List::onValueChanged(Scroller& scroller)
   setOffset((uint) scroller.value());
 }
 
+void List::onModelChanged(ListModel& model)
+{
+  updateScroller();
+
+  if (m_selection != NO_ITEM)
+  {
+    // Follow the selected row through sorting and filtering by its ID
+    const uint row = model.findRow(m_selectedID);
+    if (row == NO_ITEM)
+      setSelection(NO_ITEM, true);
+    else
+      setSelection(row, false);
+  }
+
+  invalidate();
+}
+
+void List::drawRow(const Rect& area, const char* text, WidgetState state) const
+{
+  Drawer& drawer = layer().drawer();
+  const float em = drawer.theme().em();
+  const Rect textArea(area.position + vec2(em / 2.f, 0.f),
+                      area.size - vec2(em, 0.f));
+
+  if (state == STATE_SELECTED)
+  {
+    const vec3 color = drawer.theme().backgroundColor(STATE_SELECTED);
+    drawer.fillRect(area, vec4(color, 1.f));
+  }
+
+  drawer.setFont(nullptr);
+  drawer.drawText(textArea, text, LEFT_ALIGNED, state);
+}
+
+uint List::rowCount() const
+{
+  if (m_model)
+    return m_model->rowCount();
+
+  return uint(m_items.size());
+}
+
+float List::rowHeight() const
+{
+  return layer().drawer().theme().em() * 1.5f;
+}
+
+uint List::visibleRowCount() const
+{
+  return uint(height() / rowHeight());
+}
+
 void List::beginEditing()
 {
-  if (Item* selected = selectedItem())
+  if (m_model && m_selection != NO_ITEM)
+  {
+    if (!isSelectionVisible())
+      setOffset(m_selection);
+
+    const float height = rowHeight();
+    const int row = int(m_selection) - int(m_offset);
+
+    Rect entryArea(vec2(0.f, this->height() - (row + 1) * height),
+                   vec2(width(), height));
+
+    if (m_scroller->isVisible())
+      entryArea.size.x -= m_scroller->width();
+
+    const std::string value = m_model->rowText(m_selection);
+
+    m_entry->setArea(entryArea);
+    m_entry->setText(value);
+    m_entry->setCaretPosition(uint(value.length()));
+    m_entry->show();
+    m_entry->activate();
+  }
+  else if (Item* selected = selectedItem())
   {
     const Rect area = globalArea();
     const float selectedHeight = selected->height();
@@ -419,7 +596,12 @@ void List::applyEditing()
 {
   m_entry->hide();
 
-  if (Item* item = selectedItem())
+  if (m_model)
+  {
+    if (m_selection != NO_ITEM)
+      m_itemEdited(*this, m_entry->text());
+  }
+  else if (Item* item = selectedItem())
   {
     m_itemEdited(*this, m_entry->text());
     item->setValue(m_entry->text());
@@ -435,6 +617,25 @@ void List::updateScroller()
 {
   m_maxOffset = 0;
 
+  if (m_model)
+  {
+    const uint count = m_model->rowCount();
+    const uint visible = visibleRowCount();
+
+    if (count > visible)
+    {
+      m_maxOffset = count - visible;
+      m_scroller->show();
+      m_scroller->setValueRange(0.f, float(m_maxOffset));
+      m_scroller->setPercentage(float(visible) / float(count));
+    }
+    else
+      m_scroller->hide();
+
+    setOffset(m_offset);
+    return;
+  }
+
   float totalItemHeight = 0.f;
 
   for (Item* i : m_items)
@@ -472,6 +673,9 @@ bool List::isSelectionVisible() const
   if (m_selection < m_offset)
     return false;
 
+  if (m_model)
+    return m_selection < m_offset + visibleRowCount();
+
   float visibleItemHeight = 0.f;
 
   for (uint i = m_offset;  i < m_items.size();  i++)
@@ -488,6 +692,11 @@ bool List::isSelectionVisible() const
 
 void List::setSelection(uint newSelection, bool notify)
 {
+  if (m_model && newSelection != NO_ITEM)
+    m_selectedID = m_model->rowID(newSelection);
+  else
+    m_selectedID = NO_ITEM;
+
   if (m_selection == newSelection)
     return;
 
@@ -28,7 +28,16 @@
 
 #include <enet/enet.h>
 
+#include <glm/gtc/quaternion.hpp>
+
 #include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <system_error>
 
 namespace nori
 {
@@ -36,667 +45,4073 @@ namespace nori
 namespace
 {
 
-const size_t MAX_EVENT_SIZE = 1024;
+// Initial capacity of event packet data, which grows as needed
+const size_t INITIAL_EVENT_SIZE = 64;
 
-} /*namespace*/
+// Initial capacity of snapshot packet data, which grows as needed
+const size_t INITIAL_SNAPSHOT_SIZE = 1024;
 
-PacketData::PacketData():
-  m_data(nullptr),
-  m_capacity(0),
-  m_size(0),
-  m_offset(0)
-{
-}
+// Largest size of coalesced event packets, leaving room for ENet headers
+// within the default MTU
+const size_t MAX_BATCH_SIZE = 1200;
 
-PacketData::PacketData(void* data, size_t capacity, size_t size):
-  m_data(static_cast<uint8*>(data)),
-  m_capacity(capacity),
-  m_size(size),
-  m_offset(0)
+// Time that unreliable events may wait in a send queue before being dropped
+const Time MAX_QUEUE_TIME = 1.0;
+
+// Longest time that unused bandwidth budget is saved up for bursts
+const Time MAX_CREDIT_TIME = 0.25;
+
+// Packet data size classes are powers of two from the smallest up to the
+// largest, while larger packet data is allocated individually
+const size_t SMALLEST_PACKET_CLASS = 64;
+const uint PACKET_CLASS_COUNT = 11;
+
+// Number of past snapshots kept as potential delta baselines
+const uint32 SNAPSHOT_HISTORY_SIZE = 32;
+
+enum
 {
-}
+  SNAPSHOT_DATA,
+  SNAPSHOT_ACK
+};
 
-uint8 PacketData::read8()
+// Capacity of each service thread queue, in entries
+const size_t SERVICE_QUEUE_SIZE = 16384;
+
+// Weight of each new sample in the moving averages of the clock offset and
+// arrival jitter of transform interpolators
+const Time JITTER_SMOOTHING = 0.1;
+
+// Size at which recorded traffic is handed to the writer thread
+const size_t RECORDING_BUFFER_SIZE = 65536;
+
+// Version of the traffic log format
+const uint8 RECORDING_VERSION = 1;
+
+enum
 {
-  if (m_offset + 1 > m_size)
-    panic("Packet data buffer underflow");
+  RECORD_UPDATE,
+  RECORD_CONNECT,
+  RECORD_DISCONNECT,
+  RECORD_RECEIVE,
+  RECORD_SEND
+};
 
-  return m_data[m_offset++];
-}
+// Largest number of times a simulated reliable packet is resent
+const uint MAX_SIMULATED_RESENDS = 8;
 
-uint16 PacketData::read16()
+// Number of recent delivery delays kept per simulated host
+const size_t MAX_LATENCY_SAMPLES = 4096;
+
+// Interest grid cell coordinates are limited to this many bits per axis
+const int GRID_COORDINATE_BITS = 21;
+
+// Returns the recipient of an event without reading from it
+NetworkObjectID recipientOf(const PacketData& data)
 {
-  if (m_offset + 2 > m_size)
-    panic("Packet data buffer underflow");
+  if (data.size() < 2)
+    return OBJECT_ID_INVALID;
 
-  const uint16 value = ntohs(*(uint16*) (m_data + m_offset));
-  m_offset += 2;
-  return value;
+  uint16 value;
+  std::memcpy(&value, data.data(), sizeof(value));
+  return ntohs(value);
 }
 
-uint32 PacketData::read32()
+// Returns whether a snapshot sequence number is later than another, allowing
+// for wrap-around
+bool isNewerSequence(uint32 sequence, uint32 other)
 {
-  if (m_offset + 4 > m_size)
-    panic("Packet data buffer underflow");
-
-  const uint32 value = ntohl(*(uint32*) (m_data + m_offset));
-  m_offset += 4;
-  return value;
+  return int32(sequence - other) > 0;
 }
 
-float PacketData::read32f()
+// Copies a packet, so that it no longer refers to the pool of its sender
+ENetPacket* copyPacket(const ENetPacket* packet)
 {
-  return uintBitsToFloat(read32());
+  const enet_uint32 flags = ENET_PACKET_FLAG_RELIABLE | ENET_PACKET_FLAG_UNSEQUENCED;
+  return enet_packet_create(packet->data, packet->dataLength, packet->flags & flags);
 }
 
-template <>
-std::string PacketData::read()
+bool intersects(const AABB& box, const Sphere& sphere)
 {
-  if (!std::memchr(m_data + m_offset, '\0', m_size - m_offset))
-    panic("Missing null character in packet data");
+  vec3 minimum, maximum;
+  box.bounds(minimum, maximum);
 
-  std::string result((char*) (m_data + m_offset));
-  m_offset += result.length() + 1;
-  return result;
+  const vec3 offset = clamp(sphere.center, minimum, maximum) - sphere.center;
+  return dot(offset, offset) < sphere.radius * sphere.radius;
 }
 
-void PacketData::write8(uint8 value)
+/*! @brief Lock-free single producer, single consumer ring buffer.
+ */
+template <typename T>
+class RingQueue
 {
-  if (m_size + 1 > m_capacity)
-    panic("Packet data buffer overflow");
+public:
+  RingQueue(size_t capacity):
+    m_slots(capacity),
+    m_head(0),
+    m_tail(0)
+  {
+    assert((capacity & (capacity - 1)) == 0);
+  }
+  bool push(const T& item)
+  {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) == m_slots.size())
+      return false;
 
-  m_data[m_size++] = value;
-}
+    m_slots[tail & (m_slots.size() - 1)] = item;
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+  bool pop(T& item)
+  {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire))
+      return false;
 
-void PacketData::write16(uint16 value)
+    item = m_slots[head & (m_slots.size() - 1)];
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+private:
+  std::vector<T> m_slots;
+  // Keep the indices on separate cache lines to avoid false sharing
+  std::atomic<size_t> m_head;
+  char m_padding[64];
+  std::atomic<size_t> m_tail;
+};
+
+} /*namespace*/
+
+/*! @brief Header of a block of pooled packet data.
+ *
+ *  The packet data follows the header in the same allocation.
+ */
+class PacketBlock
 {
-  if (m_size + 2 > m_capacity)
-    panic("Packet data buffer overflow");
+public:
+  uint8* data() { return reinterpret_cast<uint8*>(this + 1); }
+  PacketPool* pool;
+  std::atomic<uint> references;
+  uint sizeClass;
+  size_t capacity;
+};
+
+/*! @brief Size-classed pool of packet data blocks.
+ *
+ *  Blocks are allocated on the game thread but may be released by the
+ *  service thread when ENet is done with a packet, so the free lists are
+ *  guarded by a mutex.
+ */
+class PacketPool
+{
+public:
+  PacketPool();
+  ~PacketPool();
+  PacketBlock* allocate(size_t capacity);
+  void retain(PacketBlock* block);
+  void release(PacketBlock* block);
+  std::mutex mutex;
+  std::vector<PacketBlock*> blocks[PACKET_CLASS_COUNT];
+  std::atomic<size_t> usage;
+  std::atomic<size_t> highWater;
+};
+
+PacketPool::PacketPool():
+  usage(0),
+  highWater(0)
+{
+}
 
-  *((uint16*) (m_data + m_size)) = htons(value);
-  m_size += 2;
+PacketPool::~PacketPool()
+{
+  for (uint i = 0;  i < PACKET_CLASS_COUNT;  i++)
+  {
+    for (PacketBlock* block : blocks[i])
+    {
+      block->~PacketBlock();
+      std::free(block);
+    }
+  }
 }
 
-void PacketData::write32(uint32 value)
+PacketBlock* PacketPool::allocate(size_t capacity)
 {
-  if (m_size + 4 > m_capacity)
-    panic("Packet data buffer overflow");
+  uint sizeClass = 0;
+  while (sizeClass < PACKET_CLASS_COUNT &&
+         (SMALLEST_PACKET_CLASS << sizeClass) < capacity)
+  {
+    sizeClass++;
+  }
 
-  *((uint32*) (m_data + m_size)) = htonl(value);
-  m_size += 4;
+  PacketBlock* block = nullptr;
+
+  if (sizeClass < PACKET_CLASS_COUNT)
+  {
+    capacity = SMALLEST_PACKET_CLASS << sizeClass;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!blocks[sizeClass].empty())
+    {
+      block = blocks[sizeClass].back();
+      blocks[sizeClass].pop_back();
+    }
+  }
+
+  if (!block)
+  {
+    void* memory = std::malloc(sizeof(PacketBlock) + capacity);
+    if (!memory)
+      panic("Out of packet data memory");
+
+    block = new (memory) PacketBlock();
+    block->pool = this;
+    block->sizeClass = sizeClass;
+    block->capacity = capacity;
+  }
+
+  block->references = 1;
+
+  const size_t total = usage += capacity;
+  size_t peak = highWater;
+  while (total > peak && !highWater.compare_exchange_weak(peak, total))
+    ;
+
+  return block;
 }
 
-void PacketData::write32f(float value)
+void PacketPool::retain(PacketBlock* block)
 {
-  write32(floatBitsToUint(value));
+  block->references++;
 }
 
-template <>
-void PacketData::write(const std::string& value)
+void PacketPool::release(PacketBlock* block)
 {
-  for (char c : value)
-    write8(c);
+  if (--block->references)
+    return;
 
-  write8('\0');
+  usage -= block->capacity;
+
+  if (block->sizeClass < PACKET_CLASS_COUNT)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    blocks[block->sizeClass].push_back(block);
+  }
+  else
+  {
+    block->~PacketBlock();
+    std::free(block);
+  }
 }
 
-bool PacketData::isEmpty()
+namespace
 {
-  return m_offset == m_size;
-}
 
-size_t PacketData::size() const
+void ENET_CALLBACK releasePacketBlock(ENetPacket* packet)
 {
-  return m_size;
+  PacketBlock* block = static_cast<PacketBlock*>(packet->userData);
+  block->pool->release(block);
 }
 
-size_t PacketData::capacity() const
+} /*namespace*/
+
+/*! @brief ENet event along with the peer state needed to handle it.
+ *
+ *  The peer state is captured when the event is received, as the ENet peer
+ *  is owned by the service thread when one is running.
+ */
+class ServiceEvent
+{
+public:
+  ServiceEvent() { }
+  ServiceEvent(const ENetEvent& event);
+  ENetEvent event;
+  ENetAddress address;
+  uint32 connectID;
+  uint32 roundTripTime;
+};
+
+ServiceEvent::ServiceEvent(const ENetEvent& event):
+  event(event),
+  address(event.peer->address),
+  connectID(event.peer->connectID),
+  roundTripTime(event.peer->roundTripTime)
 {
-  return m_capacity;
 }
 
-const void* PacketData::data() const
+/*! @brief Queues between the game thread and the service thread.
+ */
+class ServiceQueues
+{
+public:
+  enum CommandType
+  {
+    SEND,
+    BROADCAST,
+    DISCONNECT
+  };
+  class Command
+  {
+  public:
+    CommandType type;
+    ENetPeer* peer;
+    uint32 connectID;
+    ENetPacket* packet;
+    ChannelID channel;
+    uint32 reason;
+  };
+  ServiceQueues();
+  void execute(ENetHost* host, const Command& command);
+  RingQueue<Command> outbound;
+  RingQueue<ServiceEvent> inbound;
+};
+
+ServiceQueues::ServiceQueues():
+  outbound(SERVICE_QUEUE_SIZE),
+  inbound(SERVICE_QUEUE_SIZE)
 {
-  return m_data;
 }
 
-bool Peer::sendPacket(ChannelID channel,
-                      PacketType type,
-                      const PacketData& data)
+void ServiceQueues::execute(ENetHost* host, const Command& command)
 {
-  uint32 flags = 0;
-
-  if (type == RELIABLE)
-    flags |= ENET_PACKET_FLAG_RELIABLE;
-  else
+  if (command.type == BROADCAST)
   {
-    if (type == UNSEQUENCED)
-      flags |= ENET_PACKET_FLAG_UNSEQUENCED;
-
-    flags |= ENET_PACKET_FLAG_NO_ALLOCATE;
+    enet_host_broadcast(host, command.channel, command.packet);
+    return;
   }
 
-  ENetPacket* packet = enet_packet_create(data.data(), data.size(), flags);
-  if (!packet)
+  // The peer may have disconnected and its slot been reused since the command
+  // was queued, which the connection ID catches
+  ENetPeer* peer = command.peer;
+  const bool connected = peer->state == ENET_PEER_STATE_CONNECTED &&
+                         peer->connectID == command.connectID;
+
+  if (command.type == SEND)
   {
-    logError("Failed to create ENet packet");
-    return false;
+    if (!connected || enet_peer_send(peer, command.channel, command.packet) < 0)
+    {
+      if (command.packet->referenceCount == 0)
+        enet_packet_destroy(command.packet);
+    }
   }
-
-  if (enet_peer_send((ENetPeer*) m_peer, channel, packet) < 0)
+  else if (command.type == DISCONNECT)
   {
-    logError("Failed to send ENet packet to peer %s", m_name.c_str());
-    return false;
+    if (connected)
+      enet_peer_disconnect(peer, command.reason);
   }
+}
 
-  return true;
+/*! @brief Captured state of all replicated network objects.
+ */
+class Snapshot
+{
+public:
+  Snapshot();
+  void reset(uint32 newSequence);
+  uint8* add(NetworkObjectID id, uint size, bool bounded = false);
+  const uint8* find(NetworkObjectID id, uint& size) const;
+  uint lowerBound(NetworkObjectID id, uint first) const;
+  uint count() const { return uint(ids.size()); }
+  uint sizeOf(uint index) const { return offsets[index + 1] - offsets[index]; }
+  const uint8* dataOf(uint index) const { return &data[offsets[index]]; }
+  uint32 sequence;
+  std::vector<NetworkObjectID> ids;
+  std::vector<uint32> offsets;
+  std::vector<uint8> data;
+  std::vector<bool> bounded;
+  std::vector<uint> unbounded;
+};
+
+Snapshot::Snapshot():
+  sequence(0),
+  offsets(1, 0)
+{
 }
 
-void Peer::disconnect(uint32 reason)
+void Snapshot::reset(uint32 newSequence)
 {
-  m_disconnecting = true;
-  m_reason = reason;
-  enet_peer_disconnect((ENetPeer*) m_peer, reason);
+  sequence = newSequence;
+  ids.clear();
+  offsets.assign(1, 0);
+  data.clear();
+  bounded.clear();
+  unbounded.clear();
 }
 
-uint32 Peer::address() const
+uint8* Snapshot::add(NetworkObjectID id, uint size, bool isBounded)
 {
-  return ((ENetPeer*) m_peer)->address.host;
+  assert(ids.empty() || ids.back() < id);
+
+  const uint32 offset = offsets.back();
+  ids.push_back(id);
+  bounded.push_back(isBounded);
+  offsets.push_back(offset + size);
+
+  if (!isBounded)
+    unbounded.push_back(count() - 1);
+
+  data.resize(offset + size);
+  return &data[offset];
 }
 
-Time Peer::roundTripTime() const
+const uint8* Snapshot::find(NetworkObjectID id, uint& size) const
 {
-  return (Time) ((ENetPeer*) m_peer)->roundTripTime / 1000.0;
+  auto i = std::lower_bound(ids.begin(), ids.end(), id);
+  if (i == ids.end() || *i != id)
+    return nullptr;
+
+  const uint index = uint(i - ids.begin());
+  size = sizeOf(index);
+  return dataOf(index);
 }
 
-Peer::Peer(void* peer, TargetID targetID, const char* name):
-  m_peer(peer),
-  m_id(targetID),
-  m_name(name),
-  m_disconnecting(false),
-  m_reason(0)
+uint Snapshot::lowerBound(NetworkObjectID id, uint first) const
 {
+  // Searches for increasing IDs are usually close together, so the search
+  // gallops ahead from the first index before bisecting
+  uint last = first, step = 1;
+
+  while (last < count() && ids[last] < id)
+  {
+    first = last + 1;
+    last += step;
+    step *= 2;
+  }
+
+  last = min(last, count());
+  return uint(std::lower_bound(ids.begin() + first, ids.begin() + last, id) - ids.begin());
 }
 
-HostObserver::~HostObserver()
+/*! @brief Ring buffer of recent snapshots.
+ *
+ *  New snapshots are built in the scratch snapshot, so that the baseline
+ *  being decoded against is never the slot being overwritten.
+ */
+class SnapshotHistory
+{
+public:
+  SnapshotHistory();
+  Snapshot* find(uint32 sequence);
+  void commit();
+  std::vector<Snapshot> entries;
+  Snapshot scratch;
+  uint32 latest;
+};
+
+SnapshotHistory::SnapshotHistory():
+  entries(SNAPSHOT_HISTORY_SIZE),
+  latest(0)
 {
 }
 
-Host::~Host()
+Snapshot* SnapshotHistory::find(uint32 sequence)
 {
-  for (Peer& p : m_peers)
-    enet_peer_disconnect_now((ENetPeer*) p.m_peer, 0);
+  if (!sequence)
+    return nullptr;
 
-  m_peers.clear();
+  Snapshot& snapshot = entries[sequence % SNAPSHOT_HISTORY_SIZE];
+  if (snapshot.sequence != sequence)
+    return nullptr;
 
-  if (m_object)
-  {
-    enet_host_flush((ENetHost*) m_object);
-    enet_host_destroy((ENetHost*) m_object);
-    m_object = nullptr;
-  }
+  return &snapshot;
+}
 
-  m_count--;
-  if (!m_count)
-    enet_deinitialize();
+void SnapshotHistory::commit()
+{
+  latest = scratch.sequence;
+  std::swap(entries[latest % SNAPSHOT_HISTORY_SIZE], scratch);
 }
 
-bool Host::sendPacketTo(TargetID targetID,
-                        ChannelID channel,
-                        PacketType type,
-                        const PacketData& data)
+/*! @brief Uniform grid of bounded network objects.
+ *
+ *  The grid records the objects placed or removed since the last update, so
+ *  that the relevant objects of a peer only need to be found again if its
+ *  view volumes have changed, and otherwise only the moved objects need to be
+ *  checked against them.
+ */
+class InterestGrid
 {
-  switch (targetID)
+public:
+  InterestGrid(float cellSize);
+  void place(NetworkObjectID id, const Sphere& bounds);
+  void remove(NetworkObjectID id);
+  void query(const AABB& area, std::vector<NetworkObjectID>& ids) const;
+  size_t count(const AABB& area) const;
+  void clearMoved();
+  float cellSize;
+  std::vector<NetworkObjectID> moved;
+private:
+  class Cell
   {
-    case LOCAL:
-    {
-      if (m_observer)
-      {
-        PacketData copy = data;
-        m_observer->onPacketReceived(targetID, copy);
-      }
+  public:
+    std::vector<NetworkObjectID> ids;
+  };
+  class Entry
+  {
+  public:
+    Entry(): placed(false), moved(false) { }
+    ivec3 minimum;
+    ivec3 maximum;
+    bool placed;
+    bool moved;
+  };
+  void cellRange(const AABB& area, ivec3& minimum, ivec3& maximum) const;
+  void insert(const Entry& entry, NetworkObjectID id);
+  void erase(const Entry& entry, NetworkObjectID id);
+  void markMoved(NetworkObjectID id);
+  static uint64 keyOf(int x, int y, int z);
+  std::unordered_map<uint64, Cell> m_cells;
+  std::vector<Entry> m_entries;
+};
+
+InterestGrid::InterestGrid(float cellSize):
+  cellSize(cellSize)
+{
+}
 
-      return true;
-    }
+void InterestGrid::place(NetworkObjectID id, const Sphere& bounds)
+{
+  if (m_entries.size() <= id)
+    m_entries.resize(id + 1);
 
-    case BROADCAST:
-      return broadcast(channel, type, data);
+  markMoved(id);
 
-    case SERVER:
-    {
-      if (isServer())
-        return sendPacketTo(LOCAL, channel, type, data);
+  Entry& entry = m_entries[id];
+  ivec3 minimum, maximum;
+  cellRange(AABB(bounds.center, vec3(bounds.radius * 2.f)), minimum, maximum);
 
-      /* FALLTHROUGH */
-    }
+  // The object may have entered or left a view volume even if it stayed
+  // within the same cells, but the cells themselves are unchanged
+  if (entry.placed && entry.minimum == minimum && entry.maximum == maximum)
+    return;
 
-    default:
+  if (entry.placed)
+    erase(entry, id);
+
+  entry.minimum = minimum;
+  entry.maximum = maximum;
+  entry.placed = true;
+  insert(entry, id);
+}
+
+void InterestGrid::remove(NetworkObjectID id)
+{
+  if (id < m_entries.size() && m_entries[id].placed)
+  {
+    erase(m_entries[id], id);
+    m_entries[id].placed = false;
+    markMoved(id);
+  }
+}
+
+void InterestGrid::query(const AABB& area, std::vector<NetworkObjectID>& ids) const
+{
+  ivec3 minimum, maximum;
+  cellRange(area, minimum, maximum);
+
+  for (int z = minimum.z;  z <= maximum.z;  z++)
+  {
+    for (int y = minimum.y;  y <= maximum.y;  y++)
     {
-      Peer* peer = findPeer(targetID);
-      if (!peer)
+      for (int x = minimum.x;  x <= maximum.x;  x++)
       {
-        logError("Cannot send event to unknown peer %u", targetID);
-        return false;
+        auto cell = m_cells.find(keyOf(x, y, z));
+        if (cell != m_cells.end())
+          ids.insert(ids.end(), cell->second.ids.begin(), cell->second.ids.end());
       }
-
-      return peer->sendPacket(channel, type, data);
     }
   }
 }
 
-bool Host::update(Time timeout)
+size_t InterestGrid::count(const AABB& area) const
 {
-  ENetEvent event;
-  bool status = true;
-  enet_uint32 ms = (enet_uint32) (timeout * 1000.0);
+  ivec3 minimum, maximum;
+  cellRange(area, minimum, maximum);
 
-  while (enet_host_service((ENetHost*) m_object, &event, ms) > 0)
+  size_t count = 0;
+
+  for (int z = minimum.z;  z <= maximum.z;  z++)
   {
-    switch (event.type)
+    for (int y = minimum.y;  y <= maximum.y;  y++)
     {
-      case ENET_EVENT_TYPE_CONNECT:
+      for (int x = minimum.x;  x <= maximum.x;  x++)
       {
-        char name[2048];
+        auto cell = m_cells.find(keyOf(x, y, z));
+        if (cell != m_cells.end())
+          count += cell->second.ids.size();
+      }
+    }
+  }
 
-        enet_address_get_host(&(event.peer->address), name, sizeof(name) - 1);
-        name[sizeof(name) - 1] = '\0';
+  return count;
+}
 
-        TargetID peerID;
+void InterestGrid::clearMoved()
+{
+  for (NetworkObjectID id : moved)
+    m_entries[id].moved = false;
 
-        if (isClient())
-          peerID = SERVER;
-        else
-          peerID = m_clientIDs.allocateID();
+  moved.clear();
+}
 
-        m_peers.push_back(Peer(event.peer, peerID, name));
-        event.peer->data = &(m_peers.back());
+void InterestGrid::cellRange(const AABB& area, ivec3& minimum, ivec3& maximum) const
+{
+  const float limit = float((1 << (GRID_COORDINATE_BITS - 1)) - 1);
 
-        if (m_observer)
-          m_observer->onPeerConnected(m_peers.back());
+  vec3 low, high;
+  area.bounds(low, high);
 
-        break;
-      }
+  minimum = ivec3(clamp(floor(low / cellSize), vec3(-limit), vec3(limit)));
+  maximum = ivec3(clamp(floor(high / cellSize), vec3(-limit), vec3(limit)));
+}
+
+void InterestGrid::insert(const Entry& entry, NetworkObjectID id)
+{
+  for (int z = entry.minimum.z;  z <= entry.maximum.z;  z++)
+  {
+    for (int y = entry.minimum.y;  y <= entry.maximum.y;  y++)
+    {
+      for (int x = entry.minimum.x;  x <= entry.maximum.x;  x++)
+        m_cells[keyOf(x, y, z)].ids.push_back(id);
+    }
+  }
+}
 
-      case ENET_EVENT_TYPE_DISCONNECT:
+void InterestGrid::erase(const Entry& entry, NetworkObjectID id)
+{
+  for (int z = entry.minimum.z;  z <= entry.maximum.z;  z++)
+  {
+    for (int y = entry.minimum.y;  y <= entry.maximum.y;  y++)
+    {
+      for (int x = entry.minimum.x;  x <= entry.maximum.x;  x++)
       {
-        const Peer* peer = static_cast<Peer*>(event.peer->data);
+        auto cell = m_cells.find(keyOf(x, y, z));
+        if (cell == m_cells.end())
+          continue;
 
-        for (auto p = m_peers.begin();  p != m_peers.end();  p++)
+        std::vector<NetworkObjectID>& ids = cell->second.ids;
+        auto i = std::find(ids.begin(), ids.end(), id);
+        if (i != ids.end())
         {
-          if (&(*p) == peer)
-          {
-            uint32 reason;
-
-            if (peer->m_disconnecting)
-              reason = peer->m_reason;
-            else
-              reason = event.data;
-
-            if (m_observer)
-              m_observer->onPeerDisconnected(*p, reason);
+          *i = ids.back();
+          ids.pop_back();
+        }
 
-            m_clientIDs.releaseID(p->id());
-
-            m_peers.erase(p);
-            break;
-          }
-        }
-
-        if (isClient())
-          status = false;
-
-        event.peer->data = nullptr;
-        break;
-      }
-
-      case ENET_EVENT_TYPE_RECEIVE:
-      {
-        if (m_observer)
-        {
-          if (Peer* peer = static_cast<Peer*>(event.peer->data))
-          {
-            PacketData data(event.packet->data,
-                            event.packet->dataLength,
-                            event.packet->dataLength);
-
-            m_observer->onPacketReceived(peer->id(), data);
-          }
-        }
-
-        enet_packet_destroy(event.packet);
-        break;
-      }
-
-      case ENET_EVENT_TYPE_NONE:
-      {
-        // This removes a useless warning by Clang
-        break;
+        if (ids.empty())
+          m_cells.erase(cell);
       }
     }
   }
-
-  enet_host_flush((ENetHost*) m_object);
-
-  m_allocated = 0;
-
-  return status;
 }
 
-void* Host::allocatePacketData(size_t size)
+void InterestGrid::markMoved(NetworkObjectID id)
 {
-  if (!size)
-    return nullptr;
-
-  if (size + m_allocated > sizeof(m_buffer))
-    panic("Out of packet data memory");
-
-  uint8* data = &m_buffer[m_allocated];
-  m_allocated += size;
-
-  return data;
+  if (!m_entries[id].moved)
+  {
+    m_entries[id].moved = true;
+    moved.push_back(id);
+  }
 }
 
-Peer* Host::findPeer(TargetID targetID)
+uint64 InterestGrid::keyOf(int x, int y, int z)
 {
-  for (Peer& p : m_peers)
-  {
-    if (p.id() == targetID)
-      return &p;
-  }
+  const uint64 mask = (uint64(1) << GRID_COORDINATE_BITS) - 1;
 
-  return nullptr;
+  return ((uint64(x) & mask) << (GRID_COORDINATE_BITS * 2)) |
+         ((uint64(y) & mask) << GRID_COORDINATE_BITS) |
+         (uint64(z) & mask);
 }
 
-NetworkObject* Host::findObject(NetworkObjectID objectID)
+/*! @brief Buffered writer of traffic logs.
+ *
+ *  Records are appended to a buffer on the game thread and full buffers are
+ *  written by a separate thread, so that recording never waits for the disk.
+ *
+ *  The log is a header followed by records, each made of a type, the time
+ *  since the previous record in microseconds and the data of the record.
+ */
+class HostRecorder
+{
+public:
+  HostRecorder();
+  ~HostRecorder();
+  bool init(const Path& path, bool server, Time time);
+  void begin(uint8 type, Time time);
+  void write8(uint8 value);
+  void writeVarint(uint32 value);
+  void writeBytes(const void* data, size_t size);
+private:
+  void run();
+  std::ofstream m_stream;
+  std::vector<uint8> m_buffer;
+  std::vector<std::vector<uint8>> m_pending;
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::thread m_thread;
+  bool m_running;
+  Time m_time;
+};
+
+HostRecorder::HostRecorder():
+  m_running(false),
+  m_time(0.0)
 {
-  if (objectID < m_objects.size())
-    return m_objects[objectID];
-  else
-    return nullptr;
 }
 
-PacketData Host::createEvent(EventID eventID, NetworkObjectID recipientID)
+HostRecorder::~HostRecorder()
 {
-  const size_t size = MAX_EVENT_SIZE + sizeof(EventID) + sizeof(NetworkObjectID);
+  if (!m_running)
+    return;
 
-  PacketData data(allocatePacketData(size), size);
-  data.write16(recipientID);
-  data.write8(eventID);
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pending.push_back(std::move(m_buffer));
+    m_running = false;
+  }
 
-  return data;
+  m_condition.notify_one();
+  m_thread.join();
 }
 
-bool Host::dispatchEvent(TargetID sourceID, PacketData& data)
+bool HostRecorder::init(const Path& path, bool server, Time time)
 {
-  const NetworkObjectID recipientID = data.read16();
-  const EventID eventID = data.read8();
+  m_time = time;
 
-  NetworkObject* object = findObject(recipientID);
-  if (!object)
+  m_stream.open(path.name(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!m_stream)
   {
-    if (isClient() || m_objectIDs.bucketOf(recipientID) == ID_BUCKET_UNUSED)
-      logError("Failed to find recipient object %u", recipientID);
+    logError("Failed to create traffic log %s", path.name().c_str());
+    return false;
+  }
+
+  m_buffer.reserve(RECORDING_BUFFER_SIZE * 2);
+  writeBytes("NORL", 4);
+  write8(RECORDING_VERSION);
+  write8(server);
+
+  m_running = true;
 
+  try
+  {
+    m_thread = std::thread(&HostRecorder::run, this);
+  }
+  catch (const std::system_error& e)
+  {
+    logError("Failed to start traffic log writer thread: %s", e.what());
+    m_running = false;
     return false;
   }
 
-  object->receiveEvent(sourceID, data, eventID);
   return true;
 }
 
-bool Host::isClient() const
-{
-  return !m_server;
-}
-
-bool Host::isServer() const
+void HostRecorder::begin(uint8 type, Time time)
 {
-  return m_server;
-}
+  if (m_buffer.size() >= RECORDING_BUFFER_SIZE)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_pending.push_back(std::move(m_buffer));
+    }
 
-uint Host::totalIncomingBytes() const
-{
-  return ((ENetHost*) m_object)->totalReceivedData;
-}
+    m_condition.notify_one();
 
-uint Host::totalOutgoingBytes() const
-{
-  return ((ENetHost*) m_object)->totalSentData;
-}
+    m_buffer = std::vector<uint8>();
+    m_buffer.reserve(RECORDING_BUFFER_SIZE * 2);
+  }
 
-uint Host::incomingBytesPerSecond() const
-{
-  return ((ENetHost*) m_object)->incomingBandwidth;
-}
+  const Time elapsed = max(time - m_time, 0.0);
+  m_time = time;
 
-uint Host::outgoingBytesPerSecond() const
-{
-  return ((ENetHost*) m_object)->outgoingBandwidth;
+  write8(type);
+  writeVarint(uint32(min(elapsed * 1000000.0, 4294967295.0)));
 }
 
-void Host::setObserver(HostObserver* newObserver)
+void HostRecorder::write8(uint8 value)
 {
-  m_observer = newObserver;
+  m_buffer.push_back(value);
 }
 
-std::unique_ptr<Host> Host::create(uint16 port,
-                                   size_t maxClientCount,
-                                   uint8 maxChannelCount)
+void HostRecorder::writeVarint(uint32 value)
 {
-  std::unique_ptr<Host> host(new Host());
-  if (!host->init(port, maxClientCount, maxChannelCount))
-    return nullptr;
+  while (value >= 0x80)
+  {
+    m_buffer.push_back(uint8(value | 0x80));
+    value >>= 7;
+  }
 
-  return host;
+  m_buffer.push_back(uint8(value));
 }
 
-std::unique_ptr<Host> Host::connect(const std::string& name,
-                                    uint16 port,
-                                    uint8 maxChannelCount)
+void HostRecorder::writeBytes(const void* data, size_t size)
 {
-  std::unique_ptr<Host> host(new Host());
-  if (!host->init(name, port, maxChannelCount))
-    return nullptr;
-
-  return host;
+  const uint8* bytes = static_cast<const uint8*>(data);
+  m_buffer.insert(m_buffer.end(), bytes, bytes + size);
 }
 
-Host::Host():
-  m_object(nullptr),
-  m_observer(nullptr),
-  m_clientIDs(FIRST_CLIENT),
-  m_objectIDs(OBJECT_ID_POOL_BASE),
-  m_allocated(0)
+void HostRecorder::run()
 {
-}
+  std::vector<std::vector<uint8>> buffers;
 
-bool Host::init(uint16 port, size_t maxClientCount, uint8 maxChannelCount)
-{
-  if (!m_count)
+  for (;;)
   {
-    if (enet_initialize())
-      return false;
-  }
+    bool running;
 
-  m_count++;
-  m_server = true;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_condition.wait(lock, [this]() { return !m_pending.empty() || !m_running; });
+      buffers.swap(m_pending);
+      running = m_running;
+    }
 
-  ENetAddress address;
-  address.host = ENET_HOST_ANY;
-  address.port = port;
+    for (const auto& b : buffers)
+      m_stream.write((const char*) b.data(), b.size());
 
-  m_object = enet_host_create(&address, maxClientCount, maxChannelCount, 0, 0);
-  if (!m_object)
-  {
-    logError("Failed to create ENet server host");
-    return false;
-  }
+    buffers.clear();
 
-  if (enet_host_compress_with_range_coder((ENetHost*) m_object) < 0)
-  {
-    logError("Failed to create ENet range compressor");
-    return false;
+    if (!running)
+      break;
   }
 
-  return true;
+  m_stream.flush();
 }
 
-bool Host::init(const std::string& name, uint16 port, uint8 maxChannelCount)
+/*! @brief Reader of traffic logs for replay.
+ */
+class HostReplay
 {
-  if (!m_count)
+public:
+  bool init(const Path& path, bool& server);
+  bool next();
+  bool read8(uint8& value);
+  bool readVarint(uint32& value);
+  bool readBytes(void* data, size_t size);
+  ENetPeer* peer(TargetID id);
+  std::ifstream stream;
+  std::vector<std::unique_ptr<ENetPeer>> peers;
+  std::vector<uint8> data;
+  bool realTime;
+  bool pending;
+  uint8 type;
+  Time time;
+  Time start;
+  uint32 connectCount;
+};
+
+bool HostReplay::init(const Path& path, bool& server)
+{
+  stream.open(path.name(), std::ios::in | std::ios::binary);
+  if (!stream)
   {
-    if (enet_initialize())
-      return false;
+    logError("Failed to open traffic log %s", path.name().c_str());
+    return false;
   }
 
-  m_count++;
-  m_server = false;
+  char magic[4];
+  uint8 version, flags;
 
-  m_object = enet_host_create(nullptr, 1, maxChannelCount, 0, 0);
-  if (!m_object)
+  if (!readBytes(magic, sizeof(magic)) || std::memcmp(magic, "NORL", 4) != 0 ||
+      !read8(version) || !read8(flags))
   {
-    logError("Failed to create ENet client host");
+    logError("File %s is not a traffic log", path.name().c_str());
     return false;
   }
 
-  if (enet_host_compress_with_range_coder((ENetHost*) m_object) < 0)
+  if (version != RECORDING_VERSION)
   {
-    logError("Failed to create ENet range compressor");
+    logError("Traffic log %s has unsupported version %u",
+             path.name().c_str(),
+             version);
     return false;
   }
 
-  ENetAddress address;
-  address.port = port;
+  server = flags != 0;
+  pending = false;
+  time = 0.0;
+  start = 0.0;
+  connectCount = 0;
+  return true;
+}
 
-  if (enet_address_set_host(&address, name.c_str()) < 0)
-  {
-    logError("Failed to resolve server name %s", name.c_str());
-    return false;
-  }
+bool HostReplay::next()
+{
+  uint32 elapsed;
 
-  ENetPeer* peer = enet_host_connect((ENetHost*) m_object,
-                                     &address,
-                                     ENET_PROTOCOL_MAXIMUM_CHANNEL_COUNT,
-                                     0);
-  if (!peer)
-  {
-    logError("Failed to connect to server %s:%u", name.c_str(), port);
+  if (!read8(type) || !readVarint(elapsed))
     return false;
-  }
 
+  time += elapsed / 1000000.0;
+  pending = true;
   return true;
 }
 
-bool Host::broadcast(ChannelID channel, PacketType type, const PacketData& data)
+bool HostReplay::read8(uint8& value)
 {
-  if (!isServer())
-  {
-    logError("Only the server is allowed to broadcast");
+  const int c = stream.get();
+  if (c == EOF)
     return false;
-  }
 
-  uint32 flags = 0;
-
-  if (type == RELIABLE)
-    flags |= ENET_PACKET_FLAG_RELIABLE;
-  else
-  {
-    if (type == UNSEQUENCED)
-      flags |= ENET_PACKET_FLAG_UNSEQUENCED;
+  value = uint8(c);
+  return true;
+}
 
-    flags |= ENET_PACKET_FLAG_NO_ALLOCATE;
-  }
+bool HostReplay::readVarint(uint32& value)
+{
+  value = 0;
 
-  ENetPacket* packet = enet_packet_create(data.data(), data.size(), flags);
-  if (!packet)
+  for (uint shift = 0;  shift < 35;  shift += 7)
   {
-    logError("Failed to create ENet packet");
-    return false;
+    uint8 byte;
+    if (!read8(byte))
+      return false;
+
+    value |= uint32(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
   }
 
-  enet_host_broadcast((ENetHost*) m_object, channel, packet);
-  return true;
+  return false;
 }
 
-uint Host::m_count = 0;
+bool HostReplay::readBytes(void* target, size_t size)
+{
+  stream.read((char*) target, size);
+  return size_t(stream.gcount()) == size;
+}
 
-NetworkObject::NetworkObject(Host& host, NetworkObjectID objectID):
-  m_id(objectID),
-  m_host(host)
+ENetPeer* HostReplay::peer(TargetID id)
 {
-  if (isOnServer())
-  {
-    if (m_id == OBJECT_ID_INVALID)
-      m_id = m_host.m_objectIDs.allocateID();
-  }
-  else
+  if (peers.size() <= id)
+    peers.resize(id + 1);
+
+  if (!peers[id])
   {
-    if (m_id == OBJECT_ID_INVALID)
-      panic("Object on client created with invalid ID");
+    peers[id].reset(new ENetPeer());
+    std::memset(peers[id].get(), 0, sizeof(ENetPeer));
   }
 
-  auto& objects = m_host.m_objects;
-
-  if (objects.size() <= m_id)
-    objects.insert(objects.end(), m_id * 2 - objects.size(), nullptr);
-
-  objects[m_id] = this;
+  return peers[id].get();
 }
 
-NetworkObject::~NetworkObject()
+PacketData::PacketData():
+  m_block(nullptr),
+  m_data(nullptr),
+  m_capacity(0),
+  m_size(0),
+  m_offset(0),
+  m_writeBits(0),
+  m_readBits(0)
 {
-  if (isOnServer() && m_id >= OBJECT_ID_POOL_BASE)
-    m_host.m_objectIDs.releaseID(m_id);
-
-  m_host.m_objects[m_id] = nullptr;
 }
 
-void NetworkObject::synchronize()
+PacketData::PacketData(void* data, size_t capacity, size_t size):
+  m_block(nullptr),
+  m_data(static_cast<uint8*>(data)),
+  m_capacity(capacity),
+  m_size(size),
+  m_offset(0),
+  m_writeBits(0),
+  m_readBits(0)
 {
 }
 
-PacketData NetworkObject::createEvent(EventID eventID, NetworkObjectID recipientID) const
+PacketData::PacketData(const PacketData& source):
+  m_block(source.m_block),
+  m_data(source.m_data),
+  m_capacity(source.m_capacity),
+  m_size(source.m_size),
+  m_offset(source.m_offset),
+  m_writeBits(source.m_writeBits),
+  m_readBits(source.m_readBits)
 {
-  return m_host.createEvent(eventID, recipientID);
+  if (m_block)
+    m_block->pool->retain(m_block);
 }
 
-bool NetworkObject::broadcastEvent(ChannelID channelID,
-                                   PacketType type,
-                                   PacketData& data) const
+PacketData::~PacketData()
 {
-  return sendEvent(BROADCAST, channelID, type, data);
+  if (m_block)
+    m_block->pool->release(m_block);
 }
 
-bool NetworkObject::broadcastEvent(ChannelID channelID,
-                                   PacketType type,
-                                   NetworkObjectID recipientID,
-                                   EventID eventID) const
+PacketData& PacketData::operator = (const PacketData& source)
 {
-  return sendEvent(BROADCAST, channelID, type, recipientID, eventID);
+  if (source.m_block)
+    source.m_block->pool->retain(source.m_block);
+
+  if (m_block)
+    m_block->pool->release(m_block);
+
+  m_block = source.m_block;
+  m_data = source.m_data;
+  m_capacity = source.m_capacity;
+  m_size = source.m_size;
+  m_offset = source.m_offset;
+  m_writeBits = source.m_writeBits;
+  m_readBits = source.m_readBits;
+  return *this;
 }
 
-bool NetworkObject::sendEvent(TargetID targetID,
-                              ChannelID channelID,
-                              PacketType type,
-                              PacketData& data) const
+uint8 PacketData::read8()
 {
-  return m_host.sendPacketTo(targetID, channelID, type, data);
+  uint8 value;
+  if (!read8(value))
+    panic("Packet data buffer underflow");
+
+  return value;
 }
 
-bool NetworkObject::sendEvent(TargetID targetID,
-                              ChannelID channelID,
-                              PacketType type,
-                              NetworkObjectID recipientID,
-                              EventID eventID) const
+uint16 PacketData::read16()
 {
-  PacketData event = createEvent(eventID, recipientID);
-  return sendEvent(targetID, channelID, type, event);
+  uint16 value;
+  if (!read16(value))
+    panic("Packet data buffer underflow");
+
+  return value;
 }
 
-void NetworkObject::receiveEvent(TargetID senderID,
-                                 PacketData& data,
-                                 EventID eventID)
+uint32 PacketData::read32()
 {
+  uint32 value;
+  if (!read32(value))
+    panic("Packet data buffer underflow");
+
+  return value;
+}
+
+float PacketData::read32f()
+{
+  return uintBitsToFloat(read32());
+}
+
+bool PacketData::read8(uint8& value)
+{
+  if (m_offset + 1 > m_size)
+    return false;
+
+  m_readBits = 0;
+  value = m_data[m_offset++];
+  return true;
+}
+
+bool PacketData::read16(uint16& value)
+{
+  if (m_offset + 2 > m_size)
+    return false;
+
+  m_readBits = 0;
+
+  value = ntohs(*(uint16*) (m_data + m_offset));
+  m_offset += 2;
+  return true;
+}
+
+bool PacketData::read32(uint32& value)
+{
+  if (m_offset + 4 > m_size)
+    return false;
+
+  m_readBits = 0;
+
+  value = ntohl(*(uint32*) (m_data + m_offset));
+  m_offset += 4;
+  return true;
+}
+
+bool PacketData::require(size_t bitCount) const
+{
+  return (m_size - m_offset) * 8 + m_readBits >= bitCount;
+}
+
+uint32 PacketData::readBits(uint count)
+{
+  if (!require(count))
+    panic("Packet data buffer underflow");
+
+  return readBitsUnchecked(count);
+}
+
+uint32 PacketData::readBitsUnchecked(uint count)
+{
+  assert(count > 0 && count <= 32);
+  assert(require(count));
+
+  uint32 value = 0;
+  uint shift = 0;
+
+  while (count)
+  {
+    if (!m_readBits)
+    {
+      m_offset++;
+      m_readBits = 8;
+    }
+
+    // Bits are packed starting from the least significant bit of each byte
+    const uint used = 8 - m_readBits;
+    const uint n = min(count, uint(m_readBits));
+    const uint32 bits = (m_data[m_offset - 1] >> used) & ((1u << n) - 1);
+
+    value |= bits << shift;
+    shift += n;
+    count -= n;
+    m_readBits -= n;
+  }
+
+  return value;
+}
+
+uint32 PacketData::readVarint()
+{
+  uint32 value;
+  if (!readVarint(value))
+    panic("Invalid variable length integer in packet data");
+
+  return value;
+}
+
+bool PacketData::readVarint(uint32& value)
+{
+  uint32 result = 0;
+
+  for (uint i = 0;  i < 5;  i++)
+  {
+    if (m_offset + i + 1 > m_size)
+      return false;
+
+    const uint8 byte = m_data[m_offset + i];
+    result |= uint32(byte & 0x7f) << (i * 7);
+
+    if (!(byte & 0x80))
+    {
+      m_offset += i + 1;
+      m_readBits = 0;
+      value = result;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+float PacketData::readFloat(float minValue, float maxValue, uint bits)
+{
+  if (!require(bits))
+    panic("Packet data buffer underflow");
+
+  return readFloatUnchecked(minValue, maxValue, bits);
+}
+
+float PacketData::readFloatUnchecked(float minValue, float maxValue, uint bits)
+{
+  const double steps = double((uint64(1) << bits) - 1);
+  const double scaled = double(readBitsUnchecked(bits)) / steps;
+  return minValue + float((maxValue - minValue) * scaled);
+}
+
+quat PacketData::readQuat(uint bits)
+{
+  const float range = 0.707107f;
+
+  if (!require(2 + bits * 3))
+    panic("Packet data buffer underflow");
+
+  const uint largest = readBitsUnchecked(2);
+
+  float components[4];
+  float sum = 0.f;
+
+  for (uint i = 0;  i < 4;  i++)
+  {
+    if (i == largest)
+      continue;
+
+    components[i] = readFloatUnchecked(-range, range, bits);
+    sum += components[i] * components[i];
+  }
+
+  components[largest] = sqrt(max(0.f, 1.f - sum));
+
+  return quat(components[3], components[0], components[1], components[2]);
+}
+
+bool PacketData::readBytes(void* target, size_t count)
+{
+  if (m_offset + count > m_size)
+    return false;
+
+  std::memcpy(target, m_data + m_offset, count);
+  m_offset += count;
+  m_readBits = 0;
+  return true;
+}
+
+template <>
+std::string PacketData::read()
+{
+  if (!std::memchr(m_data + m_offset, '\0', m_size - m_offset))
+    panic("Missing null character in packet data");
+
+  std::string result((char*) (m_data + m_offset));
+  m_offset += result.length() + 1;
+  m_readBits = 0;
+  return result;
+}
+
+void PacketData::write8(uint8 value)
+{
+  reserve(m_size + 1);
+
+  m_data[m_size++] = value;
+  m_writeBits = 0;
+}
+
+void PacketData::write16(uint16 value)
+{
+  reserve(m_size + 2);
+
+  *((uint16*) (m_data + m_size)) = htons(value);
+  m_size += 2;
+  m_writeBits = 0;
+}
+
+void PacketData::write32(uint32 value)
+{
+  reserve(m_size + 4);
+
+  *((uint32*) (m_data + m_size)) = htonl(value);
+  m_size += 4;
+  m_writeBits = 0;
+}
+
+void PacketData::write32f(float value)
+{
+  write32(floatBitsToUint(value));
+}
+
+void PacketData::writeBits(uint32 value, uint count)
+{
+  assert(count > 0 && count <= 32);
+
+  while (count)
+  {
+    if (!m_writeBits)
+    {
+      reserve(m_size + 1);
+      m_data[m_size++] = 0;
+      m_writeBits = 8;
+    }
+
+    const uint used = 8 - m_writeBits;
+    const uint n = min(count, uint(m_writeBits));
+
+    m_data[m_size - 1] |= uint8((value & ((1u << n) - 1)) << used);
+    value = uint32(uint64(value) >> n);
+    count -= n;
+    m_writeBits -= n;
+  }
+}
+
+void PacketData::writeVarint(uint32 value)
+{
+  while (value >= 0x80)
+  {
+    write8(uint8(value | 0x80));
+    value >>= 7;
+  }
+
+  write8(uint8(value));
+}
+
+void PacketData::writeFloat(float value, float minValue, float maxValue, uint bits)
+{
+  assert(bits > 0 && bits <= 32);
+
+  // Quantize in double precision, as a float cannot represent every step of
+  // a 32 bit range and would overflow it at the maximum value
+  const uint64 steps = (uint64(1) << bits) - 1;
+  const double scaled = (double(clamp(value, minValue, maxValue)) - minValue) /
+                        (double(maxValue) - minValue);
+  const uint64 step = uint64(scaled * double(steps) + 0.5);
+  writeBits(uint32(min(step, steps)), bits);
+}
+
+void PacketData::writeQuat(const quat& value, uint bits)
+{
+  const float range = 0.707107f;
+  const float components[] = { value.x, value.y, value.z, value.w };
+
+  uint largest = 0;
+
+  for (uint i = 1;  i < 4;  i++)
+  {
+    if (abs(components[i]) > abs(components[largest]))
+      largest = i;
+  }
+
+  // The largest component is rebuilt as positive, so flip the sign of the
+  // quaternion if needed, which represents the same rotation
+  const float sign = components[largest] < 0.f ? -1.f : 1.f;
+
+  writeBits(largest, 2);
+
+  for (uint i = 0;  i < 4;  i++)
+  {
+    if (i != largest)
+      writeFloat(components[i] * sign, -range, range, bits);
+  }
+}
+
+void PacketData::writeBytes(const void* source, size_t count)
+{
+  reserve(m_size + count);
+  std::memcpy(m_data + m_size, source, count);
+  m_size += count;
+  m_writeBits = 0;
+}
+
+template <>
+void PacketData::write(const std::string& value)
+{
+  for (char c : value)
+    write8(c);
+
+  write8('\0');
+}
+
+bool PacketData::isEmpty()
+{
+  return m_offset == m_size;
+}
+
+size_t PacketData::size() const
+{
+  return m_size;
+}
+
+size_t PacketData::capacity() const
+{
+  return m_capacity;
+}
+
+const void* PacketData::data() const
+{
+  return m_data;
+}
+
+void PacketData::reserve(size_t size)
+{
+  if (size <= m_capacity)
+    return;
+
+  if (!m_block)
+    panic("Packet data buffer overflow");
+
+  // Grow geometrically into a new block, leaving any other descriptors
+  // sharing the old block unaffected
+  PacketPool* pool = m_block->pool;
+  PacketBlock* block = pool->allocate(max(size, m_capacity * 2));
+  std::memcpy(block->data(), m_data, m_size);
+  pool->release(m_block);
+
+  m_block = block;
+  m_data = block->data();
+  m_capacity = block->capacity;
+}
+
+bool Peer::sendPacket(ChannelID channel,
+                      PacketType type,
+                      const PacketData& data)
+{
+  void* packet = m_host->createENetPacket(data, type);
+  if (!packet)
+    return false;
+
+  return m_host->sendENetPacket(this, channel, packet);
+}
+
+void Peer::disconnect(uint32 reason)
+{
+  m_disconnecting = true;
+  m_reason = reason;
+  m_host->disconnectPeer(*this, reason);
+}
+
+uint32 Peer::address() const
+{
+  return m_address;
+}
+
+Time Peer::roundTripTime() const
+{
+  // The service thread or simulation owns the ENet peer, so use the time it
+  // last reported
+  if (m_host->isQueued())
+    return (Time) m_roundTripTime / 1000.0;
+
+  return (Time) ((ENetPeer*) m_peer)->roundTripTime / 1000.0;
+}
+
+void Peer::addView(const Sphere& view)
+{
+  View v;
+  v.sphere = view;
+  v.box = AABB(view.center, vec3(view.radius * 2.f));
+  v.spherical = true;
+  m_views.push_back(v);
+  m_viewsChanged = true;
+}
+
+void Peer::addView(const AABB& view)
+{
+  View v;
+  v.box = view;
+  v.spherical = false;
+  m_views.push_back(v);
+  m_viewsChanged = true;
+}
+
+void Peer::setView(size_t index, const Sphere& view)
+{
+  assert(index < m_views.size());
+
+  View& v = m_views[index];
+  v.sphere = view;
+  v.box = AABB(view.center, vec3(view.radius * 2.f));
+  v.spherical = true;
+  m_viewsChanged = true;
+}
+
+void Peer::setView(size_t index, const AABB& view)
+{
+  assert(index < m_views.size());
+
+  View& v = m_views[index];
+  v.box = view;
+  v.spherical = false;
+  m_viewsChanged = true;
+}
+
+void Peer::clearViews()
+{
+  m_views.clear();
+  m_viewsChanged = true;
+}
+
+bool Peer::isRelevant(NetworkObjectID objectID) const
+{
+  return m_host->isRelevant(*this, objectID);
+}
+
+Peer::Peer(Host& host, void* peer, TargetID targetID, const char* name):
+  m_host(&host),
+  m_peer(peer),
+  m_connectID(0),
+  m_address(0),
+  m_roundTripTime(0),
+  m_id(targetID),
+  m_generation(0),
+  m_index(0),
+  m_name(name),
+  m_disconnecting(false),
+  m_reason(0),
+  m_ackedSnapshot(0),
+  m_credit(0.0),
+  m_viewsChanged(false)
+{
+}
+
+HostObserver::~HostObserver()
+{
+}
+
+Host::~Host()
+{
+  if (m_threaded)
+  {
+    m_running = false;
+    m_thread.join();
+    m_threaded = false;
+
+    flushServiceQueues(false);
+  }
+
+  if (m_simulation)
+    m_simulation->detach(*this);
+
+  if (m_replay)
+    drainOutbound();
+
+  if (m_simulation || m_replay)
+  {
+    m_peers.clear();
+    m_peerTable.clear();
+    return;
+  }
+
+  for (Peer* p : m_peers)
+    enet_peer_disconnect_now((ENetPeer*) p->m_peer, 0);
+
+  m_peers.clear();
+  m_peerTable.clear();
+
+  if (m_object)
+  {
+    enet_host_flush((ENetHost*) m_object);
+    enet_host_destroy((ENetHost*) m_object);
+    m_object = nullptr;
+  }
+
+  m_count--;
+  if (!m_count)
+    enet_deinitialize();
+}
+
+bool Host::sendPacketTo(TargetID targetID,
+                        ChannelID channel,
+                        PacketType type,
+                        const PacketData& data)
+{
+  switch (targetID)
+  {
+    case LOCAL:
+    {
+      if (m_observer)
+      {
+        PacketData copy = data;
+        m_observer->onPacketReceived(targetID, copy);
+      }
+
+      return true;
+    }
+
+    case BROADCAST:
+      return broadcast(channel, type, data);
+
+    case SERVER:
+    {
+      if (isServer())
+        return sendPacketTo(LOCAL, channel, type, data);
+
+      /* FALLTHROUGH */
+    }
+
+    default:
+    {
+      Peer* peer = findPeer(targetID);
+      if (!peer)
+      {
+        logError("Cannot send event to unknown peer %u", targetID);
+        return false;
+      }
+
+      return peer->sendPacket(channel, type, data);
+    }
+  }
+}
+
+bool Host::update(Time timeout)
+{
+  bool status = true;
+
+  const Time now = time();
+  const Time deltaTime = now - m_updateTime;
+  m_updateTime = now;
+
+  if (m_recorder)
+    m_recorder->begin(RECORD_UPDATE, now);
+
+  updateInterest();
+
+  for (Peer* p : m_peers)
+  {
+    if (!schedule(*p, deltaTime))
+      status = false;
+  }
+
+  if (m_replay)
+  {
+    if (!replayRecords())
+      status = false;
+  }
+  else if (isQueued())
+  {
+    ServiceEvent e;
+
+    while (m_queues->inbound.pop(e))
+    {
+      if (!handleEvent(e))
+        status = false;
+    }
+  }
+  else
+  {
+    ENetEvent event;
+    enet_uint32 ms = (enet_uint32) (timeout * 1000.0);
+
+    while (enet_host_service((ENetHost*) m_object, &event, ms) > 0)
+    {
+      ServiceEvent e(event);
+
+      if (!handleEvent(e))
+        status = false;
+    }
+
+    enet_host_flush((ENetHost*) m_object);
+  }
+
+  return status;
+}
+
+bool Host::startServiceThread(uint frequency)
+{
+  if (m_threaded)
+    return true;
+
+  if (m_simulation || m_replay)
+  {
+    logError("Cannot start a service thread for a simulated or replaying host");
+    return false;
+  }
+
+  if (!frequency)
+  {
+    logError("Invalid network service frequency");
+    return false;
+  }
+
+  if (!m_queues)
+    m_queues.reset(new ServiceQueues());
+
+  m_running = true;
+  m_threaded = true;
+
+  try
+  {
+    m_thread = std::thread(&Host::service, this, frequency);
+  }
+  catch (const std::system_error& e)
+  {
+    logError("Failed to start network service thread: %s", e.what());
+    m_running = false;
+    m_threaded = false;
+    return false;
+  }
+
+  return true;
+}
+
+void Host::stopServiceThread()
+{
+  if (!m_threaded)
+    return;
+
+  m_running = false;
+  m_thread.join();
+  m_threaded = false;
+
+  flushServiceQueues(true);
+}
+
+bool Host::replicate(ChannelID channel)
+{
+  if (!isServer())
+  {
+    logError("Only the server is allowed to replicate objects");
+    return false;
+  }
+
+  updateInterest();
+
+  Snapshot& current = m_snapshots->scratch;
+  // Sequence number zero means no snapshot, so it is skipped on wrap-around
+  uint32 sequence = m_snapshots->latest + 1;
+  if (!sequence)
+    sequence++;
+
+  current.reset(sequence);
+
+  for (size_t i = 0;  i < m_objects.size();  i++)
+  {
+    NetworkObject* object = m_objects[i];
+    if (!object || !object->m_replicaSize)
+      continue;
+
+    const bool bounded = m_interest && object->m_bounded;
+
+    object->synchronize();
+    object->captureReplicas(current.add(NetworkObjectID(i),
+                                        object->m_replicaSize,
+                                        bounded));
+  }
+
+  m_snapshots->commit();
+
+  bool status = true;
+
+  for (Peer* p : m_peers)
+  {
+    if (!sendSnapshot(*p, channel))
+      status = false;
+  }
+
+  return status;
+}
+
+PacketData Host::allocatePacketData(size_t capacity)
+{
+  PacketBlock* block = m_pool->allocate(capacity);
+
+  PacketData data(block->data(), block->capacity);
+  data.m_block = block;
+  return data;
+}
+
+Peer* Host::findPeer(TargetID targetID)
+{
+  if (targetID < m_peerTable.size())
+    return m_peerTable[targetID].get();
+  else
+    return nullptr;
+}
+
+Peer* Host::findPeer(TargetID targetID, uint32 generation)
+{
+  Peer* peer = findPeer(targetID);
+  if (peer && peer->m_generation == generation)
+    return peer;
+  else
+    return nullptr;
+}
+
+NetworkObject* Host::findObject(NetworkObjectID objectID)
+{
+  if (objectID < m_objects.size())
+    return m_objects[objectID];
+  else
+    return nullptr;
+}
+
+PacketData Host::createEvent(EventID eventID, NetworkObjectID recipientID)
+{
+  PacketData data = allocatePacketData(INITIAL_EVENT_SIZE);
+  data.write16(recipientID);
+  data.write8(eventID);
+
+  return data;
+}
+
+bool Host::dispatchEvent(TargetID sourceID, PacketData& data)
+{
+  NetworkObjectID recipientID;
+  EventID eventID;
+
+  // Event headers come straight off the wire, so truncated ones are rejected
+  if (!data.read16(recipientID) || !data.read8(eventID))
+  {
+    logError("Truncated event from peer %u", sourceID);
+    return false;
+  }
+
+  if (recipientID == OBJECT_ID_BATCH)
+    return dispatchBatch(sourceID, data);
+
+  if (recipientID == OBJECT_ID_SNAPSHOT)
+  {
+    if (isClient() && eventID == SNAPSHOT_DATA)
+      return receiveSnapshot(sourceID, data);
+
+    if (isServer() && eventID == SNAPSHOT_ACK)
+    {
+      uint32 sequence;
+      if (!data.read32(sequence))
+      {
+        logError("Truncated snapshot acknowledgement from peer %u", sourceID);
+        return false;
+      }
+
+      Peer* peer = findPeer(sourceID);
+      if (peer && sequence &&
+          (!peer->m_ackedSnapshot ||
+           isNewerSequence(sequence, peer->m_ackedSnapshot)) &&
+          !isNewerSequence(sequence, m_snapshots->latest))
+      {
+        peer->m_ackedSnapshot = sequence;
+      }
+
+      return true;
+    }
+
+    logError("Invalid snapshot event %u", eventID);
+    return false;
+  }
+
+  NetworkObject* object = findObject(recipientID);
+  if (!object)
+  {
+    if (isClient() || m_objectIDs.bucketOf(recipientID) == ID_BUCKET_UNUSED)
+      logError("Failed to find recipient object %u", recipientID);
+
+    return false;
+  }
+
+  object->receiveEvent(sourceID, data, eventID);
+  return true;
+}
+
+bool Host::isClient() const
+{
+  return !m_server;
+}
+
+bool Host::isServer() const
+{
+  return m_server;
+}
+
+uint Host::totalIncomingBytes() const
+{
+  if (isQueued())
+    return m_totalIncoming;
+
+  return ((ENetHost*) m_object)->totalReceivedData;
+}
+
+uint Host::totalOutgoingBytes() const
+{
+  if (isQueued())
+    return m_totalOutgoing;
+
+  return ((ENetHost*) m_object)->totalSentData;
+}
+
+uint Host::incomingBytesPerSecond() const
+{
+  if (isQueued())
+    return m_incomingBandwidth;
+
+  return ((ENetHost*) m_object)->incomingBandwidth;
+}
+
+uint Host::outgoingBytesPerSecond() const
+{
+  if (isQueued())
+    return m_outgoingBandwidth;
+
+  return ((ENetHost*) m_object)->outgoingBandwidth;
+}
+
+Time Host::time() const
+{
+  if (m_simulation)
+    return m_simulation->time();
+
+  return m_timer.time();
+}
+
+size_t Host::packetMemoryUsage() const
+{
+  return m_pool->usage;
+}
+
+size_t Host::packetMemoryHighWater() const
+{
+  return m_pool->highWater;
+}
+
+void Host::setPeerBandwidth(uint newBandwidth)
+{
+  m_peerBandwidth = newBandwidth;
+}
+
+bool Host::setInterestManagement(bool enabled, float cellSize)
+{
+  if (!enabled)
+  {
+    m_interest.reset();
+    return true;
+  }
+
+  if (cellSize <= 0.f)
+  {
+    logError("Invalid interest grid cell size %f", cellSize);
+    return false;
+  }
+
+  m_interest.reset(new InterestGrid(cellSize));
+
+  for (size_t i = 0;  i < m_objects.size();  i++)
+  {
+    if (m_objects[i] && m_objects[i]->m_bounded)
+      m_interest->place(NetworkObjectID(i), m_objects[i]->m_bounds);
+  }
+
+  for (Peer* p : m_peers)
+    p->m_viewsChanged = true;
+
+  return true;
+}
+
+void Host::setObserver(HostObserver* newObserver)
+{
+  m_observer = newObserver;
+}
+
+bool Host::startRecording(const Path& path)
+{
+  stopRecording();
+
+  std::unique_ptr<HostRecorder> recorder(new HostRecorder());
+  if (!recorder->init(path, isServer(), time()))
+    return false;
+
+  m_recorder = std::move(recorder);
+  return true;
+}
+
+void Host::stopRecording()
+{
+  m_recorder.reset();
+}
+
+std::unique_ptr<Host> Host::create(uint16 port,
+                                   size_t maxClientCount,
+                                   uint8 maxChannelCount)
+{
+  std::unique_ptr<Host> host(new Host());
+  if (!host->init(port, maxClientCount, maxChannelCount))
+    return nullptr;
+
+  return host;
+}
+
+std::unique_ptr<Host> Host::connect(const std::string& name,
+                                    uint16 port,
+                                    uint8 maxChannelCount)
+{
+  std::unique_ptr<Host> host(new Host());
+  if (!host->init(name, port, maxChannelCount))
+    return nullptr;
+
+  return host;
+}
+
+std::unique_ptr<Host> Host::replay(const Path& path, bool realTime)
+{
+  std::unique_ptr<Host> host(new Host());
+  if (!host->init(path, realTime))
+    return nullptr;
+
+  return host;
+}
+
+Host::Host():
+  m_object(nullptr),
+  m_observer(nullptr),
+  m_clientIDs(FIRST_CLIENT),
+  m_objectIDs(OBJECT_ID_POOL_BASE),
+  m_pool(new PacketPool()),
+  m_snapshots(new SnapshotHistory()),
+  m_snapshotBytes(0),
+  m_running(false),
+  m_totalIncoming(0),
+  m_totalOutgoing(0),
+  m_incomingBandwidth(0),
+  m_outgoingBandwidth(0),
+  m_peerBandwidth(0),
+  m_droppedEventCount(0),
+  m_savedMessageCount(0),
+  m_simulation(nullptr),
+  m_updateTime(0.0),
+  m_threaded(false)
+{
+  m_timer.start();
+}
+
+bool Host::init(uint16 port, size_t maxClientCount, uint8 maxChannelCount)
+{
+  if (!m_count)
+  {
+    if (enet_initialize())
+      return false;
+  }
+
+  m_count++;
+  m_server = true;
+
+  ENetAddress address;
+  address.host = ENET_HOST_ANY;
+  address.port = port;
+
+  m_object = enet_host_create(&address, maxClientCount, maxChannelCount, 0, 0);
+  if (!m_object)
+  {
+    logError("Failed to create ENet server host");
+    return false;
+  }
+
+  if (enet_host_compress_with_range_coder((ENetHost*) m_object) < 0)
+  {
+    logError("Failed to create ENet range compressor");
+    return false;
+  }
+
+  return true;
+}
+
+bool Host::init(const std::string& name, uint16 port, uint8 maxChannelCount)
+{
+  if (!m_count)
+  {
+    if (enet_initialize())
+      return false;
+  }
+
+  m_count++;
+  m_server = false;
+
+  m_object = enet_host_create(nullptr, 1, maxChannelCount, 0, 0);
+  if (!m_object)
+  {
+    logError("Failed to create ENet client host");
+    return false;
+  }
+
+  if (enet_host_compress_with_range_coder((ENetHost*) m_object) < 0)
+  {
+    logError("Failed to create ENet range compressor");
+    return false;
+  }
+
+  ENetAddress address;
+  address.port = port;
+
+  if (enet_address_set_host(&address, name.c_str()) < 0)
+  {
+    logError("Failed to resolve server name %s", name.c_str());
+    return false;
+  }
+
+  ENetPeer* peer = enet_host_connect((ENetHost*) m_object,
+                                     &address,
+                                     ENET_PROTOCOL_MAXIMUM_CHANNEL_COUNT,
+                                     0);
+  if (!peer)
+  {
+    logError("Failed to connect to server %s:%u", name.c_str(), port);
+    return false;
+  }
+
+  return true;
+}
+
+bool Host::init(const Path& path, bool realTime)
+{
+  m_replay.reset(new HostReplay());
+  m_replay->realTime = realTime;
+
+  if (!m_replay->init(path, m_server))
+    return false;
+
+  m_queues.reset(new ServiceQueues());
+  return true;
+}
+
+bool Host::broadcast(ChannelID channel, PacketType type, const PacketData& data)
+{
+  if (!isServer())
+  {
+    logError("Only the server is allowed to broadcast");
+    return false;
+  }
+
+  const NetworkObjectID recipientID = recipientOf(data);
+  const NetworkObject* recipient = m_interest ? findObject(recipientID) : nullptr;
+
+  // Events for bounded objects become a send to each peer they are relevant
+  // to, all sharing the same pooled packet data
+  if (recipient && recipient->m_bounded)
+  {
+    bool status = true;
+
+    for (Peer* p : m_peers)
+    {
+      if (!isRelevant(*p, recipientID))
+      {
+        m_savedMessageCount++;
+        continue;
+      }
+
+      if (!p->sendPacket(channel, type, data))
+        status = false;
+    }
+
+    return status;
+  }
+
+  void* packet = createENetPacket(data, type);
+  if (!packet)
+    return false;
+
+  return sendENetPacket(nullptr, channel, packet);
+}
+
+bool Host::sendSnapshot(Peer& peer, ChannelID channel)
+{
+  const Snapshot& current = *m_snapshots->find(m_snapshots->latest);
+  const Snapshot* baseline = m_snapshots->find(peer.m_ackedSnapshot);
+
+  // The objects each peer was sent are recorded per snapshot, as the state
+  // of an object culled from a baseline is unknown to the peer
+  if (peer.m_visible.empty())
+    peer.m_visible.resize(SNAPSHOT_HISTORY_SIZE);
+
+  const Peer::VisibleSet* baseVisible = nullptr;
+
+  if (baseline)
+  {
+    baseVisible = &peer.m_visible[baseline->sequence % SNAPSHOT_HISTORY_SIZE];
+    if (baseVisible->sequence != baseline->sequence)
+      baseline = nullptr;
+  }
+
+  Peer::VisibleSet& visible = peer.m_visible[current.sequence % SNAPSHOT_HISTORY_SIZE];
+  visible.sequence = current.sequence;
+  visible.all = !m_interest || peer.m_views.empty();
+  visible.ids.clear();
+
+  if (!visible.all)
+    visible.ids = peer.m_relevantIDs;
+
+  auto sentInBaseline = [&](uint index)
+  {
+    return !baseline->bounded[index] || baseVisible->all ||
+           std::binary_search(baseVisible->ids.begin(),
+                              baseVisible->ids.end(),
+                              baseline->ids[index]);
+  };
+
+  PacketData data = allocatePacketData(INITIAL_SNAPSHOT_SIZE);
+  data.write16(OBJECT_ID_SNAPSHOT);
+  data.write8(SNAPSHOT_DATA);
+  data.write32(current.sequence);
+  data.writeVarint(baseline ? current.sequence - baseline->sequence : 0);
+
+  const uint baseCount = baseline ? baseline->count() : 0;
+  NetworkObjectID previousID = OBJECT_ID_INVALID;
+
+  // Writes the object at the specified index of the current snapshot and of
+  // the baseline, where either index may be past the end if it is missing
+  auto writeObject = [&](NetworkObjectID id, uint c, uint b)
+  {
+    // Objects only in the baseline have been destroyed
+    if (c == current.count())
+    {
+      if (sentInBaseline(b))
+      {
+        data.writeVarint(id - previousID);
+        data.writeVarint(0);
+        previousID = id;
+      }
+
+      return;
+    }
+
+    const uint size = current.sizeOf(c);
+    const bool culled = current.bounded[c] && !isRelevant(peer, id);
+    const uint8* state = current.dataOf(c);
+    const uint8* base = nullptr;
+    bool known = false;
+
+    if (b < baseCount)
+    {
+      known = sentInBaseline(b);
+      if (known && baseline->sizeOf(b) == size)
+        base = baseline->dataOf(b);
+    }
+
+    // Objects leaving the view of the peer are removed from its snapshots
+    if (culled)
+    {
+      if (known)
+      {
+        data.writeVarint(id - previousID);
+        data.writeVarint(0);
+        previousID = id;
+      }
+
+      return;
+    }
+
+    // Changed words are sent raw as their XOR against the baseline, so only
+    // the unchanged words are saved
+    const uint wordCount = (size + 3) / 4;
+    if (m_snapshotDelta.size() < size)
+      m_snapshotDelta.resize(size);
+
+    uint8* delta = m_snapshotDelta.data();
+    uint deltaSize = 0;
+
+    for (uint w = 0;  w < wordCount;  w++)
+    {
+      const uint start = w * 4, end = min(start + 4, size);
+
+      if (base && std::memcmp(state + start, base + start, end - start) == 0)
+        continue;
+
+      for (uint i = start;  i < end;  i++)
+        delta[deltaSize++] = base ? state[i] ^ base[i] : state[i];
+    }
+
+    if (base && !deltaSize)
+      return;
+
+    data.writeVarint(id - previousID);
+    data.writeVarint(size);
+    previousID = id;
+
+    // One mask bit per four byte word of state, set if the word has changed
+    for (uint w = 0;  w < wordCount;  w++)
+    {
+      const uint start = w * 4, end = min(start + 4, size);
+      const bool changed = !base || std::memcmp(state + start, base + start, end - start);
+      data.writeBits(changed, 1);
+    }
+
+    data.writeBytes(delta, deltaSize);
+  };
+
+  if (visible.all || (baseline && baseVisible->all))
+  {
+    uint c = 0, b = 0;
+
+    while (c < current.count() || b < baseCount)
+    {
+      if (c == current.count() ||
+          (b < baseCount && baseline->ids[b] < current.ids[c]))
+      {
+        writeObject(baseline->ids[b], current.count(), b);
+        b++;
+        continue;
+      }
+
+      const bool matched = b < baseCount && baseline->ids[b] == current.ids[c];
+      writeObject(current.ids[c], c, matched ? b : baseCount);
+
+      c++;
+      if (matched)
+        b++;
+    }
+  }
+  else
+  {
+    // Only objects that are unbounded, relevant to the peer or were sent in
+    // the baseline can end up in the snapshot, so the many objects out of
+    // view of the peer are never visited
+    std::vector<NetworkObjectID>& ids = m_snapshotIDs;
+    ids = peer.m_relevantIDs;
+
+    for (uint index : current.unbounded)
+      ids.push_back(current.ids[index]);
+
+    if (baseline)
+    {
+      for (uint index : baseline->unbounded)
+        ids.push_back(baseline->ids[index]);
+
+      ids.insert(ids.end(), baseVisible->ids.begin(), baseVisible->ids.end());
+    }
+
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    // Both snapshots are sorted by ID, so each search starts where the
+    // previous one ended
+    uint c = 0, b = 0;
+
+    for (NetworkObjectID id : ids)
+    {
+      c = current.lowerBound(id, c);
+      if (baseline)
+        b = baseline->lowerBound(id, b);
+
+      const bool inCurrent = c < current.count() && current.ids[c] == id;
+      const bool inBaseline = b < baseCount && baseline->ids[b] == id;
+
+      if (inCurrent || inBaseline)
+        writeObject(id, inCurrent ? c : current.count(), inBaseline ? b : baseCount);
+    }
+  }
+
+  data.writeVarint(0);
+
+  void* packet = createENetPacket(data, UNSEQUENCED);
+  if (!packet)
+    return false;
+
+  if (!sendENetPacket(&peer, channel, packet))
+    return false;
+
+  m_snapshotBytes += data.size();
+  return true;
+}
+
+bool Host::receiveSnapshot(TargetID sourceID, PacketData& data)
+{
+  uint32 sequence, baseDistance;
+
+  if (!data.read32(sequence) || !data.readVarint(baseDistance))
+  {
+    logError("Truncated snapshot from peer %u", sourceID);
+    return false;
+  }
+
+  // Snapshots arrive unsequenced, so older ones are simply dropped
+  if (!sequence ||
+      (m_snapshots->latest && !isNewerSequence(sequence, m_snapshots->latest)))
+  {
+    return true;
+  }
+
+  // The server only uses baselines still in its history, which has the same
+  // size as ours
+  if (baseDistance >= SNAPSHOT_HISTORY_SIZE)
+  {
+    logError("Invalid snapshot baseline from peer %u", sourceID);
+    return false;
+  }
+
+  const Snapshot* baseline = nullptr;
+
+  if (baseDistance)
+  {
+    baseline = m_snapshots->find(sequence - baseDistance);
+    if (!baseline)
+      return true;
+  }
+
+  Snapshot& current = m_snapshots->scratch;
+  current.reset(sequence);
+
+  uint b = 0;
+  const uint baseCount = baseline ? baseline->count() : 0;
+  NetworkObjectID id = OBJECT_ID_INVALID;
+
+  for (;;)
+  {
+    uint32 distance;
+    if (!data.readVarint(distance))
+    {
+      logError("Truncated snapshot from peer %u", sourceID);
+      return false;
+    }
+
+    if (!distance)
+      break;
+
+    if (id + distance > 65535)
+    {
+      logError("Invalid object ID in snapshot");
+      return false;
+    }
+
+    id += NetworkObjectID(distance);
+
+    // Objects not in the snapshot are unchanged since the baseline
+    while (b < baseCount && baseline->ids[b] < id)
+    {
+      std::memcpy(current.add(baseline->ids[b], baseline->sizeOf(b)),
+                  baseline->dataOf(b),
+                  baseline->sizeOf(b));
+      b++;
+    }
+
+    const uint8* base = nullptr;
+
+    uint32 size;
+    if (!data.readVarint(size))
+    {
+      logError("Truncated snapshot from peer %u", sourceID);
+      return false;
+    }
+
+    if (size > 65535)
+    {
+      logError("Invalid object size in snapshot");
+      return false;
+    }
+
+    if (b < baseCount && baseline->ids[b] == id)
+    {
+      if (baseline->sizeOf(b) == size)
+        base = baseline->dataOf(b);
+
+      b++;
+    }
+
+    if (!size)
+      continue;
+
+    uint8* state = current.add(id, size);
+    if (base)
+      std::memcpy(state, base, size);
+    else
+      std::memset(state, 0, size);
+
+    const uint wordCount = (size + 3) / 4;
+    if (m_snapshotDelta.size() < size)
+      m_snapshotDelta.resize(size);
+    if (m_snapshotMask.size() < wordCount)
+      m_snapshotMask.resize(wordCount);
+
+    uint8* delta = m_snapshotDelta.data();
+    uint8* changed = m_snapshotMask.data();
+    uint deltaSize = 0;
+
+    if (!data.require(wordCount))
+    {
+      logError("Truncated snapshot from peer %u", sourceID);
+      return false;
+    }
+
+    for (uint w = 0;  w < wordCount;  w++)
+    {
+      changed[w] = uint8(data.readBitsUnchecked(1));
+      if (changed[w])
+        deltaSize += min(w * 4 + 4, size) - w * 4;
+    }
+
+    // The changed words are bounds checked once for the whole object
+    if (!data.readBytes(delta, deltaSize))
+    {
+      logError("Truncated snapshot from peer %u", sourceID);
+      return false;
+    }
+
+    const uint8* source = delta;
+
+    for (uint w = 0;  w < wordCount;  w++)
+    {
+      if (!changed[w])
+        continue;
+
+      for (uint i = w * 4;  i < min(w * 4 + 4, size);  i++)
+        state[i] ^= *source++;
+    }
+
+    NetworkObject* object = findObject(id);
+    if (object && object->m_replicaSize == size)
+    {
+      object->applyReplicas(state);
+      object->synchronize();
+    }
+  }
+
+  while (b < baseCount)
+  {
+    std::memcpy(current.add(baseline->ids[b], baseline->sizeOf(b)),
+                baseline->dataOf(b),
+                baseline->sizeOf(b));
+    b++;
+  }
+
+  m_snapshots->commit();
+  m_snapshotBytes += data.size();
+
+  PacketData ack = createEvent(SNAPSHOT_ACK, OBJECT_ID_SNAPSHOT);
+  ack.write32(sequence);
+  return sendPacketTo(sourceID, 0, UNSEQUENCED, ack);
+}
+
+bool Host::queuePacketTo(TargetID targetID,
+                         ChannelID channel,
+                         PacketType type,
+                         const PacketData& data,
+                         float priority)
+{
+  if (targetID == LOCAL || (targetID == SERVER && isServer()))
+    return sendPacketTo(targetID, channel, type, data);
+
+  Peer::QueuedPacket packet;
+  packet.data = data;
+  packet.channel = channel;
+  packet.type = type;
+  packet.priority = priority;
+  packet.accumulated = 0.f;
+  packet.time = time();
+
+  if (targetID == BROADCAST)
+  {
+    if (!isServer())
+    {
+      logError("Only the server is allowed to broadcast");
+      return false;
+    }
+
+    const NetworkObjectID recipientID = recipientOf(data);
+
+    // The queued copies all share the same pooled packet data
+    for (Peer* p : m_peers)
+    {
+      if (!isRelevant(*p, recipientID))
+      {
+        m_savedMessageCount++;
+        continue;
+      }
+
+      p->m_queue.push_back(packet);
+    }
+
+    return true;
+  }
+
+  Peer* peer = findPeer(targetID);
+  if (!peer)
+  {
+    logError("Cannot queue event for unknown peer %u", targetID);
+    return false;
+  }
+
+  peer->m_queue.push_back(packet);
+  return true;
+}
+
+bool Host::schedule(Peer& peer, Time deltaTime)
+{
+  auto& queue = peer.m_queue;
+  if (queue.empty())
+    return true;
+
+  const bool limited = m_peerBandwidth != 0;
+  const double maxCredit = m_peerBandwidth * MAX_CREDIT_TIME;
+
+  if (limited)
+    peer.m_credit = min(peer.m_credit + m_peerBandwidth * deltaTime, maxCredit);
+
+  // Reliable events keep their queue order, ahead of everything else, while
+  // other events go by accumulated priority, oldest first among equals
+  for (Peer::QueuedPacket& p : queue)
+    p.accumulated += p.priority;
+
+  auto precedes = [](const Peer::QueuedPacket& x, const Peer::QueuedPacket& y)
+  {
+    if ((x.type == RELIABLE) != (y.type == RELIABLE))
+      return x.type == RELIABLE;
+    if (x.type == RELIABLE)
+      return false;
+    return x.accumulated > y.accumulated;
+  };
+
+  // Accumulation only reorders events of differing priorities, so the queue
+  // is usually still in order and only needs checking
+  if (!std::is_sorted(queue.begin(), queue.end(), precedes))
+    std::stable_sort(queue.begin(), queue.end(), precedes);
+
+  class Batch
+  {
+  public:
+    ChannelID channel;
+    PacketType type;
+    PacketData data;
+  };
+
+  std::vector<Batch> batches;
+  bool status = true;
+  bool blocked = false;
+  size_t sentCount = 0;
+
+  const Time now = time();
+
+  auto sendBatch = [&](Batch& batch)
+  {
+    if (void* packet = createENetPacket(batch.data, batch.type))
+    {
+      if (!sendENetPacket(&peer, batch.channel, packet))
+        status = false;
+    }
+    else
+      status = false;
+  };
+
+  for (size_t i = 0;  i < queue.size();  i++)
+  {
+    Peer::QueuedPacket& p = queue[i];
+    const size_t size = p.data.size() + 5;
+
+    // Once over budget, nothing more is sent this update, so that events
+    // further down are not sent before those ahead of them.  An event larger
+    // than the most credit that can be saved up is sent once the credit is
+    // full, leaving the credit negative until it has been paid back
+    const bool affordable = size <= peer.m_credit ||
+                            (i == 0 && peer.m_credit >= maxCredit);
+
+    if (blocked || (limited && !affordable))
+    {
+      blocked = true;
+      queue[i - sentCount] = p;
+      continue;
+    }
+
+    Batch* batch = nullptr;
+
+    for (Batch& b : batches)
+    {
+      if (b.channel == p.channel && b.type == p.type)
+      {
+        batch = &b;
+        break;
+      }
+    }
+
+    if (batch && batch->data.size() + size > MAX_BATCH_SIZE)
+    {
+      sendBatch(*batch);
+      batch->data = allocatePacketData(MAX_BATCH_SIZE);
+      batch->data.write16(OBJECT_ID_BATCH);
+      batch->data.write8(0);
+    }
+
+    if (!batch)
+    {
+      Batch b;
+      b.channel = p.channel;
+      b.type = p.type;
+      b.data = allocatePacketData(MAX_BATCH_SIZE);
+      b.data.write16(OBJECT_ID_BATCH);
+      b.data.write8(0);
+      batches.push_back(b);
+      batch = &batches.back();
+    }
+
+    batch->data.writeVarint(uint32(p.data.size()));
+    batch->data.writeBytes(p.data.data(), p.data.size());
+
+    if (limited)
+      peer.m_credit -= size;
+
+    sentCount++;
+  }
+
+  queue.resize(queue.size() - sentCount);
+
+  for (Batch& b : batches)
+    sendBatch(b);
+
+  // Drop unreliable events that have become too old to be useful
+  auto stale = std::remove_if(queue.begin(), queue.end(),
+                              [now](const Peer::QueuedPacket& p)
+  {
+    return p.type != RELIABLE && now - p.time > MAX_QUEUE_TIME;
+  });
+
+  m_droppedEventCount += queue.end() - stale;
+  queue.erase(stale, queue.end());
+
+  return status;
+}
+
+bool Host::dispatchBatch(TargetID sourceID, PacketData& data)
+{
+  bool status = true;
+
+  while (data.remaining())
+  {
+    uint32 size;
+    if (!data.readVarint(size) || size > data.remaining())
+    {
+      logError("Truncated event batch from peer %u", sourceID);
+      return false;
+    }
+
+    PacketData event(data.m_data + data.m_offset, size, size);
+    data.m_offset += size;
+
+    if (!dispatchEvent(sourceID, event))
+      status = false;
+  }
+
+  return status;
+}
+
+void Host::updateInterest()
+{
+  if (!m_interest)
+    return;
+
+  InterestGrid& grid = *m_interest;
+  std::vector<NetworkObjectID> candidates;
+
+  auto isVisible = [](const Peer& peer, const NetworkObject* object)
+  {
+    if (!object || !object->m_bounded)
+      return false;
+
+    for (const Peer::View& v : peer.m_views)
+    {
+      if (v.spherical ? v.sphere.intersects(object->m_bounds)
+                      : intersects(v.box, object->m_bounds))
+      {
+        return true;
+      }
+    }
+
+    return false;
+  };
+
+  for (Peer* p : m_peers)
+  {
+    if (p->m_views.empty() && p->m_relevantIDs.empty())
+      continue;
+
+    if (p->m_relevant.size() < m_objects.size())
+      p->m_relevant.resize(m_objects.size(), false);
+
+    // Peers whose views have not changed only need the moved objects checked,
+    // unless more objects have moved than there are near their views
+    bool incremental = !p->m_viewsChanged;
+
+    if (incremental)
+    {
+      size_t nearby = 0;
+      for (const Peer::View& v : p->m_views)
+        nearby += grid.count(v.box);
+
+      incremental = grid.moved.size() <= nearby;
+    }
+
+    if (incremental)
+    {
+      for (NetworkObjectID id : grid.moved)
+      {
+        const bool relevant = id < m_objects.size() && isVisible(*p, m_objects[id]);
+        if (relevant == p->m_relevant[id])
+          continue;
+
+        p->m_relevant[id] = relevant;
+
+        auto i = std::lower_bound(p->m_relevantIDs.begin(),
+                                  p->m_relevantIDs.end(),
+                                  id);
+        if (relevant)
+          p->m_relevantIDs.insert(i, id);
+        else
+          p->m_relevantIDs.erase(i);
+      }
+
+      continue;
+    }
+
+    for (NetworkObjectID id : p->m_relevantIDs)
+      p->m_relevant[id] = false;
+
+    p->m_relevantIDs.clear();
+    candidates.clear();
+
+    for (const Peer::View& v : p->m_views)
+      grid.query(v.box, candidates);
+
+    for (NetworkObjectID id : candidates)
+    {
+      // Objects spanning several cells or views are found more than once
+      if (p->m_relevant[id])
+        continue;
+
+      if (isVisible(*p, m_objects[id]))
+      {
+        p->m_relevant[id] = true;
+        p->m_relevantIDs.push_back(id);
+      }
+    }
+
+    std::sort(p->m_relevantIDs.begin(), p->m_relevantIDs.end());
+
+    p->m_viewsChanged = false;
+  }
+
+  grid.clearMoved();
+}
+
+bool Host::isRelevant(const Peer& peer, NetworkObjectID objectID) const
+{
+  if (!m_interest || peer.m_views.empty())
+    return true;
+
+  if (objectID >= m_objects.size())
+    return true;
+
+  const NetworkObject* object = m_objects[objectID];
+  if (!object || !object->m_bounded)
+    return true;
+
+  return objectID < peer.m_relevant.size() && peer.m_relevant[objectID];
+}
+
+bool Host::sendENetPacket(Peer* peer, ChannelID channel, void* packet)
+{
+  if (m_recorder)
+  {
+    const ENetPacket* p = (const ENetPacket*) packet;
+
+    m_recorder->begin(RECORD_SEND, time());
+    m_recorder->writeVarint(peer ? peer->id() : BROADCAST);
+    m_recorder->write8(channel);
+    m_recorder->write8(uint8(p->flags));
+    m_recorder->writeVarint(uint32(p->dataLength));
+    m_recorder->writeBytes(p->data, p->dataLength);
+  }
+
+  if (isQueued())
+  {
+    ServiceQueues::Command command;
+    command.type = peer ? ServiceQueues::SEND : ServiceQueues::BROADCAST;
+    command.peer = peer ? (ENetPeer*) peer->m_peer : nullptr;
+    command.connectID = peer ? peer->m_connectID : 0;
+    command.packet = (ENetPacket*) packet;
+    command.channel = channel;
+    command.reason = 0;
+
+    while (!m_queues->outbound.push(command))
+      drainOutbound();
+
+    return true;
+  }
+
+  if (!peer)
+  {
+    enet_host_broadcast((ENetHost*) m_object, channel, (ENetPacket*) packet);
+    return true;
+  }
+
+  if (enet_peer_send((ENetPeer*) peer->m_peer, channel, (ENetPacket*) packet) < 0)
+  {
+    enet_packet_destroy((ENetPacket*) packet);
+    logError("Failed to send ENet packet to peer %s", peer->m_name.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool Host::handleEvent(ServiceEvent& e)
+{
+  ENetEvent& event = e.event;
+  bool status = true;
+
+  switch (event.type)
+  {
+    case ENET_EVENT_TYPE_CONNECT:
+    {
+      char name[2048];
+
+      // Simulated and replayed peers have no name to look up
+      if (m_simulation || m_replay)
+        enet_address_get_host_ip(&(e.address), name, sizeof(name) - 1);
+      else
+        enet_address_get_host(&(e.address), name, sizeof(name) - 1);
+
+      name[sizeof(name) - 1] = '\0';
+
+      TargetID peerID;
+      uint32 generation = 0;
+
+      if (isClient())
+        peerID = SERVER;
+      else
+      {
+        peerID = m_clientIDs.allocateID();
+        generation = m_clientIDs.generationOf(peerID);
+      }
+
+      Peer* peer = new Peer(*this, event.peer, peerID, name);
+      peer->m_connectID = e.connectID;
+      peer->m_address = e.address.host;
+      peer->m_roundTripTime = e.roundTripTime;
+      peer->m_generation = generation;
+      peer->m_index = m_peers.size();
+      event.peer->data = peer;
+
+      if (m_peerTable.size() <= peerID)
+        m_peerTable.resize(peerID + 1);
+
+      m_peerTable[peerID].reset(peer);
+      m_peers.push_back(peer);
+
+      if (m_recorder)
+      {
+        m_recorder->begin(RECORD_CONNECT, time());
+        m_recorder->writeVarint(peerID);
+        m_recorder->writeBytes(&e.address.host, sizeof(e.address.host));
+      }
+
+      if (m_observer)
+        m_observer->onPeerConnected(*peer);
+
+      break;
+    }
+
+    case ENET_EVENT_TYPE_DISCONNECT:
+    {
+      if (Peer* peer = static_cast<Peer*>(event.peer->data))
+      {
+        uint32 reason;
+
+        if (peer->m_disconnecting)
+          reason = peer->m_reason;
+        else
+          reason = event.data;
+
+        if (m_recorder)
+        {
+          m_recorder->begin(RECORD_DISCONNECT, time());
+          m_recorder->writeVarint(peer->id());
+          m_recorder->writeVarint(reason);
+        }
+
+        if (m_observer)
+          m_observer->onPeerDisconnected(*peer, reason);
+
+        if (isServer())
+          m_clientIDs.releaseID(peer->id());
+
+        // Move the last peer into the vacated slot of the compact list
+        m_peers[peer->m_index] = m_peers.back();
+        m_peers[peer->m_index]->m_index = peer->m_index;
+        m_peers.pop_back();
+
+        m_peerTable[peer->id()].reset();
+      }
+
+      if (isClient())
+        status = false;
+
+      event.peer->data = nullptr;
+      break;
+    }
+
+    case ENET_EVENT_TYPE_RECEIVE:
+    {
+      if (Peer* peer = static_cast<Peer*>(event.peer->data))
+      {
+        peer->m_roundTripTime = e.roundTripTime;
+
+        if (m_recorder)
+        {
+          m_recorder->begin(RECORD_RECEIVE, time());
+          m_recorder->writeVarint(peer->id());
+          m_recorder->write8(event.channelID);
+          m_recorder->writeVarint(uint32(event.packet->dataLength));
+          m_recorder->writeBytes(event.packet->data, event.packet->dataLength);
+        }
+
+        if (m_observer)
+        {
+          PacketData data(event.packet->data,
+                          event.packet->dataLength,
+                          event.packet->dataLength);
+
+          m_observer->onPacketReceived(peer->id(), data);
+        }
+      }
+
+      enet_packet_destroy(event.packet);
+      break;
+    }
+
+    case ENET_EVENT_TYPE_NONE:
+    {
+      // This removes a useless warning by Clang
+      break;
+    }
+  }
+
+  return status;
+}
+
+bool Host::replayRecords()
+{
+  HostReplay& replay = *m_replay;
+
+  drainOutbound();
+
+  const Time now = time();
+  bool status = true;
+
+  for (;;)
+  {
+    if (!replay.pending && !replay.next())
+      return false;
+
+    if (replay.realTime && replay.time > now)
+      break;
+
+    replay.pending = false;
+
+    if (replay.type == RECORD_UPDATE)
+    {
+      if (replay.realTime)
+        continue;
+
+      break;
+    }
+
+    uint32 id;
+    if (!replay.readVarint(id) || id > 65535)
+    {
+      logError("Invalid record in traffic log");
+      return false;
+    }
+
+    ENetEvent event;
+    std::memset(&event, 0, sizeof(event));
+    event.peer = replay.peer(TargetID(id));
+
+    if (replay.type == RECORD_CONNECT)
+    {
+      event.type = ENET_EVENT_TYPE_CONNECT;
+
+      if (!replay.readBytes(&event.peer->address.host, sizeof(event.peer->address.host)))
+        return false;
+
+      event.peer->connectID = ++replay.connectCount;
+    }
+    else if (replay.type == RECORD_DISCONNECT)
+    {
+      event.type = ENET_EVENT_TYPE_DISCONNECT;
+
+      if (!replay.readVarint(event.data))
+        return false;
+    }
+    else if (replay.type == RECORD_RECEIVE || replay.type == RECORD_SEND)
+    {
+      uint8 channel, flags = 0;
+      uint32 size;
+
+      if (!replay.read8(channel) ||
+          (replay.type == RECORD_SEND && !replay.read8(flags)) ||
+          !replay.readVarint(size))
+      {
+        return false;
+      }
+
+      replay.data.resize(size);
+      if (!replay.readBytes(replay.data.data(), size))
+        return false;
+
+      // Sent packets are only recorded for offline analysis
+      if (replay.type == RECORD_SEND)
+        continue;
+
+      event.type = ENET_EVENT_TYPE_RECEIVE;
+      event.channelID = channel;
+      event.packet = enet_packet_create(replay.data.data(), size, 0);
+    }
+    else
+    {
+      logError("Invalid record type %u in traffic log", replay.type);
+      return false;
+    }
+
+    ServiceEvent e(event);
+
+    if (!handleEvent(e))
+      status = false;
+  }
+
+  return status;
+}
+
+void* Host::createENetPacket(const PacketData& data, PacketType type)
+{
+  uint32 flags = 0;
+
+  if (type == RELIABLE)
+    flags |= ENET_PACKET_FLAG_RELIABLE;
+  else if (type == UNSEQUENCED)
+    flags |= ENET_PACKET_FLAG_UNSEQUENCED;
+
+  // Pooled packet data is shared with ENet until it frees the packet, while
+  // any other packet data has to be copied
+  if (data.m_block)
+    flags |= ENET_PACKET_FLAG_NO_ALLOCATE;
+
+  ENetPacket* packet = enet_packet_create(data.data(), data.size(), flags);
+  if (!packet)
+  {
+    logError("Failed to create ENet packet");
+    return nullptr;
+  }
+
+  if (data.m_block)
+  {
+    m_pool->retain(data.m_block);
+    packet->userData = data.m_block;
+    packet->freeCallback = releasePacketBlock;
+  }
+
+  return packet;
+}
+
+void Host::drainOutbound()
+{
+  // Simulated and replaying hosts have no service thread to drain the queue,
+  // so it is drained here on the thread that fills it
+  if (m_simulation)
+    m_simulation->flush(*this);
+  else if (m_replay)
+  {
+    // Packets sent while replaying go nowhere
+    ServiceQueues::Command command;
+
+    while (m_queues->outbound.pop(command))
+    {
+      if (command.packet && command.packet->referenceCount == 0)
+        enet_packet_destroy(command.packet);
+    }
+  }
+  else
+  {
+    // The service thread drains the queue at a fixed rate, so wait for it
+    std::this_thread::yield();
+  }
+}
+
+void Host::disconnectPeer(Peer& peer, uint32 reason)
+{
+  if (isQueued())
+  {
+    ServiceQueues::Command command;
+    command.type = ServiceQueues::DISCONNECT;
+    command.peer = (ENetPeer*) peer.m_peer;
+    command.connectID = peer.m_connectID;
+    command.packet = nullptr;
+    command.channel = 0;
+    command.reason = reason;
+
+    while (!m_queues->outbound.push(command))
+      drainOutbound();
+  }
+  else
+    enet_peer_disconnect((ENetPeer*) peer.m_peer, reason);
+}
+
+void Host::service(uint frequency)
+{
+  ENetHost* host = (ENetHost*) m_object;
+  const enet_uint32 ms = max(1u, 1000u / frequency);
+
+  while (m_running)
+  {
+    ServiceQueues::Command command;
+
+    while (m_queues->outbound.pop(command))
+      m_queues->execute(host, command);
+
+    ENetEvent event;
+
+    // Waiting in the service call keeps the rate without busy looping, and
+    // wakes up as soon as data arrives
+    if (enet_host_service(host, &event, ms) > 0)
+    {
+      do
+      {
+        const ServiceEvent e(event);
+
+        while (!m_queues->inbound.push(e))
+          std::this_thread::yield();
+      }
+      while (enet_host_check_events(host, &event) > 0);
+    }
+
+    enet_host_flush(host);
+
+    m_totalIncoming = host->totalReceivedData;
+    m_totalOutgoing = host->totalSentData;
+    m_incomingBandwidth = host->incomingBandwidth;
+    m_outgoingBandwidth = host->outgoingBandwidth;
+  }
+}
+
+void Host::flushServiceQueues(bool dispatch)
+{
+  ENetHost* host = (ENetHost*) m_object;
+
+  ServiceQueues::Command command;
+
+  while (m_queues->outbound.pop(command))
+    m_queues->execute(host, command);
+
+  ServiceEvent e;
+
+  while (m_queues->inbound.pop(e))
+  {
+    if (dispatch)
+      handleEvent(e);
+    else if (e.event.type == ENET_EVENT_TYPE_RECEIVE)
+      enet_packet_destroy(e.event.packet);
+  }
+}
+
+uint Host::m_count = 0;
+
+NetworkObject::NetworkObject(Host& host, NetworkObjectID objectID):
+  m_id(objectID),
+  m_pooled(false),
+  m_host(host),
+  m_replicaSize(0),
+  m_bounded(false)
+{
+  if (isOnServer())
+  {
+    if (m_id == OBJECT_ID_INVALID)
+    {
+      m_id = m_host.m_objectIDs.allocateID();
+      m_pooled = true;
+    }
+  }
+  else
+  {
+    if (m_id == OBJECT_ID_INVALID)
+      panic("Object on client created with invalid ID");
+  }
+
+  auto& objects = m_host.m_objects;
+
+  if (objects.size() <= m_id)
+    objects.insert(objects.end(), m_id * 2 - objects.size(), nullptr);
+
+  objects[m_id] = this;
+}
+
+NetworkObject::~NetworkObject()
+{
+  // Objects created with an explicit ID never took it from the pool
+  if (m_pooled)
+    m_host.m_objectIDs.releaseID(m_id);
+
+  if (m_bounded && m_host.m_interest)
+    m_host.m_interest->remove(m_id);
+
+  m_host.m_objects[m_id] = nullptr;
+}
+
+void NetworkObject::synchronize()
+{
+}
+
+void NetworkObject::setBounds(const Sphere& newBounds)
+{
+  m_bounds = newBounds;
+  m_bounded = true;
+
+  if (m_host.m_interest)
+    m_host.m_interest->place(m_id, m_bounds);
+}
+
+void NetworkObject::setPosition(vec3 newPosition)
+{
+  setBounds(Sphere(newPosition, m_bounds.radius));
+}
+
+PacketData NetworkObject::createEvent(EventID eventID, NetworkObjectID recipientID) const
+{
+  return m_host.createEvent(eventID, recipientID);
+}
+
+bool NetworkObject::broadcastEvent(ChannelID channelID,
+                                   PacketType type,
+                                   PacketData& data) const
+{
+  return sendEvent(BROADCAST, channelID, type, data);
+}
+
+bool NetworkObject::broadcastEvent(ChannelID channelID,
+                                   PacketType type,
+                                   NetworkObjectID recipientID,
+                                   EventID eventID) const
+{
+  return sendEvent(BROADCAST, channelID, type, recipientID, eventID);
+}
+
+bool NetworkObject::sendEvent(TargetID targetID,
+                              ChannelID channelID,
+                              PacketType type,
+                              PacketData& data) const
+{
+  return m_host.sendPacketTo(targetID, channelID, type, data);
+}
+
+bool NetworkObject::sendEvent(TargetID targetID,
+                              ChannelID channelID,
+                              PacketType type,
+                              NetworkObjectID recipientID,
+                              EventID eventID) const
+{
+  PacketData event = createEvent(eventID, recipientID);
+  return sendEvent(targetID, channelID, type, event);
+}
+
+bool NetworkObject::queueEvent(TargetID targetID,
+                               ChannelID channelID,
+                               PacketType type,
+                               PacketData& data,
+                               float priority) const
+{
+  return m_host.queuePacketTo(targetID, channelID, type, data, priority);
+}
+
+void NetworkObject::receiveEvent(TargetID senderID,
+                                 PacketData& data,
+                                 EventID eventID)
+{
+}
+
+void NetworkObject::replicate(bool& field)
+{
+  static_assert(sizeof(bool) == 1, "Replication requires one byte bools");
+  addReplica(&field, 1, 1);
+}
+
+void NetworkObject::replicate(uint8& field)
+{
+  addReplica(&field, 1, 1);
+}
+
+void NetworkObject::replicate(uint16& field)
+{
+  addReplica(&field, 2, 1);
+}
+
+void NetworkObject::replicate(uint32& field)
+{
+  addReplica(&field, 4, 1);
+}
+
+void NetworkObject::replicate(int32& field)
+{
+  addReplica(&field, 4, 1);
+}
+
+void NetworkObject::replicate(float& field)
+{
+  addReplica(&field, 4, 1);
+}
+
+void NetworkObject::replicate(vec2& field)
+{
+  addReplica(&field, 4, 2);
+}
+
+void NetworkObject::replicate(vec3& field)
+{
+  addReplica(&field, 4, 3);
+}
+
+void NetworkObject::replicate(vec4& field)
+{
+  addReplica(&field, 4, 4);
+}
+
+void NetworkObject::replicate(quat& field)
+{
+  addReplica(&field, 4, 4);
+}
+
+void NetworkObject::addReplica(void* address, uint elementSize, uint elementCount)
+{
+  if (m_replicaSize + elementSize * elementCount > 65535)
+    panic("Too much replicated data in network object %u", m_id);
+
+  Replica replica;
+  replica.address = address;
+  replica.elementSize = uint8(elementSize);
+  replica.elementCount = uint8(elementCount);
+  m_replicas.push_back(replica);
+
+  m_replicaSize += elementSize * elementCount;
+}
+
+void NetworkObject::captureReplicas(uint8* target) const
+{
+  // Replicated state is kept in network byte order
+  for (const Replica& r : m_replicas)
+  {
+    const uint8* source = static_cast<const uint8*>(r.address);
+
+    for (uint i = 0;  i < r.elementCount;  i++)
+    {
+      if (r.elementSize == 4)
+      {
+        uint32 value;
+        std::memcpy(&value, source, 4);
+        value = htonl(value);
+        std::memcpy(target, &value, 4);
+      }
+      else if (r.elementSize == 2)
+      {
+        uint16 value;
+        std::memcpy(&value, source, 2);
+        value = htons(value);
+        std::memcpy(target, &value, 2);
+      }
+      else
+        *target = *source;
+
+      source += r.elementSize;
+      target += r.elementSize;
+    }
+  }
+}
+
+void NetworkObject::applyReplicas(const uint8* source)
+{
+  for (const Replica& r : m_replicas)
+  {
+    uint8* target = static_cast<uint8*>(r.address);
+
+    for (uint i = 0;  i < r.elementCount;  i++)
+    {
+      if (r.elementSize == 4)
+      {
+        uint32 value;
+        std::memcpy(&value, source, 4);
+        value = ntohl(value);
+        std::memcpy(target, &value, 4);
+      }
+      else if (r.elementSize == 2)
+      {
+        uint16 value;
+        std::memcpy(&value, source, 2);
+        value = ntohs(value);
+        std::memcpy(target, &value, 2);
+      }
+      else
+        *target = *source;
+
+      source += r.elementSize;
+      target += r.elementSize;
+    }
+  }
+}
+
+TransformInterpolator::TransformInterpolator(size_t capacity):
+  m_states(max(capacity, size_t(2))),
+  m_first(0),
+  m_count(0),
+  m_delay(0.1),
+  m_jitterScale(2.f),
+  m_maxExtrapolation(0.25),
+  m_offset(0.0),
+  m_jitter(0.0)
+{
+}
+
+void TransformInterpolator::add(Time time, Time arrival, const Transform3& transform)
+{
+  if (m_count && time <= state(m_count - 1).time)
+    return;
+
+  // The moving average of the clock offset also follows any clock drift
+  const Time offset = arrival - time;
+
+  if (m_count)
+  {
+    const Time deviation = offset - m_offset;
+    m_offset += deviation * JITTER_SMOOTHING;
+    m_jitter += (abs(deviation) - m_jitter) * JITTER_SMOOTHING;
+  }
+  else
+    m_offset = offset;
+
+  if (m_count == m_states.size())
+  {
+    m_first = (m_first + 1) % m_states.size();
+    m_count--;
+  }
+
+  State& s = m_states[(m_first + m_count) % m_states.size()];
+  s.time = time;
+  s.transform = transform;
+  m_count++;
+}
+
+bool TransformInterpolator::evaluate(Time now, Transform3& result) const
+{
+  if (!m_count)
+    return false;
+
+  const Time target = now - m_offset - delay();
+
+  const State& first = state(0);
+  if (target <= first.time)
+  {
+    result = first.transform;
+    return true;
+  }
+
+  const State& last = state(m_count - 1);
+  if (m_count == 1)
+  {
+    result = last.transform;
+    return true;
+  }
+
+  if (target >= last.time)
+  {
+    // Continue the motion between the two newest transforms for a while
+    const State& previous = state(m_count - 2);
+    const Time elapsed = min(target - last.time, m_maxExtrapolation);
+    const float t = float(elapsed / (last.time - previous.time));
+
+    result = last.transform;
+    result.position += (last.transform.position - previous.transform.position) * t;
+    return true;
+  }
+
+  for (size_t i = 1;  i < m_count;  i++)
+  {
+    const State& b = state(i);
+    if (b.time < target)
+      continue;
+
+    const State& a = state(i - 1);
+    const float t = float((target - a.time) / (b.time - a.time));
+
+    result.position = mix(a.transform.position, b.transform.position, t);
+    result.rotation = slerp(a.transform.rotation, b.transform.rotation, t);
+    result.scale = mix(a.transform.scale, b.transform.scale, t);
+    break;
+  }
+
+  return true;
+}
+
+void TransformInterpolator::reset()
+{
+  m_first = 0;
+  m_count = 0;
+  m_offset = 0.0;
+  m_jitter = 0.0;
+}
+
+const TransformInterpolator::State& TransformInterpolator::state(size_t index) const
+{
+  return m_states[(m_first + index) % m_states.size()];
+}
+
+TransformPredictor::TransformPredictor():
+  m_sequence(0),
+  m_tolerance(0.01f)
+{
+}
+
+TransformPredictor::~TransformPredictor()
+{
+}
+
+uint32 TransformPredictor::predict(const PacketData& input)
+{
+  Input i;
+  i.sequence = ++m_sequence;
+  i.data = input;
+
+  // Inputs are read from copies, leaving the recorded ones unread for replay
+  PacketData data = input;
+  applyInput(m_transform, data);
+
+  i.predicted = m_transform;
+  m_inputs.push_back(i);
+  return i.sequence;
+}
+
+void TransformPredictor::reconcile(uint32 sequence, const Transform3& authoritative)
+{
+  size_t count = 0;
+
+  while (count < m_inputs.size() && m_inputs[count].sequence <= sequence)
+    count++;
+
+  // Reports arriving out of order may refer to inputs already reconciled
+  if (!count)
+    return;
+
+  const Transform3 predicted = m_inputs[count - 1].predicted;
+  m_inputs.erase(m_inputs.begin(), m_inputs.begin() + count);
+
+  const float distance = length(predicted.position - authoritative.position);
+  const float angle = 2.f * acos(min(abs(dot(predicted.rotation, authoritative.rotation)), 1.f));
+
+  if (distance <= m_tolerance && angle <= m_tolerance)
+    return;
+
+  const Transform3 previous = m_transform;
+  m_transform = authoritative;
+
+  for (Input& i : m_inputs)
+  {
+    PacketData data = i.data;
+    applyInput(m_transform, data);
+    i.predicted = m_transform;
+  }
+
+  onCorrection(previous, m_transform);
+}
+
+void TransformPredictor::setTransform(const Transform3& newTransform)
+{
+  m_transform = newTransform;
+}
+
+void TransformPredictor::onCorrection(const Transform3& previous,
+                                      const Transform3& corrected)
+{
+}
+
+/*! @brief ENet peer of a simulated link, as seen by one of its endpoints.
+ */
+class SimulatedPeer
+{
+public:
+  // This must come first, as commands refer to the ENet peer
+  ENetPeer peer;
+  SimulatedLink* link;
+  uint side;
+};
+
+/*! @brief Simulated connection between the server and a client.
+ *
+ *  Side zero is the server and side one the client.  The state of each
+ *  direction is indexed by the side it is towards.
+ */
+class SimulatedLink
+{
+public:
+  SimulatedLink(uint index);
+  SimulatedPeer peers[2];
+  uint endpoints[2];
+  Time reliableTime[2];
+  uint32 sentSequence[2];
+  uint32 receivedSequence[2];
+  uint index;
+  bool connected;
+};
+
+SimulatedLink::SimulatedLink(uint index):
+  index(index),
+  connected(false)
+{
+  for (uint side = 0;  side < 2;  side++)
+  {
+    std::memset(&peers[side].peer, 0, sizeof(ENetPeer));
+    peers[side].link = this;
+    peers[side].side = side;
+    endpoints[side] = 0;
+    reliableTime[side] = 0.0;
+    sentSequence[side] = 0;
+    receivedSequence[side] = 0;
+  }
+}
+
+LinkModel::LinkModel():
+  latency(0.0),
+  jitter(0.0),
+  loss(0.f)
+{
+}
+
+NetworkSimulation::~NetworkSimulation()
+{
+  for (const Packet& p : m_packets)
+  {
+    if (p.packet)
+      enet_packet_destroy((ENetPacket*) p.packet);
+  }
+}
+
+std::unique_ptr<Host> NetworkSimulation::createServer(size_t maxClientCount)
+{
+  if (!m_endpoints.empty())
+  {
+    logError("Simulated network already has a server");
+    return nullptr;
+  }
+
+  m_maxClientCount = maxClientCount;
+  return std::unique_ptr<Host>(createHost(true));
+}
+
+std::unique_ptr<Host> NetworkSimulation::connect()
+{
+  if (m_endpoints.empty() || !m_endpoints.front().host)
+  {
+    logError("Cannot connect without a simulated server");
+    return nullptr;
+  }
+
+  size_t clientCount = 0;
+
+  for (const auto& l : m_links)
+  {
+    if (l->connected)
+      clientCount++;
+  }
+
+  if (clientCount >= m_maxClientCount)
+  {
+    logError("Simulated server is full");
+    return nullptr;
+  }
+
+  Host* host = createHost(false);
+
+  SimulatedLink* link = new SimulatedLink(uint(m_links.size()));
+  m_links.push_back(std::unique_ptr<SimulatedLink>(link));
+
+  link->endpoints[0] = 0;
+  link->endpoints[1] = uint(m_endpoints.size() - 1);
+  link->connected = true;
+
+  for (uint side = 0;  side < 2;  side++)
+  {
+    ENetPeer& peer = link->peers[side].peer;
+    peer.address.host = ENET_HOST_TO_NET_32(0x7f000001);
+    peer.address.port = uint16(link->index);
+    peer.connectID = link->index + 1;
+    peer.roundTripTime = enet_uint32(m_model.latency * 2000.0);
+  }
+
+  schedule(*link, 0, ENET_EVENT_TYPE_CONNECT, nullptr, 0, 0);
+  schedule(*link, 1, ENET_EVENT_TYPE_CONNECT, nullptr, 0, 0);
+
+  return std::unique_ptr<Host>(host);
+}
+
+void NetworkSimulation::advance(Time deltaTime)
+{
+  const Time previous = m_time;
+  m_time += deltaTime;
+
+  // Hosts are flushed in the order they were created, to stay deterministic
+  for (Endpoint& e : m_endpoints)
+  {
+    if (e.host)
+      flush(e);
+  }
+
+  std::vector<Packet> waiting;
+
+  while (!m_packets.empty() && m_packets.front().time <= m_time)
+  {
+    std::pop_heap(m_packets.begin(), m_packets.end(), isLater);
+    const Packet packet = m_packets.back();
+    m_packets.pop_back();
+
+    // Packets held back by a full queue arrive no earlier than this advance
+    if (!deliver(packet, max(packet.time, previous)))
+      waiting.push_back(packet);
+  }
+
+  // Packets that did not fit in the queue of their host wait until the next
+  // advance, keeping their place in line
+  for (const Packet& p : waiting)
+  {
+    m_packets.push_back(p);
+    std::push_heap(m_packets.begin(), m_packets.end(), isLater);
+  }
+
+  if (floor(m_time) > floor(previous))
+  {
+    for (Endpoint& e : m_endpoints)
+    {
+      if (!e.host)
+        continue;
+
+      e.host->m_incomingBandwidth = e.host->m_totalIncoming - e.lastIncoming;
+      e.host->m_outgoingBandwidth = e.host->m_totalOutgoing - e.lastOutgoing;
+      e.lastIncoming = e.host->m_totalIncoming;
+      e.lastOutgoing = e.host->m_totalOutgoing;
+    }
+  }
+}
+
+Time NetworkSimulation::latencyPercentile(const Host& host, float fraction) const
+{
+  for (const Endpoint& e : m_endpoints)
+  {
+    if (e.host != &host)
+      continue;
+
+    if (e.delays.empty())
+      return 0.0;
+
+    std::vector<float> delays(e.delays);
+    const size_t index = min(size_t(fraction * delays.size()), delays.size() - 1);
+    std::nth_element(delays.begin(), delays.begin() + index, delays.end());
+    return delays[index];
+  }
+
+  return 0.0;
+}
+
+void NetworkSimulation::setLinkModel(const LinkModel& newModel)
+{
+  m_model = newModel;
+  m_model.latency = max(m_model.latency, 0.0);
+  m_model.jitter = max(m_model.jitter, 0.0);
+  m_model.loss = clamp(m_model.loss, 0.f, 1.f);
+
+  for (auto& l : m_links)
+  {
+    for (uint side = 0;  side < 2;  side++)
+      l->peers[side].peer.roundTripTime = enet_uint32(m_model.latency * 2000.0);
+  }
+}
+
+std::unique_ptr<NetworkSimulation> NetworkSimulation::create(uint32 seed)
+{
+  return std::unique_ptr<NetworkSimulation>(new NetworkSimulation(seed));
+}
+
+NetworkSimulation::NetworkSimulation(uint32 seed):
+  m_state(seed ^ 0x9e3779b9),
+  m_time(0.0),
+  m_order(0),
+  m_maxClientCount(0),
+  m_lostCount(0),
+  m_deliveredCount(0)
+{
+  // The random number generator gets stuck at zero
+  if (!m_state)
+    m_state = 1;
+}
+
+Host* NetworkSimulation::createHost(bool server)
+{
+  Host* host = new Host();
+  host->m_simulation = this;
+  host->m_server = server;
+  host->m_queues.reset(new ServiceQueues());
+
+  Endpoint endpoint;
+  endpoint.host = host;
+  endpoint.delayCount = 0;
+  endpoint.lastIncoming = 0;
+  endpoint.lastOutgoing = 0;
+  m_endpoints.push_back(endpoint);
+
+  return host;
+}
+
+void NetworkSimulation::detach(Host& host)
+{
+  for (uint i = 0;  i < m_endpoints.size();  i++)
+  {
+    Endpoint& e = m_endpoints[i];
+    if (e.host != &host)
+      continue;
+
+    // Anything the host sent before being destroyed still goes out
+    flush(e);
+
+    for (auto& l : m_links)
+    {
+      if (!l->connected)
+        continue;
+
+      if (l->endpoints[0] == i || l->endpoints[1] == i)
+      {
+        l->connected = false;
+        schedule(*l, l->endpoints[0] == i ? 1 : 0, ENET_EVENT_TYPE_DISCONNECT, nullptr, 0, 0);
+      }
+    }
+
+    e.host = nullptr;
+
+    ServiceEvent event;
+
+    while (host.m_queues->inbound.pop(event))
+    {
+      if (event.event.type == ENET_EVENT_TYPE_RECEIVE)
+        enet_packet_destroy(event.event.packet);
+    }
+  }
+}
+
+void NetworkSimulation::flush(Host& host)
+{
+  for (Endpoint& e : m_endpoints)
+  {
+    if (e.host == &host)
+      flush(e);
+  }
+}
+
+void NetworkSimulation::flush(Endpoint& endpoint)
+{
+  const uint index = uint(&endpoint - &m_endpoints.front());
+
+  ServiceQueues::Command command;
+
+  while (endpoint.host->m_queues->outbound.pop(command))
+  {
+    ENetPacket* packet = command.packet;
+
+    if (command.type == ServiceQueues::BROADCAST)
+    {
+      for (auto& l : m_links)
+      {
+        if (l->connected && l->endpoints[0] == index)
+          schedule(*l, 1, ENET_EVENT_TYPE_RECEIVE, copyPacket(packet), command.channel, 0);
+      }
+    }
+    else
+    {
+      SimulatedPeer* peer = reinterpret_cast<SimulatedPeer*>(command.peer);
+      SimulatedLink& link = *peer->link;
+
+      if (link.connected && peer->peer.connectID == command.connectID)
+      {
+        if (command.type == ServiceQueues::SEND)
+        {
+          schedule(link, 1 - peer->side, ENET_EVENT_TYPE_RECEIVE,
+                   copyPacket(packet), command.channel, 0);
+        }
+        else if (command.type == ServiceQueues::DISCONNECT)
+        {
+          link.connected = false;
+          schedule(link, 0, ENET_EVENT_TYPE_DISCONNECT, nullptr, 0, command.reason);
+          schedule(link, 1, ENET_EVENT_TYPE_DISCONNECT, nullptr, 0, command.reason);
+        }
+      }
+    }
+
+    if (packet && packet->referenceCount == 0)
+      enet_packet_destroy(packet);
+  }
+}
+
+void NetworkSimulation::schedule(SimulatedLink& link,
+                                 uint side,
+                                 uint type,
+                                 void* packet,
+                                 ChannelID channel,
+                                 uint32 data)
+{
+  ENetPacket* enetPacket = (ENetPacket*) packet;
+
+  if (enetPacket)
+  {
+    if (Host* sender = m_endpoints[link.endpoints[1 - side]].host)
+      sender->m_totalOutgoing += uint(enetPacket->dataLength);
+  }
+
+  Packet p;
+  p.time = m_time + m_model.latency + m_model.jitter * random();
+  p.sent = m_time;
+  p.order = m_order++;
+  p.link = link.index;
+  p.side = side;
+  p.type = type;
+  p.packet = packet;
+  p.channel = channel;
+  p.data = data;
+  p.sequence = 0;
+
+  if (!enetPacket || (enetPacket->flags & ENET_PACKET_FLAG_RELIABLE))
+  {
+    // Lost reliable packets are resent after a round trip
+    for (uint i = 0;  i < MAX_SIMULATED_RESENDS && random() < m_model.loss;  i++)
+      p.time += m_model.latency * 2.0;
+
+    // Reliable packets and connection events arrive in the order sent
+    p.time = max(p.time, link.reliableTime[side]);
+    link.reliableTime[side] = p.time;
+  }
+  else
+  {
+    if (random() < m_model.loss)
+    {
+      enet_packet_destroy(enetPacket);
+      m_lostCount++;
+      return;
+    }
+
+    if (!(enetPacket->flags & ENET_PACKET_FLAG_UNSEQUENCED))
+      p.sequence = ++link.sentSequence[side];
+  }
+
+  m_packets.push_back(p);
+  std::push_heap(m_packets.begin(), m_packets.end(), isLater);
+}
+
+bool NetworkSimulation::deliver(const Packet& packet, Time arrival)
+{
+  SimulatedLink& link = *m_links[packet.link];
+  Endpoint& endpoint = m_endpoints[link.endpoints[packet.side]];
+  ENetPacket* enetPacket = (ENetPacket*) packet.packet;
+
+  // Sequenced packets arriving after newer ones are dropped
+  if (!endpoint.host ||
+      (packet.sequence && packet.sequence <= link.receivedSequence[packet.side]))
+  {
+    if (enetPacket)
+    {
+      enet_packet_destroy(enetPacket);
+      m_lostCount++;
+    }
+
+    return true;
+  }
+
+  ENetEvent event;
+  event.type = ENetEventType(packet.type);
+  event.peer = &link.peers[packet.side].peer;
+  event.channelID = packet.channel;
+  event.data = packet.data;
+  event.packet = enetPacket;
+
+  if (!endpoint.host->m_queues->inbound.push(ServiceEvent(event)))
+    return false;
+
+  if (packet.sequence)
+    link.receivedSequence[packet.side] = packet.sequence;
+
+  if (enetPacket)
+  {
+    endpoint.host->m_totalIncoming += uint(enetPacket->dataLength);
+
+    // The delay is measured to the modeled arrival rather than to the end of
+    // the advance, so that it is not quantized to the advance step
+    const float delay = float(arrival - packet.sent);
+
+    if (endpoint.delays.size() < MAX_LATENCY_SAMPLES)
+      endpoint.delays.push_back(delay);
+    else
+      endpoint.delays[endpoint.delayCount % MAX_LATENCY_SAMPLES] = delay;
+
+    endpoint.delayCount++;
+    m_deliveredCount++;
+  }
+
+  return true;
+}
+
+float NetworkSimulation::random()
+{
+  // A simple xorshift generator gives the same sequence on every platform
+  m_state ^= m_state << 13;
+  m_state ^= m_state >> 17;
+  m_state ^= m_state << 5;
+
+  return float(m_state >> 8) / 16777216.f;
+}
+
+bool NetworkSimulation::isLater(const Packet& x, const Packet& y)
+{
+  if (x.time != y.time)
+    return x.time > y.time;
+
+  return x.order > y.order;
 }
 
 } /*namespace nori*/
@@ -30,6 +30,7 @@
 #include <nori/Profile.hpp>
 
 #include <algorithm>
+#include <map>
 
 namespace nori
 {
@@ -46,6 +47,16 @@ ProfileNode::ProfileNode(const char* name):
 {
 }
 
+Time ProfileNode::selfDuration() const
+{
+  Time duration = m_duration;
+
+  for (const ProfileNode& c : m_children)
+    duration -= c.m_duration;
+
+  return duration;
+}
+
 ProfileNode* ProfileNode::findChild(const char* name)
 {
   auto n = std::find(m_children.begin(), m_children.end(), name);
@@ -55,6 +66,11 @@ ProfileNode* ProfileNode::findChild(const char* name)
   return &(*n);
 }
 
+Profile::Profile():
+  m_root("Root")
+{
+}
+
 void Profile::beginFrame()
 {
   resetNode(m_root);
@@ -90,6 +106,62 @@ void Profile::endNode()
   m_stack.pop_back();
 }
 
+std::string Profile::hierarchicalReport() const
+{
+  std::string report;
+  reportNode(report, m_root, 0);
+  return report;
+}
+
+std::string Profile::flatReport() const
+{
+  struct Entry
+  {
+    uint calls;
+    Time duration;
+  };
+
+  std::map<std::string, Entry> entries;
+  std::vector<const ProfileNode*> nodes(1, &m_root);
+
+  while (!nodes.empty())
+  {
+    const ProfileNode* node = nodes.back();
+    nodes.pop_back();
+
+    if (!node->callCount())
+      continue;
+
+    Entry& entry = entries[node->name()];
+    entry.calls += node->callCount();
+    entry.duration += node->selfDuration();
+
+    for (const ProfileNode& c : node->children())
+      nodes.push_back(&c);
+  }
+
+  std::vector<std::pair<std::string, Entry>> sorted(entries.begin(), entries.end());
+
+  std::sort(sorted.begin(), sorted.end(),
+            [](const std::pair<std::string, Entry>& a,
+               const std::pair<std::string, Entry>& b)
+  {
+    return a.second.duration > b.second.duration;
+  });
+
+  std::string report;
+
+  for (const auto& e : sorted)
+  {
+    report += format("%10.3f ms %8u  %s\n",
+                     e.second.duration * 1000.0,
+                     e.second.calls,
+                     e.first.c_str());
+  }
+
+  return report;
+}
+
 void Profile::beginNode(ProfileNode& node)
 {
   node.m_calls++;
@@ -107,7 +179,24 @@ void Profile::resetNode(ProfileNode& node)
     resetNode(c);
 }
 
-Profile* Profile::m_current = nullptr;
+void Profile::reportNode(std::string& report, const ProfileNode& node, uint depth)
+{
+  // Nodes are kept across frames but may not have been entered in this one
+  if (!node.callCount())
+    return;
+
+  report += format("%10.3f ms %10.3f ms %8u  %*s%s\n",
+                   node.duration() * 1000.0,
+                   node.selfDuration() * 1000.0,
+                   node.callCount(),
+                   int(depth * 2), "",
+                   node.name().c_str());
+
+  for (const ProfileNode& c : node.children())
+    reportNode(report, c, depth + 1);
+}
+
+thread_local Profile* Profile::m_current = nullptr;
 
 } /*namespace nori*/
 
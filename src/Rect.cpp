@@ -113,7 +113,7 @@ bool Rect::clipBy(const Rect& other)
   if (minY > otherMaxY || maxY < otherMinY)
     return false;
 
-  setBounds(max(minY, otherMinX), max(minY, otherMinY),
+  setBounds(max(minX, otherMinX), max(minY, otherMinY),
             min(maxX, otherMaxX), min(maxY, otherMaxY));
 
   return true;
@@ -267,7 +267,7 @@ bool Recti::clipBy(const Recti& other)
   if (minY > otherMaxY || maxY < otherMinY)
     return false;
 
-  setBounds(max(minY, otherMinX), max(minY, otherMinY),
+  setBounds(max(minX, otherMinX), max(minY, otherMinY),
             min(maxX, otherMaxX), min(maxY, otherMaxY));
 
   return true;
@@ -34,6 +34,7 @@
 #include <nori/RenderBuffer.hpp>
 #include <nori/Program.hpp>
 #include <nori/RenderContext.hpp>
+#include <nori/GlyphAtlas.hpp>
 
 #define GREG_IMPLEMENTATION
 #define GREG_USE_GLFW3
@@ -335,12 +336,14 @@ RenderConfig::RenderConfig(uint colorBits,
                            uint depthBits,
                            uint stencilBits,
                            uint samples,
-                           bool debug):
+                           bool debug,
+                           uint glyphWorkerCount):
   colorBits(colorBits),
   depthBits(depthBits),
   stencilBits(stencilBits),
   samples(samples),
-  debug(debug)
+  debug(debug),
+  glyphWorkerCount(glyphWorkerCount)
 {
 }
 
@@ -398,7 +401,10 @@ RenderStats::RenderStats():
   m_programCount(0),
   m_textureSize(0),
   m_vertexBufferSize(0),
-  m_indexBufferSize(0)
+  m_indexBufferSize(0),
+  m_glyphAtlasPageCount(0),
+  m_glyphAtlasOccupancy(0.f),
+  m_glyphAtlasEvictionCount(0)
 {
   m_frames.push_back(Frame());
   m_timer.start();
@@ -464,6 +470,13 @@ void RenderStats::addPrimitives(PrimitiveType type, uint vertexCount)
   }
 }
 
+void RenderStats::addBatch(uint operationCount)
+{
+  Frame& frame = m_frames.front();
+  frame.batchCount++;
+  frame.batchedOperationCount += operationCount;
+}
+
 void RenderStats::addTexture(size_t size)
 {
   m_textureCount++;
@@ -510,6 +523,15 @@ void RenderStats::removeProgram()
   m_programCount--;
 }
 
+void RenderStats::setGlyphAtlasUsage(uint pageCount,
+                                     float occupancy,
+                                     uint evictionCount)
+{
+  m_glyphAtlasPageCount = pageCount;
+  m_glyphAtlasOccupancy = occupancy;
+  m_glyphAtlasEvictionCount = evictionCount;
+}
+
 RenderStats::Frame::Frame():
   stateChangeCount(0),
   operationCount(0),
@@ -517,6 +539,8 @@ RenderStats::Frame::Frame():
   pointCount(0),
   lineCount(0),
   triangleCount(0),
+  batchCount(0),
+  batchedOperationCount(0),
   duration(0.0)
 {
 }
@@ -859,6 +883,8 @@ public:
 
 RenderContext::~RenderContext()
 {
+  m_glyphAtlas = nullptr;
+
   m_framebuffer = nullptr;
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
@@ -1348,6 +1374,14 @@ Window& RenderContext::window()
   return m_window;
 }
 
+GlyphAtlas& RenderContext::glyphAtlas()
+{
+  if (!m_glyphAtlas)
+    m_glyphAtlas = GlyphAtlas::create(*this, m_glyphWorkerCount);
+
+  return *m_glyphAtlas;
+}
+
 const RenderLimits& RenderContext::limits() const
 {
   return *m_limits;
@@ -1368,6 +1402,7 @@ RenderContext::RenderContext(ResourceCache& cache):
   m_cache(cache),
   m_handle(nullptr),
   m_debug(false),
+  m_glyphWorkerCount(0),
   m_dirtyBinding(true),
   m_dirtyState(true),
   m_cullingInverted(false),
@@ -1378,6 +1413,8 @@ RenderContext::RenderContext(ResourceCache& cache):
 
 bool RenderContext::init(const WindowConfig& wc, const RenderConfig& rc)
 {
+  m_glyphWorkerCount = rc.glyphWorkerCount;
+
   glfwSetErrorCallback(errorCallback);
 
   if (!glfwInit())
@@ -1757,6 +1794,18 @@ void RenderContext::onFrame()
     s.buffer->discard();
   }
 
+  if (m_glyphAtlas)
+  {
+    m_glyphAtlas->update();
+
+    if (m_stats)
+    {
+      m_stats->setGlyphAtlasUsage(m_glyphAtlas->pageCount(),
+                                  m_glyphAtlas->occupancy(),
+                                  m_glyphAtlas->evictionCount());
+    }
+  }
+
   if (m_stats)
     m_stats->addFrame();
 }
@@ -29,6 +29,9 @@
 #include <nori/Resource.hpp>
 #include <nori/Sample.hpp>
 
+#include <fstream>
+#include <iterator>
+
 #include <stb_vorbis.c>
 
 namespace nori
@@ -84,5 +87,220 @@ Ref<Sample> Sample::read(ResourceCache& cache, const std::string& name)
   return sample;
 }
 
+CompressedSample::CompressedSample(const ResourceInfo& info,
+                                   std::vector<char>&& data,
+                                   SampleFormat format,
+                                   uint frequency,
+                                   size_t length):
+  Resource(info),
+  data(std::move(data)),
+  format(format),
+  frequency(frequency),
+  length(length)
+{
+}
+
+bool CompressedSample::decode(std::vector<char>& target) const
+{
+  int error;
+
+  stb_vorbis* file = stb_vorbis_open_memory((const unsigned char*) data.data(),
+                                            (int) data.size(),
+                                            &error, nullptr);
+  if (!file)
+  {
+    logError("Failed to decode sample %s", name().c_str());
+    return false;
+  }
+
+  const int channels = format == SAMPLE_MONO16 ? 1 : 2;
+
+  target.resize(decodedSize());
+
+  short* samples = (short*) target.data();
+  size_t frames = 0;
+
+  while (frames < length)
+  {
+    const int count =
+      stb_vorbis_get_samples_short_interleaved(file, channels,
+                                               samples + frames * channels,
+                                               int((length - frames) * channels));
+    if (count < 1)
+      break;
+
+    frames += count;
+  }
+
+  stb_vorbis_close(file);
+
+  target.resize(frames * channels * sizeof(short));
+  return true;
+}
+
+size_t CompressedSample::decodedSize() const
+{
+  if (format == SAMPLE_MONO16)
+    return length * sizeof(short);
+  else
+    return length * 2 * sizeof(short);
+}
+
+Ref<CompressedSample> CompressedSample::read(ResourceCache& cache,
+                                             const std::string& name)
+{
+  if (CompressedSample* cached = cache.find<CompressedSample>(name))
+    return cached;
+
+  const Path path = cache.findFile(name);
+  if (path.isEmpty())
+  {
+    logError("Failed to find sample %s", name.c_str());
+    return nullptr;
+  }
+
+  std::ifstream stream(path.name(), std::ios::in | std::ios::binary);
+  if (stream.fail())
+  {
+    logError("Failed to open audio file %s", path.name().c_str());
+    return nullptr;
+  }
+
+  std::vector<char> data((std::istreambuf_iterator<char>(stream)),
+                         std::istreambuf_iterator<char>());
+
+  int error;
+
+  // Only the headers are parsed here, to find the format and length
+  stb_vorbis* file = stb_vorbis_open_memory((const unsigned char*) data.data(),
+                                            (int) data.size(),
+                                            &error, nullptr);
+  if (!file)
+  {
+    logError("Failed to read audio file %s", path.name().c_str());
+    return nullptr;
+  }
+
+  const stb_vorbis_info info = stb_vorbis_get_info(file);
+  const size_t length = stb_vorbis_stream_length_in_samples(file);
+
+  stb_vorbis_close(file);
+
+  SampleFormat format;
+  if (info.channels == 1)
+    format = SAMPLE_MONO16;
+  else
+    format = SAMPLE_STEREO16;
+
+  return new CompressedSample(ResourceInfo(cache, name, path),
+                              std::move(data),
+                              format, info.sample_rate, length);
+}
+
+SampleStream::~SampleStream()
+{
+  if (m_handle)
+    stb_vorbis_close((stb_vorbis*) m_handle);
+}
+
+size_t SampleStream::read(int16* target, size_t count)
+{
+  const int channels = this->channels();
+
+  size_t total = 0;
+
+  // Each call only returns data up to the end of the current Vorbis frame
+  while (total < count)
+  {
+    const int frames =
+      stb_vorbis_get_samples_short_interleaved((stb_vorbis*) m_handle,
+                                               channels,
+                                               target + total * channels,
+                                               int((count - total) * channels));
+    if (frames < 1)
+      break;
+
+    total += frames;
+  }
+
+  return total;
+}
+
+bool SampleStream::seek(size_t frame)
+{
+  if (frame == 0)
+  {
+    stb_vorbis_seek_start((stb_vorbis*) m_handle);
+    return true;
+  }
+
+  if (frame >= m_length)
+  {
+    logError("Cannot seek past the end of sample stream");
+    return false;
+  }
+
+  if (!stb_vorbis_seek((stb_vorbis*) m_handle, (unsigned int) frame))
+  {
+    logError("Failed to seek in sample stream");
+    return false;
+  }
+
+  return true;
+}
+
+std::unique_ptr<SampleStream> SampleStream::open(ResourceCache& cache,
+                                                 const std::string& name)
+{
+  const Path path = cache.findFile(name);
+  if (path.isEmpty())
+  {
+    logError("Failed to find sample %s", name.c_str());
+    return nullptr;
+  }
+
+  std::unique_ptr<SampleStream> stream(new SampleStream());
+  if (!stream->init(path))
+    return nullptr;
+
+  return stream;
+}
+
+SampleStream::SampleStream():
+  m_handle(nullptr),
+  m_format(SAMPLE_MONO16),
+  m_frequency(0),
+  m_length(0)
+{
+}
+
+bool SampleStream::init(const Path& path)
+{
+  int error;
+
+  stb_vorbis* file = stb_vorbis_open_filename(path.name().c_str(),
+                                              &error, nullptr);
+  if (!file)
+  {
+    logError("Failed to open audio file %s", path.name().c_str());
+    return false;
+  }
+
+  m_handle = file;
+
+  const stb_vorbis_info info = stb_vorbis_get_info(file);
+
+  // Streams with more than two channels are mixed down to stereo
+  if (info.channels == 1)
+    m_format = SAMPLE_MONO16;
+  else
+    m_format = SAMPLE_STEREO16;
+
+  m_frequency = info.sample_rate;
+  m_length = stb_vorbis_stream_length_in_samples(file);
+
+  return true;
+}
+
 } /*namespace nori*/
 
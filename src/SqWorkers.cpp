@@ -0,0 +1,643 @@
+///////////////////////////////////////////////////////////////////////
+// Nori - a simple game engine
+// Copyright (c) 2014 Camilla Berglund <elmindreda@elmindreda.org>
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any
+// damages arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any
+// purpose, including commercial applications, and to alter it and
+// redistribute it freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you
+//     must not claim that you wrote the original software. If you use
+//     this software in a product, an acknowledgment in the product
+//     documentation would be appreciated but is not required.
+//
+//  2. Altered source versions must be plainly marked as such, and
+//     must not be misrepresented as being the original software.
+//
+//  3. This notice may not be removed or altered from any source
+//     distribution.
+//
+///////////////////////////////////////////////////////////////////////
+
+#include <nori/Config.hpp>
+#include <nori/Core.hpp>
+#include <nori/Path.hpp>
+#include <nori/Resource.hpp>
+#include <nori/Time.hpp>
+#include <nori/Profile.hpp>
+#include <nori/Transform.hpp>
+
+#include <nori/Squirrel.hpp>
+#include <nori/SqWorkers.hpp>
+
+#include <thread>
+#include <algorithm>
+
+#include <cstring>
+
+namespace nori
+{
+
+namespace
+{
+
+enum ValueTag
+{
+  TAG_NULL,
+  TAG_BOOL,
+  TAG_INTEGER,
+  TAG_FLOAT,
+  TAG_STRING,
+  TAG_ARRAY,
+  TAG_TABLE
+};
+
+const uint MAX_VALUE_DEPTH = 32;
+
+template <typename T>
+void writeScalar(std::vector<uint8>& data, T value)
+{
+  const size_t offset = data.size();
+  data.resize(offset + sizeof(T));
+  std::memcpy(data.data() + offset, &value, sizeof(T));
+}
+
+template <typename T>
+bool readScalar(const std::vector<uint8>& data, size_t& offset, T& value)
+{
+  if (data.size() - offset < sizeof(T))
+    return false;
+
+  std::memcpy(&value, data.data() + offset, sizeof(T));
+  offset += sizeof(T);
+  return true;
+}
+
+bool writeValue(HSQUIRRELVM vm, SQInteger index, std::vector<uint8>& data, uint depth)
+{
+  if (depth == MAX_VALUE_DEPTH)
+    return false;
+
+  if (index < 0)
+    index = sq_gettop(vm) + index + 1;
+
+  switch (sq_gettype(vm, index))
+  {
+    case OT_NULL:
+    {
+      data.push_back(TAG_NULL);
+      return true;
+    }
+
+    case OT_BOOL:
+    {
+      SQBool value;
+      sq_getbool(vm, index, &value);
+      data.push_back(TAG_BOOL);
+      data.push_back(value ? 1 : 0);
+      return true;
+    }
+
+    case OT_INTEGER:
+    {
+      SQInteger value;
+      sq_getinteger(vm, index, &value);
+      data.push_back(TAG_INTEGER);
+      writeScalar(data, int64(value));
+      return true;
+    }
+
+    case OT_FLOAT:
+    {
+      SQFloat value;
+      sq_getfloat(vm, index, &value);
+      data.push_back(TAG_FLOAT);
+      writeScalar(data, double(value));
+      return true;
+    }
+
+    case OT_STRING:
+    {
+      const SQChar* value;
+      sq_getstring(vm, index, &value);
+      const uint32 length = uint32(sq_getsize(vm, index));
+      data.push_back(TAG_STRING);
+      writeScalar(data, length);
+      data.insert(data.end(), value, value + length);
+      return true;
+    }
+
+    case OT_ARRAY:
+    case OT_TABLE:
+    {
+      const bool table = sq_gettype(vm, index) == OT_TABLE;
+      data.push_back(table ? TAG_TABLE : TAG_ARRAY);
+      writeScalar(data, uint32(sq_getsize(vm, index)));
+
+      bool success = true;
+
+      sq_pushnull(vm);
+
+      while (success && SQ_SUCCEEDED(sq_next(vm, index)))
+      {
+        if (table && !writeValue(vm, -2, data, depth + 1))
+          success = false;
+        else if (!writeValue(vm, -1, data, depth + 1))
+          success = false;
+
+        sq_pop(vm, 2);
+      }
+
+      sq_poptop(vm);
+      return success;
+    }
+
+    default:
+      return false;
+  }
+}
+
+bool readValue(HSQUIRRELVM vm, const std::vector<uint8>& data, size_t& offset, uint depth)
+{
+  uint8 tag;
+  if (depth == MAX_VALUE_DEPTH || !readScalar(data, offset, tag))
+    return false;
+
+  switch (tag)
+  {
+    case TAG_NULL:
+    {
+      sq_pushnull(vm);
+      return true;
+    }
+
+    case TAG_BOOL:
+    {
+      uint8 value;
+      if (!readScalar(data, offset, value))
+        return false;
+
+      sq_pushbool(vm, value ? SQTrue : SQFalse);
+      return true;
+    }
+
+    case TAG_INTEGER:
+    {
+      int64 value;
+      if (!readScalar(data, offset, value))
+        return false;
+
+      sq_pushinteger(vm, SQInteger(value));
+      return true;
+    }
+
+    case TAG_FLOAT:
+    {
+      double value;
+      if (!readScalar(data, offset, value))
+        return false;
+
+      sq_pushfloat(vm, SQFloat(value));
+      return true;
+    }
+
+    case TAG_STRING:
+    {
+      uint32 length;
+      if (!readScalar(data, offset, length) || data.size() - offset < length)
+        return false;
+
+      sq_pushstring(vm, (const SQChar*) data.data() + offset, length);
+      offset += length;
+      return true;
+    }
+
+    case TAG_ARRAY:
+    case TAG_TABLE:
+    {
+      uint32 count;
+      if (!readScalar(data, offset, count))
+        return false;
+
+      if (tag == TAG_TABLE)
+        sq_newtableex(vm, count);
+      else
+        sq_newarray(vm, 0);
+
+      for (uint32 i = 0;  i < count;  i++)
+      {
+        if (!readValue(vm, data, offset, depth + 1))
+        {
+          sq_poptop(vm);
+          return false;
+        }
+
+        if (tag == TAG_ARRAY)
+        {
+          sq_arrayappend(vm, -2);
+          continue;
+        }
+
+        if (!readValue(vm, data, offset, depth + 1))
+        {
+          sq_pop(vm, 2);
+          return false;
+        }
+
+        if (SQ_FAILED(sq_newslot(vm, -3, SQFalse)))
+        {
+          sq_poptop(vm);
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    default:
+      return false;
+  }
+}
+
+} /*namespace*/
+
+/*! @brief Worker thread of a Squirrel worker pool.
+ */
+class SqWorkerPool::Worker
+{
+public:
+  Worker(ResourceCache& cache);
+  void run(Time deltaTime);
+  void deliver(const SqMessage& message);
+  static SQInteger onSend(HSQUIRRELVM vm);
+  class Entity
+  {
+  public:
+    uint32 id;
+    SqObject instance;
+    SqFunction update;
+    SqFunction onMessage;
+  };
+  Entity* findEntity(uint32 id);
+  SqVM vm;
+  std::vector<Entity> entities;
+  std::vector<SqMessage> inbox;
+  std::vector<SqMessage> outbox;
+  uint32 current;
+  std::thread thread;
+};
+
+SqWorkerPool::Worker::Worker(ResourceCache& cache):
+  vm(cache),
+  current(0)
+{
+  SqMemoryScope scope(vm);
+
+  sq_pushroottable(vm);
+  sq_pushstring(vm, "send", -1);
+  sq_pushuserpointer(vm, this);
+  sq_newclosure(vm, onSend, 1);
+  sq_setparamscheck(vm, 4, ".is.");
+  sq_setnativeclosurename(vm, -1, "send");
+  sq_newslot(vm, -3, SQFalse);
+  sq_poptop(vm);
+}
+
+void SqWorkerPool::Worker::run(Time deltaTime)
+{
+  SqMemoryScope scope(vm);
+
+  for (const SqMessage& message : inbox)
+    deliver(message);
+
+  inbox.clear();
+
+  for (Entity& entity : entities)
+  {
+    current = entity.id;
+    entity.update.call(float(deltaTime));
+  }
+
+  current = 0;
+}
+
+void SqWorkerPool::Worker::deliver(const SqMessage& message)
+{
+  Entity* entity = findEntity(message.target);
+  if (!entity || entity->onMessage.isNull())
+    return;
+
+  current = entity->id;
+
+  sq_pushobject(vm, entity->onMessage.handle());
+  sq_pushobject(vm, entity->instance.handle());
+  sq_pushinteger(vm, SQInteger(message.sender));
+  sq_pushstring(vm, message.name.c_str(), message.name.size());
+
+  if (message.push(vm))
+    sq_call(vm, 4, SQFalse, SQTrue);
+  else
+  {
+    logError("Failed to deserialize message %s", message.name.c_str());
+    sq_pop(vm, 3);
+  }
+
+  sq_poptop(vm);
+  current = 0;
+}
+
+SQInteger SqWorkerPool::Worker::onSend(HSQUIRRELVM vm)
+{
+  SQUserPointer pointer;
+  sq_getuserpointer(vm, -1, &pointer);
+  Worker& worker = *static_cast<Worker*>(pointer);
+
+  SQInteger target;
+  sq_getinteger(vm, 2, &target);
+
+  const SQChar* name;
+  sq_getstring(vm, 3, &name);
+
+  SqMessage message(worker.current, uint32(target), name);
+  if (!message.store(vm, 4))
+    return sq_throwerror(vm, "Message value cannot be sent");
+
+  worker.outbox.push_back(std::move(message));
+  return 0;
+}
+
+SqWorkerPool::Worker::Entity* SqWorkerPool::Worker::findEntity(uint32 id)
+{
+  // Entities are created in order of increasing ID
+  auto e = std::lower_bound(entities.begin(), entities.end(), id,
+                            [](const Entity& entity, uint32 id)
+  {
+    return entity.id < id;
+  });
+
+  if (e == entities.end() || e->id != id)
+    return nullptr;
+
+  return &(*e);
+}
+
+SqMessage::SqMessage():
+  sender(0),
+  target(0)
+{
+  data.push_back(TAG_NULL);
+}
+
+SqMessage::SqMessage(uint32 sender, uint32 target, const char* name):
+  sender(sender),
+  target(target),
+  name(name)
+{
+  data.push_back(TAG_NULL);
+}
+
+bool SqMessage::store(HSQUIRRELVM vm, SQInteger index)
+{
+  data.clear();
+
+  if (!writeValue(vm, index, data, 0))
+  {
+    data.assign(1, TAG_NULL);
+    return false;
+  }
+
+  return true;
+}
+
+bool SqMessage::push(HSQUIRRELVM vm) const
+{
+  size_t offset = 0;
+  return readValue(vm, data, offset, 0);
+}
+
+SqWorkerPool::~SqWorkerPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopping = true;
+  }
+
+  m_startCondition.notify_all();
+
+  for (auto& worker : m_workers)
+  {
+    if (worker->thread.joinable())
+      worker->thread.join();
+  }
+}
+
+bool SqWorkerPool::execute(const char* name)
+{
+  for (auto& worker : m_workers)
+  {
+    if (!worker->vm.execute(name))
+      return false;
+  }
+
+  return true;
+}
+
+uint32 SqWorkerPool::createEntity(const char* className)
+{
+  const uint32 id = m_nextID;
+  Worker& worker = *m_workers[id % m_workers.size()];
+  SqVM& vm = worker.vm;
+  SqMemoryScope scope(vm);
+
+  sq_pushroottable(vm);
+  sq_pushstring(vm, className, -1);
+
+  if (SQ_FAILED(sq_get(vm, -2)))
+  {
+    logError("Failed to find entity class %s", className);
+    sq_poptop(vm);
+    return 0;
+  }
+
+  if (sq_gettype(vm, -1) != OT_CLASS)
+  {
+    logError("Entity class %s is not a class", className);
+    sq_pop(vm, 2);
+    return 0;
+  }
+
+  worker.current = id;
+
+  sq_pushroottable(vm);
+  sq_pushinteger(vm, SQInteger(id));
+  const SQRESULT result = sq_call(vm, 2, SQTrue, SQTrue);
+
+  worker.current = 0;
+
+  if (SQ_FAILED(result))
+  {
+    logError("Failed to create entity of class %s", className);
+    sq_pop(vm, 2);
+    return 0;
+  }
+
+  Worker::Entity entity;
+  entity.id = id;
+  entity.instance = SqObject(vm, -1);
+  entity.update = SqFunction(entity.instance, "update");
+  entity.onMessage = SqFunction(entity.instance, "onMessage");
+  worker.entities.push_back(std::move(entity));
+
+  sq_pop(vm, 3);
+
+  m_nextID++;
+  return id;
+}
+
+void SqWorkerPool::destroyEntity(uint32 id)
+{
+  if (!id)
+    return;
+
+  Worker& worker = *m_workers[id % m_workers.size()];
+
+  Worker::Entity* entity = worker.findEntity(id);
+  if (!entity)
+    return;
+
+  worker.entities.erase(worker.entities.begin() + (entity - worker.entities.data()));
+}
+
+void SqWorkerPool::post(const SqMessage& message)
+{
+  route(SqMessage(message));
+}
+
+void SqWorkerPool::update(Time deltaTime)
+{
+  ProfileNodeCall call("SqWorkerPool::update");
+
+  m_messages.clear();
+
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_deltaTime = deltaTime;
+    m_pending = uint(m_workers.size());
+    m_frame++;
+    m_startCondition.notify_all();
+    m_finishCondition.wait(lock, [this] { return m_pending == 0; });
+  }
+
+  std::vector<SqMessage> sent;
+
+  for (auto& worker : m_workers)
+  {
+    std::move(worker->outbox.begin(), worker->outbox.end(), std::back_inserter(sent));
+    worker->outbox.clear();
+  }
+
+  // Each worker's messages are in sending order and each sender lives on
+  // exactly one worker, so this order is independent of the worker count
+  std::stable_sort(sent.begin(), sent.end(), [](const SqMessage& a, const SqMessage& b)
+  {
+    return a.sender < b.sender;
+  });
+
+  for (SqMessage& message : sent)
+    route(std::move(message));
+}
+
+SqVM& SqWorkerPool::vm(uint index) const
+{
+  return m_workers[index]->vm;
+}
+
+std::unique_ptr<SqWorkerPool> SqWorkerPool::create(ResourceCache& cache,
+                                                   uint workerCount)
+{
+  std::unique_ptr<SqWorkerPool> pool(new SqWorkerPool(cache));
+  if (!pool->init(workerCount))
+    return nullptr;
+
+  return pool;
+}
+
+SqWorkerPool::SqWorkerPool(ResourceCache& cache):
+  m_cache(cache),
+  m_nextID(1),
+  m_frame(0),
+  m_pending(0),
+  m_deltaTime(0.0),
+  m_stopping(false)
+{
+}
+
+bool SqWorkerPool::init(uint workerCount)
+{
+  if (!workerCount)
+    workerCount = max(std::thread::hardware_concurrency(), 1u);
+
+  for (uint i = 0;  i < workerCount;  i++)
+    m_workers.push_back(std::unique_ptr<Worker>(new Worker(m_cache)));
+
+  for (auto& worker : m_workers)
+  {
+    try
+    {
+      worker->thread = std::thread(&SqWorkerPool::work, this, std::ref(*worker));
+    }
+    catch (const std::system_error& e)
+    {
+      logError("Failed to start script worker thread: %s", e.what());
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void SqWorkerPool::work(Worker& worker)
+{
+  uint64 frame = 0;
+
+  for (;;)
+  {
+    Time deltaTime;
+
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_startCondition.wait(lock, [&] { return m_stopping || m_frame != frame; });
+      if (m_stopping)
+        return;
+
+      frame = m_frame;
+      deltaTime = m_deltaTime;
+    }
+
+    worker.run(deltaTime);
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (--m_pending == 0)
+        m_finishCondition.notify_one();
+    }
+  }
+}
+
+void SqWorkerPool::route(SqMessage&& message)
+{
+  if (message.target == 0)
+    m_messages.push_back(std::move(message));
+  else
+  {
+    Worker& worker = *m_workers[message.target % m_workers.size()];
+    worker.inbox.push_back(std::move(message));
+  }
+}
+
+} /*namespace nori*/
+
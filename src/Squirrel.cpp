@@ -28,6 +28,9 @@
 #include <nori/Core.hpp>
 #include <nori/Path.hpp>
 #include <nori/Resource.hpp>
+#include <nori/Time.hpp>
+#include <nori/Profile.hpp>
+#include <nori/Transform.hpp>
 
 #include <nori/Squirrel.hpp>
 
@@ -36,8 +39,12 @@
 
 #include <sstream>
 #include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <mutex>
 
 #include <cstring>
+#include <cstdlib>
 
 namespace nori
 {
@@ -45,6 +52,106 @@ namespace nori
 namespace
 {
 
+enum
+{
+  PROFILE_FUNCTION = 1,
+  PROFILE_LINE = 2
+};
+
+// Heap growth since the last collection before garbage is collected within
+// a frame budget, and before a collection is reported as overdue
+const double GARBAGE_GROWTH = 1.25;
+const double GARBAGE_LIMIT = 2.0;
+
+const char BYTECODE_MAGIC[4] = { 'N', 'S', 'Q', 'B' };
+
+struct BytecodeHeader
+{
+  char magic[4];
+  uint32 version;
+  uint64 hash;
+};
+
+struct BytecodeReader
+{
+  const char* data;
+  size_t size;
+  size_t offset;
+};
+
+uint64 hashText(const std::string& text)
+{
+  // 64-bit FNV-1a
+  uint64 hash = 14695981039346656037ull;
+
+  for (char c : text)
+  {
+    hash ^= uint8(c);
+    hash *= 1099511628211ull;
+  }
+
+  return hash;
+}
+
+bool readText(const Path& path, std::string& text)
+{
+  std::ifstream stream(path.name(), std::ios::in | std::ios::binary);
+  if (stream.fail())
+    return false;
+
+  stream.seekg(0, std::ios::end);
+  text.resize((uint) stream.tellg());
+
+  stream.seekg(0, std::ios::beg);
+  stream.read(&text[0], text.size());
+
+  return !stream.fail();
+}
+
+SQInteger readBytes(SQUserPointer user, SQUserPointer target, SQInteger size)
+{
+  BytecodeReader& reader = *(BytecodeReader*) user;
+
+  const size_t count = std::min(size_t(size), reader.size - reader.offset);
+  std::memcpy(target, reader.data + reader.offset, count);
+  reader.offset += count;
+
+  return SQInteger(count);
+}
+
+SQInteger writeBytes(SQUserPointer user, SQUserPointer source, SQInteger size)
+{
+  std::ofstream& stream = *(std::ofstream*) user;
+
+  stream.write((const char*) source, size);
+  if (stream.fail())
+    return 0;
+
+  return size;
+}
+
+void findScripts(const Path& path,
+                 const std::string& name,
+                 std::vector<std::string>& names)
+{
+  for (const std::string& child : path.children())
+  {
+    if (child == "." || child == "..")
+      continue;
+
+    const Path childPath = path + child;
+    const std::string childName = name.empty() ? child : name + '/' + child;
+
+    if (childPath.isDirectory())
+      findScripts(childPath, childName, names);
+    else if (childPath.suffix() == "nut")
+    {
+      if (std::find(names.begin(), names.end(), childName) == names.end())
+        names.push_back(childName);
+    }
+  }
+}
+
 std::string escapeString(const SQChar* string)
 {
   std::string result;
@@ -197,13 +304,27 @@ void logErrorCallStack(HSQUIRRELVM vm)
 }
 
 template <typename T>
-void pushData(HSQUIRRELVM vm, const char* className, T value)
+void pushValue(HSQUIRRELVM vm, HSQOBJECT class_, const T& value)
+{
+  // The instance constructor is skipped, as the value is copied over anyway
+  sq_pushobject(vm, class_);
+  sq_createinstance(vm, -1);
+
+  SQUserPointer pointer;
+  sq_getinstanceup(vm, -1, &pointer, nullptr);
+  new (pointer) T(value);
+
+  sq_remove(vm, -2);
+}
+
+template <typename T>
+T getValue(HSQUIRRELVM vm, SQInteger index)
 {
-  SqTable root(SqTable::rootTable(vm));
-  SqClass class_(root.get<SqClass>(className));
-  SqNativeInstance<T> instance(class_.createInstance());
-  *instance.native() = value;
-  sq_pushobject(vm, instance.handle());
+  SQUserPointer pointer;
+  if (SQ_FAILED(sq_getinstanceup(vm, index, &pointer, SqDataClass<T>::typeTag())))
+    return T();
+
+  return *static_cast<T*>(pointer);
 }
 
 template <typename T>
@@ -221,11 +342,21 @@ std::string vecToString(T v) { return stringCast(v); }
 template <typename T>
 float vecDot(T a, T b) { return dot(a, b); }
 
+quat quatMul(quat a, quat b) { return a * b; }
+vec3 quatRotate(quat q, vec3 v) { return q * v; }
+quat quatInverse(quat q) { return inverse(q); }
+std::string quatToString(quat q) { return stringCast(q); }
+
+Transform3 transformMul(Transform3 a, Transform3 b) { return a * b; }
+vec3 transformPoint(Transform3 t, vec3 point) { return t * point; }
+Transform3 transformInverse(Transform3 t) { return t.inverse(); }
+vec3 transformPosition(Transform3 t) { return t.position; }
+quat transformRotation(Transform3 t) { return t.rotation; }
+float transformScale(Transform3 t) { return t.scale; }
+
 template <typename T>
-void registerVectorClass(SqVM& vm, const char* name)
+SqDataClass<T> createVectorClass(SqVM& vm)
 {
-  SqTable rootTable(vm.rootTable());
-
   SqDataClass<T> vecClass(vm);
   vecClass.addMethod("_add", &vecAdd<T>);
   vecClass.addMethod("_sub", &vecSub<T>);
@@ -234,93 +365,248 @@ void registerVectorClass(SqVM& vm, const char* name)
   vecClass.addMethod("_unm", &vecUnm<T>);
   vecClass.addMethod("_tostring", &vecToString<T>);
   vecClass.addMethod("dot", &vecDot<T>);
-  rootTable.addSlot(name, (SqClass) vecClass);
+  return vecClass;
 }
 
-void registerCoreClasses(SqVM& vm)
+SqDataClass<quat> createQuatClass(SqVM& vm)
 {
-  SqTable rootTable(vm.rootTable());
+  SqDataClass<quat> quatClass(vm);
+  quatClass.addMethod("_mul", &quatMul);
+  quatClass.addMethod("_tostring", &quatToString);
+  quatClass.addMethod("rotate", &quatRotate);
+  quatClass.addMethod("inverse", &quatInverse);
+  return quatClass;
+}
 
-  registerVectorClass<vec2>(vm, "Vec2");
-  registerVectorClass<vec3>(vm, "Vec3");
-  registerVectorClass<vec4>(vm, "Vec4");
+SqDataClass<Transform3> createTransformClass(SqVM& vm)
+{
+  SqDataClass<Transform3> transformClass(vm);
+  transformClass.addMethod("_mul", &transformMul);
+  transformClass.addMethod("transformPoint", &transformPoint);
+  transformClass.addMethod("inverse", &transformInverse);
+  transformClass.addMethod("position", &transformPosition);
+  transformClass.addMethod("rotation", &transformRotation);
+  transformClass.addMethod("scale", &transformScale);
+  return transformClass;
 }
 
-} /*namespace*/
+const size_t POOL_CLASS_SIZE = 16;
+const size_t POOL_CLASS_COUNT = 32;
+const size_t POOL_CHUNK_SIZE = 64 * 1024;
+const size_t POOL_BATCH_COUNT = 64;
 
-namespace detail
+/*! @brief Free block in a Squirrel memory pool free list.
+ */
+struct PoolBlock
 {
+  PoolBlock* next;
+};
 
-template <>
-bool get(HSQUIRRELVM vm, SQInteger index)
+/*! @brief Size-classed pool shared by all Squirrel VMs.
+ *
+ *  Blocks move between the shared free lists and the per-thread caches in
+ *  batches, so the mutex is only taken once per batch.  Chunks carved into
+ *  blocks are kept for the lifetime of the process.
+ */
+class SharedPool
+{
+public:
+  SharedPool();
+  PoolBlock* acquire(size_t sizeClass, size_t& count);
+  void release(size_t sizeClass, PoolBlock* head, PoolBlock* tail);
+  std::mutex mutex;
+  PoolBlock* blocks[POOL_CLASS_COUNT];
+};
+
+SharedPool::SharedPool()
 {
-  SQBool value;
-  sq_getbool(vm, index, &value);
-  return value ? true : false;
+  std::fill(blocks, blocks + POOL_CLASS_COUNT, nullptr);
 }
 
-template <>
-void push(HSQUIRRELVM vm, bool value)
+PoolBlock* SharedPool::acquire(size_t sizeClass, size_t& count)
 {
-  sq_pushbool(vm, SQBool(value));
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (!blocks[sizeClass])
+  {
+    const size_t size = (sizeClass + 1) * POOL_CLASS_SIZE;
+
+    char* chunk = static_cast<char*>(std::malloc(POOL_CHUNK_SIZE));
+    if (!chunk)
+      panic("Out of Squirrel memory");
+
+    for (size_t offset = 0;  offset + size <= POOL_CHUNK_SIZE;  offset += size)
+    {
+      PoolBlock* block = reinterpret_cast<PoolBlock*>(chunk + offset);
+      block->next = blocks[sizeClass];
+      blocks[sizeClass] = block;
+    }
+  }
+
+  PoolBlock* head = blocks[sizeClass];
+  PoolBlock* tail = head;
+  count = 1;
+
+  while (tail->next && count < POOL_BATCH_COUNT)
+  {
+    tail = tail->next;
+    count++;
+  }
+
+  blocks[sizeClass] = tail->next;
+  tail->next = nullptr;
+  return head;
 }
 
-template <>
-int get(HSQUIRRELVM vm, SQInteger index)
+void SharedPool::release(size_t sizeClass, PoolBlock* head, PoolBlock* tail)
 {
-  SQInteger value;
-  sq_getinteger(vm, index, &value);
-  return int(value);
+  std::lock_guard<std::mutex> lock(mutex);
+  tail->next = blocks[sizeClass];
+  blocks[sizeClass] = head;
 }
 
-template <>
-void push(HSQUIRRELVM vm, int value)
+SharedPool& sharedPool()
 {
-  sq_pushinteger(vm, SQInteger(value));
+  // Deliberately leaked so that it outlives the thread caches
+  static SharedPool* pool = new SharedPool();
+  return *pool;
 }
 
-template <>
-float get(HSQUIRRELVM vm, SQInteger index)
+/*! @brief Per-thread cache of Squirrel memory pool blocks.
+ */
+class PoolCache
+{
+public:
+  PoolCache();
+  ~PoolCache();
+  void* allocate(size_t sizeClass);
+  void release(size_t sizeClass, void* memory);
+  PoolBlock* blocks[POOL_CLASS_COUNT];
+  size_t counts[POOL_CLASS_COUNT];
+};
+
+PoolCache::PoolCache()
 {
-  SQFloat value;
-  sq_getfloat(vm, index, &value);
-  return float(value);
+  std::fill(blocks, blocks + POOL_CLASS_COUNT, nullptr);
+  std::fill(counts, counts + POOL_CLASS_COUNT, 0);
 }
 
-template <>
-void push(HSQUIRRELVM vm, float value)
+PoolCache::~PoolCache()
 {
-  sq_pushfloat(vm, SQFloat(value));
+  for (size_t i = 0;  i < POOL_CLASS_COUNT;  i++)
+  {
+    if (PoolBlock* head = blocks[i])
+    {
+      PoolBlock* tail = head;
+      while (tail->next)
+        tail = tail->next;
+
+      sharedPool().release(i, head, tail);
+      blocks[i] = nullptr;
+      counts[i] = 0;
+    }
+  }
 }
 
-template <>
-const char* get(HSQUIRRELVM vm, SQInteger index)
+void* PoolCache::allocate(size_t sizeClass)
 {
-  const SQChar* value;
-  sq_getstring(vm, index, &value);
-  return value;
+  if (!blocks[sizeClass])
+    blocks[sizeClass] = sharedPool().acquire(sizeClass, counts[sizeClass]);
+
+  PoolBlock* block = blocks[sizeClass];
+  blocks[sizeClass] = block->next;
+  counts[sizeClass]--;
+  return block;
 }
 
-template <>
-void push(HSQUIRRELVM vm, const char* value)
+void PoolCache::release(size_t sizeClass, void* memory)
 {
-  sq_pushstring(vm, value, -1);
+  PoolBlock* block = static_cast<PoolBlock*>(memory);
+  block->next = blocks[sizeClass];
+  blocks[sizeClass] = block;
+
+  if (++counts[sizeClass] == POOL_BATCH_COUNT * 2)
+  {
+    PoolBlock* tail = block;
+    for (size_t i = 1;  i < POOL_BATCH_COUNT;  i++)
+      tail = tail->next;
+
+    blocks[sizeClass] = tail->next;
+    counts[sizeClass] -= POOL_BATCH_COUNT;
+    sharedPool().release(sizeClass, block, tail);
+  }
 }
 
-template <>
-std::string get(HSQUIRRELVM vm, SQInteger index)
+thread_local PoolCache poolCache;
+
+size_t poolSizeClass(SQUnsignedInteger size)
 {
-  const SQChar* value;
-  sq_getstring(vm, index, &value);
-  return std::string(value);
+  return size ? size_t(size - 1) / POOL_CLASS_SIZE : 0;
 }
 
-template <>
-void push(HSQUIRRELVM vm, std::string value)
+// Squirrel passes the size of the block to every free and realloc, so the
+// size class can be recovered without a block header
+void* poolMalloc(SQUnsignedInteger size)
+{
+  const size_t sizeClass = poolSizeClass(size);
+  if (sizeClass < POOL_CLASS_COUNT)
+    return poolCache.allocate(sizeClass);
+
+  void* memory = std::malloc(size_t(size));
+  if (!memory)
+    panic("Out of Squirrel memory");
+
+  return memory;
+}
+
+void poolFree(void* memory, SQUnsignedInteger size)
+{
+  if (!memory)
+    return;
+
+  const size_t sizeClass = poolSizeClass(size);
+  if (sizeClass < POOL_CLASS_COUNT)
+    poolCache.release(sizeClass, memory);
+  else
+    std::free(memory);
+}
+
+void* poolRealloc(void* memory, SQUnsignedInteger oldSize, SQUnsignedInteger newSize)
+{
+  if (!memory)
+    return poolMalloc(newSize);
+
+  const size_t oldClass = poolSizeClass(oldSize);
+  const size_t newClass = poolSizeClass(newSize);
+
+  if (oldClass == newClass && newClass < POOL_CLASS_COUNT)
+    return memory;
+
+  if (oldClass >= POOL_CLASS_COUNT && newClass >= POOL_CLASS_COUNT)
+  {
+    memory = std::realloc(memory, size_t(newSize));
+    if (!memory)
+      panic("Out of Squirrel memory");
+
+    return memory;
+  }
+
+  void* newMemory = poolMalloc(newSize);
+  std::memcpy(newMemory, memory, size_t(std::min(oldSize, newSize)));
+  poolFree(memory, oldSize);
+  return newMemory;
+}
+
+SqVM& getVM(HSQUIRRELVM vm)
 {
-  sq_pushstring(vm, value.c_str(), -1);
+  return *static_cast<SqVM*>(sq_getsharedforeignptr(vm));
 }
 
+} /*namespace*/
+
+namespace detail
+{
+
 template <>
 SqObject get(HSQUIRRELVM vm, SQInteger index)
 {
@@ -384,54 +670,87 @@ void push(HSQUIRRELVM vm, SqInstance value)
 template <>
 vec2 get(HSQUIRRELVM vm, SQInteger index)
 {
-  vec2* value;
-  sq_getinstanceup(vm, index, (SQUserPointer*) &value, nullptr);
-  return *value;
+  return getValue<vec2>(vm, index);
 }
 
 template <>
 void push(HSQUIRRELVM vm, vec2 value)
 {
-  pushData(vm, "Vec2", value);
+  pushValue(vm, getVM(vm).m_valueClasses[SqVM::VALUE_VEC2], value);
 }
 
 template <>
 vec3 get(HSQUIRRELVM vm, SQInteger index)
 {
-  vec3* value;
-  sq_getinstanceup(vm, index, (SQUserPointer*) &value, nullptr);
-  return *value;
+  return getValue<vec3>(vm, index);
 }
 
 template <>
 void push(HSQUIRRELVM vm, vec3 value)
 {
-  pushData(vm, "Vec3", value);
+  pushValue(vm, getVM(vm).m_valueClasses[SqVM::VALUE_VEC3], value);
 }
 
 template <>
 vec4 get(HSQUIRRELVM vm, SQInteger index)
 {
-  vec4* value;
-  sq_getinstanceup(vm, index, (SQUserPointer*) &value, nullptr);
-  return *value;
+  return getValue<vec4>(vm, index);
 }
 
 template <>
 void push(HSQUIRRELVM vm, vec4 value)
 {
-  pushData(vm, "Vec4", value);
+  pushValue(vm, getVM(vm).m_valueClasses[SqVM::VALUE_VEC4], value);
+}
+
+template <>
+quat get(HSQUIRRELVM vm, SQInteger index)
+{
+  return getValue<quat>(vm, index);
+}
+
+template <>
+void push(HSQUIRRELVM vm, quat value)
+{
+  pushValue(vm, getVM(vm).m_valueClasses[SqVM::VALUE_QUAT], value);
+}
+
+template <>
+Transform3 get(HSQUIRRELVM vm, SQInteger index)
+{
+  return getValue<Transform3>(vm, index);
+}
+
+template <>
+void push(HSQUIRRELVM vm, Transform3 value)
+{
+  pushValue(vm, getVM(vm).m_valueClasses[SqVM::VALUE_TRANSFORM3], value);
 }
 
 } /*namespace detail*/
 
 SqVM::SqVM(ResourceCache& cache):
   m_cache(cache),
-  m_vm(nullptr)
-{
+  m_vm(nullptr),
+  m_caching(false),
+  m_profiling(false),
+  m_garbagePauseTime(0.0),
+  m_garbageRate(0.0),
+  m_garbageCollectedCount(0),
+  m_garbageUsage(0),
+  m_garbageOverdue(false),
+  m_memoryUsage(0),
+  m_memoryHighWater(0)
+{
+  static std::once_flag allocatorFlag;
+  std::call_once(allocatorFlag, []() { sq_setallocator(onAllocate, onReallocate, onFree); });
+
+  SqMemoryScope scope(*this);
+
   m_vm = sq_open(1024);
 
   sq_setforeignptr(m_vm, nullptr);
+  sq_setsharedforeignptr(m_vm, this);
   sq_setprintfunc(m_vm, onLogMessage, onLogError);
   sq_setcompilererrorhandler(m_vm, onCompilerError);
 
@@ -442,17 +761,33 @@ SqVM::SqVM(ResourceCache& cache):
   sq_seterrorhandler(m_vm);
   sq_poptop(m_vm);
 
-  registerCoreClasses(*this);
+  registerValueClass(VALUE_VEC2, "Vec2", createVectorClass<vec2>(*this));
+  registerValueClass(VALUE_VEC3, "Vec3", createVectorClass<vec3>(*this));
+  registerValueClass(VALUE_VEC4, "Vec4", createVectorClass<vec4>(*this));
+  registerValueClass(VALUE_QUAT, "Quat", createQuatClass(*this));
+  registerValueClass(VALUE_TRANSFORM3, "Transform3", createTransformClass(*this));
+
+  // Calibrate the collection time estimate on the initial heap
+  collectGarbage();
 }
 
 SqVM::~SqVM()
 {
+  SqMemoryScope scope(*this);
+
   if (m_vm)
+  {
+    for (HSQOBJECT& valueClass : m_valueClasses)
+      sq_release(m_vm, &valueClass);
+
     sq_close(m_vm);
+  }
 }
 
 bool SqVM::execute(const char* name)
 {
+  SqMemoryScope scope(*this);
+
   const Path path = m_cache.findFile(name);
   if (path.isEmpty())
   {
@@ -460,30 +795,188 @@ bool SqVM::execute(const char* name)
     return false;
   }
 
-  std::ifstream stream(path.name());
-  if (stream.fail())
+  std::string text;
+  if (!readText(path, text))
   {
-    logError("Failed to open script %s", name);
-    return nullptr;
+    logError("Failed to read script %s", name);
+    return false;
   }
 
-  stream.seekg(0, std::ios::end);
+  if (!load(name, path, text))
+    return false;
+
+  return run();
+}
+
+bool SqVM::execute(const char* name, const char* text)
+{
+  SqMemoryScope scope(*this);
+
+  if (SQ_FAILED(sq_compilebuffer(m_vm, text, std::strlen(text), name, true)))
+    return false;
+
+  return run();
+}
+
+bool SqVM::precompile(const char* name)
+{
+  SqMemoryScope scope(*this);
+
+  const Path path = m_cache.findFile(name);
+  if (path.isEmpty())
+  {
+    logError("Failed to find script %s", name);
+    return false;
+  }
 
   std::string text;
-  text.resize((uint) stream.tellg());
+  if (!readText(path, text))
+  {
+    logError("Failed to read script %s", name);
+    return false;
+  }
 
-  stream.seekg(0, std::ios::beg);
-  stream.read(&text[0], text.size());
-  stream.close();
+  const uint64 hash = bytecodeHash(text);
+  const Path bytecode = bytecodePath(name, path);
+
+  if (readBytecode(bytecode, hash))
+  {
+    sq_poptop(m_vm);
+    return true;
+  }
 
-  return execute(name, text.c_str());
+  if (SQ_FAILED(sq_compilebuffer(m_vm, text.c_str(), text.size(), name, true)))
+    return false;
+
+  const bool success = writeBytecode(bytecode, hash);
+
+  sq_poptop(m_vm);
+  return success;
 }
 
-bool SqVM::execute(const char* name, const char* text)
+bool SqVM::precompileTree(const char* directory)
 {
-  if (SQ_FAILED(sq_compilebuffer(m_vm, text, std::strlen(text), name, true)))
+  std::vector<std::string> names;
+
+  if (m_cache.searchPaths().empty())
+    findScripts(Path(directory), directory, names);
+  else
+  {
+    for (const Path& path : m_cache.searchPaths())
+      findScripts(path + directory, directory, names);
+  }
+
+  bool success = true;
+
+  for (const std::string& name : names)
+  {
+    if (!precompile(name.c_str()))
+      success = false;
+  }
+
+  return success;
+}
+
+void SqVM::setCaching(bool enabled)
+{
+  m_caching = enabled;
+}
+
+void SqVM::setCacheDirectory(const Path& newDirectory)
+{
+  m_cacheDirectory = newDirectory;
+}
+
+void SqVM::setProfiling(bool enabled)
+{
+  m_profiling = enabled;
+  m_profileFrames.clear();
+
+  // Line events are only emitted by scripts compiled with debug info
+  sq_enabledebuginfo(m_vm, enabled);
+
+  if (enabled)
+    sq_setnativedebughook(m_vm, onDebugHook);
+  else
+    sq_setnativedebughook(m_vm, nullptr);
+}
+
+uint SqVM::collectGarbage()
+{
+  SqMemoryScope scope(*this);
+
+  ProfileNodeCall call("SqVM::collectGarbage");
+
+  const size_t usage = memoryUsage();
+
+  Timer timer;
+  timer.start();
+
+  const SQInteger count = sq_collectgarbage(m_vm);
+
+  m_garbagePauseTime = timer.time();
+  m_garbageRate = m_garbagePauseTime / double(max(usage, size_t(1)));
+  m_garbageCollectedCount = count > 0 ? uint(count) : 0;
+  m_garbageUsage = memoryUsage();
+  m_garbageOverdue = false;
+
+  return m_garbageCollectedCount;
+}
+
+bool SqVM::collectGarbage(Time budget)
+{
+  const size_t usage = memoryUsage();
+
+  if (double(usage) < double(m_garbageUsage) * GARBAGE_GROWTH)
+  {
+    m_garbageOverdue = false;
+    return false;
+  }
+
+  // Marking visits every live object, so the pause grows with the heap.  The
+  // collector cannot be interrupted, so a collection expected to exceed the
+  // budget is left for the caller to make at a better time
+  if (m_garbageRate * double(usage) > budget)
+  {
+    m_garbageOverdue = double(usage) >= double(m_garbageUsage) * GARBAGE_LIMIT;
     return false;
+  }
+
+  collectGarbage();
+  return true;
+}
+
+void SqVM::registerValueClass(ValueClass index, const char* name, SqClass class_)
+{
+  rootTable().addSlot(name, class_);
+
+  // Keep a reference of our own, so values can be pushed without looking up
+  // the class and even if a script replaces the root table slot
+  m_valueClasses[index] = class_.handle();
+  sq_addref(m_vm, &m_valueClasses[index]);
+}
+
+bool SqVM::load(const char* name, const Path& path, const std::string& text)
+{
+  if (!m_caching)
+    return SQ_SUCCEEDED(sq_compilebuffer(m_vm, text.c_str(), text.size(), name, true));
+
+  const uint64 hash = bytecodeHash(text);
+  const Path bytecode = bytecodePath(name, path);
+
+  if (readBytecode(bytecode, hash))
+    return true;
 
+  if (SQ_FAILED(sq_compilebuffer(m_vm, text.c_str(), text.size(), name, true)))
+    return false;
+
+  // The script can still run if the bytecode could not be cached
+  writeBytecode(bytecode, hash);
+  return true;
+}
+
+bool SqVM::run()
+{
   sq_pushroottable(m_vm);
 
   const SQRESULT result = sq_call(m_vm, 1, false, true);
@@ -492,6 +985,98 @@ bool SqVM::execute(const char* name, const char* text)
   return SQ_SUCCEEDED(result);
 }
 
+Path SqVM::bytecodePath(const char* name, const Path& path) const
+{
+  if (m_cacheDirectory.isEmpty())
+  {
+    std::string bytecode = path.name();
+
+    const std::string suffix = path.suffix();
+    if (!suffix.empty())
+      bytecode.resize(bytecode.size() - suffix.size() - 1);
+
+    return Path(bytecode + ".cnut");
+  }
+
+  // Scripts in different directories may share a file name
+  return m_cacheDirectory + format("%016llx.cnut",
+                                   (unsigned long long) hashText(name));
+}
+
+bool SqVM::readBytecode(const Path& path, uint64 hash)
+{
+  std::ifstream stream(path.name(), std::ios::in | std::ios::binary);
+  if (stream.fail())
+    return false;
+
+  const std::vector<char> data((std::istreambuf_iterator<char>(stream)),
+                               std::istreambuf_iterator<char>());
+
+  BytecodeHeader header;
+  if (data.size() < sizeof(header))
+    return false;
+
+  std::memcpy(&header, data.data(), sizeof(header));
+
+  if (std::memcmp(header.magic, BYTECODE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != SQUIRREL_VERSION_NUMBER ||
+      header.hash != hash)
+  {
+    return false;
+  }
+
+  BytecodeReader reader = { data.data(), data.size(), sizeof(header) };
+
+  if (SQ_FAILED(sq_readclosure(m_vm, readBytes, &reader)))
+  {
+    logWarning("Failed to read bytecode %s", path.name().c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool SqVM::writeBytecode(const Path& path, uint64 hash)
+{
+  if (!m_cacheDirectory.isEmpty() && !m_cacheDirectory.isDirectory())
+    m_cacheDirectory.createDirectory();
+
+  std::ofstream stream(path.name(),
+                       std::ios::out | std::ios::binary | std::ios::trunc);
+  if (stream.fail())
+  {
+    logWarning("Failed to create bytecode %s", path.name().c_str());
+    return false;
+  }
+
+  BytecodeHeader header;
+  std::memcpy(header.magic, BYTECODE_MAGIC, sizeof(header.magic));
+  header.version = SQUIRREL_VERSION_NUMBER;
+  header.hash = hash;
+
+  stream.write((const char*) &header, sizeof(header));
+
+  if (SQ_FAILED(sq_writeclosure(m_vm, writeBytes, &stream)))
+  {
+    logWarning("Failed to write bytecode %s", path.name().c_str());
+    stream.close();
+    Path(path).remove();
+    return false;
+  }
+
+  return true;
+}
+
+uint64 SqVM::bytecodeHash(const std::string& text) const
+{
+  // Bytecode compiled with debug info for profiling must not be mixed up
+  // with regular bytecode of the same script
+  if (m_profiling)
+    return ~hashText(text);
+
+  return hashText(text);
+}
+
 SqVM::operator HSQUIRRELVM ()
 {
   return m_vm;
@@ -519,6 +1104,8 @@ SqTable SqVM::constTable()
 
 SqTable SqVM::registryTable()
 {
+  SqMemoryScope scope(*this);
+
   sq_pushregistrytable(m_vm);
   SqTable table(m_vm, -1);
   sq_poptop(m_vm);
@@ -570,6 +1157,112 @@ SQInteger SqVM::onRuntimeError(HSQUIRRELVM vm)
   return 0;
 }
 
+void SqVM::onDebugHook(HSQUIRRELVM vm,
+                       SQInteger type,
+                       const SQChar* source,
+                       SQInteger line,
+                       const SQChar* function)
+{
+  std::vector<uint8>& frames = getVM(vm).m_profileFrames;
+  Profile* profile = Profile::currentNode();
+
+  if (!source)
+    source = "unknown";
+  if (!function)
+    function = "unknown";
+
+  if (type == 'c')
+  {
+    if (profile)
+    {
+      profile->beginNode(format("%s (%s)", function, source).c_str());
+      frames.push_back(PROFILE_FUNCTION);
+    }
+    else
+      frames.push_back(0);
+  }
+  else if (type == 'l')
+  {
+    if (!profile || frames.empty() || !(frames.back() & PROFILE_FUNCTION))
+      return;
+
+    if (frames.back() & PROFILE_LINE)
+      profile->endNode();
+
+    profile->beginNode(format("%s:%i", source, int(line)).c_str());
+    frames.back() |= PROFILE_LINE;
+  }
+  else if (type == 'r')
+  {
+    // Calls made before profiling was enabled have no frame
+    if (frames.empty())
+      return;
+
+    if (profile)
+    {
+      if (frames.back() & PROFILE_LINE)
+        profile->endNode();
+      if (frames.back() & PROFILE_FUNCTION)
+        profile->endNode();
+    }
+
+    frames.pop_back();
+  }
+}
+
+void* SqVM::onAllocate(SQUnsignedInteger size)
+{
+  addMemoryUsage(size_t(size), 0);
+  return poolMalloc(size);
+}
+
+void* SqVM::onReallocate(void* memory,
+                         SQUnsignedInteger oldSize,
+                         SQUnsignedInteger newSize)
+{
+  addMemoryUsage(size_t(newSize), memory ? size_t(oldSize) : 0);
+  return poolRealloc(memory, oldSize, newSize);
+}
+
+void SqVM::onFree(void* memory, SQUnsignedInteger size)
+{
+  if (memory)
+    addMemoryUsage(0, size_t(size));
+
+  poolFree(memory, size);
+}
+
+void SqVM::addMemoryUsage(size_t added, size_t removed)
+{
+  SqVM* vm = m_current;
+  if (!vm)
+    return;
+
+  // Memory allocated outside of any scope may be freed inside one
+  vm->m_memoryUsage -= min(vm->m_memoryUsage, removed);
+  vm->m_memoryUsage += added;
+  vm->m_memoryHighWater = max(vm->m_memoryHighWater, vm->m_memoryUsage);
+}
+
+thread_local SqVM* SqVM::m_current = nullptr;
+
+SqMemoryScope::SqMemoryScope(SqVM& vm):
+  m_previous(SqVM::m_current)
+{
+  SqVM::m_current = &vm;
+}
+
+SqMemoryScope::SqMemoryScope(HSQUIRRELVM vm):
+  m_previous(SqVM::m_current)
+{
+  SqVM::m_current = vm ? &getVM(vm) : nullptr;
+}
+
+SqMemoryScope::~SqMemoryScope()
+{
+  SqVM::m_current = m_previous;
+}
+
 SqObject::SqObject():
   m_vm(nullptr)
 {
@@ -582,8 +1275,10 @@ SqObject::SqObject(HSQUIRRELVM vm, SQInteger index):
   if (!m_vm)
     panic("VM handle cannot be NULL when constructing from stack");
 
+  SqMemoryScope scope(m_vm);
+
   sq_resetobject(&m_handle);
-  sq_getstackobj(m_vm, -1, &m_handle);
+  sq_getstackobj(m_vm, index, &m_handle);
   sq_addref(m_vm, &m_handle);
 }
 
@@ -591,6 +1286,7 @@ SqObject::SqObject(const SqObject& source):
   m_vm(source.m_vm),
   m_handle(source.m_handle)
 {
+  SqMemoryScope scope(m_vm);
   sq_addref(m_vm, &m_handle);
 }
 
@@ -599,13 +1295,16 @@ SqObject::SqObject(SqObject&& source):
   m_handle(source.m_handle)
 {
   source.m_vm = nullptr;
-  sq_resetobject(&m_handle);
+  sq_resetobject(&source.m_handle);
 }
 
 SqObject::~SqObject()
 {
   if (m_vm)
+  {
+    SqMemoryScope scope(m_vm);
     sq_release(m_vm, &m_handle);
+  }
 }
 
 SqObject SqObject::clone() const
@@ -613,6 +1312,8 @@ SqObject SqObject::clone() const
   if (!m_vm)
     return SqObject();
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_clone(m_vm, -1);
   SqObject clone(m_vm, -1);
@@ -623,8 +1324,16 @@ SqObject SqObject::clone() const
 SqObject& SqObject::operator = (const SqObject& source)
 {
   HSQOBJECT next = source.m_handle;
-  sq_addref(m_vm, &next);
-  sq_release(m_vm, &m_handle);
+  if (source.m_vm)
+  {
+    SqMemoryScope scope(source.m_vm);
+    sq_addref(source.m_vm, &next);
+  }
+  if (m_vm)
+  {
+    SqMemoryScope scope(m_vm);
+    sq_release(m_vm, &m_handle);
+  }
   m_handle = next;
   m_vm = source.m_vm;
   return *this;
@@ -635,6 +1344,8 @@ std::string SqObject::asString() const
   if (!m_vm)
     return std::string();
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_tostring(m_vm, -1);
 
@@ -666,6 +1377,8 @@ bool SqObject::removeSlot(const char* name)
   if (isNull())
     return false;
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_pushstring(m_vm, name, -1);
 
@@ -684,6 +1397,8 @@ bool SqObject::addFunction(const char* name,
   if (isNull())
     return false;
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_pushstring(m_vm, name, -1);
 
@@ -697,11 +1412,18 @@ bool SqObject::addFunction(const char* name,
   return SQ_SUCCEEDED(result);
 }
 
+SqFunction SqObject::function(const char* name)
+{
+  return SqFunction(*this, name);
+}
+
 bool SqObject::clear()
 {
   if (isNull())
     return false;
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
 
   const SQRESULT result = sq_clear(m_vm, -1);
@@ -724,6 +1446,8 @@ SQInteger SqObject::size() const
 SqArray::SqArray(HSQUIRRELVM vm):
   SqObject(vm)
 {
+  SqMemoryScope scope(m_vm);
+
   sq_newarray(m_vm, 0);
   sq_getstackobj(m_vm, -1, &m_handle);
   sq_addref(m_vm, &m_handle);
@@ -749,6 +1473,8 @@ bool SqArray::remove(SQInteger index)
   if (isNull())
     return false;
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
 
   const SQRESULT result = sq_arrayremove(m_vm, -1, index);
@@ -762,6 +1488,8 @@ bool SqArray::pop()
   if (isNull())
     return false;
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
 
   const SQRESULT result = sq_arraypop(m_vm, -1, false);
@@ -775,6 +1503,8 @@ bool SqArray::resize(SQInteger newSize)
   if (isNull())
     return false;
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
 
   const SQRESULT result = sq_arrayresize(m_vm, -1, newSize);
@@ -788,6 +1518,8 @@ bool SqArray::reverse()
   if (isNull())
     return false;
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
 
   const SQRESULT result = sq_arrayreverse(m_vm, -1);
@@ -801,6 +1533,8 @@ SqObject SqArray::operator [] (SQInteger index) const
   if (isNull())
     panic("Cannot retrieve slot from null");
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_pushinteger(m_vm, index);
 
@@ -818,6 +1552,8 @@ SqObject SqArray::operator [] (SQInteger index) const
 SqTable::SqTable(HSQUIRRELVM vm):
   SqObject(vm)
 {
+  SqMemoryScope scope(m_vm);
+
   sq_newtable(m_vm);
   sq_getstackobj(m_vm, -1, &m_handle);
   sq_addref(m_vm, &m_handle);
@@ -840,6 +1576,8 @@ SqTable::SqTable(HSQUIRRELVM vm, SQInteger index):
 
 SqTable SqTable::rootTable(HSQUIRRELVM vm)
 {
+  SqMemoryScope scope(vm);
+
   sq_pushroottable(vm);
   SqTable table(vm, -1);
   sq_poptop(vm);
@@ -849,6 +1587,8 @@ SqTable SqTable::rootTable(HSQUIRRELVM vm)
 
 SqTable SqTable::constTable(HSQUIRRELVM vm)
 {
+  SqMemoryScope scope(vm);
+
   sq_pushconsttable(vm);
   SqTable table(vm, -1);
   sq_poptop(vm);
@@ -859,6 +1599,8 @@ SqTable SqTable::constTable(HSQUIRRELVM vm)
 SqClass::SqClass(HSQUIRRELVM vm):
   SqObject(vm)
 {
+  SqMemoryScope scope(m_vm);
+
   sq_newclass(m_vm, false);
   sq_getstackobj(m_vm, -1, &m_handle);
   sq_addref(m_vm, &m_handle);
@@ -884,6 +1626,8 @@ SqInstance SqClass::createInstance() const
   if (isNull())
     panic("Cannot create instance of null");
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_createinstance(m_vm, -1);
 
@@ -898,6 +1642,8 @@ SqTable SqClass::attributes()
   if (isNull())
     return SqTable();
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_pushnull(m_vm);
   sq_getattributes(m_vm, -2);
@@ -913,6 +1659,8 @@ SqTable SqClass::memberAttributes(const char* name)
   if (isNull())
     return SqTable();
 
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_pushstring(m_vm, name, -1);
   sq_getattributes(m_vm, -2);
@@ -939,6 +1687,8 @@ SqInstance::SqInstance(HSQUIRRELVM vm, SQInteger index):
 
 SqClass SqInstance::class_() const
 {
+  SqMemoryScope scope(m_vm);
+
   sq_pushobject(m_vm, m_handle);
   sq_getclass(m_vm, -1);
 
@@ -957,5 +1707,27 @@ void* SqInstance::pointer()
   return result;
 }
 
+SqFunction::SqFunction(const SqObject& environment, const char* name):
+  SqObject(environment.vm()),
+  m_environment(environment)
+{
+  if (m_environment.isNull())
+    return;
+
+  SqMemoryScope scope(m_vm);
+
+  sq_pushobject(m_vm, m_environment.handle());
+  sq_pushstring(m_vm, name, -1);
+
+  if (SQ_SUCCEEDED(sq_get(m_vm, -2)))
+  {
+    sq_getstackobj(m_vm, -1, &m_handle);
+    sq_addref(m_vm, &m_handle);
+    sq_poptop(m_vm);
+  }
+
+  sq_poptop(m_vm);
+}
+
 } /*namespace nori*/
 
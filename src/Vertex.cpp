@@ -185,6 +185,8 @@ const VertexFormat Vertex2ft2fv::format("2f:vTexCoord 2f:vPosition");
 
 const VertexFormat Vertex2ft3fv::format("2f:vTexCoord 3f:vPosition");
 
+const VertexFormat Vertex4fc2ft2fv::format("4f:vColor 2f:vTexCoord 2f:vPosition");
+
 const VertexFormat Vertex4fc2ft3fv::format("4f:vColor 2f:vTexCoord 3f:vPosition");
 
 const VertexFormat Vertex3fn2ft3fv::format("3f:vNormal 2f:vTexCoord 3f:vPosition");
@@ -40,7 +40,8 @@ Widget::Widget(Layer& layer, Widget* parent):
   m_enabled(true),
   m_visible(true),
   m_draggable(false),
-  m_focusable(false)
+  m_focusable(false),
+  m_layoutDirty(false)
 {
   if (m_parent)
   {
@@ -148,7 +149,12 @@ void Widget::disable()
 
 void Widget::invalidate()
 {
-  m_layer.invalidate();
+  m_layer.invalidate(globalArea());
+}
+
+void Widget::invalidate(const Rect& area)
+{
+  m_layer.invalidate(Rect(area.position + globalPos(), area.size));
 }
 
 void Widget::activate()
@@ -280,6 +286,9 @@ void Widget::setArea(const Rect& newArea)
 {
   if (newArea != m_area)
   {
+    // Both the area being vacated and the new area need redrawing
+    invalidate();
+
     m_area = newArea;
     onAreaChanged();
 
@@ -299,12 +308,24 @@ void Widget::setPosition(vec2 newPosition)
 
 void Widget::setDesiredSize(vec2 newSize)
 {
+  if (m_desired == newSize)
+    return;
+
   m_desired = newSize;
 
   if (m_parent)
     m_parent->onChildDesiredSizeChanged(*this);
 }
 
+void Widget::invalidateLayout()
+{
+  // Ancestors of a dirty widget are always dirty, so stop at the first one
+  for (Widget* w = this;  w && !w->m_layoutDirty;  w = w->m_parent)
+    w->m_layoutDirty = true;
+
+  m_layer.m_layoutDirty = true;
+}
+
 void Widget::setFocusable(bool focusable)
 {
   m_focusable = focusable;
@@ -344,6 +365,14 @@ void Widget::onAreaChanged()
   m_areaChanged(*this);
 }
 
+void Widget::onMeasure()
+{
+}
+
+void Widget::onArrange()
+{
+}
+
 void Widget::onFocusChanged(bool activated)
 {
   m_focusChanged(*this, activated);
@@ -402,5 +431,30 @@ void Widget::onDragEnded(vec2 point, MouseButton button)
   m_dragEnded(*this, point, button);
 }
 
+void Widget::measureLayout()
+{
+  if (!m_layoutDirty)
+    return;
+
+  for (Widget* c : m_children)
+    c->measureLayout();
+
+  onMeasure();
+}
+
+void Widget::arrangeLayout()
+{
+  if (!m_layoutDirty)
+    return;
+
+  onArrange();
+
+  // Children may have been flagged by having their areas set
+  for (Widget* c : m_children)
+    c->arrangeLayout();
+
+  m_layoutDirty = false;
+}
+
 } /*namespace nori*/
 
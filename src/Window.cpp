@@ -40,6 +40,8 @@
 #include <utf8.h>
 
 #include <algorithm>
+#include <chrono>
+#include <thread>
 #include <cstring>
 
 #include <glm/gtx/quaternion.hpp>
@@ -52,6 +54,10 @@ namespace nori
 namespace
 {
 
+// GLFW cannot wait for events with a timeout, so a scheduled refresh is
+// waited for by polling at this interval
+const Time REFRESH_POLL_INTERVAL = 0.01;
+
 Window& windowFromHandle(GLFWwindow* handle)
 {
   return ((RenderContext*) glfwGetWindowUserPointer(handle))->window();
@@ -300,7 +306,23 @@ bool Window::update()
   if (m_refreshMode == MANUAL_REFRESH)
   {
     while (!m_needsRefresh && !glfwWindowShouldClose(m_handle))
-      glfwWaitEvents();
+    {
+      if (m_refreshTime == 0.0)
+      {
+        glfwWaitEvents();
+        continue;
+      }
+
+      const Time remaining = m_refreshTime - Timer::currentTime();
+      if (remaining <= 0.0)
+      {
+        m_refreshTime = 0.0;
+        break;
+      }
+
+      glfwPollEvents();
+      std::this_thread::sleep_for(std::chrono::duration<double>(min(remaining, REFRESH_POLL_INTERVAL)));
+    }
   }
   else
     glfwPollEvents();
@@ -313,6 +335,14 @@ void Window::invalidate()
   m_needsRefresh = true;
 }
 
+void Window::invalidate(Time delay)
+{
+  const Time time = Timer::currentTime() + delay;
+
+  if (m_refreshTime == 0.0 || time < m_refreshTime)
+    m_refreshTime = time;
+}
+
 void Window::captureCursor()
 {
   glfwSetInputMode(m_handle, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
@@ -426,6 +456,7 @@ Window::Window():
   m_hook(nullptr),
   m_target(nullptr),
   m_needsRefresh(false),
+  m_refreshTime(0.0),
   m_refreshMode(AUTOMATIC_REFRESH)
 {
 }
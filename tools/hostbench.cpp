@@ -0,0 +1,437 @@
+///////////////////////////////////////////////////////////////////////
+// Nori - a simple game engine
+// Copyright (c) 2014 Camilla Berglund <elmindreda@elmindreda.org>
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any
+// damages arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any
+// purpose, including commercial applications, and to alter it and
+// redistribute it freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you
+//     must not claim that you wrote the original software. If you use
+//     this software in a product, an acknowledgment in the product
+//     documentation would be appreciated but is not required.
+//
+//  2. Altered source versions must be plainly marked as such, and
+//     must not be misrepresented as being the original software.
+//
+//  3. This notice may not be removed or altered from any source
+//     distribution.
+//
+///////////////////////////////////////////////////////////////////////
+
+#include <nori/Config.hpp>
+#include <nori/Core.hpp>
+#include <nori/Time.hpp>
+#include <nori/ID.hpp>
+#include <nori/Network.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+using namespace nori;
+
+namespace
+{
+
+const uint FIRST_STEP = 250;
+
+class Options
+{
+public:
+  Options();
+  bool parse(int argc, char** argv);
+  uint clientCount;
+  uint objectCount;
+  uint churnCount;
+  uint tickCount;
+  uint lookupCount;
+  uint32 seed;
+};
+
+/*! Deterministic xorshift generator, so that runs can be reproduced.
+ */
+class Random
+{
+public:
+  Random(uint32 seed);
+  uint32 next();
+  uint32 below(uint32 limit) { return next() % limit; }
+private:
+  uint32 m_state;
+};
+
+/*! Peer that has disconnected, kept to check that its ID is rejected by
+ *  findPeer once reused.
+ */
+class Departed
+{
+public:
+  TargetID id;
+  uint32 generation;
+};
+
+class Observer : public HostObserver
+{
+public:
+  void onPeerConnected(Peer& peer) override;
+  void onPeerDisconnected(Peer& peer, uint32 reason) override;
+  void onPacketReceived(TargetID targetID, PacketData& data) override;
+  std::vector<Peer*> peers;
+  std::vector<size_t> indices;
+  std::vector<Departed> departed;
+};
+
+Options::Options():
+  clientCount(4000),
+  objectCount(32000),
+  churnCount(50),
+  tickCount(300),
+  lookupCount(10000000),
+  seed(1)
+{
+}
+
+bool Options::parse(int argc, char** argv)
+{
+  for (int i = 1;  i < argc;  i++)
+  {
+    const char* name = argv[i];
+
+    if (i + 1 == argc)
+      return false;
+
+    const char* value = argv[++i];
+
+    if (std::strcmp(name, "-clients") == 0)
+      clientCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-objects") == 0)
+      objectCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-churn") == 0)
+      churnCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-ticks") == 0)
+      tickCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-lookups") == 0)
+      lookupCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-seed") == 0)
+      seed = uint32(std::strtoul(value, nullptr, 10));
+    else
+      return false;
+  }
+
+  // Both IDs are 16 bits wide, with a few values reserved
+  if (clientCount > 60000 || objectCount > 60000)
+    return false;
+
+  return clientCount > 0 && churnCount <= clientCount && lookupCount > 0 &&
+         seed != 0;
+}
+
+Random::Random(uint32 seed):
+  m_state(seed)
+{
+}
+
+uint32 Random::next()
+{
+  m_state ^= m_state << 13;
+  m_state ^= m_state >> 17;
+  m_state ^= m_state << 5;
+  return m_state;
+}
+
+void Observer::onPeerConnected(Peer& peer)
+{
+  if (indices.size() <= peer.id())
+    indices.resize(peer.id() + 1);
+
+  indices[peer.id()] = peers.size();
+  peers.push_back(&peer);
+}
+
+void Observer::onPeerDisconnected(Peer& peer, uint32 reason)
+{
+  Departed d;
+  d.id = peer.id();
+  d.generation = peer.generation();
+  departed.push_back(d);
+
+  // Searching the peer list would make the observer the slowest part of
+  // each disconnect, so the last peer is moved into the vacated slot
+  const size_t index = indices[peer.id()];
+  peers[index] = peers.back();
+  indices[peers[index]->id()] = index;
+  peers.pop_back();
+}
+
+void Observer::onPacketReceived(TargetID targetID, PacketData& data)
+{
+}
+
+/*! @return The sizes to measure at, doubling from the first step up to and
+ *  including the specified count.
+ */
+std::vector<uint> steps(uint count)
+{
+  std::vector<uint> result;
+
+  for (uint step = FIRST_STEP;  step < count;  step *= 2)
+    result.push_back(step);
+
+  result.push_back(count);
+  return result;
+}
+
+/*! Releases and reallocates random IDs of a pool holding the specified number
+ *  of IDs, as peers and objects come and go.
+ */
+void measureIDs(uint count, uint operations, Random& random)
+{
+  IDPool<TargetID> pool(FIRST_CLIENT);
+  std::vector<TargetID> ids;
+
+  for (uint i = 0;  i < count;  i++)
+    ids.push_back(pool.allocateID());
+
+  Timer timer;
+  timer.start();
+
+  for (uint i = 0;  i < operations;  i++)
+  {
+    const uint index = random.below(count);
+    pool.releaseID(ids[index]);
+    ids[index] = pool.allocateID();
+  }
+
+  std::printf("ids: %5u allocated, %.1f ns per release and allocation\n",
+              count, timer.time() / operations * 1e9);
+}
+
+/*! Looks up random target IDs, both live and free, with and without their
+ *  generation.
+ */
+void measurePeers(Host& server, const Observer& observer, uint lookups, Random& random)
+{
+  std::vector<TargetID> ids;
+  std::vector<uint32> generations;
+
+  for (const Peer* peer : observer.peers)
+  {
+    ids.push_back(peer->id());
+    generations.push_back(peer->generation());
+  }
+
+  // A tenth of the lookups are for IDs with no peer, as after a disconnect
+  const TargetID limit = TargetID(ids.size() + ids.size() / 10 + FIRST_CLIENT);
+
+  std::vector<TargetID> targets(1024);
+  for (TargetID& target : targets)
+    target = TargetID(FIRST_CLIENT + random.below(limit - FIRST_CLIENT));
+
+  uint found = 0;
+
+  Timer timer;
+  timer.start();
+
+  for (uint i = 0;  i < lookups;  i++)
+  {
+    if (server.findPeer(targets[i & 1023]))
+      found++;
+  }
+
+  const Time plain = timer.time();
+
+  uint current = 0;
+
+  timer.start();
+
+  for (uint i = 0;  i < lookups;  i++)
+  {
+    const uint index = i % ids.size();
+    if (server.findPeer(ids[index], generations[index]))
+      current++;
+  }
+
+  const Time checked = timer.time();
+
+  std::printf("peers: %5u connected, findPeer %.1f ns (%.0f%% found), "
+              "with generation %.1f ns (%.0f%% found)\n",
+              uint(ids.size()),
+              plain / lookups * 1e9,
+              found * 100.0 / lookups,
+              checked / lookups * 1e9,
+              current * 100.0 / lookups);
+}
+
+/*! Looks up random object IDs among the specified number of objects.
+ */
+void measureObjects(Host& server, uint count, uint lookups, Random& random)
+{
+  std::vector<std::unique_ptr<NetworkObject>> objects;
+
+  for (uint i = 0;  i < count;  i++)
+    objects.emplace_back(new NetworkObject(server));
+
+  std::vector<NetworkObjectID> targets(1024);
+  for (NetworkObjectID& target : targets)
+    target = objects[random.below(count)]->id();
+
+  uint found = 0;
+
+  Timer timer;
+  timer.start();
+
+  for (uint i = 0;  i < lookups;  i++)
+  {
+    if (server.findObject(targets[i & 1023]))
+      found++;
+  }
+
+  std::printf("objects: %5u created, findObject %.1f ns (%.0f%% found)\n",
+              count, timer.time() / lookups * 1e9, found * 100.0 / lookups);
+}
+
+Time percentile(std::vector<Time>& values, float fraction)
+{
+  if (values.empty())
+    return 0.0;
+
+  std::sort(values.begin(), values.end());
+  const size_t index = size_t(fraction * float(values.size() - 1) + 0.5f);
+  return values[index];
+}
+
+} /*namespace*/
+
+int main(int argc, char** argv)
+{
+  Options options;
+  if (!options.parse(argc, argv))
+  {
+    std::fprintf(stderr,
+                 "Usage: %s [-clients count] [-objects count] [-churn count] "
+                 "[-ticks count] [-lookups count] [-seed seed]\n",
+                 argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Random random(options.seed);
+
+  for (uint count : steps(max(options.clientCount, options.objectCount)))
+    measureIDs(count, options.lookupCount / 10, random);
+
+  std::unique_ptr<NetworkSimulation> simulation = NetworkSimulation::create(options.seed);
+  if (!simulation)
+    return EXIT_FAILURE;
+
+  std::unique_ptr<Host> server = simulation->createServer(options.clientCount);
+  if (!server)
+    return EXIT_FAILURE;
+
+  Observer observer;
+  server->setObserver(&observer);
+
+  std::vector<std::unique_ptr<Host>> clients;
+
+  for (uint count : steps(options.clientCount))
+  {
+    while (clients.size() < count)
+    {
+      std::unique_ptr<Host> client = simulation->connect();
+      if (!client)
+        return EXIT_FAILURE;
+
+      clients.push_back(std::move(client));
+    }
+
+    simulation->advance(0.01);
+    server->update(0.0);
+
+    for (const std::unique_ptr<Host>& client : clients)
+      client->update(0.0);
+
+    measurePeers(*server, observer, options.lookupCount, random);
+  }
+
+  for (uint count : steps(options.objectCount))
+    measureObjects(*server, count, options.lookupCount, random);
+
+  // After as many idle ticks, to measure the update cost of the connected
+  // peers alone, each tick replaces random clients with new ones, whose
+  // connections the server handles on its next update
+  const Time period = 1.0 / 30.0;
+  std::vector<Time> idleTimes, tickTimes;
+  uint highestID = 0;
+
+  Timer timer;
+
+  for (uint tick = 0;  tick < options.tickCount * 2;  tick++)
+  {
+    const bool churning = tick >= options.tickCount;
+
+    for (uint i = 0;  churning && i < options.churnCount;  i++)
+    {
+      std::unique_ptr<Host>& client = clients[random.below(uint(clients.size()))];
+      client.reset();
+      client = simulation->connect();
+      if (!client)
+        return EXIT_FAILURE;
+    }
+
+    simulation->advance(period);
+
+    timer.start();
+    server->update(0.0);
+
+    if (churning)
+      tickTimes.push_back(timer.time());
+    else
+      idleTimes.push_back(timer.time());
+
+    for (const std::unique_ptr<Host>& client : clients)
+      client->update(0.0);
+
+    for (const Peer* peer : observer.peers)
+      highestID = max(highestID, uint(peer->id()));
+  }
+
+  uint stale = 0;
+
+  for (const Departed& d : observer.departed)
+  {
+    if (!server->findPeer(d.id, d.generation))
+      stale++;
+  }
+
+  const Time idle = std::accumulate(idleTimes.begin(), idleTimes.end(), 0.0);
+  const Time total = std::accumulate(tickTimes.begin(), tickTimes.end(), 0.0);
+  const uint changes = options.churnCount * options.tickCount;
+
+  std::printf("churn: %u clients, %u replaced per tick, %u ticks\n",
+              uint(observer.peers.size()),
+              options.churnCount,
+              options.tickCount);
+  std::printf("churn server update: idle mean %.3f ms, mean %.3f ms, "
+              "p99 %.3f ms, %.2f us per disconnect and connect\n",
+              idle / max(idleTimes.size(), size_t(1)) * 1000.0,
+              total / max(tickTimes.size(), size_t(1)) * 1000.0,
+              percentile(tickTimes, 0.99f) * 1000.0,
+              (total - idle) / max(changes, 1u) * 1e6);
+  std::printf("churn ids: highest %u, %u of %u departed peers rejected as stale\n",
+              highestID,
+              stale,
+              uint(observer.departed.size()));
+
+  clients.clear();
+  server.reset();
+
+  return EXIT_SUCCESS;
+}
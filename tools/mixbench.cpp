@@ -0,0 +1,229 @@
+///////////////////////////////////////////////////////////////////////
+// Nori - a simple game engine
+// Copyright (c) 2014 Camilla Berglund <elmindreda@elmindreda.org>
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any
+// damages arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any
+// purpose, including commercial applications, and to alter it and
+// redistribute it freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you
+//     must not claim that you wrote the original software. If you use
+//     this software in a product, an acknowledgment in the product
+//     documentation would be appreciated but is not required.
+//
+//  2. Altered source versions must be plainly marked as such, and
+//     must not be misrepresented as being the original software.
+//
+//  3. This notice may not be removed or altered from any source
+//     distribution.
+//
+///////////////////////////////////////////////////////////////////////
+
+#include <nori/Config.hpp>
+#include <nori/Core.hpp>
+#include <nori/Time.hpp>
+#include <nori/Path.hpp>
+#include <nori/Resource.hpp>
+#include <nori/Sample.hpp>
+#include <nori/Audio.hpp>
+
+#include <glm/gtc/constants.hpp>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace nori;
+
+namespace
+{
+
+// The software backend has this many voices
+const uint MAX_VOICE_COUNT = 256;
+const uint FIRST_STEP = 16;
+
+// Samples are at a different rate than the output, so every voice resamples
+const uint SAMPLE_FREQUENCY = 44100;
+
+class Options
+{
+public:
+  Options();
+  bool parse(int argc, char** argv);
+  uint voiceCount;
+  uint frequency;
+  uint updateRate;
+  Time duration;
+  Path output;
+};
+
+Options::Options():
+  voiceCount(MAX_VOICE_COUNT),
+  frequency(48000),
+  updateRate(60),
+  duration(10.0)
+{
+}
+
+bool Options::parse(int argc, char** argv)
+{
+  for (int i = 1;  i < argc;  i++)
+  {
+    const char* name = argv[i];
+
+    if (i + 1 == argc)
+      return false;
+
+    const char* value = argv[++i];
+
+    if (std::strcmp(name, "-voices") == 0)
+      voiceCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-frequency") == 0)
+      frequency = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-rate") == 0)
+      updateRate = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-seconds") == 0)
+      duration = std::strtod(value, nullptr);
+    else if (std::strcmp(name, "-output") == 0)
+      output = Path(value);
+    else
+      return false;
+  }
+
+  return voiceCount > 0 && voiceCount <= MAX_VOICE_COUNT &&
+         frequency > 0 && updateRate > 0 && duration > 0.0;
+}
+
+/*! Creates a second of a mono tone with some harmonics, so that the mixed
+ *  data is not trivially constant.
+ */
+Ref<AudioBuffer> createTone(ResourceCache& cache, AudioContext& context)
+{
+  std::vector<int16> samples(SAMPLE_FREQUENCY);
+
+  for (size_t i = 0;  i < samples.size();  i++)
+  {
+    const float t = float(i) / SAMPLE_FREQUENCY * two_pi<float>() * 220.f;
+    samples[i] = int16(12000.f * std::sin(t) + 4000.f * std::sin(t * 3.f));
+  }
+
+  Sample sample(ResourceInfo(cache),
+                (const char*) samples.data(),
+                samples.size() * sizeof(int16),
+                SAMPLE_MONO16,
+                SAMPLE_FREQUENCY);
+
+  return AudioBuffer::create(ResourceInfo(cache), context, sample);
+}
+
+/*! Mixes the specified number of looping voices spread around the listener
+ *  for the specified duration and reports how long the mixing took.
+ */
+bool measure(ResourceCache& cache, const Options& options, uint count)
+{
+  std::unique_ptr<AudioContext> context =
+    AudioContext::create(cache, AudioConfig(AUDIO_SOFTWARE,
+                                            options.frequency,
+                                            options.output));
+  if (!context)
+    return false;
+
+  context->setMaxVoiceCount(count);
+
+  Ref<AudioBuffer> buffer = createTone(cache, *context);
+  if (!buffer)
+    return false;
+
+  std::vector<Ref<AudioSource>> sources;
+
+  for (uint i = 0;  i < count;  i++)
+  {
+    Ref<AudioSource> source = AudioSource::create(*context);
+    if (!source)
+      return false;
+
+    // Varied pitches and positions exercise resampling, attenuation and
+    // panning for every voice
+    const float angle = float(i) * 2.39996f;
+    const float distance = 1.f + float(i % 16);
+    source->setBuffer(buffer);
+    source->setLooping(true);
+    source->setPitch(0.5f + float(i % 32) / 21.f);
+    source->setPosition(vec3(std::cos(angle), 0.f, std::sin(angle)) * distance);
+    source->start();
+    sources.push_back(source);
+  }
+
+  const Time period = 1.0 / options.updateRate;
+  const uint updateCount = uint(options.duration * options.updateRate);
+
+  // Binding voices happens on the first update
+  context->update(period);
+
+  if (context->voiceCount() != count)
+  {
+    logError("Only %u of %u voices were bound", context->voiceCount(), count);
+    return false;
+  }
+
+  Timer timer;
+  timer.start();
+
+  for (uint i = 0;  i < updateCount;  i++)
+    context->update(period);
+
+  // Each update waits for the blocks of the previous one, so an empty update
+  // waits for the last of them
+  context->update(0.0);
+
+  const Time elapsed = timer.time();
+  const Time mixed = updateCount * period;
+
+  std::printf("voices: %3u, %.2f ms per second of audio, %.1fx real time, "
+              "%.0f voices in real time\n",
+              count,
+              elapsed / mixed * 1000.0,
+              mixed / elapsed,
+              count * mixed / elapsed);
+
+  sources.clear();
+  return true;
+}
+
+} /*namespace*/
+
+int main(int argc, char** argv)
+{
+  Options options;
+  if (!options.parse(argc, argv))
+  {
+    std::fprintf(stderr,
+                 "Usage: %s [-voices count] [-frequency hz] [-rate hz] "
+                 "[-seconds duration] [-output file]\n",
+                 argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  ResourceCache cache;
+
+  std::vector<uint> counts;
+
+  for (uint count = FIRST_STEP;  count < options.voiceCount;  count *= 2)
+    counts.push_back(count);
+
+  counts.push_back(options.voiceCount);
+
+  for (uint count : counts)
+  {
+    if (!measure(cache, options, count))
+      return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
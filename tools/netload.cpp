@@ -0,0 +1,519 @@
+///////////////////////////////////////////////////////////////////////
+// Nori - a simple game engine
+// Copyright (c) 2005 Camilla Berglund <elmindreda@elmindreda.org>
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any
+// damages arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any
+// purpose, including commercial applications, and to alter it and
+// redistribute it freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you
+//     must not claim that you wrote the original software. If you use
+//     this software in a product, an acknowledgment in the product
+//     documentation would be appreciated but is not required.
+//
+//  2. Altered source versions must be plainly marked as such, and
+//     must not be misrepresented as being the original software.
+//
+//  3. This notice may not be removed or altered from any source
+//     distribution.
+//
+///////////////////////////////////////////////////////////////////////
+
+#include <nori/Config.hpp>
+#include <nori/Core.hpp>
+#include <nori/Time.hpp>
+#include <nori/Primitive.hpp>
+#include <nori/Network.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <numeric>
+
+using namespace nori;
+
+namespace
+{
+
+enum
+{
+  EVENT_INPUT,
+  EVENT_NOISE
+};
+
+const float WORLD_SIZE = 1024.f;
+const float VIEW_RADIUS = 64.f;
+
+// Distance an avatar may stray from the center of its view before the view
+// is moved, as moving a view makes the server find its objects again
+const float VIEW_SLACK = 4.f;
+
+class Options
+{
+public:
+  Options();
+  bool parse(int argc, char** argv);
+  uint clientCount;
+  uint objectCount;
+  uint tickCount;
+  uint tickRate;
+  uint32 seed;
+  bool interest;
+  bool delta;
+  LinkModel model;
+};
+
+/*! Server side avatar of a synthetic client, wandering in a circle.
+ */
+class Avatar : public NetworkObject
+{
+public:
+  Avatar(Host& host, uint index);
+  void move(Time time);
+  vec3 position;
+  vec3 viewCenter;
+  uint32 inputCount;
+private:
+  vec3 m_center;
+  float m_phase;
+};
+
+/*! Server side object without a client, such as a creature, wandering in a
+ *  line and now and then broadcasting an event to nearby clients.
+ */
+class Mover : public NetworkObject
+{
+public:
+  Mover(Host& host, uint index);
+  void move(Time time);
+  vec3 position;
+private:
+  vec3 m_origin;
+  vec3 m_direction;
+};
+
+/*! Server side recipient of the input events of all clients.
+ */
+class Game : public NetworkObject
+{
+public:
+  Game(Host& host);
+  void receiveEvent(TargetID senderID, PacketData& data, EventID eventID) override;
+  std::vector<Avatar*> avatars;
+};
+
+class Observer : public HostObserver
+{
+public:
+  Observer(Host& host);
+  void onPeerConnected(Peer& peer) override;
+  void onPeerDisconnected(Peer& peer, uint32 reason) override;
+  void onPacketReceived(TargetID targetID, PacketData& data) override;
+  Host& host;
+  bool acknowledging;
+  uint connectedCount;
+  uint eventCount;
+  std::vector<Peer*> peers;
+};
+
+Options::Options():
+  clientCount(1000),
+  objectCount(0),
+  tickCount(600),
+  tickRate(30),
+  seed(1),
+  interest(true),
+  delta(true)
+{
+  model.latency = 0.05;
+  model.jitter = 0.01;
+  model.loss = 0.01f;
+}
+
+bool Options::parse(int argc, char** argv)
+{
+  for (int i = 1;  i < argc;  i++)
+  {
+    const char* name = argv[i];
+
+    if (std::strcmp(name, "-no-interest") == 0)
+    {
+      interest = false;
+      continue;
+    }
+
+    if (std::strcmp(name, "-no-delta") == 0)
+    {
+      delta = false;
+      continue;
+    }
+
+    if (i + 1 == argc)
+      return false;
+
+    const char* value = argv[++i];
+
+    if (std::strcmp(name, "-clients") == 0)
+      clientCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-objects") == 0)
+      objectCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-ticks") == 0)
+      tickCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-rate") == 0)
+      tickRate = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-seed") == 0)
+      seed = uint32(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-latency") == 0)
+      model.latency = std::strtod(value, nullptr);
+    else if (std::strcmp(name, "-jitter") == 0)
+      model.jitter = std::strtod(value, nullptr);
+    else if (std::strcmp(name, "-loss") == 0)
+      model.loss = float(std::strtod(value, nullptr));
+    else
+      return false;
+  }
+
+  return clientCount > 0 && tickRate > 0;
+}
+
+Avatar::Avatar(Host& host, uint index):
+  NetworkObject(host),
+  inputCount(0),
+  m_phase(float(index))
+{
+  // Clients are spread over the world on a deterministic scatter
+  const float x = std::fmod(float(index) * 97.31f, WORLD_SIZE);
+  const float z = std::fmod(float(index) * 53.87f, WORLD_SIZE);
+  m_center = vec3(x, 0.f, z);
+
+  replicate(position);
+  replicate(inputCount);
+  move(0.0);
+
+  viewCenter = position;
+}
+
+void Avatar::move(Time time)
+{
+  const float angle = float(time) + m_phase;
+  position = m_center + vec3(std::cos(angle), 0.f, std::sin(angle)) * 8.f;
+  setBounds(Sphere(position, 1.f));
+}
+
+Mover::Mover(Host& host, uint index):
+  NetworkObject(host)
+{
+  const float x = std::fmod(float(index) * 31.73f, WORLD_SIZE);
+  const float z = std::fmod(float(index) * 71.19f, WORLD_SIZE);
+  const float angle = float(index);
+  m_origin = vec3(x, 0.f, z);
+  m_direction = vec3(std::cos(angle), 0.f, std::sin(angle));
+
+  replicate(position);
+  move(0.0);
+}
+
+void Mover::move(Time time)
+{
+  // Movers pace back and forth over a few view radii
+  const float offset = std::fmod(float(time) * 4.f, VIEW_RADIUS * 4.f);
+  position = m_origin + m_direction * std::fabs(offset - VIEW_RADIUS * 2.f);
+  setBounds(Sphere(position, 1.f));
+}
+
+Game::Game(Host& host):
+  NetworkObject(host, OBJECT_ID_GAME)
+{
+}
+
+void Game::receiveEvent(TargetID senderID, PacketData& data, EventID eventID)
+{
+  if (eventID != EVENT_INPUT)
+    return;
+
+  data.read32();
+
+  if (senderID < avatars.size() && avatars[senderID])
+    avatars[senderID]->inputCount++;
+}
+
+Observer::Observer(Host& host):
+  host(host),
+  acknowledging(true),
+  connectedCount(0),
+  eventCount(0)
+{
+}
+
+void Observer::onPeerConnected(Peer& peer)
+{
+  connectedCount++;
+  peers.push_back(&peer);
+}
+
+void Observer::onPeerDisconnected(Peer& peer, uint32 reason)
+{
+  peers.erase(std::remove(peers.begin(), peers.end(), &peer), peers.end());
+}
+
+void Observer::onPacketReceived(TargetID targetID, PacketData& data)
+{
+  PacketData header(data);
+  NetworkObjectID recipientID;
+  if (!header.read16(recipientID))
+    return;
+
+  // Clients have no copies of the server objects, so their events are only
+  // counted
+  if (host.isClient() && recipientID != OBJECT_ID_SNAPSHOT)
+  {
+    eventCount++;
+    return;
+  }
+
+  // Without acknowledgements the server has no baselines to delta compress
+  // against, so every snapshot is sent in full
+  if (host.isServer() && recipientID == OBJECT_ID_SNAPSHOT && !acknowledging)
+    return;
+
+  host.dispatchEvent(targetID, data);
+}
+
+Time percentile(std::vector<Time>& values, float fraction)
+{
+  if (values.empty())
+    return 0.0;
+
+  std::sort(values.begin(), values.end());
+  const size_t index = size_t(fraction * float(values.size() - 1) + 0.5f);
+  return values[index];
+}
+
+} /*namespace*/
+
+int main(int argc, char** argv)
+{
+  Options options;
+  if (!options.parse(argc, argv))
+  {
+    std::fprintf(stderr,
+                 "Usage: %s [-clients count] [-objects count] [-ticks count] "
+                 "[-rate hz] [-seed seed] [-latency s] [-jitter s] "
+                 "[-loss fraction] [-no-interest] [-no-delta]\n",
+                 argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::unique_ptr<NetworkSimulation> simulation = NetworkSimulation::create(options.seed);
+  if (!simulation)
+    return EXIT_FAILURE;
+
+  simulation->setLinkModel(options.model);
+
+  std::unique_ptr<Host> server = simulation->createServer(options.clientCount);
+  if (!server)
+    return EXIT_FAILURE;
+
+  Observer serverObserver(*server);
+  serverObserver.acknowledging = options.delta;
+  server->setObserver(&serverObserver);
+
+  if (options.interest)
+    server->setInterestManagement(true, VIEW_RADIUS * 2.f);
+
+  std::vector<std::unique_ptr<Host>> clients;
+  std::vector<std::unique_ptr<Observer>> observers;
+
+  for (uint i = 0;  i < options.clientCount;  i++)
+  {
+    std::unique_ptr<Host> client = simulation->connect();
+    if (!client)
+      return EXIT_FAILURE;
+
+    observers.emplace_back(new Observer(*client));
+    client->setObserver(observers.back().get());
+    clients.push_back(std::move(client));
+  }
+
+  std::unique_ptr<Game> game(new Game(*server));
+  std::vector<std::unique_ptr<Avatar>> avatars;
+  std::vector<std::unique_ptr<Mover>> movers;
+
+  for (uint i = 0;  i < options.objectCount;  i++)
+    movers.emplace_back(new Mover(*server, i));
+
+  const Time period = 1.0 / options.tickRate;
+  std::vector<Time> tickTimes;
+  tickTimes.reserve(options.tickCount);
+
+  Timer timer;
+  timer.start();
+
+  bool measuring = false;
+  uint startTick = 0;
+  uint startIncoming = 0, startOutgoing = 0;
+  size_t startSnapshot = 0, startSaved = 0;
+  uint64 broadcasts = 0;
+
+  for (uint tick = 0;  tick < options.tickCount;  tick++)
+  {
+    simulation->advance(period);
+
+    const Time start = timer.time();
+
+    server->update(0.0);
+
+    // Each newly connected client gets an avatar and a view around it
+    for (Peer* peer : serverObserver.peers)
+    {
+      if (game->avatars.size() <= peer->id())
+        game->avatars.resize(peer->id() + 1, nullptr);
+
+      if (game->avatars[peer->id()])
+        continue;
+
+      Avatar* avatar = new Avatar(*server, uint(avatars.size()));
+      avatars.emplace_back(avatar);
+      game->avatars[peer->id()] = avatar;
+
+      peer->addView(Sphere(avatar->viewCenter, VIEW_RADIUS));
+    }
+
+    for (Peer* peer : serverObserver.peers)
+    {
+      Avatar* avatar = game->avatars[peer->id()];
+      avatar->move(simulation->time());
+
+      if (distance(avatar->position, avatar->viewCenter) > VIEW_SLACK)
+      {
+        avatar->viewCenter = avatar->position;
+        peer->setView(0, Sphere(avatar->viewCenter, VIEW_RADIUS));
+      }
+    }
+
+    // Each mover broadcasts once per simulated second, staggered by index
+    for (uint i = 0;  i < movers.size();  i++)
+    {
+      Mover& mover = *movers[i];
+      mover.move(simulation->time());
+
+      if ((tick + i) % options.tickRate == 0)
+      {
+        PacketData data = server->createEvent(EVENT_NOISE, mover.id());
+        data.write32(tick);
+        server->sendPacketTo(BROADCAST, 0, UNSEQUENCED, data);
+
+        if (measuring)
+          broadcasts += serverObserver.peers.size();
+      }
+    }
+
+    server->replicate();
+
+    tickTimes.push_back(timer.time() - start);
+
+    for (uint i = 0;  i < clients.size();  i++)
+    {
+      clients[i]->update(0.0);
+
+      if (observers[i]->connectedCount)
+      {
+        PacketData data = clients[i]->createEvent(EVENT_INPUT, OBJECT_ID_GAME);
+        data.write32(tick);
+        clients[i]->sendPacketTo(SERVER, 0, UNSEQUENCED, data);
+      }
+    }
+
+    // Traffic is measured from when every client has connected
+    if (!measuring && serverObserver.peers.size() == clients.size())
+    {
+      measuring = true;
+      startTick = tick;
+      startIncoming = server->totalIncomingBytes();
+      startOutgoing = server->totalOutgoingBytes();
+      startSnapshot = server->totalSnapshotBytes();
+      startSaved = server->savedMessageCount();
+    }
+  }
+
+  const uint measuredTicks = options.tickCount - startTick;
+  const Time duration = measuredTicks * period;
+
+  std::vector<Time> medians, tails;
+
+  for (const std::unique_ptr<Host>& client : clients)
+  {
+    medians.push_back(simulation->latencyPercentile(*client, 0.5f));
+    tails.push_back(simulation->latencyPercentile(*client, 0.99f));
+  }
+
+  std::printf("clients: %u connected, %u objects, %u simulated seconds\n",
+              uint(serverObserver.peers.size()),
+              uint(avatars.size() + movers.size()),
+              uint(options.tickCount * period));
+  std::printf("server tick: mean %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+              std::accumulate(tickTimes.begin(), tickTimes.end(), 0.0) /
+                max(tickTimes.size(), size_t(1)) * 1000.0,
+              percentile(tickTimes, 0.5f) * 1000.0,
+              percentile(tickTimes, 0.99f) * 1000.0,
+              percentile(tickTimes, 1.f) * 1000.0);
+  std::printf("server tick per client: mean %.2f us\n",
+              std::accumulate(tickTimes.begin(), tickTimes.end(), 0.0) /
+                max(tickTimes.size(), size_t(1)) /
+                max(serverObserver.peers.size(), size_t(1)) * 1e6);
+
+  if (duration > 0.0)
+  {
+    std::printf("server traffic: in %.0f bytes/s, out %.0f bytes/s\n",
+                (server->totalIncomingBytes() - startIncoming) / duration,
+                (server->totalOutgoingBytes() - startOutgoing) / duration);
+    std::printf("snapshots: %.1f bytes per client per tick, %s\n",
+                double(server->totalSnapshotBytes() - startSnapshot) /
+                  max(serverObserver.peers.size(), size_t(1)) / measuredTicks,
+                options.delta ? "delta compressed" : "sent in full");
+  }
+
+  if (broadcasts)
+  {
+    const size_t saved = server->savedMessageCount() - startSaved;
+    std::printf("broadcast events: %llu sends, %llu withheld by interest (%.1f%%)\n",
+                (unsigned long long) broadcasts,
+                (unsigned long long) saved,
+                100.0 * double(saved) / double(broadcasts));
+
+    uint64 received = 0;
+    for (const std::unique_ptr<Observer>& observer : observers)
+      received += observer->eventCount;
+
+    std::printf("broadcast events: %.1f received per client per second\n",
+                double(received) / clients.size() / (options.tickCount * period));
+  }
+
+  std::printf("client latency p50: best %.1f ms, median %.1f ms, worst %.1f ms\n",
+              percentile(medians, 0.f) * 1000.0,
+              percentile(medians, 0.5f) * 1000.0,
+              percentile(medians, 1.f) * 1000.0);
+  std::printf("client latency p99: best %.1f ms, median %.1f ms, worst %.1f ms\n",
+              percentile(tails, 0.f) * 1000.0,
+              percentile(tails, 0.5f) * 1000.0,
+              percentile(tails, 1.f) * 1000.0);
+  std::printf("packets: %u delivered, %u lost\n",
+              uint(simulation->deliveredPacketCount()),
+              uint(simulation->lostPacketCount()));
+
+  // Objects and hosts must go before the simulation that carries them
+  avatars.clear();
+  movers.clear();
+  game.reset();
+  clients.clear();
+  server.reset();
+
+  return EXIT_SUCCESS;
+}
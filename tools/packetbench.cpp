@@ -0,0 +1,550 @@
+///////////////////////////////////////////////////////////////////////
+// Nori - a simple game engine
+// Copyright (c) 2014 Camilla Berglund <elmindreda@elmindreda.org>
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any
+// damages arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any
+// purpose, including commercial applications, and to alter it and
+// redistribute it freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you
+//     must not claim that you wrote the original software. If you use
+//     this software in a product, an acknowledgment in the product
+//     documentation would be appreciated but is not required.
+//
+//  2. Altered source versions must be plainly marked as such, and
+//     must not be misrepresented as being the original software.
+//
+//  3. This notice may not be removed or altered from any source
+//     distribution.
+//
+///////////////////////////////////////////////////////////////////////
+
+#include <nori/Config.hpp>
+#include <nori/Core.hpp>
+#include <nori/Time.hpp>
+#include <nori/Network.hpp>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace nori;
+
+namespace
+{
+
+const float POSITION_RANGE = 1024.f;
+const float VELOCITY_RANGE = 64.f;
+
+const size_t MAX_FIELD_COUNT = 64;
+const size_t BUFFER_SIZE = MAX_FIELD_COUNT * 8;
+
+enum FieldType
+{
+  FIELD_BITS,
+  FIELD_VARINT,
+  FIELD_8,
+  FIELD_32,
+  FIELD_FLOAT,
+  FIELD_QUAT,
+  FIELD_TYPE_COUNT
+};
+
+class Options
+{
+public:
+  Options();
+  bool parse(int argc, char** argv);
+  uint32 seed;
+  uint fuzzCount;
+  uint messageCount;
+};
+
+/*! Deterministic xorshift generator, so that failures can be reproduced.
+ */
+class Random
+{
+public:
+  Random(uint32 seed);
+  uint32 next();
+  uint32 below(uint32 limit) { return next() % limit; }
+  float between(float minimum, float maximum);
+private:
+  uint32 m_state;
+};
+
+/*! Field of a randomly generated message, along with its written value.
+ */
+class Field
+{
+public:
+  FieldType type;
+  uint bits;
+  uint32 value;
+  float minimum;
+  float maximum;
+  float real;
+  quat rotation;
+};
+
+/*! Entity update of the kind sent many times per tick.
+ */
+class Update
+{
+public:
+  uint32 id;
+  vec3 position;
+  quat rotation;
+  vec3 velocity;
+  uint8 flags;
+};
+
+Options::Options():
+  seed(1),
+  fuzzCount(100000),
+  messageCount(1000000)
+{
+}
+
+bool Options::parse(int argc, char** argv)
+{
+  for (int i = 1;  i < argc;  i++)
+  {
+    const char* name = argv[i];
+
+    if (i + 1 == argc)
+      return false;
+
+    const char* value = argv[++i];
+
+    if (std::strcmp(name, "-seed") == 0)
+      seed = uint32(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-fuzz") == 0)
+      fuzzCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-messages") == 0)
+      messageCount = uint(std::strtoul(value, nullptr, 10));
+    else
+      return false;
+  }
+
+  return seed != 0 && messageCount > 0;
+}
+
+Random::Random(uint32 seed):
+  m_state(seed)
+{
+}
+
+uint32 Random::next()
+{
+  m_state ^= m_state << 13;
+  m_state ^= m_state >> 17;
+  m_state ^= m_state << 5;
+  return m_state;
+}
+
+float Random::between(float minimum, float maximum)
+{
+  return minimum + (maximum - minimum) * float(next() >> 8) / 16777216.f;
+}
+
+Field generateField(Random& random)
+{
+  Field f;
+  f.type = FieldType(random.below(FIELD_TYPE_COUNT));
+  f.bits = 1 + random.below(32);
+  f.value = random.next();
+
+  switch (f.type)
+  {
+    case FIELD_BITS:
+      if (f.bits < 32)
+        f.value &= (1u << f.bits) - 1;
+      break;
+    case FIELD_VARINT:
+      // Small values are the common case for varints
+      f.value >>= random.below(32);
+      break;
+    case FIELD_8:
+      f.value &= 0xff;
+      break;
+    case FIELD_32:
+    case FIELD_TYPE_COUNT:
+      break;
+    case FIELD_FLOAT:
+      f.bits = 2 + random.below(23);
+      f.minimum = random.between(-1000.f, 0.f);
+      f.maximum = f.minimum + random.between(0.01f, 1000.f);
+      // Values outside the range are clamped by the writer
+      f.real = random.between(f.minimum - 1.f, f.maximum + 1.f);
+      break;
+    case FIELD_QUAT:
+      f.bits = 6 + random.below(10);
+      f.rotation = normalize(quat(random.between(-1.f, 1.f),
+                                  random.between(-1.f, 1.f),
+                                  random.between(-1.f, 1.f),
+                                  random.between(-1.f, 1.f)));
+      break;
+  }
+
+  return f;
+}
+
+void writeField(PacketData& data, const Field& f)
+{
+  switch (f.type)
+  {
+    case FIELD_BITS:
+      data.writeBits(f.value, f.bits);
+      break;
+    case FIELD_VARINT:
+      data.writeVarint(f.value);
+      break;
+    case FIELD_8:
+      data.write8(uint8(f.value));
+      break;
+    case FIELD_32:
+      data.write32(f.value);
+      break;
+    case FIELD_FLOAT:
+      data.writeFloat(f.real, f.minimum, f.maximum, f.bits);
+      break;
+    case FIELD_QUAT:
+      data.writeQuat(f.rotation, f.bits);
+      break;
+    case FIELD_TYPE_COUNT:
+      break;
+  }
+}
+
+/*! Reads a field with the checked readers.
+ *  @return @c true if the field was read and matched what was written, or
+ *  @c false if there was not enough data.  Mismatches are fatal.
+ */
+bool readField(PacketData& data, const Field& f)
+{
+  bool matched = true;
+
+  switch (f.type)
+  {
+    case FIELD_BITS:
+    {
+      if (!data.require(f.bits))
+        return false;
+
+      matched = data.readBits(f.bits) == f.value;
+      break;
+    }
+
+    case FIELD_VARINT:
+    {
+      uint32 value;
+      if (!data.readVarint(value))
+        return false;
+
+      matched = value == f.value;
+      break;
+    }
+
+    case FIELD_8:
+    {
+      uint8 value;
+      if (!data.read8(value))
+        return false;
+
+      matched = value == f.value;
+      break;
+    }
+
+    case FIELD_32:
+    {
+      uint32 value;
+      if (!data.read32(value))
+        return false;
+
+      matched = value == f.value;
+      break;
+    }
+
+    case FIELD_FLOAT:
+    {
+      if (!data.require(f.bits))
+        return false;
+
+      // Quantization error is at most half a step, plus rounding slack
+      const float step = (f.maximum - f.minimum) / float((1u << f.bits) - 1);
+      const float expected = clamp(f.real, f.minimum, f.maximum);
+      const float value = data.readFloat(f.minimum, f.maximum, f.bits);
+      matched = std::fabs(value - expected) <= step * 0.5f + 1e-3f;
+      break;
+    }
+
+    case FIELD_QUAT:
+    {
+      if (!data.require(2 + f.bits * 3))
+        return false;
+
+      // The sign of a quaternion does not change the rotation
+      const quat value = data.readQuat(f.bits);
+      const float tolerance = 4.f / float(1u << f.bits);
+      matched = std::fabs(std::fabs(dot(value, f.rotation)) - 1.f) <= tolerance;
+      break;
+    }
+
+    case FIELD_TYPE_COUNT:
+      break;
+  }
+
+  if (!matched)
+    panic("Field of type %u and width %u did not round-trip", f.type, f.bits);
+
+  return true;
+}
+
+/*! Writes random messages and reads them back, in full and truncated.
+ */
+bool fuzz(const Options& options)
+{
+  Random random(options.seed);
+  std::vector<Field> fields;
+  uint8 buffer[BUFFER_SIZE];
+  size_t truncatedCount = 0;
+
+  for (uint i = 0;  i < options.fuzzCount;  i++)
+  {
+    fields.clear();
+
+    const uint fieldCount = 1 + random.below(MAX_FIELD_COUNT);
+    for (uint j = 0;  j < fieldCount;  j++)
+      fields.push_back(generateField(random));
+
+    PacketData writer(buffer, sizeof(buffer));
+    for (const Field& f : fields)
+      writeField(writer, f);
+
+    PacketData reader(buffer, sizeof(buffer), writer.size());
+    for (const Field& f : fields)
+    {
+      if (!readField(reader, f))
+      {
+        logError("Message %u was cut short", i);
+        return false;
+      }
+    }
+
+    if (!reader.isEmpty())
+    {
+      logError("Message %u has data left over", i);
+      return false;
+    }
+
+    // Every byte belongs to some field, so a truncated message must fail to
+    // read before its end, with every field before that intact
+    const size_t size = random.below(uint32(writer.size()));
+    PacketData truncated(buffer, sizeof(buffer), size);
+    uint readCount = 0;
+
+    for (const Field& f : fields)
+    {
+      if (!readField(truncated, f))
+        break;
+
+      readCount++;
+    }
+
+    if (readCount == fields.size())
+    {
+      logError("Message %u was read in full after truncation", i);
+      return false;
+    }
+
+    truncatedCount++;
+  }
+
+  std::printf("fuzz: %u messages round-tripped, %u truncated copies rejected\n",
+              options.fuzzCount, uint(truncatedCount));
+  return true;
+}
+
+std::vector<Update> generateUpdates(Random& random, size_t count)
+{
+  std::vector<Update> updates(count);
+
+  for (Update& u : updates)
+  {
+    u.id = random.below(65536);
+    u.position = vec3(random.between(-POSITION_RANGE, POSITION_RANGE),
+                      random.between(-POSITION_RANGE, POSITION_RANGE),
+                      random.between(-POSITION_RANGE, POSITION_RANGE));
+    u.rotation = normalize(quat(random.between(-1.f, 1.f),
+                                random.between(-1.f, 1.f),
+                                random.between(-1.f, 1.f),
+                                random.between(-1.f, 1.f)));
+    u.velocity = vec3(random.between(-VELOCITY_RANGE, VELOCITY_RANGE),
+                      random.between(-VELOCITY_RANGE, VELOCITY_RANGE),
+                      random.between(-VELOCITY_RANGE, VELOCITY_RANGE));
+    u.flags = uint8(random.below(16));
+  }
+
+  return updates;
+}
+
+void writeAligned(PacketData& data, const Update& u)
+{
+  data.write16(uint16(u.id));
+
+  for (uint i = 0;  i < 3;  i++)
+    data.write32f(u.position[i]);
+
+  data.write32f(u.rotation.x);
+  data.write32f(u.rotation.y);
+  data.write32f(u.rotation.z);
+  data.write32f(u.rotation.w);
+
+  for (uint i = 0;  i < 3;  i++)
+    data.write32f(u.velocity[i]);
+
+  data.write8(u.flags);
+}
+
+float readAligned(PacketData& data)
+{
+  float sum = float(data.read16());
+
+  // Position, rotation and velocity
+  for (uint i = 0;  i < 10;  i++)
+    sum += data.read32f();
+
+  return sum + float(data.read8());
+}
+
+void writePacked(PacketData& data, const Update& u)
+{
+  data.writeVarint(u.id);
+
+  for (uint i = 0;  i < 3;  i++)
+    data.writeFloat(u.position[i], -POSITION_RANGE, POSITION_RANGE, 16);
+
+  data.writeQuat(u.rotation);
+
+  for (uint i = 0;  i < 3;  i++)
+    data.writeFloat(u.velocity[i], -VELOCITY_RANGE, VELOCITY_RANGE, 12);
+
+  data.writeBits(u.flags, 4);
+}
+
+float readPacked(PacketData& data)
+{
+  float sum = float(data.readVarint());
+
+  for (uint i = 0;  i < 3;  i++)
+    sum += data.readFloat(-POSITION_RANGE, POSITION_RANGE, 16);
+
+  sum += data.readQuat().w;
+
+  for (uint i = 0;  i < 3;  i++)
+    sum += data.readFloat(-VELOCITY_RANGE, VELOCITY_RANGE, 12);
+
+  return sum + float(data.readBits(4));
+}
+
+float readPackedBulk(PacketData& data)
+{
+  float sum = float(data.readVarint());
+
+  // The rest of the update has a fixed size, so it is checked only once
+  if (!data.require(3 * 16 + 29 + 3 * 12 + 4))
+    return 0.f;
+
+  for (uint i = 0;  i < 3;  i++)
+    sum += data.readFloatUnchecked(-POSITION_RANGE, POSITION_RANGE, 16);
+
+  sum += data.readQuat().w;
+
+  for (uint i = 0;  i < 3;  i++)
+    sum += data.readFloatUnchecked(-VELOCITY_RANGE, VELOCITY_RANGE, 12);
+
+  return sum + float(data.readBitsUnchecked(4));
+}
+
+/*! Encodes and decodes entity updates and reports the rate of each.
+ */
+template <typename W, typename R>
+bool measure(const char* name,
+             const std::vector<Update>& updates,
+             uint messageCount,
+             W write,
+             R read)
+{
+  uint8 buffer[256];
+  size_t size = 0;
+  float sum = 0.f;
+
+  Timer timer;
+  timer.start();
+
+  for (uint i = 0;  i < messageCount;  i++)
+  {
+    PacketData data(buffer, sizeof(buffer));
+    write(data, updates[i % updates.size()]);
+    size = data.size();
+  }
+
+  const Time writeTime = timer.time();
+  timer.start();
+
+  for (uint i = 0;  i < messageCount;  i++)
+  {
+    PacketData data(buffer, sizeof(buffer), size);
+    sum += read(data);
+  }
+
+  const Time readTime = timer.time();
+
+  // The sum keeps the reads from being optimized away
+  if (!std::isfinite(sum))
+    return false;
+
+  std::printf("%-8s %2u bytes  write %6.1f M/s  read %6.1f M/s\n",
+              name, uint(size),
+              messageCount / writeTime / 1e6,
+              messageCount / readTime / 1e6);
+  return true;
+}
+
+} /*namespace*/
+
+int main(int argc, char** argv)
+{
+  Options options;
+  if (!options.parse(argc, argv))
+  {
+    std::fprintf(stderr,
+                 "Usage: %s [-seed seed] [-fuzz count] [-messages count]\n",
+                 argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (!fuzz(options))
+    return EXIT_FAILURE;
+
+  Random random(options.seed);
+  const std::vector<Update> updates = generateUpdates(random, 1024);
+
+  // Aligned and packed updates differ in size, but each loop writes and
+  // reads the same update into the same buffer every time
+  if (!measure("aligned", updates, options.messageCount, writeAligned, readAligned) ||
+      !measure("packed", updates, options.messageCount, writePacked, readPacked) ||
+      !measure("bulk", updates, options.messageCount, writePacked, readPackedBulk))
+  {
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
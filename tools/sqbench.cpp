@@ -0,0 +1,713 @@
+///////////////////////////////////////////////////////////////////////
+// Nori - a simple game engine
+// Copyright (c) 2014 Camilla Berglund <elmindreda@elmindreda.org>
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any
+// damages arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any
+// purpose, including commercial applications, and to alter it and
+// redistribute it freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you
+//     must not claim that you wrote the original software. If you use
+//     this software in a product, an acknowledgment in the product
+//     documentation would be appreciated but is not required.
+//
+//  2. Altered source versions must be plainly marked as such, and
+//     must not be misrepresented as being the original software.
+//
+//  3. This notice may not be removed or altered from any source
+//     distribution.
+//
+///////////////////////////////////////////////////////////////////////
+
+#include <nori/Config.hpp>
+#include <nori/Core.hpp>
+#include <nori/Time.hpp>
+#include <nori/Path.hpp>
+#include <nori/Resource.hpp>
+#include <nori/Squirrel.hpp>
+#include <nori/SqWorkers.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <thread>
+
+#if !NORI_SYSTEM_WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace nori;
+
+namespace
+{
+
+class Options
+{
+public:
+  Options();
+  bool parse(int argc, char** argv);
+  std::string mode;
+  Path directory;
+  uint scriptCount;
+  uint functionCount;
+  uint repeatCount;
+  uint callCount;
+  uint frameCount;
+  uint objectCount;
+  bool systemAllocator;
+  uint entityCount;
+  uint updateCount;
+  uint workerCount;
+  Time budget;
+  uint loadingInterval;
+};
+
+Options::Options():
+  directory("sqbench-scripts"),
+  scriptCount(50),
+  functionCount(200),
+  repeatCount(5),
+  callCount(1000000),
+  frameCount(1000),
+  objectCount(1000),
+  systemAllocator(false),
+  entityCount(10000),
+  updateCount(100),
+  workerCount(std::thread::hardware_concurrency()),
+  budget(0.001),
+  loadingInterval(500)
+{
+}
+
+bool Options::parse(int argc, char** argv)
+{
+  if (argc < 2)
+    return false;
+
+  mode = argv[1];
+
+  for (int i = 2;  i < argc;  i++)
+  {
+    const char* name = argv[i];
+
+    if (i + 1 == argc)
+      return false;
+
+    const char* value = argv[++i];
+
+    if (std::strcmp(name, "-dir") == 0)
+      directory = Path(value);
+    else if (std::strcmp(name, "-scripts") == 0)
+      scriptCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-functions") == 0)
+      functionCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-repeat") == 0)
+      repeatCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-calls") == 0)
+      callCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-frames") == 0)
+      frameCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-objects") == 0)
+      objectCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-entities") == 0)
+      entityCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-updates") == 0)
+      updateCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-workers") == 0)
+      workerCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-budget") == 0)
+      budget = std::strtod(value, nullptr) / 1000.0;
+    else if (std::strcmp(name, "-loading") == 0)
+      loadingInterval = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-allocator") == 0)
+    {
+      if (std::strcmp(value, "system") == 0)
+        systemAllocator = true;
+      else if (std::strcmp(value, "pool") != 0)
+        return false;
+    }
+    else
+      return false;
+  }
+
+  // The hardware thread count may not be known
+  workerCount = max(workerCount, 1u);
+
+  return repeatCount > 0 && callCount > 0 && frameCount > 0 && updateCount > 0;
+}
+
+Time percentile(std::vector<Time>& values, double fraction)
+{
+  std::sort(values.begin(), values.end());
+  return values[min(size_t(values.size() * fraction), values.size() - 1)];
+}
+
+Time median(std::vector<Time>& values)
+{
+  return percentile(values, 0.5);
+}
+
+/*! @return The peak resident set size of this process, in kilobytes, or zero
+ *  if it is not available.
+ */
+size_t peakResidentSize()
+{
+#if NORI_SYSTEM_WIN32
+  return 0;
+#else
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+#if NORI_SYSTEM_MACOSX
+  return size_t(usage.ru_maxrss) / 1024;
+#else
+  return size_t(usage.ru_maxrss);
+#endif
+#endif
+}
+
+void* systemAllocate(SQUnsignedInteger size)
+{
+  return std::malloc(size);
+}
+
+void* systemReallocate(void* memory, SQUnsignedInteger, SQUnsignedInteger newSize)
+{
+  return std::realloc(memory, newSize);
+}
+
+void systemFree(void* memory, SQUnsignedInteger)
+{
+  std::free(memory);
+}
+
+/*! Writes a script defining a class and a number of free functions, roughly
+ *  in the style of gameplay code.
+ */
+bool writeScript(const Path& path, uint index, uint functionCount)
+{
+  std::ofstream stream(path.name().c_str());
+  if (stream.fail())
+    return false;
+
+  stream << "class Entity" << index << "\n{\n"
+         << "  position = null;\n  health = 100;\n  tags = null;\n"
+         << "  constructor() { position = [0.0, 0.0, 0.0]; tags = {}; }\n"
+         << "  function damage(amount) { health -= amount; return health > 0; }\n"
+         << "}\n\n";
+
+  for (uint i = 0;  i < functionCount;  i++)
+  {
+    stream << "function update" << index << "_" << i << "(entity, dt)\n{\n"
+           << "  local speed = " << i << ".5 * dt;\n"
+           << "  for (local j = 0;  j < 3;  j++)\n"
+           << "    entity.position[j] += speed;\n"
+           << "  if (entity.health < " << i % 100 << ")\n"
+           << "    entity.tags[\"wounded\"] <- \"entity " << i << " is wounded\";\n"
+           << "  return entity.damage(" << i % 7 << ");\n"
+           << "}\n\n";
+  }
+
+  return !stream.fail();
+}
+
+/*! Loads every script in a fresh VM and returns the time it took.
+ */
+Time loadScripts(ResourceCache& cache,
+                 const std::vector<std::string>& names,
+                 bool caching)
+{
+  SqVM vm(cache);
+  vm.setCaching(caching);
+
+  Timer timer;
+  timer.start();
+
+  for (const std::string& name : names)
+  {
+    if (!vm.execute(name.c_str()))
+      return -1.0;
+  }
+
+  return timer.time();
+}
+
+int runStartup(const Options& options)
+{
+  if (!options.directory.isDirectory() && !options.directory.createDirectory())
+  {
+    logError("Failed to create script directory %s",
+             options.directory.name().c_str());
+    return EXIT_FAILURE;
+  }
+
+  std::vector<std::string> names;
+  size_t size = 0;
+
+  for (uint i = 0;  i < options.scriptCount;  i++)
+  {
+    const std::string name = format("script%u.nut", i);
+    const Path path = options.directory + name;
+
+    if (!writeScript(path, i, options.functionCount))
+    {
+      logError("Failed to write script %s", path.name().c_str());
+      return EXIT_FAILURE;
+    }
+
+    std::ifstream stream(path.name().c_str(), std::ios::ate);
+    size += size_t(stream.tellg());
+    names.push_back(name);
+  }
+
+  ResourceCache cache;
+  if (!cache.addSearchPath(options.directory))
+    return EXIT_FAILURE;
+
+  std::vector<Time> coldTimes, cachedTimes;
+
+  for (uint i = 0;  i < options.repeatCount;  i++)
+    coldTimes.push_back(loadScripts(cache, names, false));
+
+  Time precompileTime;
+
+  {
+    SqVM vm(cache);
+    vm.setCaching(true);
+
+    Timer timer;
+    timer.start();
+
+    if (!vm.precompileTree(""))
+      return EXIT_FAILURE;
+
+    precompileTime = timer.time();
+  }
+
+  for (uint i = 0;  i < options.repeatCount;  i++)
+    cachedTimes.push_back(loadScripts(cache, names, true));
+
+  if (*std::min_element(coldTimes.begin(), coldTimes.end()) < 0.0 ||
+      *std::min_element(cachedTimes.begin(), cachedTimes.end()) < 0.0)
+  {
+    return EXIT_FAILURE;
+  }
+
+  const Time cold = median(coldTimes);
+  const Time cached = median(cachedTimes);
+
+  std::printf("scripts: %u, %.1f KB of source\n",
+              options.scriptCount, size / 1024.0);
+  std::printf("precompile: %.1f ms\n", precompileTime * 1000.0);
+  std::printf("startup cold: %.1f ms, cached: %.1f ms, %.1fx faster\n",
+              cold * 1000.0, cached * 1000.0, cold / max(cached, 1e-9));
+
+  // Removes both the generated scripts and their cached bytecode
+  for (const std::string& name : options.directory.children())
+    Path(options.directory + name).remove();
+
+  options.directory.destroyDirectory();
+  return EXIT_SUCCESS;
+}
+
+int runCalls(const Options& options)
+{
+  ResourceCache cache;
+  SqVM vm(cache);
+
+  const char* text =
+    "function add(a, b) { return a + b; }\n"
+    "function dots(count)\n"
+    "{\n"
+    "  local a = Vec3(), b = Vec3(), sum = 0.0;\n"
+    "  for (local i = 0;  i < count;  i++)\n"
+    "    sum += a.dot(b);\n"
+    "  return sum;\n"
+    "}\n";
+
+  if (!vm.execute("calls.nut", text))
+    return EXIT_FAILURE;
+
+  SqTable root = vm.rootTable();
+  SqFunction add = root.function("add");
+  const uint count = options.callCount;
+  std::vector<Time> byNameTimes, byHandleTimes, nativeTimes;
+
+  for (uint i = 0;  i < options.repeatCount;  i++)
+  {
+    int sum = 0;
+
+    Timer timer;
+    timer.start();
+
+    for (uint j = 0;  j < count;  j++)
+      sum = root.eval<int>("add", sum, 1);
+
+    byNameTimes.push_back(timer.time());
+    timer.start();
+
+    for (uint j = 0;  j < count;  j++)
+      sum = add.eval<int>(sum, 1);
+
+    byHandleTimes.push_back(timer.time());
+    timer.start();
+
+    root.eval<float>("dots", int(count));
+
+    nativeTimes.push_back(timer.time());
+
+    if (sum != int(count * 2))
+      return EXIT_FAILURE;
+  }
+
+  const Time byName = median(byNameTimes);
+  const Time byHandle = median(byHandleTimes);
+  const Time native = median(nativeTimes);
+
+  std::printf("script calls by name: %.2f M/s\n", count / byName / 1e6);
+  std::printf("script calls by handle: %.2f M/s\n", count / byHandle / 1e6);
+  std::printf("native method calls from script: %.2f M/s\n",
+              count / native / 1e6);
+
+  return EXIT_SUCCESS;
+}
+
+int runAlloc(const Options& options)
+{
+  ResourceCache cache;
+
+  if (options.systemAllocator)
+  {
+    // The pool is installed by the first VM, so create and destroy one to get
+    // that over with and then replace the pool for all later VMs
+    {
+      SqVM vm(cache);
+    }
+
+    sq_setallocator(systemAllocate, systemReallocate, systemFree);
+  }
+
+  SqVM vm(cache);
+
+  // Every frame creates and drops a set of small tables, arrays and strings,
+  // much like gameplay code building per-frame state
+  const char* text =
+    "function frame(count)\n"
+    "{\n"
+    "  local entities = [];\n"
+    "  for (local i = 0;  i < count;  i++)\n"
+    "  {\n"
+    "    local entity = { id = i, position = [i, i * 2, i * 3], tags = {} };\n"
+    "    entity.name <- \"entity\" + i;\n"
+    "    entity.tags[\"group\" + (i % 10)] <- true;\n"
+    "    entities.append(entity);\n"
+    "  }\n"
+    "  return entities.len();\n"
+    "}\n";
+
+  if (!vm.execute("alloc.nut", text))
+    return EXIT_FAILURE;
+
+  SqTable root = vm.rootTable();
+  SqFunction frame = root.function("frame");
+
+  Timer timer;
+  timer.start();
+
+  for (uint i = 0;  i < options.frameCount;  i++)
+  {
+    if (frame.eval<int>(int(options.objectCount)) != int(options.objectCount))
+      return EXIT_FAILURE;
+  }
+
+  const Time elapsed = timer.time();
+
+  std::printf("allocator: %s\n", options.systemAllocator ? "system" : "pool");
+  std::printf("frames: %u of %u objects, %.3f ms per frame\n",
+              options.frameCount, options.objectCount,
+              elapsed * 1000.0 / options.frameCount);
+
+  if (!options.systemAllocator)
+    std::printf("heap high water: %.1f KB\n", vm.memoryHighWater() / 1024.0);
+
+  if (const size_t peak = peakResidentSize())
+    std::printf("peak RSS: %.1f MB\n", peak / 1024.0);
+
+  return EXIT_SUCCESS;
+}
+
+int runEntities(const Options& options)
+{
+  if (!options.directory.isDirectory() && !options.directory.createDirectory())
+  {
+    logError("Failed to create script directory %s",
+             options.directory.name().c_str());
+    return EXIT_FAILURE;
+  }
+
+  // Each entity steers towards a target and now and then messages another
+  // entity, which is likely to live on another worker
+  const Path path = options.directory + "entity.nut";
+
+  {
+    std::ofstream stream(path.name().c_str());
+    stream << "class Entity\n{\n"
+           << "  id = 0;\n  position = null;\n  velocity = null;\n"
+           << "  target = null;\n  received = 0;\n"
+           << "  constructor(id)\n  {\n"
+           << "    this.id = id;\n"
+           << "    position = [id % 100, id / 100];\n"
+           << "    velocity = [0.0, 0.0];\n"
+           << "    target = [(id * 7) % 100, (id * 13) % 100];\n"
+           << "  }\n"
+           << "  function update(dt)\n  {\n"
+           << "    for (local i = 0;  i < 2;  i++)\n    {\n"
+           << "      local delta = target[i] - position[i];\n"
+           << "      velocity[i] = velocity[i] * 0.9 + delta * 0.1;\n"
+           << "      position[i] += velocity[i] * dt;\n"
+           << "    }\n"
+           << "    local distance = sqrt(velocity[0] * velocity[0] +\n"
+           << "                          velocity[1] * velocity[1]);\n"
+           << "    if (id % 16 == 0)\n"
+           << "      send(id * 31 % " << options.entityCount << " + 1, \"ping\", distance);\n"
+           << "  }\n"
+           << "  function onMessage(sender, name, value) { received++; }\n"
+           << "}\n";
+
+    if (stream.fail())
+    {
+      logError("Failed to write script %s", path.name().c_str());
+      return EXIT_FAILURE;
+    }
+  }
+
+  ResourceCache cache;
+  if (!cache.addSearchPath(options.directory))
+    return EXIT_FAILURE;
+
+  std::vector<uint> workerCounts;
+
+  for (uint count = 1;  count < options.workerCount;  count *= 2)
+    workerCounts.push_back(count);
+
+  workerCounts.push_back(options.workerCount);
+
+  std::printf("entities: %u, updates: %u\n",
+              options.entityCount, options.updateCount);
+
+  Time single = 0.0;
+  bool success = true;
+
+  for (uint workerCount : workerCounts)
+  {
+    auto pool = SqWorkerPool::create(cache, workerCount);
+    if (!pool || !pool->execute("entity.nut"))
+    {
+      success = false;
+      break;
+    }
+
+    for (uint i = 0;  i < options.entityCount;  i++)
+    {
+      if (!pool->createEntity("Entity"))
+      {
+        success = false;
+        break;
+      }
+    }
+
+    if (!success)
+      break;
+
+    // Warm up the workers before timing them
+    pool->update(1.0 / 60.0);
+
+    Timer timer;
+    timer.start();
+
+    for (uint i = 0;  i < options.updateCount;  i++)
+      pool->update(1.0 / 60.0);
+
+    const Time elapsed = timer.time() / options.updateCount;
+    if (workerCount == 1)
+      single = elapsed;
+
+    std::printf("workers: %u, %.2f ms per update, %.2fx\n",
+                workerCount, elapsed * 1000.0, single / elapsed);
+  }
+
+  Path(path).remove();
+  options.directory.destroyDirectory();
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+enum GarbagePolicy
+{
+  GARBAGE_NONE,
+  GARBAGE_DOUBLED,
+  GARBAGE_BUDGET,
+  GARBAGE_LOADING
+};
+
+bool runGarbagePolicy(const Options& options, GarbagePolicy policy)
+{
+  ResourceCache cache;
+  SqVM vm(cache);
+
+  // A large live heap makes each collection slow, while every frame leaves
+  // behind reference cycles that only the collector can free
+  const char* text =
+    "world <- [];\n"
+    "function populate(count)\n"
+    "{\n"
+    "  for (local i = 0;  i < count;  i++)\n"
+    "    world.append({ id = i, position = [i, i], name = \"object\" + i });\n"
+    "}\n"
+    "function frame(count)\n"
+    "{\n"
+    "  for (local i = 0;  i < count;  i++)\n"
+    "  {\n"
+    "    local a = { id = i }, b = { other = a };\n"
+    "    a.other <- b;\n"
+    "  }\n"
+    "}\n";
+
+  if (!vm.execute("gc.nut", text))
+    return false;
+
+  SqTable root = vm.rootTable();
+  root.call("populate", int(options.objectCount) * 100);
+  vm.collectGarbage();
+
+  SqFunction frame = root.function("frame");
+
+  std::vector<Time> times;
+  uint collections = 0, overdue = 0, loadingCollections = 0;
+  Time loadingPause = 0.0;
+
+  for (uint i = 0;  i < options.frameCount;  i++)
+  {
+    Timer timer;
+    timer.start();
+
+    frame.call(int(options.objectCount));
+
+    if (policy == GARBAGE_DOUBLED)
+    {
+      // The behavior before the budget was enforced, collecting whatever the
+      // cost once the heap had doubled
+      if (!vm.collectGarbage(options.budget) && vm.isCollectionOverdue())
+      {
+        vm.collectGarbage();
+        collections++;
+      }
+    }
+    else if (policy != GARBAGE_NONE)
+    {
+      if (vm.collectGarbage(options.budget))
+        collections++;
+    }
+
+    times.push_back(timer.time());
+
+    if (vm.isCollectionOverdue())
+      overdue++;
+
+    // A loading screen is a pause where a full collection goes unnoticed
+    if (policy == GARBAGE_LOADING && options.loadingInterval &&
+        (i + 1) % options.loadingInterval == 0)
+    {
+      vm.collectGarbage();
+      loadingPause = max(loadingPause, vm.garbagePauseTime());
+      loadingCollections++;
+    }
+  }
+
+  const Time p50 = percentile(times, 0.5);
+  const Time p99 = percentile(times, 0.99);
+  const char* names[] = { "none", "doubled", "budget", "loading" };
+
+  std::printf("%-8s p50 %6.2f ms  p99 %6.2f ms  max %6.2f ms  "
+              "collections %4u  overdue frames %5u  heap %7.1f MB",
+              names[policy],
+              p50 * 1000.0,
+              p99 * 1000.0,
+              times.back() * 1000.0,
+              collections, overdue,
+              vm.memoryHighWater() / 1048576.0);
+
+  if (policy == GARBAGE_LOADING)
+  {
+    std::printf("  loading collections %u, longest %.2f ms",
+                loadingCollections, loadingPause * 1000.0);
+  }
+
+  std::printf("\n");
+  return true;
+}
+
+int runGarbage(const Options& options)
+{
+  std::printf("frames: %u of %u cycles, budget %.2f ms\n",
+              options.frameCount, options.objectCount,
+              options.budget * 1000.0);
+
+  const GarbagePolicy policies[] =
+  {
+    GARBAGE_NONE,
+    GARBAGE_DOUBLED,
+    GARBAGE_BUDGET,
+    GARBAGE_LOADING
+  };
+
+  for (GarbagePolicy policy : policies)
+  {
+    if (!runGarbagePolicy(options, policy))
+      return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+} /*namespace*/
+
+int main(int argc, char** argv)
+{
+  Options options;
+  if (!options.parse(argc, argv))
+  {
+    std::fprintf(stderr,
+                 "Usage: %s startup [-dir directory] [-scripts count] "
+                 "[-functions count] [-repeat count]\n"
+                 "       %s calls [-calls count] [-repeat count]\n"
+                 "       %s alloc [-frames count] [-objects count] "
+                 "[-allocator pool|system]\n"
+                 "       %s entities [-dir directory] [-entities count] "
+                 "[-updates count] [-workers count]\n"
+                 "       %s gc [-frames count] [-objects count] "
+                 "[-budget ms] [-loading frames]\n",
+                 argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (options.mode == "startup")
+    return runStartup(options);
+  if (options.mode == "calls")
+    return runCalls(options);
+  if (options.mode == "alloc")
+    return runAlloc(options);
+  if (options.mode == "entities")
+    return runEntities(options);
+  if (options.mode == "gc")
+    return runGarbage(options);
+
+  std::fprintf(stderr, "Unknown benchmark %s\n", options.mode.c_str());
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,123 @@
+///////////////////////////////////////////////////////////////////////
+// Nori - a simple game engine
+// Copyright (c) 2014 Camilla Berglund <elmindreda@elmindreda.org>
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any
+// damages arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any
+// purpose, including commercial applications, and to alter it and
+// redistribute it freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you
+//     must not claim that you wrote the original software. If you use
+//     this software in a product, an acknowledgment in the product
+//     documentation would be appreciated but is not required.
+//
+//  2. Altered source versions must be plainly marked as such, and
+//     must not be misrepresented as being the original software.
+//
+//  3. This notice may not be removed or altered from any source
+//     distribution.
+//
+///////////////////////////////////////////////////////////////////////
+
+#include <nori/Config.hpp>
+#include <nori/Core.hpp>
+#include <nori/Time.hpp>
+#include <nori/Path.hpp>
+#include <nori/Resource.hpp>
+#include <nori/Squirrel.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace nori;
+
+namespace
+{
+
+class Options
+{
+public:
+  bool parse(int argc, char** argv);
+  Path root;
+  Path cacheDirectory;
+  std::vector<std::string> directories;
+};
+
+bool Options::parse(int argc, char** argv)
+{
+  for (int i = 1;  i < argc;  i++)
+  {
+    const char* name = argv[i];
+
+    if (std::strcmp(name, "-cache") == 0)
+    {
+      if (i + 1 == argc)
+        return false;
+
+      cacheDirectory = Path(argv[++i]);
+    }
+    else if (name[0] == '-')
+      return false;
+    else if (root.isEmpty())
+      root = Path(name);
+    else
+      directories.push_back(name);
+  }
+
+  // Script names are relative to the root, so an empty directory is all of it
+  if (directories.empty())
+    directories.push_back(std::string());
+
+  return !root.isEmpty();
+}
+
+} /*namespace*/
+
+int main(int argc, char** argv)
+{
+  Options options;
+  if (!options.parse(argc, argv))
+  {
+    std::fprintf(stderr,
+                 "Usage: %s [-cache directory] root [directory...]\n",
+                 argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  ResourceCache cache;
+  if (!cache.addSearchPath(options.root))
+    return EXIT_FAILURE;
+
+  if (!options.cacheDirectory.isEmpty() &&
+      !options.cacheDirectory.isDirectory() &&
+      !options.cacheDirectory.createDirectory())
+  {
+    logError("Failed to create cache directory %s",
+             options.cacheDirectory.name().c_str());
+    return EXIT_FAILURE;
+  }
+
+  SqVM vm(cache);
+  vm.setCaching(true);
+  vm.setCacheDirectory(options.cacheDirectory);
+
+  Timer timer;
+  timer.start();
+
+  bool success = true;
+
+  for (const std::string& directory : options.directories)
+  {
+    if (!vm.precompileTree(directory.c_str()))
+      success = false;
+  }
+
+  std::printf("precompiled in %.1f ms\n", timer.time() * 1000.0);
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,363 @@
+///////////////////////////////////////////////////////////////////////
+// Nori - a simple game engine
+// Copyright (c) 2014 Camilla Berglund <elmindreda@elmindreda.org>
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any
+// damages arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any
+// purpose, including commercial applications, and to alter it and
+// redistribute it freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you
+//     must not claim that you wrote the original software. If you use
+//     this software in a product, an acknowledgment in the product
+//     documentation would be appreciated but is not required.
+//
+//  2. Altered source versions must be plainly marked as such, and
+//     must not be misrepresented as being the original software.
+//
+//  3. This notice may not be removed or altered from any source
+//     distribution.
+//
+///////////////////////////////////////////////////////////////////////
+
+#include <nori/Config.hpp>
+#include <nori/Core.hpp>
+#include <nori/Time.hpp>
+#include <nori/Path.hpp>
+#include <nori/Resource.hpp>
+#include <nori/Drawer.hpp>
+#include <nori/Layer.hpp>
+#include <nori/Widget.hpp>
+#include <nori/Label.hpp>
+#include <nori/WidgetReader.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <vector>
+
+using namespace nori;
+
+namespace
+{
+
+const uint COLUMN_COUNT = 8;
+const uint ROW_WIDGET_COUNT = 6;
+
+const char* TREE_NAME = "uibench.xml";
+
+// Frames to wait for asynchronously rasterized glyphs before giving up
+const uint MAX_GLYPH_FRAMES = 1000;
+
+class Options
+{
+public:
+  Options();
+  bool parse(int argc, char** argv);
+  uint widgetCount;
+  uint frameCount;
+  uint glyphWorkerCount;
+  Path directory;
+  Path media;
+};
+
+Options::Options():
+  widgetCount(5000),
+  frameCount(300),
+  glyphWorkerCount(0),
+  directory("uibench-widgets"),
+  media("media")
+{
+}
+
+bool Options::parse(int argc, char** argv)
+{
+  for (int i = 1;  i < argc;  i++)
+  {
+    const char* name = argv[i];
+
+    if (i + 1 == argc)
+      return false;
+
+    const char* value = argv[++i];
+
+    if (std::strcmp(name, "-widgets") == 0)
+      widgetCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-frames") == 0)
+      frameCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-glyph-workers") == 0)
+      glyphWorkerCount = uint(std::strtoul(value, nullptr, 10));
+    else if (std::strcmp(name, "-dir") == 0)
+      directory = Path(value);
+    else if (std::strcmp(name, "-media") == 0)
+      media = Path(value);
+    else
+      return false;
+  }
+
+  // The tree needs room for at least one row in every column
+  return widgetCount > 1 + COLUMN_COUNT * (1 + ROW_WIDGET_COUNT) &&
+         frameCount > 0;
+}
+
+/*! Writes a widget tree of panels of rows, in the style of a tool with many
+ *  mostly static panels.  Each row is a layout holding a label, a button, a
+ *  check button, a slider and a progress bar.  The label of the middle row is
+ *  named so that it can be changed.
+ *  @return The number of widgets written, or zero if an error occurred.
+ */
+uint writeTree(const Path& path, uint widgetCount)
+{
+  std::ofstream stream(path.name().c_str());
+  if (stream.fail())
+    return 0;
+
+  // The root and the columns are widgets too
+  const uint rowCount = (widgetCount - 1 - COLUMN_COUNT) / ROW_WIDGET_COUNT;
+
+  stream << "<?xml version=\"1.0\"?>\n"
+         << "<widgets version=\"1\">\n"
+         << "  <layout orientation=\"horizontal\" mode=\"cover\" border=\"2\">\n";
+
+  for (uint column = 0;  column < COLUMN_COUNT;  column++)
+  {
+    stream << "    <layout orientation=\"vertical\" mode=\"wrap\" border=\"2\">\n";
+
+    for (uint row = column;  row < rowCount;  row += COLUMN_COUNT)
+    {
+      stream << "      <layout orientation=\"horizontal\" mode=\"wrap\">\n";
+
+      if (row == rowCount / 2)
+        stream << "        <label name=\"status\" text=\"Row " << row << "\"/>\n";
+      else
+        stream << "        <label text=\"Row " << row << "\"/>\n";
+
+      stream << "        <push text=\"Apply\"/>\n"
+             << "        <check text=\"Enabled\" checked=\"" << (row % 2 ? "true" : "false") << "\"/>\n"
+             << "        <slider orientation=\"horizontal\" min=\"0\" max=\"100\" value=\"" << row % 100 << "\"/>\n"
+             << "        <progress orientation=\"horizontal\" min=\"0\" max=\"100\" value=\"" << row % 100 << "\"/>\n"
+             << "      </layout>\n";
+    }
+
+    stream << "    </layout>\n";
+  }
+
+  stream << "  </layout>\n"
+         << "</widgets>\n";
+
+  if (stream.fail())
+    return 0;
+
+  return 1 + COLUMN_COUNT + rowCount * ROW_WIDGET_COUNT;
+}
+
+Time median(std::vector<Time> values)
+{
+  if (values.empty())
+    return 0.0;
+
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+/*! Draws the specified number of frames of the layer and reports the median
+ *  frame time, including the buffer swap, and the mean number of draw calls.
+ *  @param[in] label The label to change every frame, or @c nullptr to leave
+ *  the layer static.
+ */
+void measureFrames(const char* name,
+                   RenderContext& context,
+                   Layer& layer,
+                   Label* label,
+                   uint frameCount)
+{
+  RenderStats stats;
+  context.setStats(&stats);
+
+  std::vector<Time> frameTimes;
+  uint64 drawCalls = 0;
+
+  Timer timer;
+
+  // The first frame is left out, as it lays out or fills the cache in full
+  for (uint i = 0;  i <= frameCount;  i++)
+  {
+    if (label)
+      label->setText(format("Frame %u", i));
+
+    timer.start();
+
+    layer.update();
+    context.clearColorBuffer();
+    layer.draw();
+
+    const uint operations = stats.currentFrame().operationCount;
+
+    context.window().update();
+
+    if (i > 0)
+    {
+      frameTimes.push_back(timer.time());
+      drawCalls += operations;
+    }
+  }
+
+  context.setStats(nullptr);
+
+  std::printf("%s: median frame %.3f ms, %.1f draw calls per frame\n",
+              name,
+              median(frameTimes) * 1000.0,
+              double(drawCalls) / frameCount);
+}
+
+} /*namespace*/
+
+int main(int argc, char** argv)
+{
+  Options options;
+  if (!options.parse(argc, argv))
+  {
+    std::fprintf(stderr,
+                 "Usage: %s [-widgets count] [-frames count] [-glyph-workers count] "
+                 "[-dir directory] [-media directory]\n",
+                 argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (!options.directory.isDirectory() && !options.directory.createDirectory())
+  {
+    logError("Failed to create widget directory %s",
+             options.directory.name().c_str());
+    return EXIT_FAILURE;
+  }
+
+  const Path path = options.directory + TREE_NAME;
+
+  const uint widgetCount = writeTree(path, options.widgetCount);
+  if (!widgetCount)
+  {
+    logError("Failed to write widget tree %s", path.name().c_str());
+    return EXIT_FAILURE;
+  }
+
+  ResourceCache cache;
+  if (!cache.addSearchPath(options.media) ||
+      !cache.addSearchPath(options.directory))
+  {
+    return EXIT_FAILURE;
+  }
+
+  const WindowConfig wc("uibench", 1280, 720, WINDOWED, false);
+  const RenderConfig rc(32, 24, 0, 0, false, options.glyphWorkerCount);
+
+  std::unique_ptr<RenderContext> context = RenderContext::create(cache, wc, rc);
+  if (!context)
+    return EXIT_FAILURE;
+
+  context->setSwapInterval(0);
+
+  std::unique_ptr<Drawer> drawer = Drawer::create(*context);
+  if (!drawer)
+    return EXIT_FAILURE;
+
+  Ref<Layer> layer(new Layer(*drawer));
+
+  Timer timer;
+  timer.start();
+
+  WidgetReader reader(cache);
+  if (!reader.read(*layer, TREE_NAME))
+    return EXIT_FAILURE;
+
+  const Time readTime = timer.time();
+
+  timer.start();
+  layer->updateLayout();
+  const Time layoutTime = timer.time();
+
+  // Glyphs are rasterized as the first frame draws them, either right away
+  // or on the glyph workers, in which case the text is drawn once they arrive
+  RenderStats stats;
+  context->setStats(&stats);
+
+  uint glyphFrames = 0;
+  Time firstFrameTime = 0.0;
+
+  timer.start();
+
+  do
+  {
+    context->clearColorBuffer();
+    layer->draw();
+    context->window().update();
+
+    if (glyphFrames == 0)
+      firstFrameTime = timer.time();
+
+    glyphFrames++;
+  }
+  while (!drawer->isComplete() && glyphFrames < MAX_GLYPH_FRAMES);
+
+  const Time glyphTime = timer.time();
+
+  context->setStats(nullptr);
+
+  Label* status = reader.find<Label>("status");
+  if (!status)
+  {
+    logError("Widget tree has no status label");
+    return EXIT_FAILURE;
+  }
+
+  // Changing the text of one label deep in the tree invalidates the layouts
+  // above it, which are measured and arranged again on the next update
+  std::vector<Time> relayoutTimes;
+
+  for (uint i = 0;  i < options.frameCount;  i++)
+  {
+    status->setText(format("Frame %u", i));
+
+    timer.start();
+    layer->update();
+    relayoutTimes.push_back(timer.time());
+  }
+
+  std::printf("load: %u widgets, read in %.1f ms, first layout in %.1f ms\n",
+              widgetCount, readTime * 1000.0, layoutTime * 1000.0);
+  std::printf("glyphs: %u workers, first frame %.1f ms, "
+              "text complete after %u frames and %.1f ms\n",
+              options.glyphWorkerCount,
+              firstFrameTime * 1000.0,
+              glyphFrames,
+              glyphTime * 1000.0);
+  std::printf("glyph atlas: %u pages, %.1f%% occupied, %u evictions\n",
+              stats.glyphAtlasPageCount(),
+              stats.glyphAtlasOccupancy() * 100.f,
+              stats.glyphAtlasEvictionCount());
+  std::printf("relayout after a label change: median %.3f ms, mean %.3f ms\n",
+              median(relayoutTimes) * 1000.0,
+              std::accumulate(relayoutTimes.begin(), relayoutTimes.end(), 0.0) /
+                relayoutTimes.size() * 1000.0);
+
+  // Drawing is measured with the layer static and with one label changing,
+  // first redrawing everything and then drawing into the retained cache
+  measureFrames("immediate static", *context, *layer, nullptr, options.frameCount);
+  measureFrames("immediate changing", *context, *layer, status, options.frameCount);
+
+  layer->setRetained(true);
+
+  measureFrames("retained static", *context, *layer, nullptr, options.frameCount);
+  measureFrames("retained changing", *context, *layer, status, options.frameCount);
+
+  layer = nullptr;
+
+  Path(path).remove();
+  options.directory.destroyDirectory();
+  return EXIT_SUCCESS;
+}